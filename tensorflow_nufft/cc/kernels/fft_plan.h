@@ -0,0 +1,258 @@
+/* Copyright 2021 The TensorFlow NUFFT Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_NUFFT_CC_KERNELS_FFT_PLAN_H_
+#define TENSORFLOW_NUFFT_CC_KERNELS_FFT_PLAN_H_
+
+#define EIGEN_USE_THREADS
+
+#include <complex>
+#include <cstdint>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <vector>
+
+#include "third_party/eigen3/unsupported/Eigen/CXX11/Tensor"
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow_nufft/cc/kernels/fftw_api.h"
+#include "tensorflow_nufft/cc/kernels/native_fft.h"
+#include "tensorflow_nufft/cc/kernels/nufft_options.h"
+#include "tensorflow_nufft/cc/kernels/parallel_api.h"
+
+namespace tensorflow {
+namespace nufft {
+
+// One dimension of an FFT, or of a loop of FFTs: `size` elements which are
+// `stride` elements apart.
+struct FftDim {
+  int64_t size;
+  int64_t stride;
+};
+
+// An in-place FFT on a fixed array, planned by one of the FFT engines (see
+// `FftEngine`). Use `make_fft_plan` to create one.
+template<typename FloatType>
+class FftPlan {
+ public:
+  virtual ~FftPlan() { }
+
+  // Executes the FFT on the array it was planned for.
+  virtual void execute() = 0;
+};
+
+namespace internal {
+
+// Estimated cost of one of FFTW's parallel jobs, in cycles. Large enough for
+// each job to be run as a separate task.
+constexpr double kFftwJobCycles = 1e6;
+
+// Returns a reference to the device whose thread pool runs FFTW's parallel
+// loops on the calling thread, or null to run them serially.
+inline const Eigen::ThreadPoolDevice*& fftw_device() {
+  static thread_local const Eigen::ThreadPoolDevice* device = nullptr;
+  return device;
+}
+
+// Sets the device for FFTW's parallel loops on the calling thread, for as long
+// as it is in scope.
+class FftwDeviceScope {
+ public:
+  explicit FftwDeviceScope(const Eigen::ThreadPoolDevice* device)
+      : previous_device_(fftw_device()) {
+    fftw_device() = device;
+  }
+
+  ~FftwDeviceScope() { fftw_device() = previous_device_; }
+
+ private:
+  const Eigen::ThreadPoolDevice* previous_device_;
+};
+
+// Runs one of FFTW's parallel loops on the thread pool of the calling thread's
+// device (see `fftw_device`). Installed with `fftw::threads_set_callback`, so
+// that FFTW never spawns threads of its own.
+inline void fftw_parallel_loop(void *(*work)(char *), char *jobdata,
+                               size_t elsize, int njobs, void *data) {
+  const Eigen::ThreadPoolDevice* device = fftw_device();
+  if (device == nullptr || njobs <= 1) {
+    for (int i = 0; i < njobs; i++)
+      work(jobdata + elsize * i);
+    return;
+  }
+  device->parallelFor(
+      njobs, Eigen::TensorOpCost(0, 0, kFftwJobCycles),
+      [&](Eigen::Index first, Eigen::Index last) {
+        for (Eigen::Index i = first; i < last; i++)
+          work(jobdata + elsize * i);
+      });
+}
+
+// Returns the mutex which guards the FFTW planner. FFTW plans must be created
+// and destroyed single-threaded.
+inline std::mutex& fftw_planner_mutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+// Sets up the global FFTW state. Only the first call for each precision has
+// any effect. If FFTW is older than 3.3.9, the parallel loops run on FFTW's own
+// threads, whose number is still set by `plan_with_nthreads`.
+template<typename FloatType>
+void initialize_fftw() {
+  static const bool is_initialized = []() {
+    fftw::init_threads<FloatType>();
+#ifdef TENSORFLOW_NUFFT_FFTW_THREADS_CALLBACK
+    fftw::threads_set_callback<FloatType>(fftw_parallel_loop, nullptr);
+#endif
+    return true;
+  }();
+  (void) is_initialized;
+}
+
+}  // namespace internal
+
+// An FFT planned by FFTW. FFTW's parallel loops run on the thread pool of
+// `device`, using at most `num_threads` threads.
+template<typename FloatType>
+class FftwFftPlan : public FftPlan<FloatType> {
+ public:
+  using FftwType = typename fftw::ComplexType<FloatType>::Type;
+  using PlanType = typename fftw::PlanType<FloatType>::Type;
+  using IodimType = typename fftw::IodimType<FloatType>::Type;
+
+  explicit FftwFftPlan(const Eigen::ThreadPoolDevice& device)
+      : device_(device), plan_(nullptr) { }
+
+  ~FftwFftPlan() override {
+    std::lock_guard<std::mutex> lock(internal::fftw_planner_mutex());
+    if (plan_) fftw::destroy_plan<FloatType>(plan_);
+  }
+
+  Status initialize(const std::vector<FftDim>& dims,
+                    const std::vector<FftDim>& loops,
+                    std::complex<FloatType>* data, int sign,
+                    unsigned flags, int num_threads) {
+    internal::initialize_fftw<FloatType>();
+    std::vector<IodimType> fftw_dims, fftw_loops;
+    for (const FftDim& dim : dims)
+      fftw_dims.push_back({dim.size, dim.stride, dim.stride});
+    for (const FftDim& loop : loops)
+      fftw_loops.push_back({loop.size, loop.stride, loop.stride});
+    FftwType* fftw_data = reinterpret_cast<FftwType*>(data);
+    // Planning may execute the FFT, e.g. with FFTW_MEASURE.
+    internal::FftwDeviceScope device_scope(&device_);
+    {
+      std::lock_guard<std::mutex> lock(internal::fftw_planner_mutex());
+      // The number of threads is a planner setting, so it only applies to
+      // this plan.
+      fftw::plan_with_nthreads<FloatType>(num_threads);
+      plan_ = fftw::plan_guru64_dft<FloatType>(
+          /* int rank */ static_cast<int>(fftw_dims.size()),
+          /* const fftw_iodim64 *dims */ fftw_dims.data(),
+          /* int howmany_rank */ static_cast<int>(fftw_loops.size()),
+          /* const fftw_iodim64 *howmany_dims */ fftw_loops.data(),
+          /* fftw_complex *in */ fftw_data,
+          /* fftw_complex *out */ fftw_data,
+          /* int sign */ sign,
+          /* unsigned flags */ flags);
+    }
+    if (!plan_) {
+      return errors::Internal("FFTW failed to create a plan.");
+    }
+    return Status::OK();
+  }
+
+  void execute() override {
+    internal::FftwDeviceScope device_scope(&device_);
+    fftw::execute<FloatType>(plan_);
+  }
+
+ private:
+  const Eigen::ThreadPoolDevice& device_;
+  PlanType plan_;
+};
+
+// An FFT planned by the built-in engine in native_fft.h. Runs on the thread
+// pool of `device`, unless `num_threads` is 1.
+template<typename FloatType>
+class NativeFftPlan : public FftPlan<FloatType> {
+ public:
+  NativeFftPlan(const Eigen::ThreadPoolDevice& device,
+                const std::vector<FftDim>& dims,
+                const std::vector<FftDim>& loops,
+                std::complex<FloatType>* data, int sign, int num_threads)
+      : device_(num_threads == 1 ? nullptr : &device),
+        transform_(to_native_dims(dims), to_native_dims(loops), sign),
+        data_(data) { }
+
+  void execute() override {
+    if (device_ == nullptr) {
+      transform_.execute(data_);
+      return;
+    }
+    transform_.execute(data_, [this](
+        int64_t total, double cycles,
+        const std::function<void(int64_t, int64_t)>& fn) {
+      parallel_for(device_, total, Eigen::TensorOpCost(0, 0, cycles), fn);
+    });
+  }
+
+ private:
+  static std::vector<native_fft::Dim> to_native_dims(
+      const std::vector<FftDim>& dims) {
+    std::vector<native_fft::Dim> native_dims;
+    for (const FftDim& dim : dims)
+      native_dims.push_back({dim.size, dim.stride});
+    return native_dims;
+  }
+
+  const Eigen::ThreadPoolDevice* device_;
+  native_fft::Transform<FloatType> transform_;
+  std::complex<FloatType>* data_;
+};
+
+// Plans an in-place FFT of rank `dims.size()` on `data`, repeated over the
+// loop dimensions `loops`, using the engine selected by `options.fft_engine`.
+// `sign` is the sign of the exponent (-1 for a forward FFT). The FFT uses up
+// to `options.num_threads` threads of the thread pool of `device`.
+template<typename FloatType>
+Status make_fft_plan(const Eigen::ThreadPoolDevice& device,
+                     const std::vector<FftDim>& dims,
+                     const std::vector<FftDim>& loops,
+                     std::complex<FloatType>* data, int sign,
+                     const InternalOptions& options,
+                     std::unique_ptr<FftPlan<FloatType>>* plan) {
+  switch (options.fft_engine) {
+    case FftEngine::AUTO:
+    case FftEngine::FFTW: {
+      auto fftw_plan = std::make_unique<FftwFftPlan<FloatType>>(device);
+      TF_RETURN_IF_ERROR(fftw_plan->initialize(
+          dims, loops, data, sign, options.fftw_flags, options.num_threads));
+      *plan = std::move(fftw_plan);
+      return Status::OK();
+    }
+    case FftEngine::NATIVE: {
+      *plan = std::make_unique<NativeFftPlan<FloatType>>(
+          device, dims, loops, data, sign, options.num_threads);
+      return Status::OK();
+    }
+  }
+  return errors::InvalidArgument("Invalid FFT engine.");
+}
+
+}  // namespace nufft
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_NUFFT_CC_KERNELS_FFT_PLAN_H_
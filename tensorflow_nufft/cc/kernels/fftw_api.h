@@ -74,6 +74,28 @@ inline void make_planner_thread_safe<double>() {
   fftw_make_planner_thread_safe();
 }
 
+#ifdef TENSORFLOW_NUFFT_FFTW_THREADS_CALLBACK
+// Signature of the function used by FFTW to run its parallel loops. See
+// `threads_set_callback`. Requires FFTW 3.3.9 or later.
+using ParallelLoop = void (*)(void *(*work)(char *), char *jobdata,
+                              size_t elsize, int njobs, void *data);
+
+template<typename FloatType>
+inline void threads_set_callback(ParallelLoop parallel_loop, void *data);
+
+template<>
+inline void threads_set_callback<float>(ParallelLoop parallel_loop,
+                                        void *data) {
+  fftwf_threads_set_callback(parallel_loop, data);
+}
+
+template<>
+inline void threads_set_callback<double>(ParallelLoop parallel_loop,
+                                         void *data) {
+  fftw_threads_set_callback(parallel_loop, data);
+}
+#endif  // TENSORFLOW_NUFFT_FFTW_THREADS_CALLBACK
+
 template<typename FloatType>
 struct ComplexType;
 
@@ -178,6 +200,49 @@ inline typename PlanType<double>::Type plan_many_dft<double>(
       sign, flags);
 }
 
+template<typename FloatType>
+struct IodimType;
+
+template<>
+struct IodimType<float> {
+  using Type = fftwf_iodim64;
+};
+
+template<>
+struct IodimType<double> {
+  using Type = fftw_iodim64;
+};
+
+template<typename FloatType>
+inline typename PlanType<FloatType>::Type plan_guru64_dft(
+    int rank, const typename IodimType<FloatType>::Type *dims,
+    int howmany_rank, const typename IodimType<FloatType>::Type *howmany_dims,
+    typename ComplexType<FloatType>::Type *in,
+    typename ComplexType<FloatType>::Type *out,
+    int sign, unsigned flags);
+
+template<>
+inline typename PlanType<float>::Type plan_guru64_dft<float>(
+    int rank, const typename IodimType<float>::Type *dims,
+    int howmany_rank, const typename IodimType<float>::Type *howmany_dims,
+    typename ComplexType<float>::Type *in,
+    typename ComplexType<float>::Type *out,
+    int sign, unsigned flags) {
+  return fftwf_plan_guru64_dft(
+      rank, dims, howmany_rank, howmany_dims, in, out, sign, flags);
+}
+
+template<>
+inline typename PlanType<double>::Type plan_guru64_dft<double>(
+    int rank, const typename IodimType<double>::Type *dims,
+    int howmany_rank, const typename IodimType<double>::Type *howmany_dims,
+    typename ComplexType<double>::Type *in,
+    typename ComplexType<double>::Type *out,
+    int sign, unsigned flags) {
+  return fftw_plan_guru64_dft(
+      rank, dims, howmany_rank, howmany_dims, in, out, sign, flags);
+}
+
 template<typename FloatType>
 inline void execute(typename PlanType<FloatType>::Type& plan);  // NOLINT
 
@@ -0,0 +1,361 @@
+/* Copyright 2021 The TensorFlow NUFFT Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A small, header-only complex FFT engine, in the spirit of pocketfft. It has
+// no external dependencies and is used as an alternative to FFTW by the CPU
+// NUFFT plan (see fft_plan.h).
+//
+// 1D transforms use a mixed-radix, self-sorting (Stockham) algorithm with
+// specialized butterflies for radices 2, 3, 4 and 5, which covers all the
+// grid sizes selected by `next_smooth_int`. Other prime factors are handled by
+// a generic butterfly whose cost grows with the square of the factor.
+// Multidimensional transforms are computed one dimension at a time.
+
+#ifndef TENSORFLOW_NUFFT_CC_KERNELS_NATIVE_FFT_H_
+#define TENSORFLOW_NUFFT_CC_KERNELS_NATIVE_FFT_H_
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace tensorflow {
+namespace native_fft {
+
+// Precomputed in-place 1D FFT of a fixed size and sign.
+template<typename FloatType>
+class Transform1D {
+ public:
+  using Complex = std::complex<FloatType>;
+
+  Transform1D(int64_t size, int sign) : size_(size), sign_(sign) {
+    // Factorize the size. Radix 4 first, as it has the cheapest butterfly.
+    int64_t n = size;
+    std::vector<int> radices;
+    while (n % 4 == 0) { radices.push_back(4); n /= 4; }
+    for (int p : {2, 3, 5}) {
+      while (n % p == 0) { radices.push_back(p); n /= p; }
+    }
+    for (int64_t p = 7; p * p <= n; p += 2) {
+      while (n % p == 0) { radices.push_back(static_cast<int>(p)); n /= p; }
+    }
+    if (n > 1) radices.push_back(static_cast<int>(n));
+
+    // Each stage splits a transform of length `length` into `radix`
+    // transforms of length `length / radix`, interleaved with stride
+    // `stride` (the product of the previous radices).
+    int64_t length = size;
+    int64_t stride = 1;
+    for (int radix : radices) {
+      Stage stage;
+      stage.radix = radix;
+      stage.m = length / radix;
+      stage.stride = stride;
+      stage.twiddle_offset = twiddles_.size();
+      for (int64_t k = 0; k < stage.m; k++)
+        for (int u = 1; u < radix; u++)
+          twiddles_.push_back(root(k * u, length));
+      if (radix > 5) {
+        stage.root_offset = roots_.size();
+        for (int k = 0; k < radix; k++)
+          roots_.push_back(root(k, radix));
+      }
+      stages_.push_back(stage);
+      length /= radix;
+      stride *= radix;
+    }
+  }
+
+  int64_t size() const { return size_; }
+
+  // Transforms `count` sequences of `size()` elements in place. Element `i`
+  // of sequence `j` is `data[j * dist + i * stride]`. The sequences are
+  // interleaved in `scratch`, which must have room for `2 * count * size()`
+  // elements, so that all passes run over `count` adjacent elements at a
+  // time. This also turns strided accesses into contiguous ones when `dist`
+  // is 1.
+  void execute(Complex* data, int64_t stride, int64_t count, int64_t dist,
+               Complex* scratch) const {
+    Complex* x = scratch;
+    Complex* y = scratch + count * size_;
+    for (int64_t i = 0; i < size_; i++)
+      for (int64_t j = 0; j < count; j++)
+        x[j + count * i] = data[j * dist + i * stride];
+    for (const Stage& stage : stages_) {
+      switch (stage.radix) {
+        case 2: pass2(stage, count, x, y); break;
+        case 3: pass3(stage, count, x, y); break;
+        case 4: pass4(stage, count, x, y); break;
+        case 5: pass5(stage, count, x, y); break;
+        default: passg(stage, count, x, y); break;
+      }
+      std::swap(x, y);
+    }
+    for (int64_t i = 0; i < size_; i++)
+      for (int64_t j = 0; j < count; j++)
+        data[j * dist + i * stride] = x[j + count * i];
+  }
+
+ private:
+  struct Stage {
+    int radix;
+    int64_t m;
+    int64_t stride;
+    size_t twiddle_offset;
+    size_t root_offset;
+  };
+
+  // Returns exp(sign * 2 * pi * i * k / n), computed in double precision.
+  Complex root(int64_t k, int64_t n) const {
+    double angle = 2.0 * M_PI * static_cast<double>(k % n) /
+                   static_cast<double>(n);
+    return Complex(static_cast<FloatType>(std::cos(angle)),
+                   static_cast<FloatType>(sign_ * std::sin(angle)));
+  }
+
+  // In all passes, for k in [0, m) and q in [0, s), the inputs
+  // x[q + s * (k + r * m)], r in [0, radix), are combined by a DFT of length
+  // `radix`, and output u is multiplied by the twiddle w^(k * u) and stored in
+  // y[q + s * (radix * k + u)]. Interleaved sequences simply scale the
+  // stride s by their number.
+  void pass2(const Stage& st, int64_t count, const Complex* x,
+             Complex* y) const {
+    const int64_t m = st.m, s = st.stride * count;
+    const Complex* tw = twiddles_.data() + st.twiddle_offset;
+    for (int64_t k = 0; k < m; k++) {
+      const Complex w1 = tw[k];
+      for (int64_t q = 0; q < s; q++) {
+        const Complex a0 = x[q + s * k];
+        const Complex a1 = x[q + s * (k + m)];
+        y[q + s * (2 * k)] = a0 + a1;
+        y[q + s * (2 * k + 1)] = (a0 - a1) * w1;
+      }
+    }
+  }
+
+  void pass3(const Stage& st, int64_t count, const Complex* x,
+             Complex* y) const {
+    const int64_t m = st.m, s = st.stride * count;
+    const Complex* tw = twiddles_.data() + st.twiddle_offset;
+    const FloatType c = static_cast<FloatType>(-0.5);
+    const FloatType d = static_cast<FloatType>(sign_ * 0.86602540378443864676);
+    for (int64_t k = 0; k < m; k++) {
+      const Complex w1 = tw[2 * k], w2 = tw[2 * k + 1];
+      for (int64_t q = 0; q < s; q++) {
+        const Complex a0 = x[q + s * k];
+        const Complex a1 = x[q + s * (k + m)];
+        const Complex a2 = x[q + s * (k + 2 * m)];
+        const Complex t0 = a1 + a2;
+        const Complex t1 = a0 + c * t0;
+        const Complex t2 = a1 - a2;
+        // i * d * t2.
+        const Complex t3(-d * t2.imag(), d * t2.real());
+        y[q + s * (3 * k)] = a0 + t0;
+        y[q + s * (3 * k + 1)] = (t1 + t3) * w1;
+        y[q + s * (3 * k + 2)] = (t1 - t3) * w2;
+      }
+    }
+  }
+
+  void pass4(const Stage& st, int64_t count, const Complex* x,
+             Complex* y) const {
+    const int64_t m = st.m, s = st.stride * count;
+    const Complex* tw = twiddles_.data() + st.twiddle_offset;
+    const FloatType sgn = static_cast<FloatType>(sign_);
+    for (int64_t k = 0; k < m; k++) {
+      const Complex w1 = tw[3 * k], w2 = tw[3 * k + 1], w3 = tw[3 * k + 2];
+      for (int64_t q = 0; q < s; q++) {
+        const Complex a0 = x[q + s * k];
+        const Complex a1 = x[q + s * (k + m)];
+        const Complex a2 = x[q + s * (k + 2 * m)];
+        const Complex a3 = x[q + s * (k + 3 * m)];
+        const Complex t0 = a0 + a2;
+        const Complex t1 = a0 - a2;
+        const Complex t2 = a1 + a3;
+        const Complex t4 = a1 - a3;
+        // sign * i * (a1 - a3).
+        const Complex t3(-sgn * t4.imag(), sgn * t4.real());
+        y[q + s * (4 * k)] = t0 + t2;
+        y[q + s * (4 * k + 1)] = (t1 + t3) * w1;
+        y[q + s * (4 * k + 2)] = (t0 - t2) * w2;
+        y[q + s * (4 * k + 3)] = (t1 - t3) * w3;
+      }
+    }
+  }
+
+  void pass5(const Stage& st, int64_t count, const Complex* x,
+             Complex* y) const {
+    const int64_t m = st.m, s = st.stride * count;
+    const Complex* tw = twiddles_.data() + st.twiddle_offset;
+    // cos(2 pi / 5), cos(4 pi / 5), sin(2 pi / 5), sin(4 pi / 5).
+    const FloatType c1 = static_cast<FloatType>(0.30901699437494742410);
+    const FloatType c2 = static_cast<FloatType>(-0.80901699437494742410);
+    const FloatType s1 = static_cast<FloatType>(
+        sign_ * 0.95105651629515357212);
+    const FloatType s2 = static_cast<FloatType>(
+        sign_ * 0.58778525229247312917);
+    for (int64_t k = 0; k < m; k++) {
+      const Complex* w = tw + 4 * k;
+      for (int64_t q = 0; q < s; q++) {
+        const Complex a0 = x[q + s * k];
+        const Complex a1 = x[q + s * (k + m)];
+        const Complex a2 = x[q + s * (k + 2 * m)];
+        const Complex a3 = x[q + s * (k + 3 * m)];
+        const Complex a4 = x[q + s * (k + 4 * m)];
+        const Complex b1 = a1 + a4, b4 = a1 - a4;
+        const Complex b2 = a2 + a3, b3 = a2 - a3;
+        const Complex r1 = a0 + c1 * b1 + c2 * b2;
+        const Complex r2 = a0 + c2 * b1 + c1 * b2;
+        // i * (s1 * b4 + s2 * b3) and i * (s2 * b4 - s1 * b3).
+        const Complex v1 = s1 * b4 + s2 * b3;
+        const Complex v2 = s2 * b4 - s1 * b3;
+        const Complex i1(-v1.imag(), v1.real());
+        const Complex i2(-v2.imag(), v2.real());
+        y[q + s * (5 * k)] = a0 + b1 + b2;
+        y[q + s * (5 * k + 1)] = (r1 + i1) * w[0];
+        y[q + s * (5 * k + 2)] = (r2 + i2) * w[1];
+        y[q + s * (5 * k + 3)] = (r2 - i2) * w[2];
+        y[q + s * (5 * k + 4)] = (r1 - i1) * w[3];
+      }
+    }
+  }
+
+  void passg(const Stage& st, int64_t count, const Complex* x,
+             Complex* y) const {
+    const int p = st.radix;
+    const int64_t m = st.m, s = st.stride * count;
+    const Complex* tw = twiddles_.data() + st.twiddle_offset;
+    const Complex* roots = roots_.data() + st.root_offset;
+    for (int64_t k = 0; k < m; k++) {
+      const Complex* w = tw + (p - 1) * k;
+      for (int64_t q = 0; q < s; q++) {
+        for (int u = 0; u < p; u++) {
+          Complex sum = x[q + s * k];
+          for (int r = 1; r < p; r++)
+            sum += x[q + s * (k + r * m)] * roots[(r * u) % p];
+          y[q + s * (p * k + u)] = u == 0 ? sum : sum * w[u - 1];
+        }
+      }
+    }
+  }
+
+  int64_t size_;
+  int sign_;
+  std::vector<Stage> stages_;
+  // Twiddle factors of all stages, concatenated.
+  std::vector<Complex> twiddles_;
+  // Roots of unity for the generic butterflies, concatenated.
+  std::vector<Complex> roots_;
+};
+
+// One dimension of a multidimensional transform, or of a loop of transforms:
+// `size` elements which are `stride` elements apart.
+struct Dim {
+  int64_t size;
+  int64_t stride;
+};
+
+// Precomputed in-place multidimensional FFT, repeated over zero or more loop
+// dimensions. Follows the conventions of FFTW's guru interface.
+template<typename FloatType>
+class Transform {
+ public:
+  using Complex = std::complex<FloatType>;
+
+  // Runs `fn(first, last)` over shards of [0, total), possibly in parallel.
+  // `cycles` is the estimated cost of each unit of work.
+  using ParallelFor = std::function<void(
+      int64_t total, double cycles,
+      const std::function<void(int64_t, int64_t)>& fn)>;
+
+  // The maximum number of lines transformed together.
+  static constexpr int64_t kBlockSize = 8;
+
+  Transform(const std::vector<Dim>& dims, const std::vector<Dim>& loops,
+            int sign)
+      : dims_(dims), loops_(loops) {
+    for (const Dim& dim : dims_)
+      transforms_.emplace_back(dim.size, sign);
+  }
+
+  // Executes the transform on `data`. The blocks of lines along each axis are
+  // independent and are distributed with `parallel_for`, if provided.
+  void execute(Complex* data,
+               const ParallelFor& parallel_for = nullptr) const {
+    for (size_t axis = 0; axis < dims_.size(); axis++) {
+      // The lines along `axis` are enumerated by the loops and the other
+      // transform dimensions. Lines which are adjacent along the dimension
+      // with the smallest stride are transformed together, in blocks of up to
+      // `kBlockSize` lines.
+      std::vector<Dim> lines = loops_;
+      for (size_t d = 0; d < dims_.size(); d++)
+        if (d != axis) lines.push_back(dims_[d]);
+      int block_dim = -1;
+      int64_t block_lines = 1, block_dist = 0;
+      if (!lines.empty()) {
+        block_dim = static_cast<int>(std::min_element(
+            lines.begin(), lines.end(),
+            [](const Dim& a, const Dim& b) { return a.stride < b.stride; }) -
+            lines.begin());
+        block_lines = lines[block_dim].size;
+        block_dist = lines[block_dim].stride;
+        lines[block_dim].size = (block_lines + kBlockSize - 1) / kBlockSize;
+        lines[block_dim].stride = block_dist * kBlockSize;
+      }
+      int64_t num_blocks = 1;
+      for (const Dim& line : lines) num_blocks *= line.size;
+
+      const Transform1D<FloatType>& transform = transforms_[axis];
+      const int64_t stride = dims_[axis].stride;
+      const int64_t scratch_size = 2 * kBlockSize * transform.size();
+      auto execute_blocks = [&](int64_t first, int64_t last) {
+        std::vector<Complex> scratch(scratch_size);
+        for (int64_t b = first; b < last; b++) {
+          int64_t offset = 0, index = b, count = 1;
+          for (int d = static_cast<int>(lines.size()) - 1; d >= 0; d--) {
+            int64_t i = index % lines[d].size;
+            index /= lines[d].size;
+            offset += i * lines[d].stride;
+            if (d == block_dim)
+              count = std::min(kBlockSize, block_lines - i * kBlockSize);
+          }
+          transform.execute(data + offset, stride, count, block_dist,
+                            scratch.data());
+        }
+      };
+      if (parallel_for) {
+        // About 5 n log2(n) flops per line.
+        const double cycles = 5.0 * kBlockSize * transform.size() *
+                              std::log2(std::max<int64_t>(transform.size(), 2));
+        parallel_for(num_blocks, cycles, execute_blocks);
+      } else {
+        execute_blocks(0, num_blocks);
+      }
+    }
+  }
+
+ private:
+  std::vector<Dim> dims_;
+  std::vector<Dim> loops_;
+  std::vector<Transform1D<FloatType>> transforms_;
+};
+
+}  // namespace native_fft
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_NUFFT_CC_KERNELS_NATIVE_FFT_H_
@@ -17,6 +17,10 @@ limitations under the License.
 #define EIGEN_USE_GPU
 #endif  // GOOGLE_CUDA
 
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
 #include "tensorflow/core/framework/bounds_check.h"
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/framework/tensor_util.h"
@@ -74,6 +78,12 @@ class NUFFTBaseOp : public OpKernel {
     int64_t rank = points.dim_size(points.dims() - 1);
     int64_t num_points = points.dim_size(points.dims() - 2);
 
+    // The weighted ops have one weight per point.
+    const FloatType* weights_data = nullptr;
+    if (weights_index_ >= 0) {
+      OP_REQUIRES_OK(ctx, GetWeights(ctx, points, &weights_data));
+    }
+
     TensorShape grid_shape;
     switch (transform_type_) {
       case TransformType::TYPE_1: {   // nonuniform to uniform
@@ -257,34 +267,67 @@ class NUFFTBaseOp : public OpKernel {
     }
     bool transpose_target = transpose_source;
 
-    // Reverse points.
-    Tensor rpoints;
-    OP_REQUIRES_OK(ctx, ctx->allocate_temp(kRealDType<FloatType>,
-                                           reshaped_points.shape(),
-                                           &rpoints));
-
-    OP_REQUIRES_OK(ctx, ::tensorflow::DoReverse<Device, FloatType>(
-        ctx->eigen_device<Device>(),
-        reshaped_points,
-        {reshaped_points.dims() - 1},
-        &rpoints));
+    // On the CPU, the plan can read and write the data in its original
+    // layout, given the offset of each transform (see `BatchLayout`), so no
+    // transposes are needed.
+    std::vector<int64_t> c_offsets, f_offsets;
+    if (transpose_source && std::is_same<Device, CPUDevice>::value) {
+      const TensorShape output_batch_shape(bcast.output_shape());
+      const TensorShape& c_batch_shape =
+          transform_type_ == TransformType::TYPE_1 ?
+          source_batch_shape : output_batch_shape;
+      const TensorShape& f_batch_shape =
+          transform_type_ == TransformType::TYPE_1 ?
+          output_batch_shape : source_batch_shape;
+      c_offsets = GetBatchOffsets(c_batch_shape, output_batch_shape,
+                                  outer_dims, inner_dims, num_points);
+      f_offsets = GetBatchOffsets(f_batch_shape, output_batch_shape,
+                                  outer_dims, inner_dims,
+                                  grid_shape.num_elements());
+      transpose_source = false;
+      transpose_target = false;
+    }
 
-    /// Transpose points to obtain single-dimension arrays.
-    Tensor tpoints;
+    // Shape of the points with the batch dimensions in computation order and
+    // one array per axis.
     TensorShape tpoints_shape = reshaped_points.shape();
     for (int i = 0; i < reshaped_points.dims(); i++) {
       tpoints_shape.set_dim(i, reshaped_points.dim_size(points_perm[i]));
     }
 
-    OP_REQUIRES_OK(ctx, ctx->allocate_temp(kRealDType<FloatType>,
-                                           tpoints_shape,
-                                           &tpoints));
+    // On the CPU, the plan reads the coordinates in place, with a stride equal
+    // to the rank and the axes in reverse order. The batch dimensions need no
+    // transpose because the points have size 1 in all the inner dimensions,
+    // so their memory order is already the computation order.
+    Tensor tpoints;
+    int64_t points_stride = 1;
+    if (std::is_same<Device, CPUDevice>::value) {
+      tpoints = reshaped_points;
+      points_stride = rank;
+    } else {
+      // Reverse points.
+      Tensor rpoints;
+      OP_REQUIRES_OK(ctx, ctx->allocate_temp(kRealDType<FloatType>,
+                                             reshaped_points.shape(),
+                                             &rpoints));
+
+      OP_REQUIRES_OK(ctx, ::tensorflow::DoReverse<Device, FloatType>(
+          ctx->eigen_device<Device>(),
+          reshaped_points,
+          {reshaped_points.dims() - 1},
+          &rpoints));
+
+      /// Transpose points to obtain single-dimension arrays.
+      OP_REQUIRES_OK(ctx, ctx->allocate_temp(kRealDType<FloatType>,
+                                             tpoints_shape,
+                                             &tpoints));
 
-    OP_REQUIRES_OK(ctx, ::tensorflow::DoTranspose<Device>(
-        ctx->eigen_device<Device>(),
-        rpoints,
-        points_perm,
-        &tpoints));
+      OP_REQUIRES_OK(ctx, ::tensorflow::DoTranspose<Device>(
+          ctx->eigen_device<Device>(),
+          rpoints,
+          points_perm,
+          &tpoints));
+    }
 
     Tensor tsource;
     const Tensor* psource;
@@ -346,12 +389,16 @@ class NUFFTBaseOp : public OpKernel {
         op_type_,
         outer_dims.size(),
         (int64_t*) psource->shape().dim_sizes().data(),
-        (int64_t*) tpoints.shape().dim_sizes().data(),
+        (int64_t*) tpoints_shape.dim_sizes().data(),
         grid_shape_vec.begin(),
         num_points,
         (FloatType*) tpoints.data(),
+        points_stride,
         reinterpret_cast<Complex<Device, FloatType>*>(psource->data()),
-        reinterpret_cast<Complex<Device, FloatType>*>(ptarget->data())));
+        reinterpret_cast<Complex<Device, FloatType>*>(ptarget->data()),
+        c_offsets.empty() ? nullptr : c_offsets.data(),
+        f_offsets.empty() ? nullptr : f_offsets.data(),
+        weights_data));
 
     if (transpose_target) {
       OP_REQUIRES_OK(ctx, ::tensorflow::DoTranspose<Device>(
@@ -375,8 +422,12 @@ class NUFFTBaseOp : public OpKernel {
                  int64_t* num_modes,
                  int64_t num_points,
                  FloatType* points,
+                 int64_t points_stride,
                  Complex<Device, FloatType>* source,
-                 Complex<Device, FloatType>* target) {
+                 Complex<Device, FloatType>* target,
+                 const int64_t* c_offsets = nullptr,
+                 const int64_t* f_offsets = nullptr,
+                 const FloatType* weights = nullptr) {
     // Number of coefficients.
     int num_coeffs = 1;
     for (int d = 0; d < rank; d++) {
@@ -430,41 +481,7 @@ class NUFFTBaseOp : public OpKernel {
     }
 
     // NUFFT options.
-    InternalOptions options;
-    // Read in user options.
-    options.max_batch_size = this->options_.max_batch_size();
-    switch (this->options_.fftw().planning_rigor()) {
-      case FftwPlanningRigor::AUTO: {
-        options.fftw_flags = FFTW_MEASURE;
-        break;
-      }
-      case FftwPlanningRigor::ESTIMATE: {
-        options.fftw_flags = FFTW_ESTIMATE;
-        break;
-      }
-      case FftwPlanningRigor::MEASURE: {
-        options.fftw_flags = FFTW_MEASURE;
-        break;
-      }
-      case FftwPlanningRigor::PATIENT: {
-        options.fftw_flags = FFTW_PATIENT;
-        break;
-      }
-      case FftwPlanningRigor::EXHAUSTIVE: {
-        options.fftw_flags = FFTW_EXHAUSTIVE;
-        break;
-      }
-    }
-
-    if (op_type != OpType::NUFFT) {
-      options.spread_only = true;
-      options.upsampling_factor = 2.0;
-    }
-
-    // Intra-op threading.
-    const DeviceBase::CpuWorkerThreads& worker_threads =
-        *ctx->device()->tensorflow_cpu_worker_threads();
-    options.num_threads = worker_threads.num_threads;
+    InternalOptions options = this->GetInternalOptions(ctx, op_type);
 
     // Make inlined vector from pointer to number of modes. TODO: use inlined
     // vector for all of num_modes.
@@ -492,24 +509,37 @@ class NUFFTBaseOp : public OpKernel {
 
     for (int call_index = 0; call_index < num_calls; call_index++) {
       points_batch = points + call_index * num_points * rank;
-      switch (rank) {
-        case 1:
-          points_x = points_batch;
-          break;
-        case 2:
-          points_x = points_batch;
-          points_y = points_batch + num_points;
-          break;
-        case 3:
-          points_x = points_batch;
-          points_y = points_batch + num_points;
-          points_z = points_batch + num_points * 2;
-          break;
+      if (points_stride == 1) {
+        // One array per axis, in FINUFFT order.
+        switch (rank) {
+          case 1:
+            points_x = points_batch;
+            break;
+          case 2:
+            points_x = points_batch;
+            points_y = points_batch + num_points;
+            break;
+          case 3:
+            points_x = points_batch;
+            points_y = points_batch + num_points;
+            points_z = points_batch + num_points * 2;
+            break;
+        }
+      } else {
+        // Interleaved coordinates, in reverse FINUFFT order.
+        points_x = points_batch + rank - 1;
+        if (rank > 1) points_y = points_batch + rank - 2;
+        if (rank > 2) points_z = points_batch + rank - 3;
       }
 
-      // Set the point coordinates.
+      // Set the point coordinates, and their weights, which are indexed like
+      // the points without the last dimension.
       TF_RETURN_IF_ERROR(plan->set_points(
-          num_points, points_x, points_y, points_z));
+          num_points, points_x, points_y, points_z, points_stride));
+      if (weights != nullptr) {
+        TF_RETURN_IF_ERROR(plan->set_weights(
+            weights + call_index * num_points));
+      }
 
       // Compute indices.
       source_index = 0;
@@ -524,19 +554,30 @@ class NUFFTBaseOp : public OpKernel {
         source_index += source_batch_indices[d] * source_batch_factors[d];
       }
 
-      c_batch = c + *c_index * num_transforms * num_points;
-      f_batch = f + *f_index * num_transforms * num_coeffs;
+      BatchLayout layout;
+      if (c_offsets != nullptr) {
+        c_batch = c;
+        layout.c_offsets = c_offsets + call_index * num_transforms;
+      } else {
+        c_batch = c + *c_index * num_transforms * num_points;
+      }
+      if (f_offsets != nullptr) {
+        f_batch = f;
+        layout.f_offsets = f_offsets + call_index * num_transforms;
+      } else {
+        f_batch = f + *f_index * num_transforms * num_coeffs;
+      }
 
       // Execute the NUFFT.
       switch (op_type) {
         case OpType::NUFFT:
-          TF_RETURN_IF_ERROR(plan->execute(c_batch, f_batch));
+          TF_RETURN_IF_ERROR(plan->execute(c_batch, f_batch, layout));
           break;
         case OpType::INTERP:
-          TF_RETURN_IF_ERROR(plan->interp(c_batch, f_batch));
+          TF_RETURN_IF_ERROR(plan->interp(c_batch, f_batch, layout));
           break;
         case OpType::SPREAD:
-          TF_RETURN_IF_ERROR(plan->spread(c_batch, f_batch));
+          TF_RETURN_IF_ERROR(plan->spread(c_batch, f_batch, layout));
           break;
       }
     }
@@ -544,12 +585,146 @@ class NUFFTBaseOp : public OpKernel {
   }
 
  protected:
+  // Returns the plan options for an op of type `op_type`, from the options
+  // attribute and the intra-op threading of `ctx`.
+  InternalOptions GetInternalOptions(OpKernelContext* ctx,
+                                     OpType op_type) const {
+    InternalOptions options;
+    // Read in user options.
+    options.max_batch_size = this->options_.max_batch_size();
+    options.cache_points = this->options_.cache_points();
+    switch (this->options_.fftw().planning_rigor()) {
+      case FftwPlanningRigor::AUTO: {
+        options.fftw_flags = FFTW_MEASURE;
+        break;
+      }
+      case FftwPlanningRigor::ESTIMATE: {
+        options.fftw_flags = FFTW_ESTIMATE;
+        break;
+      }
+      case FftwPlanningRigor::MEASURE: {
+        options.fftw_flags = FFTW_MEASURE;
+        break;
+      }
+      case FftwPlanningRigor::PATIENT: {
+        options.fftw_flags = FFTW_PATIENT;
+        break;
+      }
+      case FftwPlanningRigor::EXHAUSTIVE: {
+        options.fftw_flags = FFTW_EXHAUSTIVE;
+        break;
+      }
+    }
+    switch (this->options_.points_sorting()) {
+      case PointsSorting::POINTS_SORTING_AUTO: {
+        options.sort_points = SortPoints::AUTO;
+        break;
+      }
+      case PointsSorting::POINTS_SORTING_NONE: {
+        options.sort_points = SortPoints::NO;
+        break;
+      }
+      case PointsSorting::POINTS_SORTING_CARTESIAN: {
+        options.sort_points = SortPoints::YES;
+        break;
+      }
+      case PointsSorting::POINTS_SORTING_MORTON: {
+        options.sort_points = SortPoints::MORTON;
+        break;
+      }
+    }
+    switch (this->options_.fft_backend()) {
+      case FftBackend::FFT_BACKEND_AUTO: {
+        options.fft_engine = FftEngine::AUTO;
+        break;
+      }
+      case FftBackend::FFT_BACKEND_FFTW: {
+        options.fft_engine = FftEngine::FFTW;
+        break;
+      }
+      case FftBackend::FFT_BACKEND_NATIVE: {
+        options.fft_engine = FftEngine::NATIVE;
+        break;
+      }
+    }
+
+    if (op_type != OpType::NUFFT) {
+      options.spread_only = true;
+      options.upsampling_factor = 2.0;
+    }
+
+    // Intra-op threading.
+    const DeviceBase::CpuWorkerThreads& worker_threads =
+        *ctx->device()->tensorflow_cpu_worker_threads();
+    options.num_threads = worker_threads.num_threads;
+
+    return options;
+  }
+
+  // Validates the `weights` input, which must have the shape of `points`
+  // without the last dimension, and returns a pointer to its data.
+  Status GetWeights(OpKernelContext* ctx, const Tensor& points,
+                    const FloatType** weights_data) const {
+    const Tensor& weights = ctx->input(weights_index_);
+    TensorShape weights_shape(points.shape());
+    weights_shape.RemoveLastDims(1);
+    if (weights.shape() != weights_shape) {
+      return errors::InvalidArgument(
+          "Input `weights` must have shape ", weights_shape.DebugString(),
+          ", but got shape: ", weights.shape().DebugString());
+    }
+    *weights_data = weights.flat<FloatType>().data();
+    return Status::OK();
+  }
+
+  // Returns the offset of each transform in a tensor with batch shape
+  // `batch_shape`, with `element_size` elements per transform. The
+  // transforms are enumerated in computation order: the outer dimensions
+  // (one call per element) followed by the inner dimensions (the transforms
+  // in each call), with the sizes in `output_batch_shape`. Dimensions of size
+  // 1 in `batch_shape` are broadcast.
+  static std::vector<int64_t> GetBatchOffsets(
+      const TensorShape& batch_shape,
+      const TensorShape& output_batch_shape,
+      const gtl::InlinedVector<int32, 8>& outer_dims,
+      const gtl::InlinedVector<int32, 8>& inner_dims,
+      int64_t element_size) {
+    int num_batch_dims = batch_shape.dims();
+    gtl::InlinedVector<int64_t, 8> strides(num_batch_dims);
+    int64_t stride = element_size;
+    for (int i = num_batch_dims - 1; i >= 0; i--) {
+      strides[i] = batch_shape.dim_size(i) == 1 ? 0 : stride;
+      stride *= batch_shape.dim_size(i);
+    }
+    gtl::InlinedVector<int64_t, 8> order_sizes, order_strides;
+    for (int d : outer_dims) {
+      order_sizes.push_back(output_batch_shape.dim_size(d));
+      order_strides.push_back(strides[d]);
+    }
+    for (int d : inner_dims) {
+      order_sizes.push_back(output_batch_shape.dim_size(d));
+      order_strides.push_back(strides[d]);
+    }
+    std::vector<int64_t> offsets(output_batch_shape.num_elements());
+    for (int64_t i = 0; i < offsets.size(); i++) {
+      int64_t index = i, offset = 0;
+      for (int d = order_sizes.size() - 1; d >= 0; d--) {
+        offset += (index % order_sizes[d]) * order_strides[d];
+        index /= order_sizes[d];
+      }
+      offsets[i] = offset;
+    }
+    return offsets;
+  }
 
   TransformType transform_type_;
   FftDirection fft_direction_;
   float tol_;
   Options options_;
   OpType op_type_;
+  // Index of the `weights` input of the weighted ops (e.g., `WeightedNUFFT`),
+  // or -1 for the unweighted ops.
+  int weights_index_;
 };
 
 
@@ -580,12 +755,244 @@ class NUFFT : public NUFFTBaseOp<Device, FloatType> {
     }
 
     this->op_type_ = OpType::NUFFT;
+    // `WeightedNUFFT` has the weights after the inputs of `NUFFT`.
+    this->weights_index_ = ctx->num_inputs() > 3 ? 3 : -1;
 
     string options_serialized;
     OP_REQUIRES_OK(ctx, ctx->GetAttr("options", &options_serialized));
     OP_REQUIRES(ctx, this->options_.ParseFromString(options_serialized),
                 errors::InvalidArgument("Unable to parse options string."));
+
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("reduce_batch_axes",
+                                     &reduce_batch_axes_));
+    OP_REQUIRES(ctx, reduce_batch_axes_.empty() ||
+                     this->transform_type_ == TransformType::TYPE_1,
+                errors::InvalidArgument(
+                    "reduce_batch_axes is only supported for type-1 "
+                    "transforms."));
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    if (reduce_batch_axes_.empty()) {
+      NUFFTBaseOp<Device, FloatType>::Compute(ctx);
+    } else {
+      ComputeReduced(ctx);
+    }
+  }
+
+  private:
+  // Computes a type-1 transform summed over the batch axes in
+  // `reduce_batch_axes_`. All the transforms which are summed into the same
+  // output are spread onto one fine grid, which then needs a single FFT and
+  // deconvolution. Only implemented on the CPU.
+  void ComputeReduced(OpKernelContext* ctx) {
+    OP_REQUIRES(ctx, (std::is_same<Device, CPUDevice>::value),
+                errors::Unimplemented(
+                    "reduce_batch_axes is only supported on the CPU."));
+
+    const Tensor& source = ctx->input(0);
+    const Tensor& points = ctx->input(1);
+
+    OP_REQUIRES(ctx, points.dims() >= 2,
+                errors::InvalidArgument(
+                    "Input `points` must have rank of at least 2, but got "
+                    "shape: ", points.shape().DebugString()));
+
+    int64_t rank = points.dim_size(points.dims() - 1);
+    int64_t num_points = points.dim_size(points.dims() - 2);
+
+    OP_REQUIRES(ctx, rank >= 1 && rank <= 3,
+                errors::InvalidArgument(
+                    "Points must have 1, 2 or 3 dimensions, but got: ", rank));
+
+    TensorShape grid_shape;
+    OP_REQUIRES_OK(ctx, tensor::MakeShape(ctx->input(2), &grid_shape));
+    OP_REQUIRES(ctx, grid_shape.dims() == rank,
+                errors::InvalidArgument(
+                    "grid_shape must have ", rank, " elements, but got: ",
+                    grid_shape.DebugString()));
+    OP_REQUIRES(ctx, source.dims() >= 1 &&
+                     source.dim_size(source.dims() - 1) == num_points,
+                errors::InvalidArgument(
+                    "Input `source` must have shape [..., ", num_points,
+                    "], but got shape: ", source.shape().DebugString()));
+
+    const FloatType* weights_data = nullptr;
+    if (this->weights_index_ >= 0) {
+      OP_REQUIRES_OK(ctx, this->GetWeights(ctx, points, &weights_data));
+    }
+
+    TensorShape source_batch_shape;
+    for (int i = 0; i < source.dims() - 1; i++) {
+      source_batch_shape.AddDim(source.dim_size(i));
+    }
+    TensorShape points_batch_shape;
+    for (int i = 0; i < points.dims() - 2; i++) {
+      points_batch_shape.AddDim(points.dim_size(i));
+    }
+
+    // Insert leading ones so that both inputs have the same number of batch
+    // dimensions, and broadcast them.
+    int num_batch_dims = std::max(source_batch_shape.dims(),
+                                  points_batch_shape.dims());
+    while (source_batch_shape.dims() < num_batch_dims)
+      source_batch_shape.InsertDim(0, 1);
+    while (points_batch_shape.dims() < num_batch_dims)
+      points_batch_shape.InsertDim(0, 1);
+    TensorShape batch_shape;
+    for (int i = 0; i < num_batch_dims; i++) {
+      int64_t size = std::max(source_batch_shape.dim_size(i),
+                              points_batch_shape.dim_size(i));
+      OP_REQUIRES(ctx, (source_batch_shape.dim_size(i) == 1 ||
+                        source_batch_shape.dim_size(i) == size) &&
+                       (points_batch_shape.dim_size(i) == 1 ||
+                        points_batch_shape.dim_size(i) == size),
+                  errors::InvalidArgument(
+                      "Incompatible shapes: ", source.shape().DebugString(),
+                      " vs. ", points.shape().DebugString()));
+      batch_shape.AddDim(size);
+    }
+
+    // Split the batch dimensions into those which are kept and those which
+    // are reduced.
+    std::vector<bool> is_reduced(num_batch_dims, false);
+    for (int32 axis : reduce_batch_axes_) {
+      OP_REQUIRES(ctx, axis >= -num_batch_dims && axis < num_batch_dims,
+                  errors::InvalidArgument(
+                      "reduce_batch_axes must be in the range [",
+                      -num_batch_dims, ", ", num_batch_dims, "), but got: ",
+                      axis));
+      if (axis < 0) axis += num_batch_dims;
+      OP_REQUIRES(ctx, !is_reduced[axis],
+                  errors::InvalidArgument(
+                      "reduce_batch_axes contains a duplicate axis: ", axis));
+      is_reduced[axis] = true;
+    }
+    gtl::InlinedVector<int32, 8> kept_dims;
+    gtl::InlinedVector<int32, 8> reduced_dims;
+    TensorShape output_shape;
+    int64_t num_reduced = 1;
+    for (int i = 0; i < num_batch_dims; i++) {
+      if (is_reduced[i]) {
+        reduced_dims.push_back(i);
+        num_reduced *= batch_shape.dim_size(i);
+      } else {
+        kept_dims.push_back(i);
+        output_shape.AddDim(batch_shape.dim_size(i));
+      }
+    }
+    int64_t num_outputs = output_shape.num_elements();
+    output_shape.AppendShape(grid_shape);
+
+    Tensor* target = nullptr;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, output_shape, &target));
+    if (target->NumElements() == 0) {
+      return;
+    }
+    if (num_points == 0 || num_reduced == 0) {
+      target->flat<Complex<Device, FloatType>>().setZero();
+      return;
+    }
+
+    // Strides of the batch dimensions of the source (in elements) and of the
+    // points (in calls). Broadcast dimensions have zero stride.
+    auto batch_strides = [&](const TensorShape& shape, int64_t element_size) {
+      gtl::InlinedVector<int64_t, 8> strides(num_batch_dims);
+      int64_t stride = element_size;
+      for (int i = num_batch_dims - 1; i >= 0; i--) {
+        strides[i] = shape.dim_size(i) == 1 ? 0 : stride;
+        stride *= shape.dim_size(i);
+      }
+      return strides;
+    };
+    gtl::InlinedVector<int64_t, 8> source_strides =
+        batch_strides(source_batch_shape, num_points);
+    gtl::InlinedVector<int64_t, 8> call_strides =
+        batch_strides(points_batch_shape, 1);
+
+    // Returns the offset of the `index`-th element over the dimensions `dims`.
+    auto offset_of = [&](int64_t index,
+                         const gtl::InlinedVector<int32, 8>& dims,
+                         const gtl::InlinedVector<int64_t, 8>& strides) {
+      int64_t offset = 0;
+      for (int i = dims.size() - 1; i >= 0; i--) {
+        int64_t size = batch_shape.dim_size(dims[i]);
+        offset += (index % size) * strides[dims[i]];
+        index /= size;
+      }
+      return offset;
+    };
+
+    // The shape of the grid needs to be reversed for FINUFFT.
+    int num_modes[3] = {1, 1, 1};
+    for (int i = 0; i < rank; i++) {
+      num_modes[i] = static_cast<int>(grid_shape.dim_size(rank - 1 - i));
+    }
+
+    auto plan = std::make_unique<Plan<Device, FloatType>>(ctx);
+    OP_REQUIRES_OK(ctx, plan->initialize(
+        this->transform_type_, static_cast<int>(rank), num_modes,
+        this->fft_direction_, 1, static_cast<FloatType>(this->tol_),
+        this->GetInternalOptions(ctx, this->op_type_)));
+
+    FloatType* points_data = const_cast<FloatType*>(
+        points.flat<FloatType>().data());
+    auto* source_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(source.tensor_data().data()));
+    auto* target_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(target->tensor_data().data()));
+    int64_t grid_size = grid_shape.num_elements();
+
+    // For each output, the transforms which share the same points are spread
+    // together, and the points are only set again when they change.
+    int64_t current_call = -1;
+    std::vector<int64_t> source_offsets;
+    source_offsets.reserve(num_reduced);
+    for (int64_t output_index = 0; output_index < num_outputs;
+         output_index++) {
+      int64_t source_base = offset_of(output_index, kept_dims, source_strides);
+      int64_t call_base = offset_of(output_index, kept_dims, call_strides);
+      bool accumulate = false;
+      for (int64_t reduced_index = 0; reduced_index <= num_reduced;
+           reduced_index++) {
+        int64_t call_index = -1;
+        if (reduced_index < num_reduced) {
+          call_index = call_base + offset_of(reduced_index, reduced_dims,
+                                             call_strides);
+        }
+        if (call_index != current_call && !source_offsets.empty()) {
+          OP_REQUIRES_OK(ctx, plan->spread_sum(
+              source_data, static_cast<int>(source_offsets.size()),
+              source_offsets.data(),
+              accumulate));
+          source_offsets.clear();
+          accumulate = true;
+        }
+        if (reduced_index == num_reduced) break;
+        if (call_index != current_call) {
+          // Interleaved coordinates, in reverse FINUFFT order.
+          FloatType* points_batch =
+              points_data + call_index * num_points * rank;
+          OP_REQUIRES_OK(ctx, plan->set_points(
+              num_points, points_batch + rank - 1,
+              rank > 1 ? points_batch + rank - 2 : nullptr,
+              rank > 2 ? points_batch + rank - 3 : nullptr, rank));
+          if (weights_data != nullptr) {
+            OP_REQUIRES_OK(ctx, plan->set_weights(
+                weights_data + call_index * num_points));
+          }
+          current_call = call_index;
+        }
+        source_offsets.push_back(
+            source_base + offset_of(reduced_index, reduced_dims,
+                                    source_strides));
+      }
+      OP_REQUIRES_OK(ctx, plan->transform_sum(
+          target_data + output_index * grid_size));
+    }
   }
+
+  std::vector<int32> reduce_batch_axes_;
 };
 
 
@@ -602,6 +1009,8 @@ class Interp : public NUFFTBaseOp<Device, FloatType> {
     this->fft_direction_ = FftDirection::BACKWARD; // irrelevant
 
     this->op_type_ = OpType::INTERP;
+    // `WeightedInterp` has the weights after the inputs of `Interp`.
+    this->weights_index_ = ctx->num_inputs() > 2 ? 2 : -1;
   }
 };
 
@@ -619,71 +1028,1254 @@ class Spread : public NUFFTBaseOp<Device, FloatType> {
     this->fft_direction_ = FftDirection::BACKWARD; // irrelevant
 
     this->op_type_ = OpType::SPREAD;
+    // `WeightedSpread` has the weights after the inputs of `Spread`.
+    this->weights_index_ = ctx->num_inputs() > 3 ? 3 : -1;
   }
 };
 
 
-// Register the CPU kernels.
-REGISTER_KERNEL_BUILDER(Name("NUFFT")
-                            .Device(DEVICE_CPU)
-                            .TypeConstraint<complex64>("Tcomplex")
-                            .TypeConstraint<float>("Treal")
-                            .HostMemory("grid_shape"),
-                        NUFFT<CPUDevice, float>);
+// Computes the gradient of a type-2 NUFFT (or of an interpolation) with respect
+// to the points, by interpolating the derivative of the spreading kernel from
+// the fine grid (or from the source grid). Only implemented on the CPU.
+template <typename Device, typename FloatType>
+class PointsGradBaseOp : public NUFFTBaseOp<Device, FloatType> {
 
-REGISTER_KERNEL_BUILDER(Name("NUFFT")
-                            .Device(DEVICE_CPU)
-                            .TypeConstraint<complex128>("Tcomplex")
-                            .TypeConstraint<double>("Treal")
-                            .HostMemory("grid_shape"),
-                        NUFFT<CPUDevice, double>);
+  public:
 
-REGISTER_KERNEL_BUILDER(Name("Interp")
-                            .Device(DEVICE_CPU)
-                            .TypeConstraint<complex64>("Tcomplex")
-                            .TypeConstraint<float>("Treal"),
-                        Interp<CPUDevice, float>);
+  explicit PointsGradBaseOp(OpKernelConstruction* ctx) : NUFFTBaseOp<Device, FloatType>(ctx) { }
 
-REGISTER_KERNEL_BUILDER(Name("Interp")
-                            .Device(DEVICE_CPU)
-                            .TypeConstraint<complex128>("Tcomplex")
-                            .TypeConstraint<double>("Treal"),
-                        Interp<CPUDevice, double>);
+  void Compute(OpKernelContext* ctx) override {
+    const Tensor& source = ctx->input(0);
+    const Tensor& points = ctx->input(1);
+    const Tensor& weights = ctx->input(2);
 
-REGISTER_KERNEL_BUILDER(Name("Spread")
-                            .Device(DEVICE_CPU)
-                            .TypeConstraint<complex64>("Tcomplex")
-                            .TypeConstraint<float>("Treal")
-                            .HostMemory("grid_shape"),
-                        Spread<CPUDevice, float>);
+    OP_REQUIRES(ctx, points.dims() >= 2,
+                errors::InvalidArgument(
+                    "Input `points` must have rank of at least 2, but got "
+                    "shape: ", points.shape().DebugString()));
 
-REGISTER_KERNEL_BUILDER(Name("Spread")
-                            .Device(DEVICE_CPU)
-                            .TypeConstraint<complex128>("Tcomplex")
-                            .TypeConstraint<double>("Treal")
-                            .HostMemory("grid_shape"),
-                        Spread<CPUDevice, double>);
+    int64_t rank = points.dim_size(points.dims() - 1);
+    int64_t num_points = points.dim_size(points.dims() - 2);
 
-// Register the GPU kernels.
-#ifdef GOOGLE_CUDA
-REGISTER_KERNEL_BUILDER(Name("NUFFT")
-                            .Device(DEVICE_GPU)
-                            .TypeConstraint<complex64>("Tcomplex")
-                            .TypeConstraint<float>("Treal")
-                            .HostMemory("grid_shape"),
-                        NUFFT<GPUDevice, float>);
+    OP_REQUIRES(ctx, rank >= 1 && rank <= 3,
+                errors::InvalidArgument(
+                    "Points must have 1, 2 or 3 dimensions, but got: ", rank));
+    OP_REQUIRES(ctx, source.dims() >= rank,
+                errors::InvalidArgument(
+                    "Input `source` must have rank of at least ",
+                    rank, " but received shape: ",
+                    source.shape().DebugString()));
+    OP_REQUIRES(ctx, weights.dims() >= 1 &&
+                     weights.dim_size(weights.dims() - 1) == num_points,
+                errors::InvalidArgument(
+                    "Input `weights` must have shape [..., ", num_points,
+                    "], but got shape: ", weights.shape().DebugString()));
 
-REGISTER_KERNEL_BUILDER(Name("NUFFT")
-                            .Device(DEVICE_GPU)
-                            .TypeConstraint<complex128>("Tcomplex")
-                            .TypeConstraint<double>("Treal")
-                            .HostMemory("grid_shape"),
-                        NUFFT<GPUDevice, double>);
+    // Split the inputs into batch and element shapes.
+    TensorShape grid_shape;
+    TensorShape source_batch_shape;
+    for (int i = 0; i < source.dims(); i++) {
+      if (i < source.dims() - rank) {
+        source_batch_shape.AddDim(source.dim_size(i));
+      } else {
+        grid_shape.AddDim(source.dim_size(i));
+      }
+    }
+    TensorShape points_batch_shape;
+    for (int i = 0; i < points.dims() - 2; i++) {
+      points_batch_shape.AddDim(points.dim_size(i));
+    }
+    TensorShape weights_batch_shape;
+    for (int i = 0; i < weights.dims() - 1; i++) {
+      weights_batch_shape.AddDim(weights.dim_size(i));
+    }
 
-REGISTER_KERNEL_BUILDER(Name("Interp")
-                            .Device(DEVICE_GPU)
-                            .TypeConstraint<complex64>("Tcomplex")
-                            .TypeConstraint<float>("Treal"),
+    // Insert leading ones so that all inputs have the same number of batch
+    // dimensions.
+    int num_batch_dims = std::max({source_batch_shape.dims(),
+                                   points_batch_shape.dims(),
+                                   weights_batch_shape.dims()});
+    while (source_batch_shape.dims() < num_batch_dims)
+      source_batch_shape.InsertDim(0, 1);
+    while (points_batch_shape.dims() < num_batch_dims)
+      points_batch_shape.InsertDim(0, 1);
+    while (weights_batch_shape.dims() < num_batch_dims)
+      weights_batch_shape.InsertDim(0, 1);
+
+    // Broadcast the batch shapes.
+    TensorShape output_batch_shape;
+    for (int i = 0; i < num_batch_dims; i++) {
+      int64_t size = std::max({source_batch_shape.dim_size(i),
+                               points_batch_shape.dim_size(i),
+                               weights_batch_shape.dim_size(i)});
+      for (const TensorShape* shape : {&source_batch_shape,
+                                       &points_batch_shape,
+                                       &weights_batch_shape}) {
+        OP_REQUIRES(ctx, shape->dim_size(i) == 1 || shape->dim_size(i) == size,
+                    errors::InvalidArgument(
+                        "Incompatible shapes: ", source.shape().DebugString(),
+                        " vs. ", points.shape().DebugString(), " vs. ",
+                        weights.shape().DebugString()));
+      }
+      output_batch_shape.AddDim(size);
+    }
+
+    // The gradient has the shape of the points. The batch dimensions in which
+    // the points are broadcast are summed over.
+    Tensor* grad_points = nullptr;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, points.shape(), &grad_points));
+
+    // Each element of the points batch is one call, and the transforms in the
+    // broadcast dimensions are run together.
+    gtl::InlinedVector<int32, 8> outer_dims;
+    gtl::InlinedVector<int32, 8> inner_dims;
+    int num_transforms = 1;
+    for (int i = 0; i < num_batch_dims; i++) {
+      if (points_batch_shape.dim_size(i) == 1) {
+        inner_dims.push_back(i);
+        num_transforms *= output_batch_shape.dim_size(i);
+      } else {
+        outer_dims.push_back(i);
+      }
+    }
+    int64_t num_calls = points_batch_shape.num_elements();
+
+    if (output_batch_shape.num_elements() == 0 || num_points == 0 ||
+        grid_shape.num_elements() == 0) {
+      grad_points->flat<FloatType>().setZero();
+      return;
+    }
+
+    std::vector<int64_t> c_offsets = this->GetBatchOffsets(
+        weights_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        num_points);
+    std::vector<int64_t> f_offsets = this->GetBatchOffsets(
+        source_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        grid_shape.num_elements());
+
+    // The shape of the grid needs to be reversed for FINUFFT.
+    int num_modes[3] = {1, 1, 1};
+    for (int i = 0; i < rank; i++) {
+      num_modes[i] = static_cast<int>(grid_shape.dim_size(rank - 1 - i));
+    }
+
+    auto plan = std::make_unique<Plan<Device, FloatType>>(ctx);
+    OP_REQUIRES_OK(ctx, plan->initialize(
+        TransformType::TYPE_2, static_cast<int>(rank), num_modes,
+        this->fft_direction_, num_transforms,
+        static_cast<FloatType>(this->tol_),
+        this->GetInternalOptions(ctx, this->op_type_)));
+
+    FloatType* points_data = const_cast<FloatType*>(
+        points.flat<FloatType>().data());
+    FloatType* grad_data = grad_points->flat<FloatType>().data();
+    auto* source_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(source.tensor_data().data()));
+    auto* weights_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(weights.tensor_data().data()));
+
+    for (int64_t call_index = 0; call_index < num_calls; call_index++) {
+      // Interleaved coordinates, in reverse FINUFFT order.
+      FloatType* points_batch = points_data + call_index * num_points * rank;
+      FloatType* grad_batch = grad_data + call_index * num_points * rank;
+      OP_REQUIRES_OK(ctx, plan->set_points(
+          num_points, points_batch + rank - 1,
+          rank > 1 ? points_batch + rank - 2 : nullptr,
+          rank > 2 ? points_batch + rank - 3 : nullptr, rank));
+
+      BatchLayout layout;
+      layout.c_offsets = c_offsets.data() + call_index * num_transforms;
+      layout.f_offsets = f_offsets.data() + call_index * num_transforms;
+      OP_REQUIRES_OK(ctx, plan->points_grad(
+          weights_data, source_data, grad_batch + rank - 1,
+          rank > 1 ? grad_batch + rank - 2 : nullptr,
+          rank > 2 ? grad_batch + rank - 3 : nullptr, layout));
+    }
+  }
+};
+
+
+template <typename Device, typename FloatType>
+class NUFFTPointsGrad : public PointsGradBaseOp<Device, FloatType> {
+
+  public:
+
+  explicit NUFFTPointsGrad(OpKernelConstruction* ctx) : PointsGradBaseOp<Device, FloatType>(ctx) {
+
+    string fft_direction_str;
+
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("fft_direction", &fft_direction_str));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("tol", &this->tol_));
+
+    if (fft_direction_str == "backward") {
+      this->fft_direction_ = FftDirection::BACKWARD;
+    } else if (fft_direction_str == "forward") {
+      this->fft_direction_ = FftDirection::FORWARD;
+    }
+
+    this->transform_type_ = TransformType::TYPE_2;
+    this->op_type_ = OpType::NUFFT;
+
+    string options_serialized;
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("options", &options_serialized));
+    OP_REQUIRES(ctx, this->options_.ParseFromString(options_serialized),
+                errors::InvalidArgument("Unable to parse options string."));
+  }
+};
+
+
+template <typename Device, typename FloatType>
+class InterpPointsGrad : public PointsGradBaseOp<Device, FloatType> {
+
+  public:
+
+  explicit InterpPointsGrad(OpKernelConstruction* ctx) : PointsGradBaseOp<Device, FloatType>(ctx) {
+
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("tol", &this->tol_));
+
+    this->transform_type_ = TransformType::TYPE_2;
+    this->fft_direction_ = FftDirection::BACKWARD; // irrelevant
+
+    this->op_type_ = OpType::INTERP;
+  }
+};
+
+
+// Computes the tangent of a NUFFT with respect to both the source and the
+// points, in a single pass over the sorted points. Only implemented on the
+// CPU.
+template <typename Device, typename FloatType>
+class NUFFTTangent : public NUFFTBaseOp<Device, FloatType> {
+
+  public:
+
+  explicit NUFFTTangent(OpKernelConstruction* ctx) : NUFFTBaseOp<Device, FloatType>(ctx) {
+
+    string transform_type_str;
+    string fft_direction_str;
+
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("transform_type", &transform_type_str));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("fft_direction", &fft_direction_str));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("tol", &this->tol_));
+
+    if (transform_type_str == "type_1") {
+      this->transform_type_ = TransformType::TYPE_1;
+    } else if (transform_type_str == "type_2") {
+      this->transform_type_ = TransformType::TYPE_2;
+    }
+
+    if (fft_direction_str == "backward") {
+      this->fft_direction_ = FftDirection::BACKWARD;
+    } else if (fft_direction_str == "forward") {
+      this->fft_direction_ = FftDirection::FORWARD;
+    }
+
+    this->op_type_ = OpType::NUFFT;
+
+    string options_serialized;
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("options", &options_serialized));
+    OP_REQUIRES(ctx, this->options_.ParseFromString(options_serialized),
+                errors::InvalidArgument("Unable to parse options string."));
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    const Tensor& source = ctx->input(0);
+    const Tensor& points = ctx->input(1);
+    const Tensor& source_tangent = ctx->input(3);
+    const Tensor& points_tangent = ctx->input(4);
+
+    OP_REQUIRES(ctx, points.dims() >= 2,
+                errors::InvalidArgument(
+                    "Input `points` must have rank of at least 2, but got "
+                    "shape: ", points.shape().DebugString()));
+    OP_REQUIRES(ctx, source_tangent.shape() == source.shape(),
+                errors::InvalidArgument(
+                    "Input `source_tangent` must have the shape of `source`, "
+                    "but got shapes: ", source_tangent.shape().DebugString(),
+                    " vs. ", source.shape().DebugString()));
+    OP_REQUIRES(ctx, points_tangent.shape() == points.shape(),
+                errors::InvalidArgument(
+                    "Input `points_tangent` must have the shape of `points`, "
+                    "but got shapes: ", points_tangent.shape().DebugString(),
+                    " vs. ", points.shape().DebugString()));
+
+    int64_t rank = points.dim_size(points.dims() - 1);
+    int64_t num_points = points.dim_size(points.dims() - 2);
+
+    OP_REQUIRES(ctx, rank >= 1 && rank <= 3,
+                errors::InvalidArgument(
+                    "Points must have 1, 2 or 3 dimensions, but got: ", rank));
+
+    // Split the source into batch and element shapes.
+    TensorShape grid_shape;
+    int source_elem_rank;
+    if (this->transform_type_ == TransformType::TYPE_1) {
+      OP_REQUIRES_OK(ctx, tensor::MakeShape(ctx->input(2), &grid_shape));
+      OP_REQUIRES(ctx, grid_shape.dims() == rank,
+                  errors::InvalidArgument(
+                      "grid_shape must have ", rank, " elements, but got: ",
+                      grid_shape.DebugString()));
+      OP_REQUIRES(ctx, source.dims() >= 1 &&
+                       source.dim_size(source.dims() - 1) == num_points,
+                  errors::InvalidArgument(
+                      "Input `source` must have shape [..., ", num_points,
+                      "], but got shape: ", source.shape().DebugString()));
+      source_elem_rank = 1;
+    } else {
+      OP_REQUIRES(ctx, source.dims() >= rank,
+                  errors::InvalidArgument(
+                      "Input `source` must have rank of at least ",
+                      rank, " but received shape: ",
+                      source.shape().DebugString()));
+      for (int i = source.dims() - rank; i < source.dims(); i++) {
+        grid_shape.AddDim(source.dim_size(i));
+      }
+      source_elem_rank = rank;
+    }
+    TensorShape source_batch_shape;
+    for (int i = 0; i < source.dims() - source_elem_rank; i++) {
+      source_batch_shape.AddDim(source.dim_size(i));
+    }
+    TensorShape points_batch_shape;
+    for (int i = 0; i < points.dims() - 2; i++) {
+      points_batch_shape.AddDim(points.dim_size(i));
+    }
+
+    // Insert leading ones so that both inputs have the same number of batch
+    // dimensions, and broadcast them.
+    int num_batch_dims = std::max(source_batch_shape.dims(),
+                                  points_batch_shape.dims());
+    while (source_batch_shape.dims() < num_batch_dims)
+      source_batch_shape.InsertDim(0, 1);
+    while (points_batch_shape.dims() < num_batch_dims)
+      points_batch_shape.InsertDim(0, 1);
+    TensorShape output_batch_shape;
+    for (int i = 0; i < num_batch_dims; i++) {
+      int64_t size = std::max(source_batch_shape.dim_size(i),
+                              points_batch_shape.dim_size(i));
+      OP_REQUIRES(ctx, (source_batch_shape.dim_size(i) == 1 ||
+                        source_batch_shape.dim_size(i) == size) &&
+                       (points_batch_shape.dim_size(i) == 1 ||
+                        points_batch_shape.dim_size(i) == size),
+                  errors::InvalidArgument(
+                      "Incompatible shapes: ", source.shape().DebugString(),
+                      " vs. ", points.shape().DebugString()));
+      output_batch_shape.AddDim(size);
+    }
+
+    // The tangent has the shape of the output of the transform.
+    TensorShape output_shape = output_batch_shape;
+    int64_t output_elem_size;
+    if (this->transform_type_ == TransformType::TYPE_1) {
+      output_shape.AppendShape(grid_shape);
+      output_elem_size = grid_shape.num_elements();
+    } else {
+      output_shape.AddDim(num_points);
+      output_elem_size = num_points;
+    }
+    Tensor* target_tangent = nullptr;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, output_shape, &target_tangent));
+
+    // Each element of the points batch is one call, and the transforms in the
+    // broadcast dimensions are run together.
+    gtl::InlinedVector<int32, 8> outer_dims;
+    gtl::InlinedVector<int32, 8> inner_dims;
+    int num_transforms = 1;
+    for (int i = 0; i < num_batch_dims; i++) {
+      if (points_batch_shape.dim_size(i) == 1) {
+        inner_dims.push_back(i);
+        num_transforms *= output_batch_shape.dim_size(i);
+      } else {
+        outer_dims.push_back(i);
+      }
+    }
+    int64_t num_calls = points_batch_shape.num_elements();
+
+    if (output_shape.num_elements() == 0) {
+      return;
+    }
+    if (num_points == 0) {
+      target_tangent->flat<Complex<Device, FloatType>>().setZero();
+      return;
+    }
+
+    std::vector<int64_t> source_offsets = this->GetBatchOffsets(
+        source_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        this->transform_type_ == TransformType::TYPE_1 ?
+            num_points : grid_shape.num_elements());
+    std::vector<int64_t> output_offsets = this->GetBatchOffsets(
+        output_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        output_elem_size);
+
+    // The shape of the grid needs to be reversed for FINUFFT.
+    int num_modes[3] = {1, 1, 1};
+    for (int i = 0; i < rank; i++) {
+      num_modes[i] = static_cast<int>(grid_shape.dim_size(rank - 1 - i));
+    }
+
+    auto plan = std::make_unique<Plan<Device, FloatType>>(ctx);
+    OP_REQUIRES_OK(ctx, plan->initialize(
+        this->transform_type_, static_cast<int>(rank), num_modes,
+        this->fft_direction_, num_transforms,
+        static_cast<FloatType>(this->tol_),
+        this->GetInternalOptions(ctx, this->op_type_)));
+
+    FloatType* points_data = const_cast<FloatType*>(
+        points.flat<FloatType>().data());
+    FloatType* points_tangent_data = const_cast<FloatType*>(
+        points_tangent.flat<FloatType>().data());
+    auto* source_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(source.tensor_data().data()));
+    auto* source_tangent_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(source_tangent.tensor_data().data()));
+    auto* target_tangent_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(target_tangent->tensor_data().data()));
+
+    for (int64_t call_index = 0; call_index < num_calls; call_index++) {
+      // Interleaved coordinates, in reverse FINUFFT order.
+      FloatType* points_batch = points_data + call_index * num_points * rank;
+      FloatType* tangent_batch =
+          points_tangent_data + call_index * num_points * rank;
+      OP_REQUIRES_OK(ctx, plan->set_points(
+          num_points, points_batch + rank - 1,
+          rank > 1 ? points_batch + rank - 2 : nullptr,
+          rank > 2 ? points_batch + rank - 3 : nullptr, rank));
+
+      const int64_t* source_layout =
+          source_offsets.data() + call_index * num_transforms;
+      const int64_t* output_layout =
+          output_offsets.data() + call_index * num_transforms;
+      FloatType* tangent_x = tangent_batch + rank - 1;
+      FloatType* tangent_y = rank > 1 ? tangent_batch + rank - 2 : nullptr;
+      FloatType* tangent_z = rank > 2 ? tangent_batch + rank - 3 : nullptr;
+      BatchLayout layout;
+      if (this->transform_type_ == TransformType::TYPE_1) {
+        layout.c_offsets = source_layout;
+        layout.f_offsets = output_layout;
+        OP_REQUIRES_OK(ctx, plan->tangent(
+            source_data, nullptr, source_tangent_data, target_tangent_data,
+            tangent_x, tangent_y, tangent_z, layout));
+      } else {
+        layout.c_offsets = output_layout;
+        layout.f_offsets = source_layout;
+        OP_REQUIRES_OK(ctx, plan->tangent(
+            nullptr, source_data, target_tangent_data, source_tangent_data,
+            tangent_x, tangent_y, tangent_z, layout));
+      }
+    }
+  }
+};
+
+
+// Solves the regularized least squares problem of a type-2 NUFFT with the
+// conjugate gradient method on its normal equations,
+// `(A^H W A + lambda I) x = A^H W y`. The forward and adjoint plans are made
+// once and the work vectors are allocated once, for all the iterations. Only
+// implemented on the CPU.
+template <typename Device, typename FloatType>
+class NUFFTConjugateGradient : public NUFFTBaseOp<Device, FloatType> {
+
+  public:
+
+  explicit NUFFTConjugateGradient(OpKernelConstruction* ctx) : NUFFTBaseOp<Device, FloatType>(ctx) {
+
+    string fft_direction_str;
+
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("fft_direction", &fft_direction_str));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("l2_regularization", &l2_regularization_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("num_iterations", &num_iterations_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("rtol", &rtol_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("tol", &this->tol_));
+
+    OP_REQUIRES(ctx, num_iterations_ >= 0,
+                errors::InvalidArgument(
+                    "num_iterations must be non-negative, but got: ",
+                    num_iterations_));
+
+    this->transform_type_ = TransformType::TYPE_2;
+    if (fft_direction_str == "backward") {
+      this->fft_direction_ = FftDirection::BACKWARD;
+    } else if (fft_direction_str == "forward") {
+      this->fft_direction_ = FftDirection::FORWARD;
+    }
+
+    this->op_type_ = OpType::NUFFT;
+
+    string options_serialized;
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("options", &options_serialized));
+    OP_REQUIRES(ctx, this->options_.ParseFromString(options_serialized),
+                errors::InvalidArgument("Unable to parse options string."));
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    using DType = Complex<Device, FloatType>;
+
+    const Tensor& data = ctx->input(0);
+    const Tensor& points = ctx->input(1);
+    const Tensor& weights = ctx->input(3);
+
+    OP_REQUIRES(ctx, points.dims() >= 2,
+                errors::InvalidArgument(
+                    "Input `points` must have rank of at least 2, but got "
+                    "shape: ", points.shape().DebugString()));
+
+    int64_t rank = points.dim_size(points.dims() - 1);
+    int64_t num_points = points.dim_size(points.dims() - 2);
+
+    OP_REQUIRES(ctx, rank >= 1 && rank <= 3,
+                errors::InvalidArgument(
+                    "Points must have 1, 2 or 3 dimensions, but got: ", rank));
+
+    TensorShape grid_shape;
+    OP_REQUIRES_OK(ctx, tensor::MakeShape(ctx->input(2), &grid_shape));
+    OP_REQUIRES(ctx, grid_shape.dims() == rank,
+                errors::InvalidArgument(
+                    "grid_shape must have ", rank, " elements, but got: ",
+                    grid_shape.DebugString()));
+    OP_REQUIRES(ctx, data.dims() >= 1 &&
+                     data.dim_size(data.dims() - 1) == num_points,
+                errors::InvalidArgument(
+                    "Input `data` must have shape [..., ", num_points,
+                    "], but got shape: ", data.shape().DebugString()));
+
+    TensorShape points_batch_shape;
+    for (int i = 0; i < points.dims() - 2; i++) {
+      points_batch_shape.AddDim(points.dim_size(i));
+    }
+    TensorShape expected_weights_shape = points_batch_shape;
+    expected_weights_shape.AddDim(num_points);
+    OP_REQUIRES(ctx, weights.shape() == expected_weights_shape,
+                errors::InvalidArgument(
+                    "Input `weights` must have shape ",
+                    expected_weights_shape.DebugString(), ", but got shape: ",
+                    weights.shape().DebugString()));
+    TensorShape data_batch_shape;
+    for (int i = 0; i < data.dims() - 1; i++) {
+      data_batch_shape.AddDim(data.dim_size(i));
+    }
+
+    // Insert leading ones so that both inputs have the same number of batch
+    // dimensions, and broadcast them.
+    int num_batch_dims = std::max(data_batch_shape.dims(),
+                                  points_batch_shape.dims());
+    while (data_batch_shape.dims() < num_batch_dims)
+      data_batch_shape.InsertDim(0, 1);
+    while (points_batch_shape.dims() < num_batch_dims)
+      points_batch_shape.InsertDim(0, 1);
+    TensorShape output_batch_shape;
+    for (int i = 0; i < num_batch_dims; i++) {
+      int64_t size = std::max(data_batch_shape.dim_size(i),
+                              points_batch_shape.dim_size(i));
+      OP_REQUIRES(ctx, (data_batch_shape.dim_size(i) == 1 ||
+                        data_batch_shape.dim_size(i) == size) &&
+                       (points_batch_shape.dim_size(i) == 1 ||
+                        points_batch_shape.dim_size(i) == size),
+                  errors::InvalidArgument(
+                      "Incompatible shapes: ", data.shape().DebugString(),
+                      " vs. ", points.shape().DebugString()));
+      output_batch_shape.AddDim(size);
+    }
+
+    TensorShape output_shape = output_batch_shape;
+    output_shape.AppendShape(grid_shape);
+    int64_t grid_elems = grid_shape.num_elements();
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, output_shape, &output));
+    if (output_shape.num_elements() == 0) {
+      return;
+    }
+    if (num_points == 0) {
+      // The right-hand side is zero, and so is the solution.
+      output->flat<DType>().setZero();
+      return;
+    }
+
+    // Each element of the points batch is one call, and the systems in the
+    // broadcast dimensions (e.g., coils) are solved together.
+    gtl::InlinedVector<int32, 8> outer_dims;
+    gtl::InlinedVector<int32, 8> inner_dims;
+    int num_systems = 1;
+    for (int i = 0; i < num_batch_dims; i++) {
+      if (points_batch_shape.dim_size(i) == 1) {
+        inner_dims.push_back(i);
+        num_systems *= output_batch_shape.dim_size(i);
+      } else {
+        outer_dims.push_back(i);
+      }
+    }
+    int64_t num_calls = points_batch_shape.num_elements();
+
+    std::vector<int64_t> data_offsets = this->GetBatchOffsets(
+        data_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        num_points);
+    std::vector<int64_t> output_offsets = this->GetBatchOffsets(
+        output_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        grid_elems);
+
+    // The shape of the grid needs to be reversed for FINUFFT.
+    int num_modes[3] = {1, 1, 1};
+    for (int i = 0; i < rank; i++) {
+      num_modes[i] = static_cast<int>(grid_shape.dim_size(rank - 1 - i));
+    }
+
+    // The adjoint of the type-2 transform is the type-1 transform with the
+    // opposite sign. The forward plan shares the preprocessing of the points
+    // of the adjoint plan, so the points are only sorted once per call.
+    FftDirection adjoint_fft_direction =
+        this->fft_direction_ == FftDirection::FORWARD ?
+            FftDirection::BACKWARD : FftDirection::FORWARD;
+    InternalOptions options = this->GetInternalOptions(ctx, this->op_type_);
+    auto forward_plan = std::make_unique<Plan<Device, FloatType>>(ctx);
+    OP_REQUIRES_OK(ctx, forward_plan->initialize(
+        TransformType::TYPE_2, static_cast<int>(rank), num_modes,
+        this->fft_direction_, num_systems,
+        static_cast<FloatType>(this->tol_), options));
+    auto adjoint_plan = std::make_unique<Plan<Device, FloatType>>(ctx);
+    OP_REQUIRES_OK(ctx, adjoint_plan->initialize(
+        TransformType::TYPE_1, static_cast<int>(rank), num_modes,
+        adjoint_fft_direction, num_systems,
+        static_cast<FloatType>(this->tol_), options));
+
+    // Work vectors: the solution, the residual, the search direction and the
+    // normal operator applied to it, for all the systems, and the values at
+    // the points.
+    Tensor x_tensor, r_tensor, p_tensor, q_tensor;
+    for (Tensor* tensor : {&x_tensor, &r_tensor, &p_tensor, &q_tensor}) {
+      OP_REQUIRES_OK(ctx, ctx->allocate_temp(
+          DataTypeToEnum<DType>::value,
+          TensorShape({num_systems, grid_elems}), tensor));
+    }
+    Tensor values_tensor;
+    OP_REQUIRES_OK(ctx, ctx->allocate_temp(
+        DataTypeToEnum<DType>::value,
+        TensorShape({num_systems, num_points}), &values_tensor));
+    auto x = x_tensor.matrix<DType>();
+    auto r = r_tensor.matrix<DType>();
+    auto p = p_tensor.matrix<DType>();
+    auto q = q_tensor.matrix<DType>();
+    auto values = values_tensor.matrix<DType>();
+
+    const Device& device = ctx->eigen_device<Device>();
+    const DType* data_data = data.flat<DType>().data();
+    FloatType* points_data = const_cast<FloatType*>(
+        points.flat<FloatType>().data());
+    const FloatType* weights_data = weights.flat<FloatType>().data();
+    DType* output_data = output->flat<DType>().data();
+    const DType lambda(l2_regularization_, 0);
+
+    Eigen::array<Eigen::Index, 1> reduce_dims({1});
+    Eigen::array<Eigen::Index, 2> column_shape({num_systems, 1});
+    Eigen::array<Eigen::Index, 2> grid_bcast({1, grid_elems});
+    Eigen::array<Eigen::Index, 2> points_bcast({num_systems, 1});
+    Eigen::Tensor<FloatType, 1, Eigen::RowMajor> rs(num_systems);
+    Eigen::Tensor<FloatType, 1, Eigen::RowMajor> rs_new(num_systems);
+    Eigen::Tensor<FloatType, 1, Eigen::RowMajor> pq(num_systems);
+    Eigen::Tensor<FloatType, 1, Eigen::RowMajor> rs_target(num_systems);
+    Eigen::Tensor<DType, 1, Eigen::RowMajor> alpha(num_systems);
+    Eigen::Tensor<DType, 1, Eigen::RowMajor> beta(num_systems);
+
+    for (int64_t call_index = 0; call_index < num_calls; call_index++) {
+      // Interleaved coordinates, in reverse FINUFFT order.
+      FloatType* points_batch = points_data + call_index * num_points * rank;
+      OP_REQUIRES_OK(ctx, adjoint_plan->set_points(
+          num_points, points_batch + rank - 1,
+          rank > 1 ? points_batch + rank - 2 : nullptr,
+          rank > 2 ? points_batch + rank - 3 : nullptr, rank));
+      OP_REQUIRES_OK(ctx, forward_plan->set_points_from(*adjoint_plan));
+      typename TTypes<FloatType>::UnalignedConstMatrix point_weights(
+          weights_data + call_index * num_points, 1, num_points);
+      auto weights_bcast = point_weights.template cast<DType>()
+                                        .broadcast(points_bcast);
+
+      // Applies the normal operator to the search direction, into `q`.
+      auto apply_normal_operator = [&]() -> Status {
+        TF_RETURN_IF_ERROR(forward_plan->execute(values.data(), p.data()));
+        values.device(device) = values * weights_bcast;
+        TF_RETURN_IF_ERROR(adjoint_plan->execute(values.data(), q.data()));
+        if (l2_regularization_ != 0.0f) {
+          q.device(device) += p * lambda;
+        }
+        return Status::OK();
+      };
+
+      // The right-hand side `A^H W y` is the initial residual, for a zero
+      // initial guess.
+      const int64_t* call_data_offsets =
+          data_offsets.data() + call_index * num_systems;
+      for (int i = 0; i < num_systems; i++) {
+        std::copy_n(data_data + call_data_offsets[i], num_points,
+                    values.data() + i * num_points);
+      }
+      values.device(device) = values * weights_bcast;
+      OP_REQUIRES_OK(ctx, adjoint_plan->execute(values.data(), r.data()));
+      x.device(device) = x.constant(DType(0));
+      p.device(device) = r;
+      rs.device(device) = (r.conjugate() * r).real().sum(reduce_dims);
+      rs_target = rs * static_cast<FloatType>(rtol_ * rtol_);
+
+      for (int iteration = 0; iteration < num_iterations_; iteration++) {
+        OP_REQUIRES_OK(ctx, apply_normal_operator());
+        pq.device(device) = (p.conjugate() * q).real().sum(reduce_dims);
+        for (int i = 0; i < num_systems; i++) {
+          alpha(i) = DType(pq(i) > 0 ? rs(i) / pq(i) : 0, 0);
+        }
+        auto alpha_bcast = alpha.reshape(column_shape).broadcast(grid_bcast);
+        x.device(device) += p * alpha_bcast;
+        r.device(device) -= q * alpha_bcast;
+        rs_new.device(device) = (r.conjugate() * r).real().sum(reduce_dims);
+
+        // Stop when all the systems have converged.
+        bool converged = true;
+        for (int i = 0; i < num_systems; i++) {
+          if (rs_new(i) > rs_target(i)) converged = false;
+          beta(i) = DType(rs(i) > 0 ? rs_new(i) / rs(i) : 0, 0);
+        }
+        if (converged) break;
+        p.device(device) = r + p * beta.reshape(column_shape)
+                                       .broadcast(grid_bcast);
+        rs = rs_new;
+      }
+
+      const int64_t* call_output_offsets =
+          output_offsets.data() + call_index * num_systems;
+      for (int i = 0; i < num_systems; i++) {
+        std::copy_n(x.data() + i * grid_elems, grid_elems,
+                    output_data + call_output_offsets[i]);
+      }
+    }
+  }
+
+  private:
+
+  float l2_regularization_;
+  int num_iterations_;
+  float rtol_;
+};
+
+
+// Computes sampling density compensation weights with the fixed-point
+// iteration of Pipe and Menon, on a single spread/interp plan for each element
+// of the points batch. Only implemented on the CPU.
+template <typename Device, typename FloatType>
+class DensityCompensation : public NUFFTBaseOp<Device, FloatType> {
+
+  public:
+
+  explicit DensityCompensation(OpKernelConstruction* ctx) : NUFFTBaseOp<Device, FloatType>(ctx) {
+
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("num_iterations", &num_iterations_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("rtol", &rtol_));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("tol", &this->tol_));
+
+    OP_REQUIRES(ctx, num_iterations_ >= 0,
+                errors::InvalidArgument(
+                    "num_iterations must be non-negative, but got: ",
+                    num_iterations_));
+
+    string options_serialized;
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("options", &options_serialized));
+    OP_REQUIRES(ctx, this->options_.ParseFromString(options_serialized),
+                errors::InvalidArgument("Unable to parse options string."));
+
+    this->transform_type_ = TransformType::TYPE_1;
+    this->fft_direction_ = FftDirection::BACKWARD; // irrelevant
+
+    this->op_type_ = OpType::SPREAD;
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    const Tensor& points = ctx->input(0);
+
+    OP_REQUIRES(ctx, points.dims() >= 2,
+                errors::InvalidArgument(
+                    "Input `points` must have rank of at least 2, but got "
+                    "shape: ", points.shape().DebugString()));
+
+    int64_t rank = points.dim_size(points.dims() - 1);
+    int64_t num_points = points.dim_size(points.dims() - 2);
+
+    OP_REQUIRES(ctx, rank >= 1 && rank <= 3,
+                errors::InvalidArgument(
+                    "Points must have 1, 2 or 3 dimensions, but got: ", rank));
+
+    TensorShape grid_shape;
+    OP_REQUIRES_OK(ctx, tensor::MakeShape(ctx->input(1), &grid_shape));
+    OP_REQUIRES(ctx, grid_shape.dims() == rank,
+                errors::InvalidArgument(
+                    "grid_shape must have ", rank, " elements, but got: ",
+                    grid_shape.DebugString()));
+
+    // The weights have the shape of the points, without the last dimension.
+    TensorShape weights_shape = points.shape();
+    weights_shape.RemoveLastDims(1);
+    Tensor* weights = nullptr;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, weights_shape, &weights));
+    if (weights_shape.num_elements() == 0) {
+      return;
+    }
+
+    // The shape of the grid needs to be reversed for FINUFFT.
+    int num_modes[3] = {1, 1, 1};
+    for (int i = 0; i < rank; i++) {
+      num_modes[i] = static_cast<int>(grid_shape.dim_size(rank - 1 - i));
+    }
+
+    auto plan = std::make_unique<Plan<Device, FloatType>>(ctx);
+    OP_REQUIRES_OK(ctx, plan->initialize(
+        this->transform_type_, static_cast<int>(rank), num_modes,
+        this->fft_direction_, 1, static_cast<FloatType>(this->tol_),
+        this->GetInternalOptions(ctx, this->op_type_)));
+
+    FloatType* points_data = const_cast<FloatType*>(
+        points.flat<FloatType>().data());
+    FloatType* weights_data = weights->flat<FloatType>().data();
+    int64_t num_calls = weights_shape.num_elements() / num_points;
+
+    for (int64_t call_index = 0; call_index < num_calls; call_index++) {
+      // Interleaved coordinates, in reverse FINUFFT order.
+      FloatType* points_batch = points_data + call_index * num_points * rank;
+      OP_REQUIRES_OK(ctx, plan->set_points(
+          num_points, points_batch + rank - 1,
+          rank > 1 ? points_batch + rank - 2 : nullptr,
+          rank > 2 ? points_batch + rank - 3 : nullptr, rank));
+
+      OP_REQUIRES_OK(ctx, plan->density_compensation(
+          weights_data + call_index * num_points, num_iterations_,
+          static_cast<FloatType>(rtol_)));
+    }
+  }
+
+  private:
+
+  int num_iterations_;
+  float rtol_;
+};
+
+
+// Applies the SENSE forward (type 2) or adjoint (type 1) operator, i.e., a
+// NUFFT of an image modulated by each coil sensitivity, or the sum over the
+// coils of the NUFFT of each coil's data demodulated by its sensitivity. The
+// sensitivities are applied by the deconvolution, so the per-coil images are
+// never stored. Only implemented on the CPU.
+template <typename Device, typename FloatType>
+class NUFFTSense : public NUFFTBaseOp<Device, FloatType> {
+
+  public:
+
+  explicit NUFFTSense(OpKernelConstruction* ctx) : NUFFTBaseOp<Device, FloatType>(ctx) {
+
+    string transform_type_str;
+    string fft_direction_str;
+
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("transform_type", &transform_type_str));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("fft_direction", &fft_direction_str));
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("tol", &this->tol_));
+
+    if (transform_type_str == "type_1") {
+      this->transform_type_ = TransformType::TYPE_1;
+    } else if (transform_type_str == "type_2") {
+      this->transform_type_ = TransformType::TYPE_2;
+    }
+
+    if (fft_direction_str == "backward") {
+      this->fft_direction_ = FftDirection::BACKWARD;
+    } else if (fft_direction_str == "forward") {
+      this->fft_direction_ = FftDirection::FORWARD;
+    }
+
+    this->op_type_ = OpType::NUFFT;
+
+    string options_serialized;
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("options", &options_serialized));
+    OP_REQUIRES(ctx, this->options_.ParseFromString(options_serialized),
+                errors::InvalidArgument("Unable to parse options string."));
+  }
+
+  void Compute(OpKernelContext* ctx) override {
+    const Tensor& source = ctx->input(0);
+    const Tensor& points = ctx->input(1);
+    const Tensor& sensitivities = ctx->input(2);
+
+    OP_REQUIRES(ctx, points.dims() >= 2,
+                errors::InvalidArgument(
+                    "Input `points` must have rank of at least 2, but got "
+                    "shape: ", points.shape().DebugString()));
+
+    int64_t rank = points.dim_size(points.dims() - 1);
+    int64_t num_points = points.dim_size(points.dims() - 2);
+
+    OP_REQUIRES(ctx, rank >= 1 && rank <= 3,
+                errors::InvalidArgument(
+                    "Points must have 1, 2 or 3 dimensions, but got: ", rank));
+
+    // The sensitivities have shape `[..., C] + grid_shape`.
+    OP_REQUIRES(ctx, sensitivities.dims() >= rank + 1,
+                errors::InvalidArgument(
+                    "Input `sensitivities` must have rank of at least ",
+                    rank + 1, ", but got shape: ",
+                    sensitivities.shape().DebugString()));
+    TensorShape grid_shape;
+    for (int i = sensitivities.dims() - rank; i < sensitivities.dims(); i++) {
+      grid_shape.AddDim(sensitivities.dim_size(i));
+    }
+    int64_t num_coils = sensitivities.dim_size(sensitivities.dims() - rank - 1);
+    TensorShape sensitivities_batch_shape;
+    for (int i = 0; i < sensitivities.dims() - rank - 1; i++) {
+      sensitivities_batch_shape.AddDim(sensitivities.dim_size(i));
+    }
+
+    // The image has shape `[...] + grid_shape` and the k-space data has shape
+    // `[..., C, M]`.
+    TensorShape source_batch_shape;
+    int source_elem_rank;
+    if (this->transform_type_ == TransformType::TYPE_2) {
+      OP_REQUIRES(ctx, source.dims() >= rank,
+                  errors::InvalidArgument(
+                      "Input `source` must have rank of at least ", rank,
+                      ", but got shape: ", source.shape().DebugString()));
+      for (int i = 0; i < rank; i++) {
+        OP_REQUIRES(ctx, source.dim_size(source.dims() - rank + i) ==
+                         grid_shape.dim_size(i),
+                    errors::InvalidArgument(
+                        "Input `source` must have shape [...] + ",
+                        grid_shape.DebugString(), ", but got shape: ",
+                        source.shape().DebugString()));
+      }
+      source_elem_rank = rank;
+    } else {
+      OP_REQUIRES(ctx, source.dims() >= 2 &&
+                       source.dim_size(source.dims() - 2) == num_coils &&
+                       source.dim_size(source.dims() - 1) == num_points,
+                  errors::InvalidArgument(
+                      "Input `source` must have shape [..., ", num_coils, ", ",
+                      num_points, "], but got shape: ",
+                      source.shape().DebugString()));
+      source_elem_rank = 2;
+    }
+    for (int i = 0; i < source.dims() - source_elem_rank; i++) {
+      source_batch_shape.AddDim(source.dim_size(i));
+    }
+    TensorShape points_batch_shape;
+    for (int i = 0; i < points.dims() - 2; i++) {
+      points_batch_shape.AddDim(points.dim_size(i));
+    }
+
+    // Insert leading ones so that all inputs have the same number of batch
+    // dimensions, and broadcast them.
+    int num_batch_dims = std::max({source_batch_shape.dims(),
+                                   points_batch_shape.dims(),
+                                   sensitivities_batch_shape.dims()});
+    while (source_batch_shape.dims() < num_batch_dims)
+      source_batch_shape.InsertDim(0, 1);
+    while (points_batch_shape.dims() < num_batch_dims)
+      points_batch_shape.InsertDim(0, 1);
+    while (sensitivities_batch_shape.dims() < num_batch_dims)
+      sensitivities_batch_shape.InsertDim(0, 1);
+    TensorShape output_batch_shape;
+    for (int i = 0; i < num_batch_dims; i++) {
+      int64_t size = std::max({source_batch_shape.dim_size(i),
+                               points_batch_shape.dim_size(i),
+                               sensitivities_batch_shape.dim_size(i)});
+      for (const TensorShape* shape : {&source_batch_shape,
+                                       &points_batch_shape,
+                                       &sensitivities_batch_shape}) {
+        OP_REQUIRES(ctx, shape->dim_size(i) == 1 || shape->dim_size(i) == size,
+                    errors::InvalidArgument(
+                        "Incompatible shapes: ", source.shape().DebugString(),
+                        " vs. ", points.shape().DebugString(), " vs. ",
+                        sensitivities.shape().DebugString()));
+      }
+      output_batch_shape.AddDim(size);
+    }
+
+    TensorShape output_shape = output_batch_shape;
+    if (this->transform_type_ == TransformType::TYPE_1) {
+      output_shape.AppendShape(grid_shape);
+    } else {
+      output_shape.AddDim(num_coils);
+      output_shape.AddDim(num_points);
+    }
+    Tensor* target = nullptr;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output(0, output_shape, &target));
+
+    // The adjoint adds the contribution of each coil to the image.
+    if (this->transform_type_ == TransformType::TYPE_1 || num_points == 0) {
+      target->flat<Complex<Device, FloatType>>().setZero();
+    }
+    if (output_shape.num_elements() == 0 || num_points == 0 ||
+        num_coils == 0) {
+      return;
+    }
+
+    // Each element of the points batch is one call, and the transforms in the
+    // broadcast dimensions are run together, one per coil.
+    gtl::InlinedVector<int32, 8> outer_dims;
+    gtl::InlinedVector<int32, 8> inner_dims;
+    int64_t num_images = 1;
+    for (int i = 0; i < num_batch_dims; i++) {
+      if (points_batch_shape.dim_size(i) == 1) {
+        inner_dims.push_back(i);
+        num_images *= output_batch_shape.dim_size(i);
+      } else {
+        outer_dims.push_back(i);
+      }
+    }
+    int64_t num_calls = points_batch_shape.num_elements();
+    int64_t num_transforms = num_images * num_coils;
+
+    // Transform `j * C + c` is coil `c` of image `j` of the call. Its uniform
+    // data is the image, shared by all coils, and the sensitivities and the
+    // k-space data are those of the coil.
+    const int64_t grid_size = grid_shape.num_elements();
+    const TensorShape& image_batch_shape =
+        this->transform_type_ == TransformType::TYPE_1 ?
+        output_batch_shape : source_batch_shape;
+    const TensorShape& kspace_batch_shape =
+        this->transform_type_ == TransformType::TYPE_1 ?
+        source_batch_shape : output_batch_shape;
+    std::vector<int64_t> image_offsets = this->GetBatchOffsets(
+        image_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        grid_size);
+    std::vector<int64_t> sensitivities_offsets = this->GetBatchOffsets(
+        sensitivities_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        num_coils * grid_size);
+    std::vector<int64_t> kspace_offsets = this->GetBatchOffsets(
+        kspace_batch_shape, output_batch_shape, outer_dims, inner_dims,
+        num_coils * num_points);
+    std::vector<int64_t> c_offsets(num_calls * num_transforms);
+    std::vector<int64_t> f_offsets(num_calls * num_transforms);
+    std::vector<int64_t> s_offsets(num_calls * num_transforms);
+    for (int64_t i = 0; i < num_calls * num_images; i++) {
+      for (int64_t coil = 0; coil < num_coils; coil++) {
+        int64_t t = i * num_coils + coil;
+        c_offsets[t] = kspace_offsets[i] + coil * num_points;
+        f_offsets[t] = image_offsets[i];
+        s_offsets[t] = sensitivities_offsets[i] + coil * grid_size;
+      }
+    }
+
+    // The shape of the grid needs to be reversed for FINUFFT.
+    int num_modes[3] = {1, 1, 1};
+    for (int i = 0; i < rank; i++) {
+      num_modes[i] = static_cast<int>(grid_shape.dim_size(rank - 1 - i));
+    }
+
+    auto plan = std::make_unique<Plan<Device, FloatType>>(ctx);
+    OP_REQUIRES_OK(ctx, plan->initialize(
+        this->transform_type_, static_cast<int>(rank), num_modes,
+        this->fft_direction_, static_cast<int>(num_transforms),
+        static_cast<FloatType>(this->tol_),
+        this->GetInternalOptions(ctx, this->op_type_)));
+
+    FloatType* points_data = const_cast<FloatType*>(
+        points.flat<FloatType>().data());
+    auto* source_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(source.tensor_data().data()));
+    auto* sensitivities_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(sensitivities.tensor_data().data()));
+    auto* target_data = reinterpret_cast<Complex<Device, FloatType>*>(
+        const_cast<char*>(target->tensor_data().data()));
+
+    for (int64_t call_index = 0; call_index < num_calls; call_index++) {
+      // Interleaved coordinates, in reverse FINUFFT order.
+      FloatType* points_batch = points_data + call_index * num_points * rank;
+      OP_REQUIRES_OK(ctx, plan->set_points(
+          num_points, points_batch + rank - 1,
+          rank > 1 ? points_batch + rank - 2 : nullptr,
+          rank > 2 ? points_batch + rank - 3 : nullptr, rank));
+      OP_REQUIRES_OK(ctx, plan->set_sensitivities(
+          sensitivities_data, s_offsets.data() + call_index * num_transforms));
+
+      BatchLayout layout;
+      layout.c_offsets = c_offsets.data() + call_index * num_transforms;
+      layout.f_offsets = f_offsets.data() + call_index * num_transforms;
+      if (this->transform_type_ == TransformType::TYPE_1) {
+        OP_REQUIRES_OK(ctx, plan->execute(source_data, target_data, layout));
+      } else {
+        OP_REQUIRES_OK(ctx, plan->execute(target_data, source_data, layout));
+      }
+    }
+  }
+};
+
+
+// Register the CPU kernels.
+REGISTER_KERNEL_BUILDER(Name("NUFFT")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFT")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("Interp")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal"),
+                        Interp<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("Interp")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal"),
+                        Interp<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("Spread")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        Spread<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("Spread")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        Spread<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedNUFFT")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedNUFFT")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedInterp")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal"),
+                        Interp<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedInterp")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal"),
+                        Interp<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedSpread")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        Spread<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedSpread")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        Spread<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTPointsGrad")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal"),
+                        NUFFTPointsGrad<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTPointsGrad")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal"),
+                        NUFFTPointsGrad<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("InterpPointsGrad")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal"),
+                        InterpPointsGrad<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("InterpPointsGrad")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal"),
+                        InterpPointsGrad<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTTangent")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFTTangent<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTTangent")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFTTangent<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("DensityCompensation")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        DensityCompensation<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("DensityCompensation")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        DensityCompensation<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTConjugateGradient")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFTConjugateGradient<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTConjugateGradient")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFTConjugateGradient<CPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTSense")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal"),
+                        NUFFTSense<CPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFTSense")
+                            .Device(DEVICE_CPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal"),
+                        NUFFTSense<CPUDevice, double>);
+
+// Register the GPU kernels.
+#ifdef GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(Name("NUFFT")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<GPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("NUFFT")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<GPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("Interp")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal"),
                         Interp<GPUDevice, float>);
 
 REGISTER_KERNEL_BUILDER(Name("Interp")
@@ -705,6 +2297,46 @@ REGISTER_KERNEL_BUILDER(Name("Spread")
                             .TypeConstraint<double>("Treal")
                             .HostMemory("grid_shape"),
                         Spread<GPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedNUFFT")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<GPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedNUFFT")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        NUFFT<GPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedInterp")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal"),
+                        Interp<GPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedInterp")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal"),
+                        Interp<GPUDevice, double>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedSpread")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex64>("Tcomplex")
+                            .TypeConstraint<float>("Treal")
+                            .HostMemory("grid_shape"),
+                        Spread<GPUDevice, float>);
+
+REGISTER_KERNEL_BUILDER(Name("WeightedSpread")
+                            .Device(DEVICE_GPU)
+                            .TypeConstraint<complex128>("Tcomplex")
+                            .TypeConstraint<double>("Treal")
+                            .HostMemory("grid_shape"),
+                        Spread<GPUDevice, double>);
 #endif  // GOOGLE_CUDA
 
 }  // namespace nufft
@@ -61,7 +61,16 @@ enum class SpreadThreading {
 enum class SortPoints {
   AUTO = -1,  // Choose automatically using a heuristic.
   NO = 0,     // Do not sort non-uniform points.
-  YES = 1     // Sort non-uniform points.
+  YES = 1,    // Sort non-uniform points into bins visited in Cartesian order.
+  MORTON = 2  // Sort non-uniform points into cache-sized bins visited in
+              // Morton (Z-curve) order. CPU only; same as `YES` on the GPU.
+};
+
+// Specifies the engine used to compute the FFTs on the CPU.
+enum class FftEngine {
+  AUTO = -1,  // Choose automatically. Currently FFTW.
+  FFTW = 0,   // Use FFTW.
+  NATIVE = 1  // Use the built-in, header-only engine (see native_fft.h).
 };
 
 // Specifies the spread method.
@@ -100,13 +109,22 @@ struct InternalOptions {
   // appropriate number. Applies only to the CPU kernel.
   int num_threads = 0;
 
-  // FFTW flags. Applies only to the CPU kernel.
+  // The FFT engine. See enum above. Applies only to the CPU kernel.
+  FftEngine fft_engine = FftEngine::AUTO;
+
+  // FFTW flags. Only used if the FFT engine is FFTW. Applies only to the CPU
+  // kernel.
   int fftw_flags = FFTW_ESTIMATE;
 
   // Whether to sort the non-uniform points. See enum above. Used by CPU and GPU
   // kernels.
   SortPoints sort_points = SortPoints::AUTO;
 
+  // Whether to reuse the preprocessing (e.g. the sort) of non-uniform points
+  // which were recently set on another plan. The cache is shared by all plans
+  // in the process, so this is off by default. Applies only to the CPU kernel.
+  bool cache_points = false;
+
   // The kernel evaluation method. See enum above. Applies to the CPU and the
   // GPU kernels.
   KernelEvaluationMethod kernel_evaluation_method = \
@@ -139,6 +157,11 @@ struct InternalOptions {
   // Do only spreading and/or interpolation (no FFT or deconvolution).
   bool spread_only = false;
 
+  // Whether to skip the 1D FFTs of the fine grid rows which hold only zero
+  // padding (type 2) or whose output is discarded (type 1). Applies only to
+  // the CPU kernel, for ranks 2 and 3.
+  bool prune_fft = true;
+
   // The CUDA interpolation/spreading method.
   SpreadMethod spread_method = SpreadMethod::AUTO;
 
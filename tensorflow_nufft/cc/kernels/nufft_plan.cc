@@ -28,15 +28,44 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <utility>
+#include <vector>
+
 #include "tensorflow_nufft/cc/kernels/fftw_api.h"
 #include "tensorflow_nufft/cc/kernels/nufft_plan.h"
 #include "tensorflow_nufft/cc/kernels/nufft_util.h"
-#include "tensorflow_nufft/cc/kernels/omp_api.h"
+#include "tensorflow_nufft/cc/kernels/parallel_api.h"
 
 
 // Largest possible kernel spread width per dimension, in fine grid points.
 #define MAX_KERNEL_WIDTH 16
 
+// Maximum number of bits per digit in the radix sort of the non-uniform points.
+// Digits of this size keep the per-thread histograms in L1 cache.
+constexpr int kMaxSortDigitBits = 11;
+
+// Minimum number of non-uniform points per thread when sorting. Below this,
+// the thread startup cost outweighs the parallel speedup.
+constexpr int64_t kMinPointsPerSortThread = 10000;
+
+// When updating the points, the previous sort order is only reused if at most
+// 1 in this many points changed bin or were appended. Otherwise, sorting the
+// changed points costs more than a full radix sort.
+constexpr int64_t kMaxUpdatedPointsRatio = 16;
+
+// Maximum number of point sets held by the points cache (see PointsCache).
+constexpr int kPointsCacheCapacity = 4;
+
+// Maximum total size of the points cache, in bytes.
+constexpr int64_t kPointsCacheMaxBytes = int64_t{256} << 20;
+
 
 namespace tensorflow {
 namespace nufft {
@@ -62,6 +91,9 @@ Status set_grid_size(int ms,
                      SpreadParameters<FloatType> spread_params,
                      int* grid_size);
 
+int choose_batch_size(int num_transforms, int64_t grid_size,
+                      int64_t grid_bytes, int num_threads);
+
 template<typename FloatType>
 Status setup_spreader(int rank, FloatType eps, double upsampling_factor,
                       int kerevalmeth, bool show_warnings,
@@ -74,62 +106,296 @@ Status setup_spreader_for_nufft(int rank, FloatType eps,
 
 static int get_transform_rank(int64_t n1, int64_t n2, int64_t n3);
 
+static int64_t get_data_cache_size(int level, int64_t default_size);
+
+template<typename FloatType>
+void get_cache_adaptive_bin_sizes(int rank, int kernel_width,
+                                  double* bin_size_x, double* bin_size_y,
+                                  double* bin_size_z);
+
+template<typename IndexType>
+std::vector<IndexType> get_morton_bin_order(
+    int64_t n1, int64_t n2, int64_t n3,
+    double bin_size_x, double bin_size_y, double bin_size_z);
+
 template<typename FloatType>
 Status check_spread_inputs(int64_t n1, int64_t n2, int64_t n3,
-                           int64_t num_points, FloatType *kx, FloatType *ky,
-                           FloatType *kz, SpreadParameters<FloatType> opts);
+                           const SpreadParameters<FloatType>& opts);
+
+// Describes how the NU pts changed since a previous call to preprocess_points,
+// so that its sort order can be reused. The new points are the previous
+// points, except those in [remove_begin, remove_end), in the same order and
+// possibly moved, followed by any appended points.
+template<typename IndexType>
+struct PointsUpdate {
+  // The previous permutation and bin keys, as output by preprocess_points.
+  const IndexType* sort_indices;
+  const IndexType* keys;
+  // The previous number of points.
+  IndexType num_points;
+  // The range of previous points which were removed.
+  IndexType remove_begin;
+  IndexType remove_end;
+};
 
+template<typename FloatType, typename IndexType>
+Status preprocess_points(const CPUDevice& device,
+                         IndexType* sort_indices, IndexType* keys,
+                         int64_t n1, int64_t n2, int64_t n3,
+                         IndexType num_points, FloatType *kx, FloatType *ky,
+                         FloatType *kz, int64_t points_stride,
+                         const SpreadParameters<FloatType>& opts,
+                         const PointsUpdate<IndexType>* update,
+                         bool* did_sort, PointStatistics<FloatType>* stats);
+
+// Everything the preprocessing of a set of non-uniform points depends on,
+// other than the coordinates themselves.
+struct PointsCacheKey {
+  int rank;
+  int64_t grid_dims[3];
+  int64_t num_points;
+  int kernel_width;
+  int pirange;
+  bool check_bounds;
+  SortPoints sort_points;
+  // Whether the points are sorted depends on the direction in 1D only.
+  SpreadDirection spread_direction;
+  DataType index_dtype;
+
+  bool operator==(const PointsCacheKey& other) const {
+    return rank == other.rank &&
+           grid_dims[0] == other.grid_dims[0] &&
+           grid_dims[1] == other.grid_dims[1] &&
+           grid_dims[2] == other.grid_dims[2] &&
+           num_points == other.num_points &&
+           kernel_width == other.kernel_width &&
+           pirange == other.pirange &&
+           check_bounds == other.check_bounds &&
+           sort_points == other.sort_points &&
+           spread_direction == other.spread_direction &&
+           index_dtype == other.index_dtype;
+  }
+
+  // Whether the points for `other` are binned the same way as for this key,
+  // so that their sort order can be updated to the points for this key. All
+  // fields but the number of points must match.
+  bool same_binning(const PointsCacheKey& other) const {
+    PointsCacheKey copy = other;
+    copy.num_points = num_points;
+    return *this == copy;
+  }
+};
+
+// The preprocessing of a set of non-uniform points, as computed by
+// preprocess_points. Not modified once cached.
 template<typename FloatType>
-bool bin_sort_points(int64_t* sort_indices, int64_t n1, int64_t n2, int64_t n3,
-                     int64_t num_points,  FloatType *kx, FloatType *ky,
-                     FloatType *kz, SpreadParameters<FloatType> opts);
+struct CachedPoints {
+  PointsCacheKey key;
+  // The coordinates, point by point.
+  std::vector<FloatType> coords;
+  Tensor sort_indices;
+  Tensor bin_keys;
+  bool did_sort;
+  PointStatistics<FloatType> stats;
+
+  int64_t size_in_bytes() const {
+    return coords.size() * sizeof(FloatType) + sort_indices.TotalBytes() +
+           bin_keys.TotalBytes();
+  }
+};
 
+// Copies the coordinates of `num_points` points into `coords`, point by point.
 template<typename FloatType>
-void bin_sort_singlethread(
-    int64_t *ret, int64_t num_points, FloatType *kx, FloatType *ky,
-    FloatType *kz, int64_t n1, int64_t n2, int64_t n3, int pirange,
-    double bin_size_x, double bin_size_y, double bin_size_z, int debug);
+void gather_coordinates(const CPUDevice& device, int rank, int64_t num_points,
+                        FloatType* const points[3], int64_t points_stride,
+                        FloatType* coords) {
+  parallel_for(&device, num_points,
+               Eigen::TensorOpCost(rank * sizeof(FloatType),
+                                   rank * sizeof(FloatType), rank),
+               [&](int64_t first, int64_t last) {
+    for (int64_t i = first; i < last; i++)
+      for (int d = 0; d < rank; d++)
+        coords[i * rank + d] = points[d][i * points_stride];
+  });
+}
 
+// Returns true if the coordinates of `num_points` points equal `coords`, as
+// stored by gather_coordinates.
 template<typename FloatType>
-void bin_sort_multithread(
-    int64_t *ret, int64_t num_points, FloatType *kx, FloatType *ky, FloatType *kz,
-    int64_t n1,int64_t n2,int64_t n3,int pirange,
-    double bin_size_x, double bin_size_y, double bin_size_z, int debug,
-    int num_threads);
+bool coordinates_equal(const CPUDevice& device, int rank, int64_t num_points,
+                       FloatType* const points[3], int64_t points_stride,
+                       const FloatType* coords) {
+  std::atomic<bool> equal(true);
+  parallel_for(&device, num_points,
+               Eigen::TensorOpCost(2 * rank * sizeof(FloatType), 0, rank),
+               [&](int64_t first, int64_t last) {
+    for (int64_t i = first; i < last; i++) {
+      for (int d = 0; d < rank; d++) {
+        if (points[d][i * points_stride] != coords[i * rank + d]) {
+          equal.store(false, std::memory_order_relaxed);
+          return;
+        }
+      }
+    }
+  });
+  return equal.load(std::memory_order_relaxed);
+}
 
+// Holds the preprocessing of the most recently used sets of non-uniform
+// points, so that plans which share their points only sort them once. This
+// is the case for a transform and the transforms in its gradient, which are
+// run by different ops. Entries are matched by key and by the values of the
+// coordinates, so they remain valid if the memory of the points is reused.
 template<typename FloatType>
-int spreadinterpSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
-		             FloatType *data_uniform,int64_t M, FloatType *kx, FloatType *ky, FloatType *kz,
+class PointsCache {
+ public:
+  static PointsCache& get() {
+    static PointsCache* cache = new PointsCache();
+    return *cache;
+  }
+
+  // Returns the cached preprocessing of the given points, or null if there is
+  // none.
+  std::shared_ptr<const CachedPoints<FloatType>> lookup(
+      const CPUDevice& device, const PointsCacheKey& key,
+      FloatType* const points[3], int64_t points_stride) {
+    std::vector<std::shared_ptr<const CachedPoints<FloatType>>> candidates;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& entry : entries_)
+        if (entry->key == key) candidates.push_back(entry);
+    }
+    // The coordinates are compared on the thread pool, so without holding the
+    // lock. Otherwise, the pool threads could block on it.
+    for (const auto& entry : candidates) {
+      if (coordinates_equal(device, key.rank, key.num_points, points,
+                            points_stride, entry->coords.data())) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = std::find(entries_.begin(), entries_.end(), entry);
+        if (it != entries_.end())
+          entries_.splice(entries_.begin(), entries_, it);
+        return entry;
+      }
+    }
+    return nullptr;
+  }
+
+  // Returns the most recently used entry whose points are binned the same way
+  // as for `key` and were sorted, or null if there is none. Its sort order can
+  // be updated to new points (see merge_points_update).
+  std::shared_ptr<const CachedPoints<FloatType>> latest_sorted(
+      const PointsCacheKey& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : entries_)
+      if (entry->did_sort && key.same_binning(entry->key)) return entry;
+    return nullptr;
+  }
+
+  // Adds an entry, evicting the least recently used entries as needed.
+  void insert(std::shared_ptr<const CachedPoints<FloatType>> entry) {
+    int64_t bytes = entry->size_in_bytes();
+    if (bytes > kPointsCacheMaxBytes) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_front(std::move(entry));
+    total_bytes_ += bytes;
+    while (entries_.size() > kPointsCacheCapacity ||
+           total_bytes_ > kPointsCacheMaxBytes) {
+      total_bytes_ -= entries_.back()->size_in_bytes();
+      entries_.pop_back();
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<std::shared_ptr<const CachedPoints<FloatType>>> entries_;
+  int64_t total_bytes_ = 0;
+};
+
+template<typename IndexType>
+IndexType merge_points_update(IndexType* ret, const IndexType* keys,
+                              IndexType num_points,
+                              const PointsUpdate<IndexType>& update,
+                              IndexType max_changed);
+
+static void get_radix_sort_digits(int64_t num_keys, int* num_passes,
+                                  int* digit_bits);
+
+template<typename IndexType>
+void radix_sort_by_key(const CPUDevice& device,
+                       IndexType* ret, const IndexType* keys,
+                       IndexType num_points, const IndexType* brk,
+                       int num_threads, int num_passes, int digit_bits,
+                       IndexType* counts);
+
+template<typename FloatType, typename IndexType>
+int spreadinterpSorted(const CPUDevice* device,
+                       IndexType* sort_indices,IndexType N1, IndexType N2, IndexType N3,
+		             FloatType *data_uniform,IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+		             int64_t points_stride,
 		             FloatType *data_nonuniform, tensorflow::nufft::SpreadParameters<FloatType> opts, int did_sort);
 
-template<typename FloatType>
-int interpSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
-		      FloatType *data_uniform,int64_t M, FloatType *kx, FloatType *ky, FloatType *kz,
+template<typename FloatType, typename IndexType>
+int interpSorted(const CPUDevice* device,
+                 IndexType* sort_indices,IndexType N1, IndexType N2, IndexType N3,
+		      FloatType *data_uniform,IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+		      int64_t points_stride,
 		      FloatType *data_nonuniform, SpreadParameters<FloatType> opts, int did_sort);
 
-template<typename FloatType>
-int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
-		      FloatType *data_uniform,int64_t M, FloatType *kx, FloatType *ky, FloatType *kz,
+template<typename FloatType, typename IndexType>
+int spreadSorted(const CPUDevice* device,
+                 IndexType* sort_indices,IndexType N1, IndexType N2, IndexType N3,
+		      FloatType *data_uniform,IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+		      int64_t points_stride,
 		      FloatType *data_nonuniform, SpreadParameters<FloatType> opts, int did_sort);
 
+template<typename FloatType, typename IndexType>
+void interpGradSorted(const CPUDevice* device,
+                      IndexType* sort_indices, IndexType N1, IndexType N2, IndexType N3,
+                      int batch_size, FloatType *data_uniform,
+                      const int64_t* f_offsets,
+                      FloatType *data_nonuniform, const int64_t* c_offsets,
+                      IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+                      int64_t points_stride,
+                      FloatType *grad_x, FloatType *grad_y, FloatType *grad_z,
+                      bool accumulate, const SpreadParameters<FloatType>& opts);
+
+template<typename FloatType, typename IndexType>
+void spreadTangentSorted(const CPUDevice* device,
+                         IndexType* sort_indices, IndexType N1, IndexType N2, IndexType N3,
+                         FloatType *data_uniform, IndexType M,
+                         FloatType *kx, FloatType *ky, FloatType *kz,
+                         int64_t points_stride,
+                         FloatType *data_nonuniform, FloatType *data_tangent,
+                         FloatType *tx, FloatType *ty, FloatType *tz,
+                         const SpreadParameters<FloatType>& opts);
+
+template<typename FloatType, typename IndexType>
+void interpTangentSorted(const CPUDevice* device,
+                         IndexType* sort_indices, IndexType N1, IndexType N2, IndexType N3,
+                         int batch_size, FloatType *data_uniform,
+                         FloatType *data_uniform_tangent,
+                         FloatType *data_nonuniform, const int64_t* c_offsets,
+                         IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+                         int64_t points_stride,
+                         FloatType *tx, FloatType *ty, FloatType *tz,
+                         const SpreadParameters<FloatType>& opts);
+
 template<typename FloatType>
 void deconvolveshuffle1d(
-    SpreadDirection dir, FloatType prefac, FloatType* ker, int64_t ms,
+    SpreadDirection dir, FloatType prefac, const FloatType* ker_inv, int64_t ms,
 		FloatType *fk, int64_t nf1, typename fftw::ComplexType<FloatType>::Type* fw,
     ModeOrder mode_order);
 
 template<typename FloatType>
-void deconvolveshuffle2d(
-    SpreadDirection dir, FloatType prefac, FloatType *ker1, FloatType *ker2,
-    int64_t ms, int64_t mt, FloatType *fk, int64_t nf1, int64_t nf2,
+void deconvolveshuffle1d_modulated(
+    SpreadDirection dir, FloatType prefac, const FloatType* ker_inv, int64_t ms,
+    FloatType *fk, const FloatType *sens, int64_t nf1,
     typename fftw::ComplexType<FloatType>::Type* fw, ModeOrder mode_order);
 
-template<typename FloatType>
-void deconvolveshuffle3d(
-    SpreadDirection dir, FloatType prefac, FloatType *ker1, FloatType *ker2,
-    FloatType *ker3, int64_t ms, int64_t mt, int64_t mu,
-    FloatType *fk, int64_t nf1, int64_t nf2, int64_t nf3,
-    typename fftw::ComplexType<FloatType>::Type* fw, ModeOrder mode_order);
+static inline bool fine_to_mode_index(int64_t j, int64_t nf, int64_t m,
+                                      ModeOrder mode_order,
+                                      int64_t* k, int64_t* index);
 
 template<typename FloatType>
 static inline void set_kernel_args(FloatType *args, FloatType x, const SpreadParameters<FloatType>& opts);
@@ -141,14 +407,20 @@ template<typename FloatType>
 static inline void eval_kernel_vec_Horner(FloatType *ker, const FloatType z, const int w, const SpreadParameters<FloatType> &opts);
 
 template<typename FloatType>
-void interp_line(FloatType *out,FloatType *du, FloatType *ker,int64_t i1,int64_t N1,int ns);
+static inline void evaluate_kernel_deriv_vector(FloatType *dker, FloatType *args, const SpreadParameters<FloatType>& opts, const int N);
 
 template<typename FloatType>
-void interp_square(FloatType *out,FloatType *du, FloatType *ker1, FloatType *ker2, int64_t i1,int64_t i2,int64_t N1,int64_t N2,int ns);
+static inline void eval_kernel_deriv_vec_Horner(FloatType *dker, const FloatType z, const int w, const SpreadParameters<FloatType> &opts);
 
-template<typename FloatType>
+template<typename FloatType, typename IndexType>
+void interp_line(FloatType *out,FloatType *du, FloatType *ker,IndexType i1,IndexType N1,int ns);
+
+template<typename FloatType, typename IndexType>
+void interp_square(FloatType *out,FloatType *du, FloatType *ker1, FloatType *ker2, IndexType i1,IndexType i2,IndexType N1,IndexType N2,int ns);
+
+template<typename FloatType, typename IndexType>
 void interp_cube(FloatType *out,FloatType *du, FloatType *ker1, FloatType *ker2, FloatType *ker3,
-		 int64_t i1,int64_t i2,int64_t i3,int64_t N1,int64_t N2,int64_t N3,int ns);
+		 IndexType i1,IndexType i2,IndexType i3,IndexType N1,IndexType N2,IndexType N3,int ns);
 
 template<typename FloatType>
 void spread_subproblem_1d(int64_t off1, int64_t size1,FloatType *du0,int64_t M0,FloatType *kx0,
@@ -221,20 +493,11 @@ Status Plan<CPUDevice, FloatType>::initialize(
   }
 
   // Choose overall number of threads.
-  int num_threads = OMP_GET_MAX_THREADS();
+  int num_threads = this->device_.numThreads();
   if (this->options_.num_threads > 0)
     num_threads = this->options_.num_threads; // user override
   this->options_.num_threads = num_threads;   // update options_ with actual number
 
-  // Select batch size.
-  if (this->options_.max_batch_size == 0) {
-    this->num_batches_ = 1 + (num_transforms - 1) / num_threads;
-    this->batch_size_ = 1 + (num_transforms - 1) / this->num_batches_;
-  } else {
-    this->batch_size_ = std::min(this->options_.max_batch_size, num_transforms);
-    this->num_batches_ = 1 + (num_transforms - 1) / this->batch_size_;
-  }
-
   // Choose default spreader threading configuration.
   if (this->options_.spread_threading == SpreadThreading::AUTO)
     this->options_.spread_threading = SpreadThreading::PARALLEL_SINGLE_THREADED;
@@ -259,24 +522,9 @@ Status Plan<CPUDevice, FloatType>::initialize(
     this->points_[i] = nullptr;
     this->fseries_data_[i] = nullptr;
   }
-  this->sort_indices_ = nullptr;
-
-  // FFTW initialization must be done single-threaded.
-  #pragma omp critical
-  {
-    static bool is_fftw_initialized = false;
-
-    if (!is_fftw_initialized) {
-      // Set up global FFTW state. Should be done only once.
-      #ifdef _OPENMP
-      // Initialize FFTW threads.
-      fftw::init_threads<FloatType>();
-      // Let FFTW use all threads.
-      fftw::plan_with_nthreads<FloatType>(num_threads);
-      #endif
-      is_fftw_initialized = true;
-    }
-  }
+  this->points_stride_ = 1;
+  this->num_points_ = 0;
+  this->did_sort_ = false;
 
   if (type == TransformType::TYPE_1)
     this->spread_params_.spread_direction = SpreadDirection::SPREAD;
@@ -309,98 +557,234 @@ Status Plan<CPUDevice, FloatType>::initialize(
         &this->fseries_tensor_[i]));
     this->fseries_data_[i] = reinterpret_cast<FloatType*>(
         this->fseries_tensor_[i].flat<FloatType>().data());
-    kernel_fseries_1d(this->grid_dims_[i], this->spread_params_,
-                      this->fseries_data_[i]);
+    kernel_fseries_1d(this->device_, this->grid_dims_[i],
+                      this->spread_params_, this->fseries_data_[i]);
+    // Store the reciprocals, so that deconvolution is a multiplication.
+    for (int k = 0; k < num_coeffs; k++)
+      this->fseries_data_[i][k] = 1.0 / this->fseries_data_[i][k];
   }
 
-  // Total number of points in the fine grid.
-  this->grid_size_ = this->grid_dims_[0];
+  // Total number of points in the fine grid. The sizes are multiplied in
+  // 64 bits, as the products may overflow an int before they are checked.
+  int64_t grid_size = this->grid_dims_[0];
   if (rank > 1)
-    this->grid_size_ *= this->grid_dims_[1];
+    grid_size *= this->grid_dims_[1];
   if (rank > 2)
-    this->grid_size_ *= this->grid_dims_[2];
+    grid_size *= this->grid_dims_[2];
+  if (grid_size > kMaxArraySize) {
+    return errors::Internal(
+        "size of internal fine grid is larger than maximum allowed: ",
+        grid_size, " > ", kMaxArraySize);
+  }
+  this->grid_size_ = static_cast<int>(grid_size);
+
+  // Select batch size.
+  if (this->options_.max_batch_size == 0) {
+    this->batch_size_ = choose_batch_size(
+        num_transforms, this->grid_size_, this->grid_size_ * sizeof(DType),
+        num_threads);
+  } else {
+    this->batch_size_ = std::min(this->options_.max_batch_size, num_transforms);
+  }
+  this->num_batches_ = 1 + (num_transforms - 1) / this->batch_size_;
 
-  if (this->grid_size_ * this->batch_size_ > kMaxArraySize) {
+  const int64_t batch_grid_size = grid_size * this->batch_size_;
+  if (batch_grid_size > kMaxArraySize) {
     return errors::Internal(
         "size of internal fine grid is larger than maximum allowed: ",
-        this->grid_size_ * this->batch_size_, " > ",
-        kMaxArraySize);
+        batch_grid_size, " > ", kMaxArraySize);
   }
 
   // Allocate the working fine grid through the op kernel context. We allocate a
   // flat array, since we'll only use this tensor through a raw pointer anyway.
-  TensorShape fine_grid_shape({this->grid_size_ * this->batch_size_});
+  TensorShape fine_grid_shape({batch_grid_size});
   TF_RETURN_IF_ERROR(this->context_->allocate_temp(
       DataTypeToEnum<DType>::value, fine_grid_shape, &this->grid_tensor_));
   this->grid_data_ = reinterpret_cast<FftwType*>(
       this->grid_tensor_.flat<DType>().data());
 
-  int fft_dims[3] = {1, 1, 1};
-  switch (this->rank_) {
-    case 1:
-      fft_dims[0] = this->grid_dims_[0];
-      break;
-    case 2:
-      fft_dims[1] = this->grid_dims_[0];
-      fft_dims[0] = this->grid_dims_[1];
-      break;
-    case 3:
-      fft_dims[2] = this->grid_dims_[0];
-      fft_dims[1] = this->grid_dims_[1];
-      fft_dims[0] = this->grid_dims_[2];
-      break;
-  }
-
-  #pragma omp critical
-  {
-    this->fft_plan_ = fftw::plan_many_dft<FloatType>(
-        /* int rank */ rank, /* const int *n */ fft_dims,
-        /* int howmany */ this->batch_size_,
-        /* fftw_complex *in */ this->grid_data_,
-        /* const int *inembed */ nullptr,
-        /* int istride */ 1, /* int idist */ this->grid_size_,
-        /* fftw_complex *out */ this->grid_data_,
-        /* const int *onembed */ nullptr,
-        /* int ostride */ 1, /* int odist */ this->grid_size_,
-        /* int sign */ static_cast<int>(this->fft_direction_),
-        /* unsigned flags */ this->options_.fftw_flags);
+  // If the last batch is smaller, it gets its own FFT plans, so that it does
+  // not pay for the FFTs of the unused fine grids.
+  TF_RETURN_IF_ERROR(this->plan_fft(this->batch_size_, &this->fft_plans_));
+  int remainder_batch_size = num_transforms % this->batch_size_;
+  if (remainder_batch_size > 0) {
+    TF_RETURN_IF_ERROR(this->plan_fft(remainder_batch_size,
+                                      &this->remainder_fft_plans_));
   }
 
   return Status::OK();
 }
 
 template<typename FloatType>
-Plan<CPUDevice, FloatType>::~Plan() {
+Status Plan<CPUDevice, FloatType>::plan_fft(
+    int batch_size, std::vector<std::unique_ptr<FftPlan<FloatType>>>* plans) {
+  // The pruned FFT only pays off for more than one dimension.
+  if (this->options_.prune_fft && this->rank_ > 1) {
+    return this->plan_pruned_fft(batch_size, plans);
+  }
 
-  // Destroy the FFTW plan. This must be done single-threaded.
-  #pragma omp critical
-  {
-    fftw::destroy_plan<FloatType>(this->fft_plan_);
+  // A single plan for the full FFT of all the fine grids in a batch. The
+  // dimensions are given in row-major order.
+  std::vector<FftDim> dims;
+  int64_t stride = 1;
+  for (int d = 0; d < this->rank_; d++) {
+    dims.insert(dims.begin(), {this->grid_dims_[d], stride});
+    stride *= this->grid_dims_[d];
   }
+  std::vector<FftDim> loops = {{batch_size, this->grid_size_}};
+  plans->emplace_back();
+  TF_RETURN_IF_ERROR(make_fft_plan<FloatType>(
+      this->device_, dims, loops,
+      reinterpret_cast<DType*>(this->grid_data_),
+      static_cast<int>(this->fft_direction_), this->options_,
+      &plans->back()));
 
-  // Wait until all threads are done using FFTW, then clean up the FFTW state,
-  // which only needs to be done once.
-  #ifdef _OPENMP
-  #pragma omp barrier
-  #pragma omp critical
-  {
-    static bool is_fftw_finalized = false;
-    if (!is_fftw_finalized) {
-      fftw::cleanup_threads<FloatType>();
-      is_fftw_finalized = true;
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::plan_pruned_fft(
+    int batch_size, std::vector<std::unique_ptr<FftPlan<FloatType>>>* plans) {
+  // Distance between consecutive elements along each dimension.
+  int64_t strides[3] = {1, this->grid_dims_[0],
+                        this->grid_dims_[0] * this->grid_dims_[1]};
+
+  // Along each dimension, the modes occupy two blocks of the fine grid: the
+  // non-negative frequencies at the start and the negative frequencies at the
+  // end (see deconvolveshuffle1d).
+  int64_t block_start[3][2], block_size[3][2];
+  for (int d = 0; d < this->rank_; d++) {
+    block_start[d][0] = 0;
+    block_size[d][0] = (this->num_modes_[d] + 1) / 2;
+    block_start[d][1] = this->grid_dims_[d] - this->num_modes_[d] / 2;
+    block_size[d][1] = this->num_modes_[d] / 2;
+  }
+
+  // For type 2, the grid is zero outside the mode blocks, so we transform the
+  // first dimension first, and only the rows within the mode blocks of the
+  // remaining dimensions. For type 1, only the mode blocks are kept, so we
+  // transform the last dimension first. In both cases, the rows of the
+  // dimension `axis` need only be transformed within the mode blocks of the
+  // dimensions after it.
+  for (int stage = 0; stage < this->rank_; stage++) {
+    int axis = (this->type_ == TransformType::TYPE_2) ?
+        stage : this->rank_ - 1 - stage;
+    int num_pruned_dims = this->rank_ - 1 - axis;
+
+    for (int blocks = 0; blocks < (1 << num_pruned_dims); blocks++) {
+      int64_t offset = 0;
+      bool is_empty = false;
+      std::vector<FftDim> loops;
+      loops.push_back({batch_size, this->grid_size_});
+      for (int d = this->rank_ - 1; d >= 0; d--) {
+        if (d == axis) continue;
+        int64_t size = this->grid_dims_[d];
+        if (d > axis) {
+          int block = (blocks >> (d - axis - 1)) & 1;
+          size = block_size[d][block];
+          offset += block_start[d][block] * strides[d];
+        }
+        if (size == 0) is_empty = true;
+        loops.push_back({size, strides[d]});
+      }
+      if (is_empty) continue;
+
+      std::vector<FftDim> dims = {{this->grid_dims_[axis], strides[axis]}};
+      plans->emplace_back();
+      TF_RETURN_IF_ERROR(make_fft_plan<FloatType>(
+          this->device_, dims, loops,
+          reinterpret_cast<DType*>(this->grid_data_) + offset,
+          static_cast<int>(this->fft_direction_), this->options_,
+          &plans->back()));
     }
   }
-  #endif
 
-  free(this->sort_indices_);
+  return Status::OK();
 }
 
 template<typename FloatType>
 Status Plan<CPUDevice, FloatType>::set_points(
     int num_points, FloatType* points_x,
     FloatType* points_y, FloatType* points_z) {
-  // The user only now chooses how many NU (x,y,z) points.
+  return this->set_points(num_points, points_x, points_y, points_z, 1);
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::set_points(
+    int num_points, FloatType* points_x,
+    FloatType* points_y, FloatType* points_z, int64_t points_stride) {
+  return this->set_or_update_points(num_points, points_x, points_y, points_z,
+                                    points_stride, false, 0, 0);
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::update_points(
+    int num_points, FloatType* points_x,
+    FloatType* points_y, FloatType* points_z,
+    int remove_begin, int remove_end) {
+  if (remove_begin < 0 || remove_end < remove_begin ||
+      remove_end > this->num_points_) {
+    return errors::InvalidArgument(
+        "invalid range of removed points: [", remove_begin, ", ", remove_end,
+        ") is not a subrange of [0, ", this->num_points_, ")");
+  }
+  if (num_points < this->num_points_ - (remove_end - remove_begin)) {
+    return errors::InvalidArgument(
+        "number of points (", num_points, ") is less than the number of ",
+        "points kept from the previous call (",
+        this->num_points_ - (remove_end - remove_begin), ")");
+  }
+  return this->set_or_update_points(num_points, points_x, points_y, points_z,
+                                    1, true, remove_begin, remove_end);
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::set_points_from(const Plan& other) {
+  // The sort order is a valid permutation for either spreading direction, so
+  // the direction need not match.
+  bool compatible = this->rank_ == other.rank_ &&
+      std::equal(this->grid_dims_, this->grid_dims_ + 3, other.grid_dims_) &&
+      this->spread_params_.kernel_width == other.spread_params_.kernel_width &&
+      this->spread_params_.pirange == other.spread_params_.pirange &&
+      this->spread_params_.check_bounds == other.spread_params_.check_bounds &&
+      this->spread_params_.sort_points == other.spread_params_.sort_points;
+  if (!compatible || this->type_ == TransformType::TYPE_3) {
+    return this->set_points(other.num_points_, other.points_[0],
+                            other.points_[1], other.points_[2],
+                            other.points_stride_);
+  }
+
+  // The tensors are shared, as they are never modified in place.
+  this->num_points_ = other.num_points_;
+  std::copy_n(other.points_, 3, this->points_);
+  this->points_stride_ = other.points_stride_;
+  this->index_width_ = other.index_width_;
+  this->sort_indices_tensor_ = other.sort_indices_tensor_;
+  this->bin_keys_tensor_ = other.bin_keys_tensor_;
+  this->did_sort_ = other.did_sort_;
+  this->points_stats_ = other.points_stats_;
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::set_or_update_points(
+    int num_points, FloatType* points_x,
+    FloatType* points_y, FloatType* points_z, int64_t points_stride,
+    bool update, int remove_begin, int remove_end) {
+  if (this->type_ == TransformType::TYPE_3) {
+    return errors::Unimplemented("Type-3 transforms not implemented yet.");
+  }
+
+  // Type 1/2 transform.
+  // All we can do is check, maybe bin-sort and gather statistics of the
+  // non-uniform points, which is done in a single pass.
+  // Plan must keep pointers to user's fixed points.
+  int previous_num_points = this->num_points_;
   this->num_points_ = num_points;
+  this->points_[0] = points_x;
+  this->points_[1] = points_y;
+  this->points_[2] = points_z;
+  this->points_stride_ = points_stride;
 
   int64_t grid_size_0 = this->grid_dims_[0];
   int64_t grid_size_1 = 1;
@@ -408,32 +792,132 @@ Status Plan<CPUDevice, FloatType>::set_points(
   int64_t grid_size_2 = 1;
   if (this->rank_ > 2) grid_size_2 = this->grid_dims_[2];
 
-  if (this->type_ != TransformType::TYPE_3) {
-    // Type 1/2 transform.
-    // All we can do is check and maybe bin-sort the non-uniform points.
-    // Plan must keep pointers to user's fixed points.
-    this->points_[0] = points_x;
-    this->points_[1] = points_y;
-    this->points_[2] = points_z;
-    TF_RETURN_IF_ERROR(check_spread_inputs(
-        grid_size_0, grid_size_1, grid_size_2,
-        this->num_points_, points_x, points_y, points_z,
-        this->spread_params_));
-
-    this->sort_indices_ = (int64_t*) malloc(sizeof(int64_t) * this->num_points_);
-    if (!this->sort_indices_) {
-      fprintf(stderr,"[%s] failed to allocate sort_indices_!\n",__func__);
-      // return ERR_SPREAD_ALLOC;
-    }
-    this->did_sort_ = bin_sort_points(
-        this->sort_indices_, grid_size_0, grid_size_1, grid_size_2,
-        this->num_points_, points_x, points_y, points_z, this->spread_params_);
+  TF_RETURN_IF_ERROR(check_spread_inputs(
+      grid_size_0, grid_size_1, grid_size_2, this->spread_params_));
+
+  // Use 32-bit indices whenever the largest index used by the spreader fits.
+  // The spreader indexes interleaved complex data, hence the factor of 2.
+  int64_t max_index = 2 * std::max(static_cast<int64_t>(this->num_points_),
+                                   static_cast<int64_t>(this->grid_size_));
+  IndexWidth index_width =
+      max_index <= std::numeric_limits<int32_t>::max() ?
+          IndexWidth::INT32 : IndexWidth::INT64;
+
+  // The previous sort order can only be reused if the points were sorted and
+  // the index type did not change.
+  update = update && this->did_sort_ && index_width == this->index_width_;
+  this->index_width_ = index_width;
+
+  if (this->index_width_ == IndexWidth::INT32) {
+    return this->preprocess_points_typed<int32_t>(
+        update, previous_num_points, remove_begin, remove_end);
+  }
+  return this->preprocess_points_typed<int64_t>(
+      update, previous_num_points, remove_begin, remove_end);
+}
 
-  } else {
-    // Type 3 transform.
-    return errors::Unimplemented("Type-3 transforms not implemented yet.");
+template<typename FloatType>
+template<typename IndexType>
+Status Plan<CPUDevice, FloatType>::preprocess_points_typed(
+    bool update, int previous_num_points, int remove_begin, int remove_end) {
+  int64_t grid_size_0 = this->grid_dims_[0];
+  int64_t grid_size_1 = 1;
+  if (this->rank_ > 1) grid_size_1 = this->grid_dims_[1];
+  int64_t grid_size_2 = 1;
+  if (this->rank_ > 2) grid_size_2 = this->grid_dims_[2];
+
+  // Reuse the preprocessing of the same points by another plan, if cached.
+  // The cached tensors are shared, as they are never modified in place.
+  // Otherwise, update the sort order of the most recently sorted points, if
+  // any. Any points can be described as an update of any previous points: the
+  // trailing previous points are removed if there are fewer new points, or
+  // new points are appended if there are more. This is cheap when the points
+  // move only slightly between calls, e.g. in trajectory optimization.
+  PointsCacheKey cache_key;
+  std::shared_ptr<const CachedPoints<FloatType>> previous;
+  FloatType* const points[3] = {this->points_[0], this->points_[1],
+                                this->points_[2]};
+  if (this->options_.cache_points) {
+    cache_key.rank = this->rank_;
+    cache_key.grid_dims[0] = grid_size_0;
+    cache_key.grid_dims[1] = grid_size_1;
+    cache_key.grid_dims[2] = grid_size_2;
+    cache_key.num_points = this->num_points_;
+    cache_key.kernel_width = this->spread_params_.kernel_width;
+    cache_key.pirange = this->spread_params_.pirange;
+    cache_key.check_bounds = this->spread_params_.check_bounds;
+    cache_key.sort_points = this->spread_params_.sort_points;
+    cache_key.spread_direction = this->rank_ == 1 ?
+        this->spread_params_.spread_direction : SpreadDirection::SPREAD;
+    cache_key.index_dtype = DataTypeToEnum<IndexType>::value;
+    if (!update) {
+      auto cached = PointsCache<FloatType>::get().lookup(
+          this->device_, cache_key, points, this->points_stride_);
+      if (cached != nullptr) {
+        this->sort_indices_tensor_ = cached->sort_indices;
+        this->bin_keys_tensor_ = cached->bin_keys;
+        this->did_sort_ = cached->did_sort;
+        this->points_stats_ = cached->stats;
+        return Status::OK();
+      }
+      previous = PointsCache<FloatType>::get().latest_sorted(cache_key);
+    }
+  }
+
+  // Allocate the sort indices and the bin keys. These tensors are reallocated
+  // on each call, since the number of points may differ. For an update, the
+  // previous tensors are kept alive until the new ones are computed.
+  Tensor previous_sort_indices = this->sort_indices_tensor_;
+  Tensor previous_bin_keys = this->bin_keys_tensor_;
+  TF_RETURN_IF_ERROR(this->context_->allocate_temp(
+      DataTypeToEnum<IndexType>::value, TensorShape({this->num_points_}),
+      &this->sort_indices_tensor_));
+  TF_RETURN_IF_ERROR(this->context_->allocate_temp(
+      DataTypeToEnum<IndexType>::value, TensorShape({this->num_points_}),
+      &this->bin_keys_tensor_));
+
+  PointsUpdate<IndexType> points_update;
+  if (update) {
+    points_update.sort_indices =
+        previous_sort_indices.template flat<IndexType>().data();
+    points_update.keys = previous_bin_keys.template flat<IndexType>().data();
+    points_update.num_points = previous_num_points;
+    points_update.remove_begin = remove_begin;
+    points_update.remove_end = remove_end;
+  } else if (previous != nullptr) {
+    update = true;
+    points_update.sort_indices =
+        previous->sort_indices.template flat<IndexType>().data();
+    points_update.keys = previous->bin_keys.template flat<IndexType>().data();
+    points_update.num_points = previous->key.num_points;
+    points_update.remove_begin = std::min<int64_t>(this->num_points_,
+                                                   previous->key.num_points);
+    points_update.remove_end = previous->key.num_points;
   }
 
+  TF_RETURN_IF_ERROR(preprocess_points(
+      this->device_,
+      this->sort_indices_tensor_.template flat<IndexType>().data(),
+      this->bin_keys_tensor_.template flat<IndexType>().data(),
+      grid_size_0, grid_size_1, grid_size_2,
+      static_cast<IndexType>(this->num_points_),
+      this->points_[0], this->points_[1], this->points_[2],
+      this->points_stride_,
+      this->spread_params_, update ? &points_update : nullptr,
+      &this->did_sort_, &this->points_stats_));
+
+  if (this->options_.cache_points) {
+    auto entry = std::make_shared<CachedPoints<FloatType>>();
+    entry->key = cache_key;
+    entry->coords.resize(this->num_points_ * this->rank_);
+    gather_coordinates(this->device_, this->rank_, this->num_points_, points,
+                       this->points_stride_, entry->coords.data());
+    entry->sort_indices = this->sort_indices_tensor_;
+    entry->bin_keys = this->bin_keys_tensor_;
+    entry->did_sort = this->did_sort_;
+    entry->stats = this->points_stats_;
+    PointsCache<FloatType>::get().insert(std::move(entry));
+  }
   return Status::OK();
 }
 
@@ -450,7 +934,13 @@ Status Plan<CPUDevice, FloatType>::set_points(
    Barnett 5/20/20, based on Malleo 2019.
 */
 template<typename FloatType>
-Status Plan<CPUDevice, FloatType>::execute(DType* cj, DType* fk){
+Status Plan<CPUDevice, FloatType>::execute(DType* cj, DType* fk) {
+  return this->execute(cj, fk, BatchLayout());
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::execute(DType* cj, DType* fk,
+                                           const BatchLayout& layout) {
 
   if (this->type_ != TransformType::TYPE_3) {
 
@@ -461,25 +951,50 @@ Status Plan<CPUDevice, FloatType>::execute(DType* cj, DType* fk){
       // current batch is either batch_size, or possibly truncated if last one
       int thisBatchSize = std::min(this->num_transforms_ - b*this->batch_size_, this->batch_size_);
       int bB = b*this->batch_size_;         // index of vector, since batchsizes same
-      DType* cjb = cj + bB*this->num_points_;        // point to batch of weights
-      DType* fkb = fk + bB*this->mode_count_;         // point to batch of mode coeffs
+      DType* cjb = cj;                               // point to batch of weights
+      DType* fkb = fk;                               // point to batch of mode coeffs
+      const int64_t* cj_offsets = nullptr;
+      const int64_t* fk_offsets = nullptr;
+      if (layout.c_offsets != nullptr)
+        cj_offsets = layout.c_offsets + bB;
+      else
+        cjb += bB*this->num_points_;
+      if (layout.f_offsets != nullptr)
+        fk_offsets = layout.f_offsets + bB;
+      else
+        fkb += bB*this->mode_count_;
+      const DType* sensb = this->sensitivities_;  // batch of sensitivities
+      const int64_t* sens_offsets = nullptr;
+      if (sensb != nullptr) {
+        if (this->sensitivity_offsets_ != nullptr)
+          sens_offsets = this->sensitivity_offsets_ + bB;
+        else
+          sensb += bB*this->mode_count_;
+      }
 
       // STEP 1: (varies by type)
       if (this->type_ == TransformType::TYPE_1) {  // type 1: spread NU pts this->points_[0], weights cj, to fw grid
-        TF_RETURN_IF_ERROR(this->spread_or_interp_sorted_batch(thisBatchSize, cjb));
+        TF_RETURN_IF_ERROR(this->spread_or_interp_sorted_batch(
+            thisBatchSize, cjb, nullptr, cj_offsets));
       } else {          //  type 2: amplify Fourier coeffs fk into 0-padded fw
-        TF_RETURN_IF_ERROR(this->deconvolve_batch(thisBatchSize, fkb));
+        TF_RETURN_IF_ERROR(this->deconvolve_batch(
+            thisBatchSize, fkb, fk_offsets, sensb, sens_offsets));
       }
 
-      // STEP 2: call the pre-planned FFT on this batch
-      // This wastes some flops if thisBatchSize < batch_size.
-      fftw::execute<FloatType>(this->fft_plan_);
+      // STEP 2: call the pre-planned FFT on this batch. A truncated last
+      // batch has its own plans.
+      auto& fft_plans = thisBatchSize < this->batch_size_ ?
+          this->remainder_fft_plans_ : this->fft_plans_;
+      for (auto& plan : fft_plans)
+        plan->execute();
 
       // STEP 3: (varies by type)
       if (this->type_ == TransformType::TYPE_1) {   // type 1: deconvolve (amplify) fw and shuffle to fk
-        TF_RETURN_IF_ERROR(this->deconvolve_batch(thisBatchSize, fkb));
+        TF_RETURN_IF_ERROR(this->deconvolve_batch(
+            thisBatchSize, fkb, fk_offsets, sensb, sens_offsets));
       } else {          // type 2: interpolate unif fw grid to NU target pts
-        TF_RETURN_IF_ERROR(this->spread_or_interp_sorted_batch(thisBatchSize, cjb));
+        TF_RETURN_IF_ERROR(this->spread_or_interp_sorted_batch(
+            thisBatchSize, cjb, nullptr, cj_offsets));
       }
     }                                                   // ........end b loop
   } else {
@@ -492,16 +1007,29 @@ Status Plan<CPUDevice, FloatType>::execute(DType* cj, DType* fk){
 
 template<typename FloatType>
 Status Plan<CPUDevice, FloatType>::interp(DType* c, DType* f) {
-  return this->spread_or_interp(c, f);
+  return this->spread_or_interp(c, f, BatchLayout());
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::interp(DType* c, DType* f,
+                                          const BatchLayout& layout) {
+  return this->spread_or_interp(c, f, layout);
 }
 
 template<typename FloatType>
 Status Plan<CPUDevice, FloatType>::spread(DType* c, DType* f) {
-  return this->spread_or_interp(c, f);
+  return this->spread_or_interp(c, f, BatchLayout());
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::spread(DType* c, DType* f,
+                                          const BatchLayout& layout) {
+  return this->spread_or_interp(c, f, layout);
 }
 
 template<typename FloatType>
-Status Plan<CPUDevice, FloatType>::spread_or_interp(DType* cj, DType* fk) {
+Status Plan<CPUDevice, FloatType>::spread_or_interp(DType* cj, DType* fk,
+                                                    const BatchLayout& layout) {
 
   double t_sprint = 0.0, t_fft = 0.0, t_deconv = 0.0;  // accumulated timing
 
@@ -510,10 +1038,407 @@ Status Plan<CPUDevice, FloatType>::spread_or_interp(DType* cj, DType* fk) {
     // current batch is either batch_size, or possibly truncated if last one
     int thisBatchSize = std::min(this->num_transforms_ - b*this->batch_size_, this->batch_size_);
     int bB = b*this->batch_size_;         // index of vector, since batchsizes same
-    DType* cjb = cj + bB*this->num_points_;        // point to batch of weights
-    DType* fkb = fk + bB*this->mode_count_;         // point to batch of mode coeffs
+    DType* cjb = cj;                               // point to batch of weights
+    DType* fkb = fk;                               // point to batch of mode coeffs
+    const int64_t* cj_offsets = nullptr;
+    const int64_t* fk_offsets = nullptr;
+    if (layout.c_offsets != nullptr)
+      cj_offsets = layout.c_offsets + bB;
+    else
+      cjb += bB*this->num_points_;
+    if (layout.f_offsets != nullptr)
+      fk_offsets = layout.f_offsets + bB;
+    else
+      fkb += bB*this->mode_count_;
+
+    TF_RETURN_IF_ERROR(this->spread_or_interp_sorted_batch(
+        thisBatchSize, cjb, fkb, cj_offsets, fk_offsets));
+  }
+
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::set_weights(const FloatType* weights) {
+  this->spread_params_.point_weights = weights;
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::set_sensitivities(
+    const DType* sensitivities, const int64_t* offsets) {
+  if (sensitivities != nullptr && this->options_.spread_only) {
+    return errors::InvalidArgument(
+        "Sensitivities are not supported in spread/interp only mode.");
+  }
+  this->sensitivities_ = sensitivities;
+  this->sensitivity_offsets_ = sensitivities ? offsets : nullptr;
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::spread_sum(DType* c, int count,
+                                              const int64_t* c_offsets,
+                                              bool accumulate) {
+  if (this->type_ != TransformType::TYPE_1 || this->options_.spread_only) {
+    return errors::InvalidArgument(
+        "Summed spreading requires a type-1 NUFFT plan.");
+  }
+
+  DType* grid = reinterpret_cast<DType*>(this->grid_data_);
+  if (!accumulate) {
+    parallel_for(&this->device_, this->grid_size_,
+                 Eigen::TensorOpCost(0, sizeof(DType), 1),
+                 [grid](int64_t first, int64_t last) {
+      std::fill(grid + first, grid + last, DType(0));
+    });
+  }
+
+  int64_t grid_size_0 = this->grid_dims_[0];
+  int64_t grid_size_1 = this->rank_ > 1 ? this->grid_dims_[1] : 1;
+  int64_t grid_size_2 = this->rank_ > 2 ? this->grid_dims_[2] : 1;
+  SpreadParameters<FloatType> spread_params = this->spread_params_;
+  spread_params.accumulate = true;
+
+  for (int i = 0; i < count; i++) {
+    FloatType* ci = reinterpret_cast<FloatType*>(c + c_offsets[i]);
+    if (this->index_width_ == IndexWidth::INT32) {
+      spreadinterpSorted<FloatType, int32_t>(
+          &this->device_,
+          this->sort_indices_tensor_.template flat<int32_t>().data(),
+          grid_size_0, grid_size_1, grid_size_2,
+          reinterpret_cast<FloatType*>(grid), this->num_points_,
+          this->points_[0], this->points_[1], this->points_[2],
+          this->points_stride_, ci, spread_params, this->did_sort_);
+    } else {
+      spreadinterpSorted<FloatType, int64_t>(
+          &this->device_,
+          this->sort_indices_tensor_.template flat<int64_t>().data(),
+          grid_size_0, grid_size_1, grid_size_2,
+          reinterpret_cast<FloatType*>(grid), this->num_points_,
+          this->points_[0], this->points_[1], this->points_[2],
+          this->points_stride_, ci, spread_params, this->did_sort_);
+    }
+  }
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::transform_sum(DType* f) {
+  if (this->type_ != TransformType::TYPE_1 || this->options_.spread_only) {
+    return errors::InvalidArgument(
+        "Summed spreading requires a type-1 NUFFT plan.");
+  }
+  if (this->batch_size_ != 1) {
+    return errors::InvalidArgument(
+        "Summed spreading requires a plan with a batch size of 1, but got: ",
+        this->batch_size_);
+  }
+  for (auto& plan : this->fft_plans_)
+    plan->execute();
+  return this->deconvolve_batch(1, f);
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::points_grad(DType* c, DType* f,
+                                               FloatType* grad_x,
+                                               FloatType* grad_y,
+                                               FloatType* grad_z,
+                                               const BatchLayout& layout) {
+  if (this->type_ != TransformType::TYPE_2) {
+    return errors::Internal(
+        "The points gradient requires a type-2 plan.");
+  }
+
+  int64_t grid_size_0 = this->grid_dims_[0];
+  int64_t grid_size_1 = this->rank_ > 1 ? this->grid_dims_[1] : 1;
+  int64_t grid_size_2 = this->rank_ > 2 ? this->grid_dims_[2] : 1;
+
+  for (int b = 0; b * this->batch_size_ < this->num_transforms_; b++) {
+    int this_batch_size = std::min(
+        this->num_transforms_ - b * this->batch_size_, this->batch_size_);
+    int batch_start = b * this->batch_size_;
+    DType* c_batch = c;
+    DType* f_batch = f;
+    const int64_t* c_offsets = nullptr;
+    const int64_t* f_offsets = nullptr;
+    if (layout.c_offsets != nullptr)
+      c_offsets = layout.c_offsets + batch_start;
+    else
+      c_batch += batch_start * this->num_points_;
+    if (layout.f_offsets != nullptr)
+      f_offsets = layout.f_offsets + batch_start;
+    else
+      f_batch += batch_start * this->mode_count_;
+
+    // Same as a type-2 transform, up to the interpolation. In spread/interp
+    // only mode, the derivatives are interpolated from `f` itself.
+    FloatType* grid_batch = reinterpret_cast<FloatType*>(f_batch);
+    const int64_t* grid_offsets = f_offsets;
+    if (!this->options_.spread_only) {
+      TF_RETURN_IF_ERROR(this->deconvolve_batch(this_batch_size, f_batch,
+                                                f_offsets));
+      auto& fft_plans = this_batch_size < this->batch_size_ ?
+          this->remainder_fft_plans_ : this->fft_plans_;
+      for (auto& plan : fft_plans)
+        plan->execute();
+      grid_batch = reinterpret_cast<FloatType*>(this->grid_data_);
+      grid_offsets = nullptr;
+    }
+
+    // Interpolate the derivatives for all the transforms in the batch at
+    // once, accumulating over the batches.
+    if (this->index_width_ == IndexWidth::INT32) {
+      interpGradSorted<FloatType, int32_t>(
+          &this->device_,
+          this->sort_indices_tensor_.template flat<int32_t>().data(),
+          grid_size_0, grid_size_1, grid_size_2, this_batch_size,
+          grid_batch, grid_offsets,
+          reinterpret_cast<FloatType*>(c_batch), c_offsets, this->num_points_,
+          this->points_[0], this->points_[1], this->points_[2],
+          this->points_stride_, grad_x, grad_y, grad_z, b > 0,
+          this->spread_params_);
+    } else {
+      interpGradSorted<FloatType, int64_t>(
+          &this->device_,
+          this->sort_indices_tensor_.template flat<int64_t>().data(),
+          grid_size_0, grid_size_1, grid_size_2, this_batch_size,
+          grid_batch, grid_offsets,
+          reinterpret_cast<FloatType*>(c_batch), c_offsets, this->num_points_,
+          this->points_[0], this->points_[1], this->points_[2],
+          this->points_stride_, grad_x, grad_y, grad_z, b > 0,
+          this->spread_params_);
+    }
+  }
+
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::tangent(DType* c, DType* f,
+                                           DType* c_tangent, DType* f_tangent,
+                                           FloatType* tangent_x,
+                                           FloatType* tangent_y,
+                                           FloatType* tangent_z,
+                                           const BatchLayout& layout) {
+  if (this->options_.spread_only) {
+    return errors::Internal("The tangent requires a NUFFT plan.");
+  }
+  if (this->type_ == TransformType::TYPE_3) {
+    return errors::Unimplemented("Type-3 transforms not implemented yet.");
+  }
+
+  int64_t grid_size_0 = this->grid_dims_[0];
+  int64_t grid_size_1 = this->rank_ > 1 ? this->grid_dims_[1] : 1;
+  int64_t grid_size_2 = this->rank_ > 2 ? this->grid_dims_[2] : 1;
+
+  // For type 2, the fine grids of the input are kept here while those of its
+  // tangent are computed in the working grids.
+  Tensor primal_grid_tensor;
+  DType* primal_grid = nullptr;
+  if (this->type_ == TransformType::TYPE_2) {
+    TF_RETURN_IF_ERROR(this->context_->allocate_temp(
+        DataTypeToEnum<DType>::value,
+        TensorShape({int64_t{this->grid_size_} * this->batch_size_}),
+        &primal_grid_tensor));
+    primal_grid = primal_grid_tensor.flat<DType>().data();
+  }
+
+  for (int b = 0; b * this->batch_size_ < this->num_transforms_; b++) {
+    int this_batch_size = std::min(
+        this->num_transforms_ - b * this->batch_size_, this->batch_size_);
+    int batch_start = b * this->batch_size_;
+    DType* c_batch = c;
+    DType* c_tangent_batch = c_tangent;
+    DType* f_batch = f;
+    DType* f_tangent_batch = f_tangent;
+    const int64_t* c_offsets = nullptr;
+    const int64_t* f_offsets = nullptr;
+    if (layout.c_offsets != nullptr) {
+      c_offsets = layout.c_offsets + batch_start;
+    } else {
+      c_batch += batch_start * this->num_points_;
+      c_tangent_batch += batch_start * this->num_points_;
+    }
+    if (layout.f_offsets != nullptr) {
+      f_offsets = layout.f_offsets + batch_start;
+    } else {
+      f_batch += batch_start * this->mode_count_;
+      f_tangent_batch += batch_start * this->mode_count_;
+    }
+    auto& fft_plans = this_batch_size < this->batch_size_ ?
+        this->remainder_fft_plans_ : this->fft_plans_;
+
+    if (this->type_ == TransformType::TYPE_1) {
+      // Spread the tangent of the strengths and the derivatives of the
+      // kernel to the same fine grid, then transform it as usual.
+      for (int i = 0; i < this_batch_size; i++) {
+        FloatType* grid = reinterpret_cast<FloatType*>(
+            this->grid_data_ + i * this->grid_size_);
+        int64_t c_offset = c_offsets ? c_offsets[i] :
+                                       int64_t{i} * this->num_points_;
+        FloatType* ci = reinterpret_cast<FloatType*>(c_batch + c_offset);
+        FloatType* ci_tangent = reinterpret_cast<FloatType*>(
+            c_tangent_batch + c_offset);
+        if (this->index_width_ == IndexWidth::INT32) {
+          spreadTangentSorted<FloatType, int32_t>(
+              &this->device_,
+              this->sort_indices_tensor_.template flat<int32_t>().data(),
+              grid_size_0, grid_size_1, grid_size_2, grid, this->num_points_,
+              this->points_[0], this->points_[1], this->points_[2],
+              this->points_stride_, ci, ci_tangent,
+              tangent_x, tangent_y, tangent_z, this->spread_params_);
+        } else {
+          spreadTangentSorted<FloatType, int64_t>(
+              &this->device_,
+              this->sort_indices_tensor_.template flat<int64_t>().data(),
+              grid_size_0, grid_size_1, grid_size_2, grid, this->num_points_,
+              this->points_[0], this->points_[1], this->points_[2],
+              this->points_stride_, ci, ci_tangent,
+              tangent_x, tangent_y, tangent_z, this->spread_params_);
+        }
+      }
+      for (auto& plan : fft_plans)
+        plan->execute();
+      TF_RETURN_IF_ERROR(this->deconvolve_batch(this_batch_size,
+                                                f_tangent_batch, f_offsets));
+    } else {
+      // Transform the input and its tangent to the fine grid, then
+      // interpolate the value of one and the derivatives of the other
+      // together.
+      TF_RETURN_IF_ERROR(this->deconvolve_batch(this_batch_size, f_batch,
+                                                f_offsets));
+      for (auto& plan : fft_plans)
+        plan->execute();
+      this->device_.memcpy(primal_grid, this->grid_data_,
+                           sizeof(DType) * this_batch_size * this->grid_size_);
+      TF_RETURN_IF_ERROR(this->deconvolve_batch(this_batch_size,
+                                                f_tangent_batch, f_offsets));
+      for (auto& plan : fft_plans)
+        plan->execute();
+
+      if (this->index_width_ == IndexWidth::INT32) {
+        interpTangentSorted<FloatType, int32_t>(
+            &this->device_,
+            this->sort_indices_tensor_.template flat<int32_t>().data(),
+            grid_size_0, grid_size_1, grid_size_2, this_batch_size,
+            reinterpret_cast<FloatType*>(primal_grid),
+            reinterpret_cast<FloatType*>(this->grid_data_),
+            reinterpret_cast<FloatType*>(c_tangent_batch), c_offsets,
+            this->num_points_,
+            this->points_[0], this->points_[1], this->points_[2],
+            this->points_stride_, tangent_x, tangent_y, tangent_z,
+            this->spread_params_);
+      } else {
+        interpTangentSorted<FloatType, int64_t>(
+            &this->device_,
+            this->sort_indices_tensor_.template flat<int64_t>().data(),
+            grid_size_0, grid_size_1, grid_size_2, this_batch_size,
+            reinterpret_cast<FloatType*>(primal_grid),
+            reinterpret_cast<FloatType*>(this->grid_data_),
+            reinterpret_cast<FloatType*>(c_tangent_batch), c_offsets,
+            this->num_points_,
+            this->points_[0], this->points_[1], this->points_[2],
+            this->points_stride_, tangent_x, tangent_y, tangent_z,
+            this->spread_params_);
+      }
+    }
+  }
+
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<CPUDevice, FloatType>::density_compensation(FloatType* weights,
+                                                        int max_iterations,
+                                                        FloatType rtol) {
+  if (!this->options_.spread_only ||
+      this->type_ != TransformType::TYPE_1 || this->num_transforms_ != 1) {
+    return errors::Internal(
+        "Density compensation requires a spread/interp only type-1 plan with "
+        "a single transform.");
+  }
+
+  // Complex values at the points: the weights on the way in, and their
+  // spread and interpolated values on the way out.
+  Tensor values_tensor;
+  TF_RETURN_IF_ERROR(this->context_->allocate_temp(
+      DataTypeToEnum<DType>::value, TensorShape({this->num_points_}),
+      &values_tensor));
+  DType* values = values_tensor.flat<DType>().data();
+
+  int64_t grid_size_0 = this->grid_dims_[0];
+  int64_t grid_size_1 = this->rank_ > 1 ? this->grid_dims_[1] : 1;
+  int64_t grid_size_2 = this->rank_ > 2 ? this->grid_dims_[2] : 1;
+  SpreadParameters<FloatType> spread_params = this->spread_params_;
+  spread_params.point_weights = nullptr;
+  SpreadParameters<FloatType> interp_params = spread_params;
+  interp_params.spread_direction = SpreadDirection::INTERP;
+  FloatType* grid = reinterpret_cast<FloatType*>(this->grid_data_);
+
+  auto spread_interp = [&](auto* sort_indices) {
+    using IndexType = std::remove_pointer_t<decltype(sort_indices)>;
+    spreadinterpSorted<FloatType, IndexType>(
+        &this->device_, sort_indices, grid_size_0, grid_size_1, grid_size_2,
+        grid, this->num_points_, this->points_[0], this->points_[1],
+        this->points_[2], this->points_stride_,
+        reinterpret_cast<FloatType*>(values), spread_params, this->did_sort_);
+    spreadinterpSorted<FloatType, IndexType>(
+        &this->device_, sort_indices, grid_size_0, grid_size_1, grid_size_2,
+        grid, this->num_points_, this->points_[0], this->points_[1],
+        this->points_[2], this->points_stride_,
+        reinterpret_cast<FloatType*>(values), interp_params, this->did_sort_);
+  };
+
+  const int64_t num_points = this->num_points_;
+  parallel_for(&this->device_, num_points,
+               Eigen::TensorOpCost(0, sizeof(FloatType), 1),
+               [&](int64_t first, int64_t last) {
+    std::fill(weights + first, weights + last, FloatType(1));
+  });
+
+  // The norms are reduced over a fixed partition of the points, so that the
+  // result does not depend on the scheduling of the threads.
+  const int num_threads = get_num_threads(&this->device_);
+  std::vector<double> change_norms(num_threads), weights_norms(num_threads);
+
+  for (int iteration = 0; iteration < max_iterations; iteration++) {
+    parallel_for(&this->device_, num_points,
+                 Eigen::TensorOpCost(sizeof(FloatType), sizeof(DType), 1),
+                 [&](int64_t first, int64_t last) {
+      for (int64_t j = first; j < last; j++)
+        values[j] = DType(weights[j], 0);
+    });
+    if (this->index_width_ == IndexWidth::INT32) {
+      spread_interp(this->sort_indices_tensor_.template flat<int32_t>().data());
+    } else {
+      spread_interp(this->sort_indices_tensor_.template flat<int64_t>().data());
+    }
 
-    this->spread_or_interp_sorted_batch(thisBatchSize, cjb, fkb);
+    // Update the weights and measure their relative change. The maximum
+    // pointwise error of the fixed point does not generally go to zero, but
+    // the weights do converge.
+    parallel_tasks(&this->device_, num_threads, [&](int thread_index) {
+      int64_t first = num_points * thread_index / num_threads;
+      int64_t last = num_points * (thread_index + 1) / num_threads;
+      double change_norm = 0, weights_norm = 0;
+      for (int64_t j = first; j < last; j++) {
+        FloatType magnitude = std::abs(values[j]);
+        if (magnitude == 0) continue;
+        double change = weights[j] / magnitude - weights[j];
+        weights[j] /= magnitude;
+        change_norm += change * change;
+        weights_norm += static_cast<double>(weights[j]) * weights[j];
+      }
+      change_norms[thread_index] = change_norm;
+      weights_norms[thread_index] = weights_norm;
+    });
+    double change_norm = 0, weights_norm = 0;
+    for (int t = 0; t < num_threads; t++) {
+      change_norm += change_norms[t];
+      weights_norm += weights_norms[t];
+    }
+    if (std::sqrt(change_norm) <= rtol * std::sqrt(weights_norm)) break;
   }
 
   return Status::OK();
@@ -521,11 +1446,16 @@ Status Plan<CPUDevice, FloatType>::spread_or_interp(DType* cj, DType* fk) {
 
 template<typename FloatType>
 Status Plan<CPUDevice, FloatType>::spread_or_interp_sorted_batch(
-    int batch_size, DType* cBatch, DType* fBatch) {
-  // opts.spread_threading: 1 sequential multithread, 2 parallel single-thread.
-  // omp_sets_nested deprecated, so don't use; assume not nested for 2 to work.
-  // But when nthr_outer=1 here, omp par inside the loop sees all threads...
-  int nthr_outer = this->options_.spread_threading == SpreadThreading::SEQUENTIAL_MULTI_THREADED ? 1 : batch_size;
+    int batch_size, DType* cBatch, DType* fBatch,
+    const int64_t* c_offsets, const int64_t* f_offsets) {
+  // Either run the transforms in the batch one after another, each of them
+  // multi-threaded, or run them in parallel, each of them single-threaded.
+  // Parallel loops are not nested.
+  // A batch of a single transform always uses all threads on it.
+  bool parallel_batch =
+      this->options_.spread_threading == SpreadThreading::PARALLEL_SINGLE_THREADED &&
+      batch_size > 1;
+  const CPUDevice* inner_device = parallel_batch ? nullptr : &this->device_;
 
   if (fBatch == nullptr) {
     fBatch = (DType*) this->grid_data_;
@@ -537,39 +1467,114 @@ Status Plan<CPUDevice, FloatType>::spread_or_interp_sorted_batch(
   if (this->rank_ > 1) grid_size_1 = this->grid_dims_[1];
   if (this->rank_ > 2) grid_size_2 = this->grid_dims_[2];
 
-  #pragma omp parallel for num_threads(nthr_outer)
-  for (int i=0; i<batch_size; i++) {
-    DType *fwi = fBatch + i*this->grid_size_;  // start of i'th fw array in wkspace
-    DType *ci = cBatch + i*this->num_points_;            // start of i'th c array in cBatch
-    spreadinterpSorted(this->sort_indices_, grid_size_0, grid_size_1, grid_size_2,
-                       (FloatType*)fwi, this->num_points_, this->points_[0], this->points_[1], this->points_[2],
-                       (FloatType*)ci, this->spread_params_, this->did_sort_);
+  auto spread_or_interp = [&](int i) {
+    // start of i'th fw array in wkspace and of i'th c array in cBatch
+    DType *fwi = fBatch + (f_offsets ? f_offsets[i] : i*this->grid_size_);
+    DType *ci = cBatch + (c_offsets ? c_offsets[i] : i*this->num_points_);
+    if (this->index_width_ == IndexWidth::INT32) {
+      spreadinterpSorted<FloatType, int32_t>(
+          inner_device,
+          this->sort_indices_tensor_.template flat<int32_t>().data(),
+          grid_size_0, grid_size_1, grid_size_2,
+          (FloatType*)fwi, this->num_points_, this->points_[0], this->points_[1], this->points_[2],
+          this->points_stride_,
+          (FloatType*)ci, this->spread_params_, this->did_sort_);
+    } else {
+      spreadinterpSorted<FloatType, int64_t>(
+          inner_device,
+          this->sort_indices_tensor_.template flat<int64_t>().data(),
+          grid_size_0, grid_size_1, grid_size_2,
+          (FloatType*)fwi, this->num_points_, this->points_[0], this->points_[1], this->points_[2],
+          this->points_stride_,
+          (FloatType*)ci, this->spread_params_, this->did_sort_);
+    }
+  };
+  if (parallel_batch) {
+    parallel_tasks(&this->device_, batch_size, spread_or_interp);
+  } else {
+    for (int i = 0; i < batch_size; i++)
+      spread_or_interp(i);
   }
   return Status::OK();
 }
 
 template<typename FloatType>
-Status Plan<CPUDevice, FloatType>::deconvolve_batch(int batch_size, DType* fkBatch) {
-  FloatType one = 1.0;
-  // since deconvolveshuffle?d are single-thread, omp par seems to help here...
-  #pragma omp parallel for num_threads(batch_size)
-  for (int batch_index = 0; batch_index < batch_size; batch_index++) {
-    FftwType *fwi = this->grid_data_ + batch_index * this->grid_size_;
-    DType *fki = fkBatch + batch_index * this->mode_count_;
-    if (this->rank_ == 1)
-      deconvolveshuffle1d(this->spread_params_.spread_direction, one, this->fseries_data_[0],
-                          this->num_modes_[0], (FloatType *)fki,
-                          this->grid_dims_[0], fwi, this->options_.mode_order);
-    else if (this->rank_ == 2)
-      deconvolveshuffle2d(this->spread_params_.spread_direction, one, this->fseries_data_[0],
-                          this->fseries_data_[1], this->num_modes_[0], this->num_modes_[1], (FloatType *)fki,
-                          this->grid_dims_[0], this->grid_dims_[1], fwi, this->options_.mode_order);
-    else
-      deconvolveshuffle3d(this->spread_params_.spread_direction, one, this->fseries_data_[0],
-                          this->fseries_data_[1], this->fseries_data_[2], this->num_modes_[0], this->num_modes_[1], this->num_modes_[2],
-                          (FloatType *)fki, this->grid_dims_[0], this->grid_dims_[1], this->grid_dims_[2],
-                          fwi, this->options_.mode_order);
+Status Plan<CPUDevice, FloatType>::deconvolve_batch(int batch_size, DType* fkBatch,
+                                                    const int64_t* fk_offsets,
+                                                    const DType* sensBatch,
+                                                    const int64_t* sens_offsets) {
+  // Each fine grid is split into rows along the first (contiguous) dimension.
+  // Rows are independent, so the work is split over the batch and the rows of
+  // each fine grid, which keeps all threads busy even for a single large
+  // transform.
+  const int64_t nf1 = this->grid_dims_[0];
+  const int64_t nf2 = this->rank_ > 1 ? this->grid_dims_[1] : 1;
+  const int64_t nf3 = this->rank_ > 2 ? this->grid_dims_[2] : 1;
+  const int64_t ms = this->num_modes_[0];
+  const int64_t mt = this->rank_ > 1 ? this->num_modes_[1] : 1;
+  const int64_t mu = this->rank_ > 2 ? this->num_modes_[2] : 1;
+  const int64_t num_rows = nf2 * nf3;
+  const SpreadDirection dir = this->spread_params_.spread_direction;
+
+  auto deconvolve_row = [&](int64_t batch_index, int64_t row) {
+    FftwType* fw = this->grid_data_ + batch_index * this->grid_size_ +
+                   row * nf1;
+
+    // Find the mode row which corresponds to this fine grid row, if any.
+    int64_t k2, k3, i2, i3;
+    if (!fine_to_mode_index(row % nf2, nf2, mt, this->options_.mode_order,
+                            &k2, &i2) ||
+        !fine_to_mode_index(row / nf2, nf3, mu, this->options_.mode_order,
+                            &k3, &i3)) {
+      // Not a mode row. The input to the FFT must be zero-padded here.
+      if (dir == SpreadDirection::INTERP)
+        std::fill_n(reinterpret_cast<FloatType*>(fw), 2 * nf1, 0);
+      return;
+    }
+    FloatType prefac = 1.0;
+    if (this->rank_ > 1) prefac *= this->fseries_data_[1][std::abs(k2)];
+    if (this->rank_ > 2) prefac *= this->fseries_data_[2][std::abs(k3)];
+    const int64_t mode_offset = (i3 * mt + i2) * ms;
+    DType* fki = fkBatch + (fk_offsets ? fk_offsets[batch_index] :
+                                         batch_index * this->mode_count_);
+    FloatType* fk = reinterpret_cast<FloatType*>(fki + mode_offset);
+    if (sensBatch == nullptr) {
+      deconvolveshuffle1d(dir, prefac, this->fseries_data_[0], ms, fk, nf1, fw,
+                          this->options_.mode_order);
+      return;
+    }
+    const DType* sensi = sensBatch + (
+        sens_offsets ? sens_offsets[batch_index] :
+                       batch_index * this->mode_count_);
+    const FloatType* sens = reinterpret_cast<const FloatType*>(
+        sensi + mode_offset);
+    deconvolveshuffle1d_modulated(dir, prefac, this->fseries_data_[0], ms, fk,
+                                  sens, nf1, fw, this->options_.mode_order);
+  };
+
+  if (sensBatch != nullptr && dir == SpreadDirection::SPREAD) {
+    // The transforms may add to the same fk, so each row of all of them is
+    // processed by the same thread.
+    const Eigen::TensorOpCost cost_per_row(
+        batch_size * nf1 * sizeof(FftwType),
+        batch_size * ms * sizeof(FftwType), batch_size * ms * 8);
+    parallel_for(&this->device_, num_rows, cost_per_row,
+                 [&](int64_t first, int64_t last) {
+      for (int64_t row = first; row < last; row++) {
+        for (int64_t batch_index = 0; batch_index < batch_size; batch_index++)
+          deconvolve_row(batch_index, row);
+      }
+    });
+    return Status::OK();
   }
+
+  const Eigen::TensorOpCost cost_per_row(
+      nf1 * sizeof(FftwType), nf1 * sizeof(FftwType), ms * 2);
+  parallel_for(&this->device_, batch_size * num_rows, cost_per_row,
+               [&](int64_t first, int64_t last) {
+    for (int64_t r = first; r < last; r++)
+      deconvolve_row(r / num_rows, r % num_rows);
+  });
   return Status::OK();
 }
 
@@ -613,6 +1618,72 @@ Status set_grid_size(int ms,
   return Status::OK();
 }
 
+// Estimated cost of spreading or interpolating one transform, per fine grid
+// point, in cycles. Only the ratio to `kBatchOverheadCycles` matters.
+constexpr double kSpreadCyclesPerGridPoint = 10.0;
+
+// Estimated fixed cost of one batch (the parallel loops and the FFT calls), in
+// cycles.
+constexpr double kBatchOverheadCycles = 1e5;
+
+// Parallel efficiency of spreading a single transform on all threads,
+// relative to spreading separate transforms on each thread.
+constexpr double kSingleTransformSpreadEfficiency = 0.5;
+
+// Maximum memory for the fine grids of one batch, in bytes. At least one fine
+// grid is always allocated.
+constexpr int64_t kMaxBatchGridBytes = int64_t{1} << 30;
+
+// Chooses the number of transforms in each batch, for `num_transforms`
+// transforms on fine grids of `grid_size` points (`grid_bytes` bytes) and
+// `num_threads` threads.
+//
+// Each batch spreads or interpolates its transforms in parallel, one per
+// thread, so a batch of `b` transforms takes `ceil(b / num_threads)` rounds,
+// except a batch of a single transform, which uses all threads. The FFTs and
+// the deconvolution use all threads regardless of the batch size and the last
+// batch has its own FFT plan (see `plan_fft`), so their cost does not depend
+// on the batch size. The batch size minimizes the cost of the spreading rounds
+// plus a fixed overhead per batch. Since a batch holds one fine grid per
+// transform, it is at most `num_threads` transforms (a single round) and fits
+// in `kMaxBatchGridBytes`: larger batches would only save the small overhead
+// per batch. Ties go to the smaller batch. For example, 17 transforms on 8
+// threads are done in batches of 8, 8 and 1, rather than in batches of 6, 6
+// and 5.
+int choose_batch_size(int num_transforms, int64_t grid_size,
+                      int64_t grid_bytes, int num_threads) {
+  int64_t max_batch_size = std::min<int64_t>(
+      {num_transforms, num_threads, kMaxBatchGridBytes / grid_bytes,
+       kMaxArraySize / grid_size});
+  max_batch_size = std::max<int64_t>(max_batch_size, 1);
+
+  const double round_cycles = kSpreadCyclesPerGridPoint * grid_size;
+  auto batch_cycles = [&](int64_t batch_size) {
+    double rounds;
+    if (batch_size == 1) {
+      rounds = 1.0 / std::max(1.0, kSingleTransformSpreadEfficiency *
+                                   num_threads);
+    } else {
+      rounds = (batch_size + num_threads - 1) / num_threads;
+    }
+    return kBatchOverheadCycles + rounds * round_cycles;
+  };
+
+  int best_batch_size = 1;
+  double best_cycles = 0.0;
+  for (int64_t batch_size = 1; batch_size <= max_batch_size; batch_size++) {
+    int64_t remainder = num_transforms % batch_size;
+    double cycles = (num_transforms / batch_size) * batch_cycles(batch_size);
+    if (remainder > 0)
+      cycles += batch_cycles(remainder);
+    if (batch_size == 1 || cycles < best_cycles) {
+      best_batch_size = static_cast<int>(batch_size);
+      best_cycles = cycles;
+    }
+  }
+  return best_batch_size;
+}
+
 template<typename FloatType>
 Status setup_spreader(
     int rank, FloatType eps, double upsampling_factor,
@@ -727,15 +1798,13 @@ Status setup_spreader_for_nufft(int rank, FloatType eps,
   return Status::OK();
 }
 
-// Checks spreader inputs.
-// Split out by Melody Shih, Jun 2018. Finiteness chk Barnett 7/30/18.
-// Bypass FOLD_AND_RESCALE macro which has inevitable rounding err even nr +pi,
-// giving fake invalids well inside the [-3pi,3pi] domain, 4/9/21.
+// Checks that the fine grid is large enough for spreading. The NU pts are
+// checked by preprocess_points.
+// Split out by Melody Shih, Jun 2018.
 // Equivalent to spreadcheck in original FINUFFT code.
 template<typename FloatType>
-Status check_spread_inputs(int64_t n1, int64_t n2, int64_t n3, int64_t num_points,
-                           FloatType *kx, FloatType *ky, FloatType *kz,
-                           SpreadParameters<FloatType> opts) {
+Status check_spread_inputs(int64_t n1, int64_t n2, int64_t n3,
+                           const SpreadParameters<FloatType>& opts) {
   // Check that cuboid is large enough for spreading.
   int min_n = 2 * opts.kernel_width;
   if (n1 < min_n || (n2 > 1 && n2 < min_n) || (n3 > 1 && n3 < min_n)) {
@@ -743,273 +1812,376 @@ Status check_spread_inputs(int64_t n1, int64_t n2, int64_t n3, int64_t num_point
         "cuboid too small for spreading, got (", n1, ", ", n2, ", ", n3, ") ",
         "but need at least ", min_n, " in each non-trivial dimension");
   }
-  int rank = get_transform_rank(n1, n2, n3);
-
-  // Check bounds. Check that non-uniform points are valid (+-3pi if pirange, or [-grid_size,2N])
-  // exit gracefully as soon as invalid is found.
-  // Note: isfinite() breaks with -Ofast
-  if (opts.check_bounds) {
-    FloatType lower_bound, upper_bound;
-    lower_bound = opts.pirange ? -3.0 * kPi<FloatType> : -(FloatType)n1;
-    upper_bound = opts.pirange ? 3.0 * kPi<FloatType> : 2 * (FloatType)n1;
-    for (int64_t i = 0; i < num_points; ++i) {
-      if ((kx[i] < lower_bound || kx[i] > upper_bound) || !isfinite(kx[i])) {
-        return errors::InvalidArgument(
-            "points outside valid range: kx[", i, "] = ", kx[i],
-            " is not in [", lower_bound, ", ", upper_bound, "]");
-      }
-    }
-    if (rank > 1) {
-      lower_bound = opts.pirange ? -3.0 * kPi<FloatType> : -(FloatType)n2;
-      upper_bound = opts.pirange ? 3.0 * kPi<FloatType> : 2 * (FloatType)n2;
-      for (int64_t i = 0; i<num_points; ++i) {
-        if ((ky[i] < lower_bound || ky[i] > upper_bound) || !isfinite(ky[i])) {
-          return errors::InvalidArgument(
-              "points outside valid range: ky[", i, "] = ", ky[i],
-              " is not in [", lower_bound, ", ", upper_bound, "]");
-        }
-      }
-    }
-    if (rank > 2) {
-      lower_bound = opts.pirange ? -3.0 * kPi<FloatType> : -(FloatType)n3;
-      upper_bound = opts.pirange ? 3.0 * kPi<FloatType> : 2 * (FloatType)n3;
-      for (int64_t i = 0; i < num_points; ++i) {
-        if ((kz[i] < lower_bound || kz[i] > upper_bound) || !isfinite(kz[i])) {
-          return errors::InvalidArgument(
-              "points outside valid range: kz[", i, "] = ", kz[i],
-              " is not in [", lower_bound, ", ", upper_bound, "]");
-        }
-      }
-    }
-  }
   return Status::OK();
 }
 
-// This makes a decision whether or not to sort the NU pts (influenced by
-// opts.sort_points), and if yes, calls either single- or multi-threaded bin sort,
-// writing reordered index list to sort_indices. If decided not to sort, the
-// identity permutation is written to sort_indices.
+// Validates, folds and bins the NU pts in a single parallel pass, and then
+// sorts them by bin (influenced by opts.sort_points), writing the reordered
+// index list to sort_indices. If decided not to sort, the identity
+// permutation is written to sort_indices instead, but the points are still
+// validated in parallel.
 // The permutation is designed to make RAM access close to contiguous, to
 // speed up spreading/interpolation, in the case of disordered NU points.
+//
+// Each thread handles a contiguous range of points. For each point, it checks
+// the bounds (if opts.check_bounds), folds and rescales the coordinates, adds
+// them to the bounding box, computes the bin key, and counts the key's first
+// radix digit (see radix_sort_by_key). Thus the coordinates are read once
+// before the sort, and the first radix pass needs no counting pass of its own.
 
 // Inputs:
 // num_points        - number of input NU points.
 // kx,ky,kz - length-num_points arrays of real coords of NU pts, in the domain
-//             for FOLD_AND_RESCALE, which includes [0,n1], [0,n2], [0,n3]
-//             respectively, if opts.pirange=0; or [-pi,pi] if opts.pirange=1.
-//             (only kz used in 1D, only kx and ky used in 2D.)
-//             These must have been bounds-checked already; see check_spread_inputs.
+//             [-3pi,3pi] if opts.pirange=1, or [-n,2n] in each dimension if
+//             opts.pirange=0. (only kx used in 1D, only kx and ky used in 2D.)
+// points_stride - distance between consecutive coords in kx,ky,kz. E.g., 1 for
+//             separate arrays, or the rank for interleaved (x,y,z) triples.
 // n1,n2,n3 - integer sizes of overall box (set n2=n3=1 for 1D, n3=1 for 2D).
 //             1 = x (fastest), 2 = y (medium), 3 = z (slowest).
-// opts     - spreading options struct, documented in ../include/SpreadParameters<FloatType>.h
+// opts     - spreading options struct, documented in nufft_plan.h.
+// update   - if not nullptr, describes how the points changed since a previous
+//             call which sorted them. Only the points which were appended or
+//             changed bin are then sorted, and merged into the previous order
+//             (see merge_points_update), unless too many points changed. The
+//             output is the same as for a full sort.
 // Outputs:
 // sort_indices - a good permutation of NU points. (User must preallocate
 //                 to length num_points.) Ie, kx[sort_indices[j]], j=0,..,num_points-1, is a good
 //                 ordering for the x-coords of NU pts, etc.
-// returned value - true if sorting was done, false otherwise.
+// keys         - the bin key of each NU pt, if sorted. (User must preallocate
+//                 to length num_points.) Needed to update the points later.
+// did_sort     - true if sorting was done, false otherwise.
+// stats        - statistics of the points. See PointStatistics.
+// returned value - an InvalidArgument error if a point is out of bounds or
+//                  not finite. The error refers to the first such point.
 
 // Barnett 2017; split out by Melody Shih, Jun 2018.
 // Called indexSort in original FINUFFT code.
-template<typename FloatType>
-bool bin_sort_points(int64_t* sort_indices, int64_t n1, int64_t n2, int64_t n3,
-                     int64_t num_points,  FloatType *kx, FloatType *ky,
-                     FloatType *kz, SpreadParameters<FloatType> opts) {
+template<typename FloatType, typename IndexType>
+Status preprocess_points(const CPUDevice& device,
+                         IndexType* sort_indices, IndexType* keys,
+                         int64_t n1, int64_t n2, int64_t n3,
+                         IndexType num_points, FloatType *kx, FloatType *ky,
+                         FloatType *kz, int64_t points_stride,
+                         const SpreadParameters<FloatType>& opts,
+                         const PointsUpdate<IndexType>* update,
+                         bool* did_sort, PointStatistics<FloatType>* stats) {
   int rank = get_transform_rank(n1, n2, n3);
-  int64_t grid_size = n1 * n2 * n3;
+  bool isky = (n2 > 1), iskz = (n3 > 1);  // ky,kz avail? (cannot access if not)
+  int pirange = opts.pirange;
 
   // Heuristic binning box size for uniform grid... affects performance:
   double bin_size_x = 16, bin_size_y = 4, bin_size_z = 4;
+  // Position of each bin in the output ordering. Empty for Cartesian order.
+  std::vector<IndexType> bin_order;
+  if (opts.sort_points == SortPoints::MORTON) {
+    get_cache_adaptive_bin_sizes<FloatType>(rank, opts.kernel_width,
+                                            &bin_size_x, &bin_size_y,
+                                            &bin_size_z);
+    bin_order = get_morton_bin_order<IndexType>(
+        n1, n2, n3, bin_size_x, bin_size_y, bin_size_z);
+  }
   // Put in heuristics based on cache sizes (only useful for single-thread).
   bool should_sort = !(rank == 1 && (opts.spread_direction == SpreadDirection::INTERP || (num_points > 1000 * n1)));  // 1D small-grid_size or dir=2 case: don't sort
-  bool did_sort = false;
+  *did_sort = (opts.sort_points == SortPoints::YES ||
+               opts.sort_points == SortPoints::MORTON ||
+               (opts.sort_points == SortPoints::AUTO && should_sort));
 
-  int max_threads = OMP_GET_MAX_THREADS();
+  int max_threads = device.numThreads();
   if (opts.num_threads > 0)  // user override up to max threads
     max_threads = std::min(max_threads, opts.num_threads);
+  int num_threads = opts.sort_threads;   // choose # threads for sorting
+  if (num_threads == 0)   // use auto choice: enough points to keep each thread busy
+    num_threads = std::min<int64_t>(
+        max_threads, 1 + num_points / kMinPointsPerSortThread);
+  // handle case of less points than threads
+  num_threads = std::max<IndexType>(1, std::min(num_points, (IndexType)num_threads));
+  std::vector<IndexType> brk(num_threads+1);    // list of start NU pt indices per thread
+  // distribute the NU pts to threads once & for all...
+  for (int thread_index = 0; thread_index <= num_threads; ++thread_index)
+    brk[thread_index] = (IndexType)(0.5 + num_points * (double)thread_index / num_threads);
 
-  if (opts.sort_points == SortPoints::YES ||
-      (opts.sort_points == SortPoints::AUTO && should_sort)) {
-    // store a good permutation ordering of all NU pts (rank=1,2 or 3)
-    int sort_debug = (opts.verbosity>=2);   // show timing output?
-    int sort_threads = opts.sort_threads;   // choose # threads for sorting
-    if (sort_threads == 0)   // use auto choice: when grid_size >> num_points, one thread is better!
-      sort_threads = (10 * num_points > grid_size) ? max_threads : 1;
-    if (sort_threads == 1) {
-      bin_sort_singlethread(sort_indices, num_points, kx, ky, kz, n1, n2, n3,
-                            opts.pirange, bin_size_x, bin_size_y, bin_size_z,
-                            sort_debug);
-    }
-    else {
-      bin_sort_multithread(sort_indices, num_points, kx, ky, kz, n1, n2, n3,
-                           opts.pirange, bin_size_x, bin_size_y, bin_size_z,
-                           sort_debug, sort_threads);
-    }
-    did_sort = true;
-  } else {
-    // Set identity permutation. Here OMP helps Xeon, hinders i7.
-    #pragma omp parallel for num_threads(max_threads) schedule(static,1000000)
-    for (int64_t i = 0; i < num_points; i++)
-      sort_indices[i] = i;
+  // here the +1 is needed to allow round-off error causing i1=n1/bin_size_x,
+  // for kx near +pi, ie foldrescale gives n1 (exact arith would be 0 to n1-1).
+  // Note that round-off near kx=-pi stably rounds negative to i1=0.
+  IndexType nbins1 = n1 / bin_size_x + 1, nbins2, nbins3;
+  nbins2 = isky ? n2 / bin_size_y + 1 : 1;
+  nbins3 = iskz ? n3 / bin_size_z + 1 : 1;
+  IndexType num_bins = nbins1 * nbins2 * nbins3;
+  int num_passes, digit_bits;
+  get_radix_sort_digits(num_bins, &num_passes, &digit_bits);
+  IndexType digit_mask = (IndexType{1} << digit_bits) - 1;
+
+  // Per-thread counts of the first radix digit. Also needed for an update, in
+  // case too many points changed to reuse the previous order.
+  std::vector<IndexType> counts(*did_sort ? num_threads * (digit_mask + 1) : 0);
+
+  // Valid range of the coordinates in each dimension.
+  // Note: isfinite() breaks with -Ofast, so the range checks below are written
+  // such that NaN fails them.
+  int64_t n[3] = {n1, n2, n3};
+  FloatType lower[3], upper[3];
+  for (int d = 0; d < 3; d++) {
+    lower[d] = pirange ? -3.0 * kPi<FloatType> : -(FloatType)n[d];
+    upper[d] = pirange ? 3.0 * kPi<FloatType> : 2 * (FloatType)n[d];
+  }
+
+  // Per-thread results: first invalid point and bounding box.
+  std::vector<IndexType> first_invalid(num_threads, num_points);
+  std::vector<FloatType> box(num_threads * 6);
+
+  parallel_tasks(&device, num_threads, [&](int thread_index) {
+    IndexType* thread_counts =
+        *did_sort ? counts.data() + thread_index * (digit_mask + 1) : nullptr;
+    FloatType lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+    if (brk[thread_index] < brk[thread_index+1]) {
+      int64_t k = brk[thread_index] * points_stride;
+      lo[0] = hi[0] = FOLD_AND_RESCALE(kx[k], n1, pirange);
+      if (isky) lo[1] = hi[1] = FOLD_AND_RESCALE(ky[k], n2, pirange);
+      if (iskz) lo[2] = hi[2] = FOLD_AND_RESCALE(kz[k], n3, pirange);
+    }
+    for (IndexType i = brk[thread_index]; i < brk[thread_index+1]; i++) {
+      int64_t k = i * points_stride;
+      if (opts.check_bounds) {
+        bool valid = (kx[k] >= lower[0] && kx[k] <= upper[0]);
+        if (isky) valid &= (ky[k] >= lower[1] && ky[k] <= upper[1]);
+        if (iskz) valid &= (kz[k] >= lower[2] && kz[k] <= upper[2]);
+        if (!valid) {
+          first_invalid[thread_index] = i;
+          break;
+        }
+      }
+      FloatType x = FOLD_AND_RESCALE(kx[k], n1, pirange), y = 0, z = 0;
+      if (isky) y = FOLD_AND_RESCALE(ky[k], n2, pirange);
+      if (iskz) z = FOLD_AND_RESCALE(kz[k], n3, pirange);
+      lo[0] = std::min(lo[0], x); hi[0] = std::max(hi[0], x);
+      lo[1] = std::min(lo[1], y); hi[1] = std::max(hi[1], y);
+      lo[2] = std::min(lo[2], z); hi[2] = std::max(hi[2], z);
+      if (*did_sort) {
+        // find the bin index in however many dims are needed
+        IndexType i1 = x / bin_size_x, i2 = y / bin_size_y, i3 = z / bin_size_z;
+        IndexType bin = i1 + nbins1 * (i2 + nbins2 * i3);
+        IndexType key = bin_order.empty() ? bin : bin_order[bin];
+        keys[i] = key;
+        thread_counts[key & digit_mask]++;
+      }
+    }
+    for (int d = 0; d < 3; d++) {
+      box[thread_index * 6 + d] = lo[d];
+      box[thread_index * 6 + 3 + d] = hi[d];
+    }
+  });
+
+  // Report the first invalid point, if any.
+  IndexType invalid = *std::min_element(first_invalid.begin(),
+                                        first_invalid.end());
+  if (invalid < num_points) {
+    FloatType* k[3] = {kx, ky, kz};
+    const char* names[3] = {"kx", "ky", "kz"};
+    for (int d = 0; d < rank; d++) {
+      FloatType value = k[d][invalid * points_stride];
+      if (!(value >= lower[d] && value <= upper[d])) {
+        return errors::InvalidArgument(
+            "points outside valid range: ", names[d], "[", invalid, "] = ",
+            value, " is not in [", lower[d], ", ", upper[d], "]");
+      }
+    }
+  }
+
+  // Reduce the statistics. Threads with no points do not contribute.
+  *stats = PointStatistics<FloatType>();
+  double box_volume = 1.0;
+  for (int d = 0; d < rank; d++) {
+    bool first = true;
+    for (int thread_index = 0; thread_index < num_threads; thread_index++) {
+      if (brk[thread_index] == brk[thread_index+1]) continue;
+      FloatType lo = box[thread_index * 6 + d];
+      FloatType hi = box[thread_index * 6 + 3 + d];
+      stats->lower_bound[d] = first ? lo : std::min(stats->lower_bound[d], lo);
+      stats->upper_bound[d] = first ? hi : std::max(stats->upper_bound[d], hi);
+      first = false;
+    }
+    box_volume *= std::max<double>(
+        1.0, stats->upper_bound[d] - stats->lower_bound[d]);
+  }
+  stats->density = (double)num_points / (n1 * n2 * n3);
+  stats->bounding_box_density = num_points / box_volume;
+
+  IndexType num_moved = -1;
+  if (*did_sort && update) {
+    num_moved = merge_points_update(sort_indices, keys, num_points, *update,
+                                    static_cast<IndexType>(
+                                        num_points / kMaxUpdatedPointsRatio));
+    if (opts.verbosity >= 2 && num_moved >= 0)
+      printf("\tpreprocess_points: %d bins, %d points re-sorted\n",
+             (int)num_bins, (int)num_moved);
+  }
+  if (*did_sort && num_moved < 0) {
+    radix_sort_by_key(device, sort_indices, keys, num_points, brk.data(),
+                      num_threads, num_passes, digit_bits, counts.data());
+    if (opts.verbosity >= 2)
+      printf("\tpreprocess_points: %d bins, %d radix passes, %d threads\n",
+             (int)num_bins, num_passes, num_threads);
+  } else if (!*did_sort) {
+    // Set identity permutation.
+    parallel_for(&device, num_points,
+                 Eigen::TensorOpCost(0, sizeof(IndexType), 1),
+                 [&](int64_t first, int64_t last) {
+      for (int64_t i = first; i < last; i++)
+        sort_indices[i] = i;
+    });
   }
-  return did_sort;
+  return Status::OK();
+}
+
+// Chooses the number of passes and bits per digit for the radix sort of keys
+// in [0, num_keys). Each pass sorts on a digit of at most kMaxSortDigitBits
+// bits, so a single pass (ie a counting sort) suffices for up to
+// 2^kMaxSortDigitBits keys.
+static void get_radix_sort_digits(int64_t num_keys, int* num_passes,
+                                  int* digit_bits) {
+  int key_bits = 1;
+  while (key_bits < 63 && (int64_t{1} << key_bits) < num_keys)
+    key_bits++;
+  *num_passes = 1 + (key_bits - 1) / kMaxSortDigitBits;
+  *digit_bits = 1 + (key_bits - 1) / *num_passes;
 }
 
-/* Returns permutation of all nonuniform points with good RAM access,
- * ie less cache misses for spreading, in 1D, 2D, or 3D. Single-threaded version
+/* Stable parallel LSD radix sort of the indices 0,..,num_points-1 by key.
  *
- * This is achieved by binning into cuboids (of given bin_size within the
- * overall box domain), then reading out the indices within
- * these bins in a Cartesian cuboid ordering (x fastest, y med, z slowest).
- * Finally the permutation is inverted, so that the good ordering is: the
- * NU pt of index ret[0], the NU pt of index ret[1],..., NU pt of index ret[num_points-1]
+ * Used to read out the NU pts bin by bin, for good RAM access during
+ * spreading. Each thread handles the contiguous range [brk[t], brk[t+1]) of
+ * the current ordering and counts digits in a private histogram, so the extra
+ * memory is independent of the number of keys and the sort scales with
+ * threads at any point density. The output is deterministic and does not
+ * depend on the number of threads.
  *
- * Inputs: num_points - number of input NU points.
- *         kx,ky,kz - length-num_points arrays of real coords of NU pts, in the domain
- *                    for FOLD_AND_RESCALE, which includes [0,n1], [0,n2], [0,n3]
- *                    respectively, if pirange=0; or [-pi,pi] if pirange=1.
- *         n1,n2,n3 - integer sizes of overall box (n2=n3=1 for 1D, n3=1 for 2D)
- *         bin_size_x,y,z - what binning box size to use in each dimension
- *                    (in rescaled coords where ranges are [0,Ni] ).
- *                    For 1D, only bin_size_x is used; for 2D, it & bin_size_y.
+ * Inputs: keys - length-num_points array of keys.
+ *         brk - length-(num_threads+1) array of thread range boundaries.
+ *         num_passes, digit_bits - see get_radix_sort_digits.
+ *         counts - num_threads * 2^digit_bits array with the per-thread counts
+ *                  of the first (least significant) digit. Overwritten.
  * Output:
- *         writes to ret a vector list of indices, each in the range 0,..,num_points-1.
- *         Thus, ret must have been preallocated for num_points int64_ts.
+ *         writes to ret the indices sorted by key. Thus, ret must have been
+ *         preallocated for num_points IndexTypes.
  *
- * Notes: I compared RAM usage against declaring an internal vector and passing
- * back; the latter used more RAM and was slower.
- * Avoided the bins array, as in JFM's spreader of 2016,
- * tidied up, early 2017, Barnett.
- *
- * Timings (2017): 3s for num_points=1e8 NU pts on 1 core of i7; 5s on 1 core of xeon.
+ * Extra memory: num_points indices if more than one pass is needed.
  */
-template<typename FloatType>
-void bin_sort_singlethread(
-    int64_t *ret, int64_t num_points, FloatType *kx, FloatType *ky, FloatType *kz,
-    int64_t n1, int64_t n2, int64_t n3, int pirange,
-    double bin_size_x, double bin_size_y, double bin_size_z, int debug) {
-  bool isky = (n2 > 1), iskz = (n3 > 1);  // ky,kz avail? (cannot access if not)
-  // here the +1 is needed to allow round-off error causing i1=n1/bin_size_x,
-  // for kx near +pi, ie foldrescale gives n1 (exact arith would be 0 to n1-1).
-  // Note that round-off near kx=-pi stably rounds negative to i1=0.
-  int64_t nbins1 = n1 / bin_size_x + 1, nbins2, nbins3;
-  nbins2 = isky ? n2 / bin_size_y + 1 : 1;
-  nbins3 = iskz ? n3 / bin_size_z + 1 : 1;
-  int64_t num_bins = nbins1 * nbins2 * nbins3;
-
-  std::vector<int64_t> counts(num_bins,0);  // count how many pts in each bin
-  for (int64_t i = 0; i < num_points; i++) {
-    // find the bin index in however many dims are needed
-    int64_t i1 = FOLD_AND_RESCALE(kx[i], n1, pirange) / bin_size_x, i2 = 0, i3 = 0;
-    if (isky) i2 = FOLD_AND_RESCALE(ky[i], n2, pirange) / bin_size_y;
-    if (iskz) i3 = FOLD_AND_RESCALE(kz[i], n3, pirange) / bin_size_z;
-    int64_t bin = i1 + nbins1 * (i2 + nbins2 * i3);
-    counts[bin]++;
-  }
-  std::vector<int64_t> offsets(num_bins);   // cumulative sum of bin counts
-  offsets[0] = 0;     // do: offsets = [0 cumsum(counts(1:end-1)]
-  for (int64_t i = 1; i < num_bins; i++)
-    offsets[i] = offsets[i - 1] + counts[i-1];
-
-  std::vector<int64_t> inv(num_points);           // fill inverse map
-  for (int64_t i = 0; i < num_points; i++) {
-    // find the bin index (again! but better than using RAM)
-    int64_t i1 = FOLD_AND_RESCALE(kx[i], n1, pirange) / bin_size_x, i2 = 0, i3 = 0;
-    if (isky) i2 = FOLD_AND_RESCALE(ky[i], n2, pirange) / bin_size_y;
-    if (iskz) i3 = FOLD_AND_RESCALE(kz[i], n3, pirange) / bin_size_z;
-    int64_t bin = i1 + nbins1 * (i2 + nbins2 * i3);
-    int64_t offset = offsets[bin];
-    offsets[bin]++;
-    inv[i] = offset;
-  }
-  // invert the map, writing to output pointer (writing pattern is random)
-  for (int64_t i = 0; i < num_points; i++)
-    ret[inv[i]] = i;
-}
+template<typename IndexType>
+void radix_sort_by_key(const CPUDevice& device,
+                       IndexType* ret, const IndexType* keys,
+                       IndexType num_points, const IndexType* brk,
+                       int num_threads, int num_passes, int digit_bits,
+                       IndexType* counts) {
+  IndexType num_digits = IndexType{1} << digit_bits;
+  IndexType digit_mask = num_digits - 1;
+
+  // Ping-pong between ret and tmp so that the last pass writes to ret.
+  std::vector<IndexType> tmp(num_passes > 1 ? num_points : 0);
+  IndexType* src = nullptr;  // nullptr: identity permutation.
+  IndexType* dst = (num_passes % 2 == 1) ? ret : tmp.data();
+  // Per-thread digit counts, then per-thread output offsets.
+  IndexType* offsets = counts;
+
+  for (int pass = 0; pass < num_passes; pass++) {
+    int shift = pass * digit_bits;
+    if (pass > 0) {
+      std::fill(offsets, offsets + num_threads * num_digits, 0);
+      // count digits in each thread's range of the current ordering
+      parallel_tasks(&device, num_threads, [&](int thread_index) {
+        IndexType* thread_counts = offsets + thread_index * num_digits;
+        for (IndexType j = brk[thread_index]; j < brk[thread_index+1]; j++)
+          thread_counts[(keys[src[j]] >> shift) & digit_mask]++;
+      });
+    }
 
-// Mostly-OpenMP'ed version of bin_sort_singlethread.
-// For documentation see: bin_sort_singlethread.
-// Caution: when num_points (# NU pts) << N (# U pts), is SLOWER than single-thread.
-// Barnett 2/8/18
-// Explicit #threads control argument 7/20/20.
-// Todo: if debug, print timing breakdowns.
-template<typename FloatType>
-void bin_sort_multithread(
-    int64_t *ret, int64_t num_points, FloatType *kx, FloatType *ky, FloatType *kz,
-    int64_t n1,int64_t n2,int64_t n3,int pirange,
-    double bin_size_x, double bin_size_y, double bin_size_z, int debug,
-    int num_threads) {
-  bool isky = (n2 > 1), iskz = (n3 > 1);  // ky,kz avail? (cannot access if not)
-  int64_t nbins1=n1 / bin_size_x + 1, nbins2, nbins3;  // see above note on why +1
-  nbins2 = isky ? n2 / bin_size_y + 1 : 1;
-  nbins3 = iskz ? n3 / bin_size_z + 1 : 1;
-  int64_t num_bins = nbins1 * nbins2 * nbins3;
-  if (num_threads == 0)
-    fprintf(stderr, "[%s] num_threads (%d) must be positive!\n",
-            __func__, num_threads);
-  // handle case of less points than threads
-  num_threads = std::min(num_points, (int64_t)num_threads);
-  std::vector<int64_t> brk(num_threads+1);    // list of start NU pt indices per thread
+    // exclusive scan, digit-major and thread-minor, keeps the sort stable
+    IndexType sum = 0;
+    for (IndexType d = 0; d < num_digits; d++) {
+      for (int thread_index = 0; thread_index < num_threads; thread_index++) {
+        IndexType count = offsets[thread_index * num_digits + d];
+        offsets[thread_index * num_digits + d] = sum;
+        sum += count;
+      }
+    }
 
-  // distribute the NU pts to threads once & for all...
-  for (int thread_index = 0; thread_index <= num_threads; ++thread_index)
-    brk[thread_index] = (int64_t)(0.5 + num_points * thread_index / (double)num_threads);
-
-  std::vector<int64_t> counts(num_bins, 0);     // global counts: # pts in each bin
-  // offsets per thread, size num_threads * num_bins, init to 0 by copying the counts vec...
-  std::vector< std::vector<int64_t> > ot(num_threads, counts);
-  {    // scope for ct, the 2d array of counts in bins for each thread's NU pts
-    std::vector< std::vector<int64_t> > ct(num_threads, counts);   // num_threads * num_bins, init to 0
-
-    #pragma omp parallel num_threads(num_threads)
-    {  // parallel binning to each thread's count. Block done once per thread
-      int thread_index = OMP_GET_THREAD_NUM();
-      //printf("\tt=%d: [%d,%d]\n",thread_index,jlo[thread_index],jhi[thread_index]);
-      for (int64_t i = brk[thread_index]; i < brk[thread_index+1]; i++) {
-        // find the bin index in however many dims are needed
-        int64_t i1=FOLD_AND_RESCALE(kx[i],n1,pirange)/bin_size_x, i2=0, i3=0;
-        if (isky) i2 = FOLD_AND_RESCALE(ky[i],n2,pirange)/bin_size_y;
-        if (iskz) i3 = FOLD_AND_RESCALE(kz[i],n3,pirange)/bin_size_z;
-        int64_t bin = i1+nbins1*(i2+nbins2*i3);
-        ct[thread_index][bin]++;               // no clash btw threads
+    // scatter each thread's range (writing pattern is random)
+    parallel_tasks(&device, num_threads, [&](int thread_index) {
+      IndexType* next = offsets + thread_index * num_digits;
+      for (IndexType j = brk[thread_index]; j < brk[thread_index+1]; j++) {
+        IndexType i = src ? src[j] : j;
+        dst[next[(keys[i] >> shift) & digit_mask]++] = i;
       }
+    });
+
+    src = dst;
+    dst = (dst == ret) ? tmp.data() : ret;
+  }
+}
+
+/* Sorts updated NU pts by bin key, reusing the order of the previous points.
+ *
+ * Walks the previous permutation in order, keeping the points which were not
+ * removed and whose bin did not change. These are still sorted by (key, index),
+ * since removing a range shifts the later indices uniformly. The points which
+ * changed bin and the appended points are sorted separately and merged in.
+ * Thus, apart from a sequential walk over the permutation, the cost is
+ * proportional to the number of points which changed.
+ *
+ * Inputs: keys - length-num_points array of the new keys.
+ *         update - the previous permutation and keys, and the removed range.
+ *         max_changed - the largest number of changed or new points for which
+ *                       the previous order is reused.
+ * Output:
+ *         writes to ret the indices sorted by (key, index), ie the same order
+ *         as radix_sort_by_key. Thus, ret must have been preallocated for
+ *         num_points IndexTypes, and must not alias update.sort_indices.
+ * Returned value: the number of points which were sorted (changed or new), or
+ *                 -1 if there were more than max_changed, in which case the
+ *                 contents of ret are unspecified.
+ */
+template<typename IndexType>
+IndexType merge_points_update(IndexType* ret, const IndexType* keys,
+                              IndexType num_points,
+                              const PointsUpdate<IndexType>& update,
+                              IndexType max_changed) {
+  IndexType num_removed = update.remove_end - update.remove_begin;
+  IndexType num_kept = update.num_points - num_removed;
+  if (num_points - num_kept > max_changed) return -1;
+
+  // Keep the points whose bin did not change, in the previous order.
+  IndexType num_unchanged = 0;
+  std::vector<IndexType> changed;
+  for (IndexType j = 0; j < update.num_points; j++) {
+    IndexType i = update.sort_indices[j];
+    if (i >= update.remove_begin && i < update.remove_end) continue;
+    IndexType k = (i < update.remove_begin) ? i : i - num_removed;
+    if (keys[k] == update.keys[i]) {
+      ret[num_unchanged++] = k;
+    } else {
+      changed.push_back(k);
+      if (num_points - num_kept + static_cast<IndexType>(changed.size()) >
+          max_changed)
+        return -1;
     }
-    // sum along thread axis to get global counts
-    for (int64_t b = 0; b < num_bins; ++b)   // (not worth omp. Either loop order is ok)
-      for (int thread_index = 0; thread_index < num_threads; ++thread_index)
-	  counts[b] += ct[thread_index][b];
-
-    std::vector<int64_t> offsets(num_bins);   // cumulative sum of bin counts
-    // do: offsets = [0 cumsum(counts(1:end-1))] ...
-    offsets[0] = 0;
-    for (int64_t i = 1; i < num_bins; i++)
-      offsets[i] = offsets[i-1] + counts[i-1];
-
-    for (int64_t b = 0; b < num_bins; ++b)  // now build offsets for each thread & bin:
-      ot[0][b] = offsets[b];                     // init
-    for (int thread_index = 1; thread_index < num_threads; ++thread_index)   // (again not worth omp. Either loop order is ok)
-      for (int64_t b = 0; b < num_bins; ++b)
-	ot[thread_index][b] = ot[thread_index - 1][b]+ct[thread_index - 1][b];        // cumsum along thread_index axis
-
-  }  // scope frees up ct here, before inv alloc
-
-  std::vector<int64_t> inv(num_points);           // fill inverse map, in parallel
-  #pragma omp parallel num_threads(num_threads)
-  {
-    int thread_index = OMP_GET_THREAD_NUM();
-    for (int64_t i = brk[thread_index]; i < brk[thread_index+1]; i++) {
-      // find the bin index (again! but better than using RAM)
-      int64_t i1=FOLD_AND_RESCALE(kx[i], n1, pirange) / bin_size_x, i2=0, i3=0;
-      if (isky) i2 = FOLD_AND_RESCALE(ky[i], n2, pirange) / bin_size_y;
-      if (iskz) i3 = FOLD_AND_RESCALE(kz[i], n3, pirange) / bin_size_z;
-      int64_t bin = i1 + nbins1 * (i2 + nbins2 * i3);
-      inv[i] = ot[thread_index][bin];   // get the offset for this NU pt and thread
-      ot[thread_index][bin]++;               // no clash
-    }
-  }
-  // invert the map, writing to output pointer (writing pattern is random)
-  #pragma omp parallel for num_threads(num_threads) schedule(dynamic,10000)
-  for (int64_t i=0; i<num_points; i++)
-    ret[inv[i]]=i;
+  }
+  for (IndexType k = num_kept; k < num_points; k++)
+    changed.push_back(k);
+
+  auto less = [keys](IndexType a, IndexType b) {
+    return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+  };
+  std::sort(changed.begin(), changed.end(), less);
+
+  // merge in place from the back, as there is room at the end of ret
+  IndexType a = num_unchanged, b = changed.size(), out = num_points;
+  while (b > 0) {
+    if (a > 0 && less(changed[b-1], ret[a-1]))
+      ret[--out] = ret[--a];
+    else
+      ret[--out] = changed[--b];
+  }
+  return changed.size();
 }
 
 static int get_transform_rank(int64_t n1, int64_t n2, int64_t n3) {
@@ -1019,13 +2191,88 @@ static int get_transform_rank(int64_t n1, int64_t n2, int64_t n3) {
   return rank;
 }
 
+// Returns the size in bytes of the level-1 data cache or the level-2 cache,
+// as reported by the OS, or `default_size` if it cannot be determined.
+static int64_t get_data_cache_size(int level, int64_t default_size) {
+  long size = -1;  // NOLINT(runtime/int)
+  #if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+  size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+  #endif
+  return size > 0 ? size : default_size;
+}
 
-// We macro because it has no FloatType args but gets compiled for both prec's...
+// Chooses isotropic bin sizes such that the fine grid region touched by the
+// points in one bin, i.e. the bin padded by the kernel width, fits in half of
+// the L1 cache (1D) or half of the L2 cache (2D, 3D). The other half is left
+// for the point coordinates, strengths and kernel values.
 template<typename FloatType>
-void deconvolveshuffle1d(SpreadDirection dir, FloatType prefac,FloatType* ker, int64_t ms,
+void get_cache_adaptive_bin_sizes(int rank, int kernel_width,
+                                  double* bin_size_x, double* bin_size_y,
+                                  double* bin_size_z) {
+  static const int64_t l1_size = get_data_cache_size(1, 32 * 1024);
+  static const int64_t l2_size = get_data_cache_size(2, 256 * 1024);
+  int64_t cache_size = (rank == 1) ? l1_size : l2_size;
+  double num_values = cache_size / (2.0 * 2 * sizeof(FloatType));
+  double bin_size = std::floor(std::pow(num_values, 1.0 / rank)) - kernel_width;
+  bin_size = std::max(bin_size, 4.0);
+  *bin_size_x = bin_size;
+  *bin_size_y = (rank > 1) ? bin_size : 1.0;
+  *bin_size_z = (rank > 2) ? bin_size : 1.0;
+}
+
+// Spreads the lower 21 bits of `x` so that there are two zero bits between
+// each pair of consecutive bits.
+static inline uint64_t spread_bits_3d(uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffff;
+  x = (x | x << 16) & 0x1f0000ff0000ff;
+  x = (x | x << 8) & 0x100f00f00f00f00f;
+  x = (x | x << 4) & 0x10c30c30c30c30c3;
+  x = (x | x << 2) & 0x1249249249249249;
+  return x;
+}
+
+// Returns the position of each bin along a Morton (Z-order) curve through the
+// bin grid, indexed by the Cartesian bin index used in the bin sort. Bins
+// which are close along the curve are also close in space in all dimensions,
+// so consecutive bins reuse more of the cached fine grid than in Cartesian
+// order, where consecutive z-bins are far apart in memory.
+template<typename IndexType>
+std::vector<IndexType> get_morton_bin_order(
+    int64_t n1, int64_t n2, int64_t n3,
+    double bin_size_x, double bin_size_y, double bin_size_z) {
+  // Same number of bins as in the bin sort (see there for the +1).
+  IndexType nbins1 = n1 / bin_size_x + 1;
+  IndexType nbins2 = (n2 > 1) ? n2 / bin_size_y + 1 : 1;
+  IndexType nbins3 = (n3 > 1) ? n3 / bin_size_z + 1 : 1;
+  IndexType num_bins = nbins1 * nbins2 * nbins3;
+
+  std::vector<std::pair<uint64_t, IndexType>> codes(num_bins);
+  for (IndexType i3 = 0; i3 < nbins3; i3++) {
+    for (IndexType i2 = 0; i2 < nbins2; i2++) {
+      for (IndexType i1 = 0; i1 < nbins1; i1++) {
+        IndexType bin = i1 + nbins1 * (i2 + nbins2 * i3);
+        codes[bin].first = spread_bits_3d(i1) |
+                           spread_bits_3d(i2) << 1 |
+                           spread_bits_3d(i3) << 2;
+        codes[bin].second = bin;
+      }
+    }
+  }
+  std::sort(codes.begin(), codes.end());
+
+  std::vector<IndexType> order(num_bins);
+  for (IndexType i = 0; i < num_bins; i++)
+    order[codes[i].second] = i;
+  return order;
+}
+
+
+template<typename FloatType>
+void deconvolveshuffle1d(SpreadDirection dir, FloatType prefac, const FloatType* ker_inv, int64_t ms,
 			 FloatType *fk, int64_t nf1, typename fftw::ComplexType<FloatType>::Type* fw, ModeOrder mode_order)
 /*
-  if dir == SpreadDirection::SPREAD: copies fw to fk with amplification by prefac/ker
+  if dir == SpreadDirection::SPREAD: copies fw to fk with amplification by prefac*ker_inv
   if dir == SpreadDirection::INTERP: copies fk to fw (and zero pads rest of it), same amplification.
 
   mode_order=0: use CMCL-compatible mode ordering in fk (from -N/2 up to N/2-1)
@@ -1034,16 +2281,12 @@ void deconvolveshuffle1d(SpreadDirection dir, FloatType prefac,FloatType* ker, i
   fk is size-ms FloatType complex array (2*ms FloatTypes alternating re,im parts)
   fw is a FFTW style complex array, ie FloatType [nf1][2], essentially FloatTypes
        alternating re,im parts.
-  ker is real-valued FloatType array of length nf1/2+1.
-
-  Single thread only, but shouldn't matter since mostly data movement.
-
-  It has been tested that the repeated floating division in this inner loop
-  only contributes at the <3% level in 3D relative to the fftw cost (8 threads).
-  This could be removed by passing in an inverse kernel and doing mults.
+  ker_inv is real-valued FloatType array of length nf1/2+1, holding the
+       reciprocals of the kernel Fourier series coefficients.
 
-  todo: rewrite w/ C++-complex I/O, check complex divide not slower than
-        real divide, or is there a way to force a real divide?
+  Single thread only. Multidimensional grids are processed one row at a time
+  (see Plan::deconvolve_batch). The loops are simple enough to be vectorized
+  by the compiler.
 
   Barnett 1/25/17. Fixed ms=0 case 3/14/17. mode_order flag & clean 10/25/17
 */
@@ -1053,113 +2296,116 @@ void deconvolveshuffle1d(SpreadDirection dir, FloatType prefac,FloatType* ker, i
   // set up pp & pn as ptrs to start of pos(ie nonneg) & neg chunks of fk array
   int64_t pp = -2*kmin, pn = 0;       // CMCL mode-ordering case (2* since cmplx)
   if (mode_order==ModeOrder::FFT) { pp = 0; pn = 2*(kmax+1); }   // or, instead, FFT ordering
+  FloatType* fkp = fk + pp;               // non-neg freqs k
+  FloatType* fkn = fk + pn;               // neg freqs k, from kmin up
+  FloatType* fwp = reinterpret_cast<FloatType*>(fw);
+  FloatType* fwn = reinterpret_cast<FloatType*>(fw + nf1 + kmin);
   if (dir == SpreadDirection::SPREAD) {    // read fw, write out to fk...
-    for (int64_t k=0;k<=kmax;++k) {                    // non-neg freqs k
-      fk[pp++] = prefac * fw[k][0] / ker[k];          // re
-      fk[pp++] = prefac * fw[k][1] / ker[k];          // im
+    for (int64_t k=0;k<=kmax;++k) {
+      const FloatType scale = prefac * ker_inv[k];
+      fkp[2*k] = scale * fwp[2*k];          // re
+      fkp[2*k+1] = scale * fwp[2*k+1];      // im
     }
-    for (int64_t k=kmin;k<0;++k) {                     // neg freqs k
-      fk[pn++] = prefac * fw[nf1+k][0] / ker[-k];     // re
-      fk[pn++] = prefac * fw[nf1+k][1] / ker[-k];     // im
+    for (int64_t k=0;k<-kmin;++k) {
+      const FloatType scale = prefac * ker_inv[-kmin-k];
+      fkn[2*k] = scale * fwn[2*k];          // re
+      fkn[2*k+1] = scale * fwn[2*k+1];      // im
     }
   } else {    // read fk, write out to fw w/ zero padding...
     for (int64_t k=kmax+1; k<nf1+kmin; ++k) {  // zero pad precisely where needed
       fw[k][0] = fw[k][1] = 0.0; }
-    for (int64_t k=0;k<=kmax;++k) {                    // non-neg freqs k
-      fw[k][0] = prefac * fk[pp++] / ker[k];          // re
-      fw[k][1] = prefac * fk[pp++] / ker[k];          // im
+    for (int64_t k=0;k<=kmax;++k) {
+      const FloatType scale = prefac * ker_inv[k];
+      fwp[2*k] = scale * fkp[2*k];          // re
+      fwp[2*k+1] = scale * fkp[2*k+1];      // im
     }
-    for (int64_t k=kmin;k<0;++k) {                     // neg freqs k
-      fw[nf1+k][0] = prefac * fk[pn++] / ker[-k];     // re
-      fw[nf1+k][1] = prefac * fk[pn++] / ker[-k];     // im
+    for (int64_t k=0;k<-kmin;++k) {
+      const FloatType scale = prefac * ker_inv[-kmin-k];
+      fwn[2*k] = scale * fkn[2*k];          // re
+      fwn[2*k+1] = scale * fkn[2*k+1];      // im
     }
   }
 }
 
 template<typename FloatType>
-void deconvolveshuffle2d(SpreadDirection dir,FloatType prefac,FloatType *ker1, FloatType *ker2,
-			 int64_t ms, int64_t mt,
-			 FloatType *fk, int64_t nf1, int64_t nf2, typename fftw::ComplexType<FloatType>::Type* fw,
-			 ModeOrder mode_order)
+void deconvolveshuffle1d_modulated(
+    SpreadDirection dir, FloatType prefac, const FloatType* ker_inv, int64_t ms,
+    FloatType *fk, const FloatType *sens, int64_t nf1,
+    typename fftw::ComplexType<FloatType>::Type* fw, ModeOrder mode_order)
 /*
-  2D version of deconvolveshuffle1d, calls it on each x-line using 1/ker2 fac.
-
-  if dir == SpreadDirection::SPREAD: copies fw to fk with amplification by prefac/(ker1(k1)*ker2(k2)).
-  if dir == SpreadDirection::INTERP: copies fk to fw (and zero pads rest of it), same amplification.
-
-  mode_order=0: use CMCL-compatible mode ordering in fk (each rank increasing)
-          1: use FFT-style (pos then negative, on each rank)
-
-  fk is complex array stored as 2*ms*mt FloatTypes alternating re,im parts, with
-    ms looped over fast and mt slow.
-  fw is a FFTW style complex array, ie FloatType [nf1*nf2][2], essentially FloatTypes
-       alternating re,im parts; again nf1 is fast and nf2 slow.
-  ker1, ker2 are real-valued FloatType arrays of lengths nf1/2+1, nf2/2+1
-       respectively.
-
-  Barnett 2/1/17, Fixed mt=0 case 3/14/17. mode_order 10/25/17
+  Same as deconvolveshuffle1d, with the modes modulated by the complex array
+  sens, which has the layout of fk.
+  if dir == SpreadDirection::SPREAD: adds conj(sens) times the amplified fw to
+       fk.
+  if dir == SpreadDirection::INTERP: copies sens times fk to fw (and zero pads
+       rest of it), with the same amplification.
 */
 {
-  int64_t k2min = -mt/2, k2max = (mt-1)/2;    // inclusive range of k2 indices
-  if (mt==0) k2max=-1;           // fixes zero-pad for trivial no-mode case
-  // set up pp & pn as ptrs to start of pos(ie nonneg) & neg chunks of fk array
-  int64_t pp = -2*k2min*ms, pn = 0;   // CMCL mode-ordering case (2* since cmplx)
-  if (mode_order == ModeOrder::FFT) { pp = 0; pn = 2*(k2max+1)*ms; }  // or, instead, FFT ordering
-  if (dir == SpreadDirection::INTERP)               // zero pad needed x-lines (contiguous in memory)
-    for (int64_t j=nf1*(k2max+1); j<nf1*(nf2+k2min); ++j)  // sweeps all dims
-      fw[j][0] = fw[j][1] = 0.0;
-  for (int64_t k2=0;k2<=k2max;++k2, pp+=2*ms)          // non-neg y-freqs
-    // point fk and fw to the start of this y value's row (2* is for complex):
-    deconvolveshuffle1d(dir,prefac/ker2[k2],ker1,ms,fk + pp,nf1,&fw[nf1*k2],mode_order);
-  for (int64_t k2=k2min;k2<0;++k2, pn+=2*ms)           // neg y-freqs
-    deconvolveshuffle1d(dir,prefac/ker2[-k2],ker1,ms,fk + pn,nf1,&fw[nf1*(nf2+k2)],mode_order);
+  int64_t kmin = -ms/2, kmax = (ms-1)/2;
+  if (ms==0) kmax=-1;
+  int64_t pp = -2*kmin, pn = 0;
+  if (mode_order==ModeOrder::FFT) { pp = 0; pn = 2*(kmax+1); }
+  FloatType* fkp = fk + pp;
+  FloatType* fkn = fk + pn;
+  const FloatType* sp = sens + pp;
+  const FloatType* sn = sens + pn;
+  FloatType* fwp = reinterpret_cast<FloatType*>(fw);
+  FloatType* fwn = reinterpret_cast<FloatType*>(fw + nf1 + kmin);
+  if (dir == SpreadDirection::SPREAD) {
+    for (int64_t k=0;k<=kmax;++k) {
+      const FloatType scale = prefac * ker_inv[k];
+      const FloatType re = scale * fwp[2*k], im = scale * fwp[2*k+1];
+      fkp[2*k] += sp[2*k] * re + sp[2*k+1] * im;
+      fkp[2*k+1] += sp[2*k] * im - sp[2*k+1] * re;
+    }
+    for (int64_t k=0;k<-kmin;++k) {
+      const FloatType scale = prefac * ker_inv[-kmin-k];
+      const FloatType re = scale * fwn[2*k], im = scale * fwn[2*k+1];
+      fkn[2*k] += sn[2*k] * re + sn[2*k+1] * im;
+      fkn[2*k+1] += sn[2*k] * im - sn[2*k+1] * re;
+    }
+  } else {
+    for (int64_t k=kmax+1; k<nf1+kmin; ++k) {
+      fw[k][0] = fw[k][1] = 0.0; }
+    for (int64_t k=0;k<=kmax;++k) {
+      const FloatType scale = prefac * ker_inv[k];
+      fwp[2*k] = scale * (sp[2*k] * fkp[2*k] - sp[2*k+1] * fkp[2*k+1]);
+      fwp[2*k+1] = scale * (sp[2*k] * fkp[2*k+1] + sp[2*k+1] * fkp[2*k]);
+    }
+    for (int64_t k=0;k<-kmin;++k) {
+      const FloatType scale = prefac * ker_inv[-kmin-k];
+      fwn[2*k] = scale * (sn[2*k] * fkn[2*k] - sn[2*k+1] * fkn[2*k+1]);
+      fwn[2*k+1] = scale * (sn[2*k] * fkn[2*k+1] + sn[2*k+1] * fkn[2*k]);
+    }
+  }
 }
 
-template<typename FloatType>
-void deconvolveshuffle3d(SpreadDirection dir,FloatType prefac,FloatType *ker1, FloatType *ker2,
-			 FloatType *ker3, int64_t ms, int64_t mt, int64_t mu,
-			 FloatType *fk, int64_t nf1, int64_t nf2, int64_t nf3,
-			 typename fftw::ComplexType<FloatType>::Type* fw, ModeOrder mode_order)
-/*
-  3D version of deconvolveshuffle2d, calls it on each xy-plane using 1/ker3 fac.
-
-  if dir == SpreadDirection::SPREAD: copies fw to fk with ampl by prefac/(ker1(k1)*ker2(k2)*ker3(k3)).
-  if dir == SpreadDirection::INTERP: copies fk to fw (and zero pads rest of it), same amplification.
-
-  mode_order=0: use CMCL-compatible mode ordering in fk (each rank increasing)
-          1: use FFT-style (pos then negative, on each rank)
-
-  fk is complex array stored as 2*ms*mt*mu FloatTypes alternating re,im parts, with
-    ms looped over fastest and mu slowest.
-  fw is a FFTW style complex array, ie FloatType [nf1*nf2*nf3][2], effectively
-       FloatTypes alternating re,im parts; again nf1 is fastest and nf3 slowest.
-  ker1, ker2, ker3 are real-valued FloatType arrays of lengths nf1/2+1, nf2/2+1,
-       and nf3/2+1 respectively.
-
-  Barnett 2/1/17, Fixed mu=0 case 3/14/17. mode_order 10/25/17
-*/
-{
-  int64_t k3min = -mu/2, k3max = (mu-1)/2;    // inclusive range of k3 indices
-  if (mu==0) k3max=-1;           // fixes zero-pad for trivial no-mode case
-  // set up pp & pn as ptrs to start of pos(ie nonneg) & neg chunks of fk array
-  int64_t pp = -2*k3min*ms*mt, pn = 0; // CMCL mode-ordering (2* since cmplx)
-  if (mode_order == ModeOrder::FFT) { pp = 0; pn = 2*(k3max+1)*ms*mt; }  // or FFT ordering
-  int64_t np = nf1*nf2;  // # pts in an upsampled Fourier xy-plane
-  if (dir == SpreadDirection::INTERP)           // zero pad needed xy-planes (contiguous in memory)
-    for (int64_t j=np*(k3max+1);j<np*(nf3+k3min);++j)  // sweeps all dims
-      fw[j][0] = fw[j][1] = 0.0;
-  for (int64_t k3=0;k3<=k3max;++k3, pp+=2*ms*mt)      // non-neg z-freqs
-    // point fk and fw to the start of this z value's plane (2* is for complex):
-    deconvolveshuffle2d(dir,prefac/ker3[k3],ker1,ker2,ms,mt,
-			fk + pp,nf1,nf2,&fw[np*k3],mode_order);
-  for (int64_t k3=k3min;k3<0;++k3, pn+=2*ms*mt)       // neg z-freqs
-    deconvolveshuffle2d(dir,prefac/ker3[-k3],ker1,ker2,ms,mt,
-			fk + pn,nf1,nf2,&fw[np*(nf3+k3)],mode_order);
+// Maps index j of a fine grid dimension of size nf to the frequency k and to
+// the index of that frequency in a mode dimension of size m, using the given
+// mode order. Returns false if j is in the zero-padded part of the fine grid.
+static inline bool fine_to_mode_index(int64_t j, int64_t nf, int64_t m,
+                                      ModeOrder mode_order,
+                                      int64_t* k, int64_t* index) {
+  int64_t kmin = -m/2, kmax = (m-1)/2;
+  if (m == 0) kmax = -1;
+  if (j <= kmax)
+    *k = j;
+  else if (j >= nf + kmin)
+    *k = j - nf;
+  else
+    return false;
+  if (mode_order == ModeOrder::FFT)
+    *index = *k >= 0 ? *k : m + *k;
+  else
+    *index = *k - kmin;
+  return true;
 }
 
-template<typename FloatType>
-int spreadinterpSorted(int64_t* sort_indices, int64_t N1, int64_t N2, int64_t N3,
-		      FloatType *data_uniform, int64_t M, FloatType *kx, FloatType *ky, FloatType *kz,
+template<typename FloatType, typename IndexType>
+int spreadinterpSorted(const CPUDevice* device,
+                       IndexType* sort_indices, IndexType N1, IndexType N2, IndexType N3,
+		      FloatType *data_uniform, IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+		      int64_t points_stride,
 		      FloatType *data_nonuniform, SpreadParameters<FloatType> opts, int did_sort)
 /* Logic to select the main spreading (dir=1) vs interpolation (dir=2) routine.
    See spreadinterp() above for inputs arguments and definitions.
@@ -1168,30 +2414,34 @@ int spreadinterpSorted(int64_t* sort_indices, int64_t N1, int64_t N2, int64_t N3
 */
 {
   if (opts.spread_direction == SpreadDirection::SPREAD)
-    spreadSorted(sort_indices, N1, N2, N3, data_uniform, M, kx, ky, kz, data_nonuniform, opts, did_sort);
+    spreadSorted(device, sort_indices, N1, N2, N3, data_uniform, M, kx, ky, kz, points_stride, data_nonuniform, opts, did_sort);
   else // if (opts.spread_direction == SpreadDirection::INTERP)
-    interpSorted(sort_indices, N1, N2, N3, data_uniform, M, kx, ky, kz, data_nonuniform, opts, did_sort);
+    interpSorted(device, sort_indices, N1, N2, N3, data_uniform, M, kx, ky, kz, points_stride, data_nonuniform, opts, did_sort);
 
   return 0;
 }
 
 
 // --------------------------------------------------------------------------
-template<typename FloatType>
-int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
-		      FloatType *data_uniform,int64_t M, FloatType *kx, FloatType *ky, FloatType *kz,
+template<typename FloatType, typename IndexType>
+int spreadSorted(const CPUDevice* device,
+                 IndexType* sort_indices,IndexType N1, IndexType N2, IndexType N3,
+		      FloatType *data_uniform,IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+		      int64_t points_stride,
 		      FloatType *data_nonuniform, SpreadParameters<FloatType> opts, int did_sort)
 // Spread NU pts in sorted order to a uniform grid. See spreadinterp() for doc.
 {
   int ndims = get_transform_rank(N1,N2,N3);
-  int64_t N=N1*N2*N3;            // output array size
+  IndexType N=N1*N2*N3;            // output array size
   int ns=opts.kernel_width;          // abbrev. for w, kernel width
-  int nthr = OMP_GET_MAX_THREADS();  // # threads to use to spread
+  int nthr = get_num_threads(device);  // # threads to use to spread
   if (opts.num_threads>0)
     nthr = std::min(nthr,opts.num_threads);     // user override up to max avail
 
-  for (int64_t i=0; i<2*N; i++) // zero the output array. std::fill is no faster
-    data_uniform[i]=0.0;
+  if (!opts.accumulate) {
+    for (IndexType i=0; i<2*N; i++) // zero the output array. std::fill is no faster
+      data_uniform[i]=0.0;
+  }
 
   // If there are no non-uniform points, we're done.
   if (M == 0) return 0;
@@ -1199,7 +2449,7 @@ int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
   int spread_single = (nthr==1) || (M*100<N);     // low-density heuristic?
   spread_single = 0;                 // for now
   if (spread_single) {    // ------- Basic single-core t1 spreading ------
-    for (int64_t j=0; j<M; j++) {
+    for (IndexType j=0; j<M; j++) {
       // *** todo, not urgent
       // ... (question is: will the index wrapping per NU pt slow it down?)
     }
@@ -1207,12 +2457,12 @@ int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
   } else {           // ------- Fancy multi-core blocked t1 spreading ----
                      // Splits sorted inds (jfm's advanced2), could double RAM.
     // choose nb (# subprobs) via used num_threads:
-    int nb = std::min((int64_t)nthr,M);         // simply split one subprob per thr...
-    if (nb*(int64_t)opts.max_subproblem_size<M) {  // ...or more subprobs to cap size
+    int nb = std::min((IndexType)nthr,M);         // simply split one subprob per thr...
+    if (nb*(int64_t)opts.max_subproblem_size<(int64_t)M) {  // ...or more subprobs to cap size
       nb = 1 + (M-1)/opts.max_subproblem_size;  // int div does ceil(M/opts.max_subproblem_size)
       if (opts.verbosity) printf("\tcapping subproblem sizes to max of %d\n",opts.max_subproblem_size);
     }
-    if (M*1000<N) {         // low-density heuristic: one thread per NU pt!
+    if ((int64_t)M*1000<(int64_t)N) {         // low-density heuristic: one thread per NU pt!
       nb = M;
       if (opts.verbosity) printf("\tusing low-density speed rescue nb=M...\n");
     }
@@ -1221,13 +2471,13 @@ int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
       if (opts.verbosity) printf("\tunsorted nthr=1: forcing single subproblem...\n");
     }
 
-    std::vector<int64_t> brk(nb+1); // NU index breakpoints defining nb subproblems
+    std::vector<IndexType> brk(nb+1); // NU index breakpoints defining nb subproblems
     for (int p = 0; p <= nb; ++p)
-      brk[p] = (int64_t)(0.5 + M * p / (double)nb);
+      brk[p] = (IndexType)(0.5 + M * (double)p / nb);
 
-    #pragma omp parallel for num_threads(nthr) schedule(dynamic,1)  // each is big
-    for (int isub=0; isub<nb; isub++) {   // Main loop through the subproblems
-      int64_t M0 = brk[isub+1]-brk[isub];  // # NU pts in this subproblem
+    std::mutex add_mutex;  // guards the non-atomic adds to the output
+    parallel_tasks(device, nb, [&](int isub) {  // Main loop through the subproblems
+      IndexType M0 = brk[isub+1]-brk[isub];  // # NU pts in this subproblem
       // copy the location and data vectors for the nonuniform points
       FloatType *kx0=(FloatType*)malloc(sizeof(FloatType)*M0), *ky0=nullptr, *kz0=nullptr;
       if (N2>1)
@@ -1235,13 +2485,17 @@ int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
       if (N3>1)
         kz0=(FloatType*)malloc(sizeof(FloatType)*M0);
       FloatType *dd0=(FloatType*)malloc(sizeof(FloatType)*M0*2);    // complex strength data
-      for (int64_t j=0; j<M0; j++) {           // todo: can avoid this copying?
-        int64_t kk=sort_indices[j+brk[isub]];  // NU pt from subprob index list
-        kx0[j]=FOLD_AND_RESCALE(kx[kk],N1,opts.pirange);
-        if (N2>1) ky0[j]=FOLD_AND_RESCALE(ky[kk],N2,opts.pirange);
-        if (N3>1) kz0[j]=FOLD_AND_RESCALE(kz[kk],N3,opts.pirange);
+      for (IndexType j=0; j<M0; j++) {           // todo: can avoid this copying?
+        IndexType kk=sort_indices[j+brk[isub]];  // NU pt from subprob index list
+        kx0[j]=FOLD_AND_RESCALE(kx[kk*points_stride],N1,opts.pirange);
+        if (N2>1) ky0[j]=FOLD_AND_RESCALE(ky[kk*points_stride],N2,opts.pirange);
+        if (N3>1) kz0[j]=FOLD_AND_RESCALE(kz[kk*points_stride],N3,opts.pirange);
         dd0[j*2]=data_nonuniform[kk*2];     // real part
         dd0[j*2+1]=data_nonuniform[kk*2+1]; // imag part
+        if (opts.point_weights) {
+          dd0[j*2] *= opts.point_weights[kk];
+          dd0[j*2+1] *= opts.point_weights[kk];
+        }
       }
       // get the subgrid which will include padding by roughly kernel_width/2
       int64_t offset1,offset2,offset3,size1,size2,size3; // get_subgrid sets
@@ -1262,7 +2516,7 @@ int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
       if (nthr > opts.atomic_threshold)   // see above for debug reporting
         add_wrapped_subgrid_thread_safe(offset1,offset2,offset3,size1,size2,size3,N1,N2,N3,data_uniform,du0);   // R Blackwell's atomic version
       else {
-        #pragma omp critical
+        std::lock_guard<std::mutex> lock(add_mutex);
         add_wrapped_subgrid(offset1,offset2,offset3,size1,size2,size3,N1,N2,N3,data_uniform,du0);
       }
 
@@ -1272,12 +2526,12 @@ int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
       free(kx0);
       if (N2 > 1) free(ky0);
       if (N3 > 1) free(kz0);
-    }     // end main loop over subprobs
+    });     // end main loop over subprobs
   }   // end of choice of which t1 spread type to use
 
   // in spread/interp only mode, apply scaling factor (Montalt 6/8/2021).
   if (opts.spread_only) {
-    for (int64_t i = 0; i < 2*N; i++)
+    for (IndexType i = 0; i < 2*N; i++)
       data_uniform[i] *= opts.kernel_scale;
   }
 
@@ -1286,9 +2540,11 @@ int spreadSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
 
 
 // --------------------------------------------------------------------------
-template<typename FloatType>
-int interpSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
-		      FloatType *data_uniform,int64_t M, FloatType *kx, FloatType *ky, FloatType *kz,
+template<typename FloatType, typename IndexType>
+int interpSorted(const CPUDevice* device,
+                 IndexType* sort_indices,IndexType N1, IndexType N2, IndexType N3,
+		      FloatType *data_uniform,IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+		      int64_t points_stride,
 		      FloatType *data_nonuniform, SpreadParameters<FloatType> opts, int did_sort)
 // Interpolate to NU pts in sorted order from a uniform grid.
 // See spreadinterp() for doc.
@@ -1296,14 +2552,19 @@ int interpSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
   int ndims = get_transform_rank(N1,N2,N3);
   int ns=opts.kernel_width;          // abbrev. for w, kernel width
   FloatType ns2 = (FloatType)ns/2;          // half spread width, used as stencil shift
-  int nthr = OMP_GET_MAX_THREADS();   // # threads to use to interp
-  if (opts.num_threads > 0)
-    nthr = std::min(nthr, opts.num_threads);
-
-  #pragma omp parallel num_threads(nthr)
-  {
-    #define CHUNK_SIZE 16     // Chunks of Type 2 targets (Ludvig found by expt)
-    int64_t jlist[CHUNK_SIZE];
+  #define CHUNK_SIZE 16     // Chunks of Type 2 targets (Ludvig found by expt)
+  // Each chunk evaluates the kernel and reads a patch of ns^ndims grid points
+  // for each of its targets.
+  int64_t patch_size = 1;
+  for (int d = 0; d < ndims; d++) patch_size *= ns;
+  const Eigen::TensorOpCost chunk_cost(
+      CHUNK_SIZE * (patch_size * 2 * sizeof(FloatType) + sizeof(IndexType)),
+      CHUNK_SIZE * 2 * sizeof(FloatType), CHUNK_SIZE * (patch_size * 4 + 50));
+  IndexType num_chunks = (M + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  parallel_for(device, num_chunks, chunk_cost,
+               [&](int64_t first_chunk, int64_t last_chunk) {
+    IndexType jlist[CHUNK_SIZE];
     FloatType xjlist[CHUNK_SIZE], yjlist[CHUNK_SIZE], zjlist[CHUNK_SIZE];
     FloatType outbuf[2 * CHUNK_SIZE];
     // Kernels: static alloc is faster, so we do it for up to 3D...
@@ -1314,18 +2575,17 @@ int interpSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
     FloatType *ker3 = kernel_values + 2 * ns;
 
     // Loop over interpolation chunks
-    #pragma omp for schedule (dynamic,1000)  // assign threads to NU targ pts:
-    for (int64_t i=0; i<M; i+=CHUNK_SIZE) { // main loop over NU targs, interp each from U
+    for (IndexType i=first_chunk*CHUNK_SIZE; i<std::min<IndexType>(M, last_chunk*CHUNK_SIZE); i+=CHUNK_SIZE) { // main loop over NU targs, interp each from U
       // Setup buffers for this chunk
       int bufsize = (i+CHUNK_SIZE > M) ? M-i : CHUNK_SIZE;
       for (int ibuf=0; ibuf<bufsize; ibuf++) {
-        int64_t j = sort_indices[i+ibuf];
+        IndexType j = sort_indices[i+ibuf];
         jlist[ibuf] = j;
-        xjlist[ibuf] = FOLD_AND_RESCALE(kx[j],N1,opts.pirange);
+        xjlist[ibuf] = FOLD_AND_RESCALE(kx[j*points_stride],N1,opts.pirange);
         if(ndims >=2)
-          yjlist[ibuf] = FOLD_AND_RESCALE(ky[j],N2,opts.pirange);
+          yjlist[ibuf] = FOLD_AND_RESCALE(ky[j*points_stride],N2,opts.pirange);
         if(ndims == 3)
-          zjlist[ibuf] = FOLD_AND_RESCALE(kz[j],N3,opts.pirange);
+          zjlist[ibuf] = FOLD_AND_RESCALE(kz[j*points_stride],N3,opts.pirange);
       }
 
       // Loop over targets in chunk
@@ -1337,9 +2597,9 @@ int interpSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
         FloatType *target = outbuf+2*ibuf;
 
         // coords (x,y,z), spread block corner index (i1,i2,i3) of current NU targ
-        int64_t i1=(int64_t)std::ceil(xj-ns2); // leftmost grid index
-        int64_t i2= (ndims > 1) ? (int64_t)std::ceil(yj-ns2) : 0; // min y grid index
-        int64_t i3= (ndims > 1) ? (int64_t)std::ceil(zj-ns2) : 0; // min z grid index
+        IndexType i1=(IndexType)std::ceil(xj-ns2); // leftmost grid index
+        IndexType i2= (ndims > 1) ? (IndexType)std::ceil(yj-ns2) : 0; // min y grid index
+        IndexType i3= (ndims > 1) ? (IndexType)std::ceil(zj-ns2) : 0; // min z grid index
 
         FloatType x1=(FloatType)i1-xj;           // shift of ker center, in [-w/2,-w/2+1]
         FloatType x2= (ndims > 1) ? (FloatType)i2-yj : 0 ;
@@ -1381,17 +2641,385 @@ int interpSorted(int64_t* sort_indices,int64_t N1, int64_t N2, int64_t N3,
 
       // Copy result buffer to output array
       for (int ibuf=0; ibuf<bufsize; ibuf++) {
-        int64_t j = jlist[ibuf];
-        data_nonuniform[2*j] = outbuf[2*ibuf];
-        data_nonuniform[2*j+1] = outbuf[2*ibuf+1];
+        IndexType j = jlist[ibuf];
+        FloatType weight = opts.point_weights ? opts.point_weights[j] : 1;
+        data_nonuniform[2*j] = outbuf[2*ibuf] * weight;
+        data_nonuniform[2*j+1] = outbuf[2*ibuf+1] * weight;
       }
 
     }  // end NU targ loop
-  }  // end parallel section
+  });  // end parallel section
 
   return 0;
 };
 
+template<typename FloatType, typename IndexType>
+void interpGradSorted(const CPUDevice* device,
+                      IndexType* sort_indices, IndexType N1, IndexType N2, IndexType N3,
+                      int batch_size, FloatType *data_uniform,
+                      const int64_t* f_offsets,
+                      FloatType *data_nonuniform, const int64_t* c_offsets,
+                      IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+                      int64_t points_stride,
+                      FloatType *grad_x, FloatType *grad_y, FloatType *grad_z,
+                      bool accumulate, const SpreadParameters<FloatType>& opts)
+// Interpolate the gradient with respect to the NU pts from a batch of uniform
+// grids, in sorted order. The uniform grid of transform i starts at
+// data_uniform + 2*f_offsets[i] (or 2*i*N1*N2*N3 if f_offsets is null), and
+// its NU weights at data_nonuniform + 2*c_offsets[i] (or 2*i*M if c_offsets is
+// null). The gradient of
+// sum_i Re(weight_i[j] * interp_i(x_j)) with respect to x_j is written to (or,
+// if accumulate is true, added to) grad_x, grad_y and grad_z, which have the
+// same strided layout as kx, ky and kz.
+// The kernel values and derivatives are evaluated once per NU pt and shared by
+// all the transforms in the batch, and all the partial derivatives are read
+// from the same ns^ndims patch of each grid.
+{
+  int ndims = get_transform_rank(N1,N2,N3);
+  int ns=opts.kernel_width;          // abbrev. for w, kernel width
+  FloatType ns2 = (FloatType)ns/2;          // half spread width, used as stencil shift
+  IndexType N[3] = {N1, N2, N3};
+  FloatType *k[3] = {kx, ky, kz};
+  FloatType *grad[3] = {grad_x, grad_y, grad_z};
+  // The kernel argument is (grid index - rescaled NU coordinate), so its
+  // derivative with respect to the NU coordinate is minus that of the rescaling.
+  FloatType scale[3];
+  for (int d = 0; d < ndims; d++) {
+    scale[d] = opts.pirange ? -N[d] * kOneOverTwoPi<FloatType> : -1.0;
+    // in spread/interp only mode, apply scaling factor (Montalt 6/8/2021).
+    if (opts.spread_only) scale[d] *= opts.kernel_scale;
+  }
+  int64_t grid_size = (int64_t)N1 * N2 * N3;
+
+  int64_t patch_size = 1;
+  for (int d = 0; d < ndims; d++) patch_size *= ns;
+  const Eigen::TensorOpCost chunk_cost(
+      CHUNK_SIZE * batch_size * patch_size * 4 * sizeof(FloatType),
+      CHUNK_SIZE * ndims * sizeof(FloatType),
+      CHUNK_SIZE * (batch_size * patch_size * 8 + 100));
+  IndexType num_chunks = (M + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  parallel_for(device, num_chunks, chunk_cost,
+               [&](int64_t first_chunk, int64_t last_chunk) {
+    FloatType kernel_args[MAX_KERNEL_WIDTH];
+    // Kernel values, kernel derivatives and wrapped grid indices along each
+    // dimension. Unused dimensions have a single grid point with unit weight.
+    FloatType ker[3][MAX_KERNEL_WIDTH] = {{1.0}, {1.0}, {1.0}};
+    FloatType dker[3][MAX_KERNEL_WIDTH] = {{0.0}, {0.0}, {0.0}};
+    IndexType idx[3][MAX_KERNEL_WIDTH] = {{0}, {0}, {0}};
+    int width[3] = {ns, ndims > 1 ? ns : 1, ndims > 2 ? ns : 1};
+
+    for (IndexType i = first_chunk * CHUNK_SIZE;
+         i < std::min<IndexType>(M, last_chunk * CHUNK_SIZE); i++) {
+      IndexType j = sort_indices[i];
+      for (int d = 0; d < ndims; d++) {
+        FloatType xj = FOLD_AND_RESCALE(k[d][j*points_stride],N[d],opts.pirange);
+        IndexType i0 = (IndexType)std::ceil(xj-ns2);  // leftmost grid index
+        FloatType x0 = (FloatType)i0-xj;              // in [-w/2,-w/2+1]
+        if (opts.kerevalmeth==0) {
+          set_kernel_args(kernel_args, x0, opts);
+          evaluate_kernel_vector(ker[d], kernel_args, opts, ns);
+          evaluate_kernel_deriv_vector(dker[d], kernel_args, opts, ns);
+        } else {
+          eval_kernel_vec_Horner(ker[d],x0,ns,opts);
+          eval_kernel_deriv_vec_Horner(dker[d],x0,ns,opts);
+        }
+        for (int dx = 0; dx < ns; dx++) {
+          IndexType x = i0 + dx;
+          if (x < 0) x += N[d];
+          if (x >= N[d]) x -= N[d];
+          idx[d][dx] = x;
+        }
+      }
+
+      FloatType result[3] = {0.0, 0.0, 0.0};
+      for (int t = 0; t < batch_size; t++) {
+        const FloatType *du = data_uniform +
+            2 * (f_offsets ? f_offsets[t] : (int64_t)t * grid_size);
+        const FloatType *c = data_nonuniform + 2 * j +
+            2 * (c_offsets ? c_offsets[t] : (int64_t)t * M);
+        // Partial derivatives of the interpolated value (complex).
+        FloatType g[3][2] = {{0.0, 0.0}, {0.0, 0.0}, {0.0, 0.0}};
+        for (int dz = 0; dz < width[2]; dz++) {
+          for (int dy = 0; dy < width[1]; dy++) {
+            const FloatType *row = du + 2 * (int64_t)N1 * (idx[1][dy] + (int64_t)N2 * idx[2][dz]);
+            // Sums along the row, weighted by the kernel and its derivative.
+            FloatType s[2] = {0.0, 0.0}, ds[2] = {0.0, 0.0};
+            for (int dx = 0; dx < ns; dx++) {
+              const FloatType *v = row + 2 * idx[0][dx];
+              s[0] += v[0] * ker[0][dx];
+              s[1] += v[1] * ker[0][dx];
+              ds[0] += v[0] * dker[0][dx];
+              ds[1] += v[1] * dker[0][dx];
+            }
+            FloatType k23 = ker[1][dy] * ker[2][dz];
+            FloatType dk2 = dker[1][dy] * ker[2][dz];
+            FloatType dk3 = ker[1][dy] * dker[2][dz];
+            g[0][0] += ds[0] * k23;
+            g[0][1] += ds[1] * k23;
+            g[1][0] += s[0] * dk2;
+            g[1][1] += s[1] * dk2;
+            g[2][0] += s[0] * dk3;
+            g[2][1] += s[1] * dk3;
+          }
+        }
+        for (int d = 0; d < ndims; d++)
+          result[d] += c[0] * g[d][0] - c[1] * g[d][1];
+      }
+
+      for (int d = 0; d < ndims; d++) {
+        FloatType value = scale[d] * result[d];
+        if (accumulate)
+          grad[d][j*points_stride] += value;
+        else
+          grad[d][j*points_stride] = value;
+      }
+    }
+  });
+}
+
+template<typename FloatType, typename IndexType>
+void spreadTangentSorted(const CPUDevice* device,
+                         IndexType* sort_indices, IndexType N1, IndexType N2, IndexType N3,
+                         FloatType *data_uniform, IndexType M,
+                         FloatType *kx, FloatType *ky, FloatType *kz,
+                         int64_t points_stride,
+                         FloatType *data_nonuniform, FloatType *data_tangent,
+                         FloatType *tx, FloatType *ty, FloatType *tz,
+                         const SpreadParameters<FloatType>& opts)
+// Spread the tangent of a spreading in sorted order to a uniform grid, i.e.
+// write
+// sum_j [tangent_j phi(x_j) + strength_j sum_d td[j] d phi(x_j) / dx_d[j]]
+// to data_uniform, where the NU strengths are in data_nonuniform, their
+// tangents in data_tangent, and the tangents td of the NU pts in tx, ty and tz
+// (with the same strided layout as kx, ky and kz). The kernel values and
+// derivatives are evaluated once per NU pt, and the value and the partial
+// derivatives are spread in a single pass over its ns^ndims patch. Uses the
+// same subproblems as spreadSorted.
+{
+  int ndims = get_transform_rank(N1,N2,N3);
+  IndexType N=N1*N2*N3;            // output array size
+  int ns=opts.kernel_width;          // abbrev. for w, kernel width
+  FloatType ns2 = (FloatType)ns/2;          // half spread width
+  IndexType Nd[3] = {N1, N2, N3};
+  FloatType *k[3] = {kx, ky, kz};
+  FloatType *t[3] = {tx, ty, tz};
+  // See interpGradSorted.
+  FloatType scale[3];
+  for (int d = 0; d < ndims; d++)
+    scale[d] = opts.pirange ? -Nd[d] * kOneOverTwoPi<FloatType> : -1.0;
+  int nthr = get_num_threads(device);  // # threads to use to spread
+  if (opts.num_threads>0)
+    nthr = std::min(nthr,opts.num_threads);     // user override up to max avail
+
+  std::fill_n(data_uniform, 2*N, FloatType(0.0));
+  if (M == 0) return;
+
+  int nb = std::min((IndexType)nthr,M);         // one subprob per thr...
+  if (nb*(int64_t)opts.max_subproblem_size<(int64_t)M)  // ...or more to cap size
+    nb = 1 + (M-1)/opts.max_subproblem_size;
+  std::vector<IndexType> brk(nb+1); // NU index breakpoints defining nb subproblems
+  for (int p = 0; p <= nb; ++p)
+    brk[p] = (IndexType)(0.5 + M * (double)p / nb);
+
+  std::mutex add_mutex;  // guards the non-atomic adds to the output
+  parallel_tasks(device, nb, [&](int isub) {
+    IndexType M0 = brk[isub+1]-brk[isub];  // # NU pts in this subproblem
+    std::vector<FloatType> x0[3];          // rescaled NU coordinates
+    for (int d = 0; d < ndims; d++) {
+      x0[d].resize(M0);
+      for (IndexType j=0; j<M0; j++) {
+        IndexType kk=sort_indices[j+brk[isub]];
+        x0[d][j]=FOLD_AND_RESCALE(k[d][kk*points_stride],Nd[d],opts.pirange);
+      }
+    }
+    int64_t offset[3], size[3];
+    get_subgrid(offset[0],offset[1],offset[2],size[0],size[1],size[2],
+                (int64_t)M0,x0[0].data(),x0[1].data(),x0[2].data(),ns,ndims);
+    std::vector<FloatType> du0(2*size[0]*size[1]*size[2], FloatType(0.0));
+
+    FloatType kernel_args[MAX_KERNEL_WIDTH];
+    // Kernel values and derivatives along each dimension, and the start of
+    // the patch in the subgrid. Unused dimensions have a single grid point
+    // with unit weight.
+    FloatType ker[3][MAX_KERNEL_WIDTH] = {{1.0}, {1.0}, {1.0}};
+    FloatType dker[3][MAX_KERNEL_WIDTH] = {{0.0}, {0.0}, {0.0}};
+    int64_t start[3] = {0, 0, 0};
+    int width[3] = {ns, ndims > 1 ? ns : 1, ndims > 2 ? ns : 1};
+
+    for (IndexType j=0; j<M0; j++) {
+      IndexType kk=sort_indices[j+brk[isub]];
+      // Coefficients of the kernel (v) and of its partial derivatives (a).
+      FloatType v[2] = {data_tangent[2*kk], data_tangent[2*kk+1]};
+      FloatType a[3][2] = {{0.0, 0.0}, {0.0, 0.0}, {0.0, 0.0}};
+      for (int d = 0; d < ndims; d++) {
+        // ceil offset, hence rounding, must match that in get_subgrid...
+        int64_t i0 = (int64_t)std::ceil(x0[d][j] - ns2);
+        FloatType z = (FloatType)i0 - x0[d][j];
+        if (z<-ns2) z=-ns2;
+        if (z>-ns2+1) z=-ns2+1;
+        if (opts.kerevalmeth==0) {
+          set_kernel_args(kernel_args, z, opts);
+          evaluate_kernel_vector(ker[d], kernel_args, opts, ns);
+          evaluate_kernel_deriv_vector(dker[d], kernel_args, opts, ns);
+        } else {
+          eval_kernel_vec_Horner(ker[d],z,ns,opts);
+          eval_kernel_deriv_vec_Horner(dker[d],z,ns,opts);
+        }
+        start[d] = i0 - offset[d];
+        FloatType td = scale[d] * t[d][kk*points_stride];
+        a[d][0] = data_nonuniform[2*kk] * td;
+        a[d][1] = data_nonuniform[2*kk+1] * td;
+      }
+
+      for (int dz = 0; dz < width[2]; dz++) {
+        for (int dy = 0; dy < width[1]; dy++) {
+          FloatType k23 = ker[1][dy] * ker[2][dz];
+          FloatType dk2 = dker[1][dy] * ker[2][dz];
+          FloatType dk3 = ker[1][dy] * dker[2][dz];
+          // Coefficients of the kernel and of its derivative along the row.
+          FloatType p[2], q[2];
+          p[0] = v[0] * k23 + a[1][0] * dk2 + a[2][0] * dk3;
+          p[1] = v[1] * k23 + a[1][1] * dk2 + a[2][1] * dk3;
+          q[0] = a[0][0] * k23;
+          q[1] = a[0][1] * k23;
+          FloatType *row = du0.data() + 2 * (start[0] + size[0] *
+              ((start[1] + dy) + size[1] * (start[2] + dz)));
+          for (int dx = 0; dx < ns; dx++) {
+            row[2*dx] += p[0] * ker[0][dx] + q[0] * dker[0][dx];
+            row[2*dx+1] += p[1] * ker[0][dx] + q[1] * dker[0][dx];
+          }
+        }
+      }
+    }
+
+    if (nthr > opts.atomic_threshold) {
+      add_wrapped_subgrid_thread_safe(offset[0],offset[1],offset[2],
+                                      size[0],size[1],size[2],
+                                      (int64_t)N1,(int64_t)N2,(int64_t)N3,
+                                      data_uniform,du0.data());
+    } else {
+      std::lock_guard<std::mutex> lock(add_mutex);
+      add_wrapped_subgrid(offset[0],offset[1],offset[2],
+                          size[0],size[1],size[2],
+                          (int64_t)N1,(int64_t)N2,(int64_t)N3,
+                          data_uniform,du0.data());
+    }
+  });
+}
+
+template<typename FloatType, typename IndexType>
+void interpTangentSorted(const CPUDevice* device,
+                         IndexType* sort_indices, IndexType N1, IndexType N2, IndexType N3,
+                         int batch_size, FloatType *data_uniform,
+                         FloatType *data_uniform_tangent,
+                         FloatType *data_nonuniform, const int64_t* c_offsets,
+                         IndexType M, FloatType *kx, FloatType *ky, FloatType *kz,
+                         int64_t points_stride,
+                         FloatType *tx, FloatType *ty, FloatType *tz,
+                         const SpreadParameters<FloatType>& opts)
+// Interpolate the tangent of an interpolation from a batch of uniform grids,
+// in sorted order. For each transform i, write
+// interp(g'_i)(x_j) + sum_d td[j] d interp(g_i)(x_j) / dx_d[j]
+// to data_nonuniform + 2*c_offsets[i] (or 2*i*M if c_offsets is null), where
+// the uniform grids g_i and their tangents g'_i are contiguous in data_uniform
+// and data_uniform_tangent, and the tangents td of the NU pts are in tx, ty
+// and tz (with the same strided layout as kx, ky and kz). The value and the
+// partial derivatives are read in a single pass over the ns^ndims patch of
+// each NU pt.
+{
+  int ndims = get_transform_rank(N1,N2,N3);
+  int ns=opts.kernel_width;          // abbrev. for w, kernel width
+  FloatType ns2 = (FloatType)ns/2;          // half spread width, used as stencil shift
+  IndexType N[3] = {N1, N2, N3};
+  FloatType *k[3] = {kx, ky, kz};
+  FloatType *t[3] = {tx, ty, tz};
+  // See interpGradSorted.
+  FloatType scale[3];
+  for (int d = 0; d < ndims; d++)
+    scale[d] = opts.pirange ? -N[d] * kOneOverTwoPi<FloatType> : -1.0;
+  int64_t grid_size = (int64_t)N1 * N2 * N3;
+
+  int64_t patch_size = 1;
+  for (int d = 0; d < ndims; d++) patch_size *= ns;
+  const Eigen::TensorOpCost chunk_cost(
+      CHUNK_SIZE * batch_size * patch_size * 4 * sizeof(FloatType),
+      CHUNK_SIZE * batch_size * 2 * sizeof(FloatType),
+      CHUNK_SIZE * (batch_size * patch_size * 6 + 100));
+  IndexType num_chunks = (M + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+  parallel_for(device, num_chunks, chunk_cost,
+               [&](int64_t first_chunk, int64_t last_chunk) {
+    FloatType kernel_args[MAX_KERNEL_WIDTH];
+    // Kernel values, kernel derivatives and wrapped grid indices along each
+    // dimension. Unused dimensions have a single grid point with unit weight.
+    FloatType ker[3][MAX_KERNEL_WIDTH] = {{1.0}, {1.0}, {1.0}};
+    FloatType dker[3][MAX_KERNEL_WIDTH] = {{0.0}, {0.0}, {0.0}};
+    IndexType idx[3][MAX_KERNEL_WIDTH] = {{0}, {0}, {0}};
+    int width[3] = {ns, ndims > 1 ? ns : 1, ndims > 2 ? ns : 1};
+
+    for (IndexType i = first_chunk * CHUNK_SIZE;
+         i < std::min<IndexType>(M, last_chunk * CHUNK_SIZE); i++) {
+      IndexType j = sort_indices[i];
+      FloatType td[3] = {0.0, 0.0, 0.0};
+      for (int d = 0; d < ndims; d++) {
+        FloatType xj = FOLD_AND_RESCALE(k[d][j*points_stride],N[d],opts.pirange);
+        IndexType i0 = (IndexType)std::ceil(xj-ns2);  // leftmost grid index
+        FloatType x0 = (FloatType)i0-xj;              // in [-w/2,-w/2+1]
+        if (opts.kerevalmeth==0) {
+          set_kernel_args(kernel_args, x0, opts);
+          evaluate_kernel_vector(ker[d], kernel_args, opts, ns);
+          evaluate_kernel_deriv_vector(dker[d], kernel_args, opts, ns);
+        } else {
+          eval_kernel_vec_Horner(ker[d],x0,ns,opts);
+          eval_kernel_deriv_vec_Horner(dker[d],x0,ns,opts);
+        }
+        for (int dx = 0; dx < ns; dx++) {
+          IndexType x = i0 + dx;
+          if (x < 0) x += N[d];
+          if (x >= N[d]) x -= N[d];
+          idx[d][dx] = x;
+        }
+        td[d] = scale[d] * t[d][j*points_stride];
+      }
+
+      for (int b = 0; b < batch_size; b++) {
+        const FloatType *du = data_uniform + 2 * b * grid_size;
+        const FloatType *dv = data_uniform_tangent + 2 * b * grid_size;
+        FloatType out[2] = {0.0, 0.0};
+        for (int dz = 0; dz < width[2]; dz++) {
+          for (int dy = 0; dy < width[1]; dy++) {
+            int64_t row = 2 * (int64_t)N1 * (idx[1][dy] + (int64_t)N2 * idx[2][dz]);
+            // Sums along the row: the tangent grid weighted by the kernel,
+            // and the grid weighted by the kernel and by its derivative.
+            FloatType sv[2] = {0.0, 0.0}, s[2] = {0.0, 0.0}, ds[2] = {0.0, 0.0};
+            for (int dx = 0; dx < ns; dx++) {
+              const FloatType *u = du + row + 2 * idx[0][dx];
+              const FloatType *v = dv + row + 2 * idx[0][dx];
+              sv[0] += v[0] * ker[0][dx];
+              sv[1] += v[1] * ker[0][dx];
+              s[0] += u[0] * ker[0][dx];
+              s[1] += u[1] * ker[0][dx];
+              ds[0] += u[0] * dker[0][dx];
+              ds[1] += u[1] * dker[0][dx];
+            }
+            FloatType k23 = ker[1][dy] * ker[2][dz];
+            FloatType wd = k23 * td[0];
+            FloatType ws = dker[1][dy] * ker[2][dz] * td[1] +
+                           ker[1][dy] * dker[2][dz] * td[2];
+            out[0] += sv[0] * k23 + ds[0] * wd + s[0] * ws;
+            out[1] += sv[1] * k23 + ds[1] * wd + s[1] * ws;
+          }
+        }
+        FloatType *c = data_nonuniform + 2 * j +
+            2 * (c_offsets ? c_offsets[b] : (int64_t)b * M);
+        c[0] = out[0];
+        c[1] = out[1];
+      }
+    }
+  });
+}
+
 ///////////////////////////////////////////////////////////////////////////
 
 template<typename FloatType>
@@ -1460,7 +3088,45 @@ static inline void eval_kernel_vec_Horner(FloatType *ker, const FloatType x, con
 }
 
 template<typename FloatType>
-void interp_line(FloatType *target,FloatType *du, FloatType *ker,int64_t i1,int64_t N1,int ns)
+static inline void evaluate_kernel_deriv_vector(FloatType *dker, FloatType *args, const SpreadParameters<FloatType>& opts, const int N)
+/* Evaluate the derivative of the ES kernel for a vector of N arguments, as
+   evaluate_kernel_vector. The derivative is unbounded at the edges of the
+   support, where it is set to zero. */
+{
+  FloatType b = opts.kernel_beta;
+  FloatType c = opts.kernel_c;
+  for (int i = 0; i < N; i++) {
+    FloatType r = 1.0 - c * args[i] * args[i];
+    if (r <= 0.0 || abs(args[i]) >= opts.kernel_half_width) {
+      dker[i] = 0.0;
+    } else {
+      FloatType root = sqrt(r);
+      dker[i] = -exp(b * root) * b * c * args[i] / root;
+    }
+  }
+}
+
+template<typename FloatType>
+static inline void eval_kernel_deriv_vec_Horner(FloatType *dker, const FloatType x, const int w,
+            const SpreadParameters<FloatType> &opts)
+/* Fill dker[] with the derivatives with respect to x of the Horner kernel
+   approximation of eval_kernel_vec_Horner, at x_j = x + j, for j=0,..,w-1. */
+{
+  FloatType z = 2 * x + w - 1.0;         // scale so local grid offset z in [-1,1]
+  // insert the auto-generated code which expects z, w args, writes to dker...
+  if (opts.upsampling_factor == 2.0) {     // floating point equality is fine here
+    #include "kernel_horner_deriv_sigma2.inc"
+  } else if (opts.upsampling_factor == 1.25) {
+    #include "kernel_horner_deriv_sigma125.inc"
+  } else
+    fprintf(stderr,"%s: unknown upsampling_factor, failed!\n",__func__);
+  // dz/dx = 2.
+  for (int i = 0; i < w; i++)
+    dker[i] *= 2;
+}
+
+template<typename FloatType, typename IndexType>
+void interp_line(FloatType *target,FloatType *du, FloatType *ker,IndexType i1,IndexType N1,int ns)
 // 1D interpolate complex values from du array to out, using real weights
 // ker[0] through ker[ns-1]. out must be size 2 (real,imag), and du
 // of size 2*N1 (alternating real,imag). i1 is the left-most index in [0,N1)
@@ -1469,7 +3135,7 @@ void interp_line(FloatType *target,FloatType *du, FloatType *ker,int64_t i1,int6
 // Barnett 6/15/17
 {
   FloatType out[] = {0.0, 0.0};
-  int64_t j = i1;
+  IndexType j = i1;
   if (i1<0) {                               // wraps at left
     j+=N1;
     for (int dx=0; dx<-i1; ++dx) {
@@ -1506,8 +3172,8 @@ void interp_line(FloatType *target,FloatType *du, FloatType *ker,int64_t i1,int6
   target[1] = out[1];
 }
 
-template<typename FloatType>
-void interp_square(FloatType *target,FloatType *du, FloatType *ker1, FloatType *ker2, int64_t i1,int64_t i2,int64_t N1,int64_t N2,int ns)
+template<typename FloatType, typename IndexType>
+void interp_square(FloatType *target,FloatType *du, FloatType *ker1, FloatType *ker2, IndexType i1,IndexType i2,IndexType N1,IndexType N2,int ns)
 // 2D interpolate complex values from du (uniform grid data) array to out value,
 // using ns*ns square of real weights
 // in ker. out must be size 2 (real,imag), and du
@@ -1520,7 +3186,7 @@ void interp_square(FloatType *target,FloatType *du, FloatType *ker1, FloatType *
   FloatType out[] = {0.0, 0.0};
   if (i1>=0 && i1+ns<=N1 && i2>=0 && i2+ns<=N2) {  // no wrapping: avoid ptrs
     for (int dy=0; dy<ns; dy++) {
-      int64_t j = N1*(i2+dy) + i1;
+      IndexType j = N1*(i2+dy) + i1;
       for (int dx=0; dx<ns; dx++) {
 	FloatType k = ker1[dx]*ker2[dy];
 	out[0] += du[2*j] * k;
@@ -1529,8 +3195,8 @@ void interp_square(FloatType *target,FloatType *du, FloatType *ker1, FloatType *
       }
     }
   } else {                         // wraps somewhere: use ptr list (slower)
-    int64_t j1[MAX_KERNEL_WIDTH], j2[MAX_KERNEL_WIDTH];   // 1d ptr lists
-    int64_t x=i1, y=i2;                 // initialize coords
+    IndexType j1[MAX_KERNEL_WIDTH], j2[MAX_KERNEL_WIDTH];   // 1d ptr lists
+    IndexType x=i1, y=i2;                 // initialize coords
     for (int d=0; d<ns; d++) {         // set up ptr lists
       if (x<0) x+=N1;
       if (x>=N1) x-=N1;
@@ -1540,10 +3206,10 @@ void interp_square(FloatType *target,FloatType *du, FloatType *ker1, FloatType *
       j2[d] = y++;
     }
     for (int dy=0; dy<ns; dy++) {      // use the pts lists
-      int64_t oy = N1*j2[dy];           // offset due to y
+      IndexType oy = N1*j2[dy];           // offset due to y
       for (int dx=0; dx<ns; dx++) {
 	FloatType k = ker1[dx]*ker2[dy];
-	int64_t j = oy + j1[dx];
+	IndexType j = oy + j1[dx];
 	out[0] += du[2*j] * k;
 	out[1] += du[2*j+1] * k;
       }
@@ -1553,9 +3219,9 @@ void interp_square(FloatType *target,FloatType *du, FloatType *ker1, FloatType *
   target[1] = out[1];
 }
 
-template<typename FloatType>
+template<typename FloatType, typename IndexType>
 void interp_cube(FloatType *target,FloatType *du, FloatType *ker1, FloatType *ker2, FloatType *ker3,
-		 int64_t i1,int64_t i2,int64_t i3, int64_t N1,int64_t N2,int64_t N3,int ns)
+		 IndexType i1,IndexType i2,IndexType i3, IndexType N1,IndexType N2,IndexType N3,int ns)
 // 3D interpolate complex values from du (uniform grid data) array to out value,
 // using ns*ns*ns cube of real weights
 // in ker. out must be size 2 (real,imag), and du
@@ -1569,9 +3235,9 @@ void interp_cube(FloatType *target,FloatType *du, FloatType *ker1, FloatType *ke
   if (i1>=0 && i1+ns<=N1 && i2>=0 && i2+ns<=N2 && i3>=0 && i3+ns<=N3) {
     // no wrapping: avoid ptrs
     for (int dz=0; dz<ns; dz++) {
-      int64_t oz = N1*N2*(i3+dz);        // offset due to z
+      IndexType oz = N1*N2*(i3+dz);        // offset due to z
       for (int dy=0; dy<ns; dy++) {
-	int64_t j = oz + N1*(i2+dy) + i1;
+	IndexType j = oz + N1*(i2+dy) + i1;
 	FloatType ker23 = ker2[dy]*ker3[dz];
 	for (int dx=0; dx<ns; dx++) {
 	  FloatType k = ker1[dx]*ker23;
@@ -1582,8 +3248,8 @@ void interp_cube(FloatType *target,FloatType *du, FloatType *ker1, FloatType *ke
       }
     }
   } else {                         // wraps somewhere: use ptr list (slower)
-    int64_t j1[MAX_KERNEL_WIDTH], j2[MAX_KERNEL_WIDTH], j3[MAX_KERNEL_WIDTH];   // 1d ptr lists
-    int64_t x=i1, y=i2, z=i3;         // initialize coords
+    IndexType j1[MAX_KERNEL_WIDTH], j2[MAX_KERNEL_WIDTH], j3[MAX_KERNEL_WIDTH];   // 1d ptr lists
+    IndexType x=i1, y=i2, z=i3;         // initialize coords
     for (int d=0; d<ns; d++) {          // set up ptr lists
       if (x<0) x+=N1;
       if (x>=N1) x-=N1;
@@ -1596,13 +3262,13 @@ void interp_cube(FloatType *target,FloatType *du, FloatType *ker1, FloatType *ke
       j3[d] = z++;
     }
     for (int dz=0; dz<ns; dz++) {             // use the pts lists
-      int64_t oz = N1*N2*j3[dz];               // offset due to z
+      IndexType oz = N1*N2*j3[dz];               // offset due to z
       for (int dy=0; dy<ns; dy++) {
-	int64_t oy = oz + N1*j2[dy];           // offset due to y & z
+	IndexType oy = oz + N1*j2[dy];           // offset due to y & z
 	FloatType ker23 = ker2[dy]*ker3[dz];
 	for (int dx=0; dx<ns; dx++) {
 	  FloatType k = ker1[dx]*ker23;
-	  int64_t j = oy + j1[dx];
+	  IndexType j = oy + j1[dx];
 	  out[0] += du[2*j] * k;
 	  out[1] += du[2*j+1] * k;
 	}
@@ -1869,18 +3535,15 @@ void add_wrapped_subgrid_thread_safe(int64_t offset1,int64_t offset2,int64_t off
       FloatType *in  = du0 + 2*size1*(dy + size2*dz);   // ptr to subgrid array
       int64_t o = 2*(offset1+N1);         // 1d offset for output
       for (int j=0; j<2*nlo; j++) { // j is really dx/2 (since re,im parts)
-#pragma omp atomic
-        out[j + o] += in[j];
+        atomic_add(&out[j + o], in[j]);
       }
       o = 2*offset1;
       for (int j=2*nlo; j<2*(size1-nhi); j++) {
-#pragma omp atomic
-        out[j + o] += in[j];
+        atomic_add(&out[j + o], in[j]);
       }
       o = 2*(offset1-N1);
       for (int j=2*(size1-nhi); j<2*size1; j++) {
-#pragma omp atomic
-        out[j+o] += in[j];
+        atomic_add(&out[j + o], in[j]);
       }
     }
   }
@@ -32,6 +32,8 @@ limitations under the License.
 
 #include "tensorflow_nufft/cc/kernels/nufft_plan.h"
 
+#include <algorithm>
+
 #include <thrust/device_ptr.h>
 #include <thrust/scan.h>
 
@@ -283,6 +285,20 @@ __global__ void MapBinToSubproblemKernel(
   }
 }
 
+template<typename FloatType>
+__global__ void WeightPointsKernel(int64_t M, int batch_size,
+                                   const FloatType* weights,
+                                   const GpuComplex<FloatType>* c_in,
+                                   GpuComplex<FloatType>* c_out) {
+  // The batch may have more than 2^31 values, so use 64-bit indices.
+  for (int64_t i = threadIdx.x + int64_t{blockIdx.x} * blockDim.x;
+       i < M * batch_size; i += int64_t{gridDim.x} * blockDim.x) {
+    FloatType weight = weights[i % M];
+    c_out[i].x = c_in[i].x * weight;
+    c_out[i].y = c_in[i].y * weight;
+  }
+}
+
 /* Kernel for copying fw to fk with amplication by prefac / ker */
 // Note: assume modeord = 0: CMCL - compatible mode ordering in fk (from -N / 2 up
 // to N / 2 - 1)
@@ -1571,7 +1587,8 @@ Status Plan<GPUDevice, FloatType>::initialize(
   }
 
   // Select whether or not to sort points.
-  if (this->options_.sort_points == SortPoints::AUTO) {
+  if (this->options_.sort_points == SortPoints::AUTO ||
+      this->options_.sort_points == SortPoints::MORTON) {
     this->options_.sort_points = SortPoints::YES;
   }
 
@@ -1687,7 +1704,8 @@ Status Plan<GPUDevice, FloatType>::initialize(
     // Allocate fine grid and set convenience pointer.
     TF_RETURN_IF_ERROR(this->context_->allocate_temp(
         DataTypeToEnum<std::complex<FloatType>>::value,
-        TensorShape({this->grid_size_ * this->options_.max_batch_size}),
+        TensorShape({int64_t{this->grid_size_} *
+                     this->options_.max_batch_size}),
         &this->grid_tensor_));
     this->grid_data_ = reinterpret_cast<DType*>(
         this->grid_tensor_.flat<std::complex<FloatType>>().data());
@@ -1709,7 +1727,8 @@ Status Plan<GPUDevice, FloatType>::initialize(
           &kernel_fseries_host[i], attr));
       kernel_fseries_host_data[i] = reinterpret_cast<FloatType*>(
           kernel_fseries_host[i].flat<FloatType>().data());
-      kernel_fseries_1d(this->grid_dims_[i], this->spread_params_,
+      kernel_fseries_1d(this->context_->eigen_cpu_device(),
+                        this->grid_dims_[i], this->spread_params_,
                         kernel_fseries_host_data[i]);
 
       // Allocate device memory and save convenience accessors.
@@ -1853,6 +1872,17 @@ Status Plan<GPUDevice, FloatType>::execute(DType* d_c, DType* d_fk) {
   DType* d_fkstart;
   DType* d_cstart;
 
+  // Weighted copy of the values of a type-1 transform.
+  Tensor weighted_c;
+  if (this->spread_params_.point_weights != nullptr &&
+      this->type_ == TransformType::TYPE_1) {
+    TF_RETURN_IF_ERROR(this->context_->allocate_temp(
+        DataTypeToEnum<std::complex<FloatType>>::value,
+        TensorShape({int64_t{this->options_.max_batch_size} *
+                     this->num_points_}),
+        &weighted_c));
+  }
+
   for (int i = 0;
        i * this->options_.max_batch_size < this->num_transforms_;
        i++) {
@@ -1867,6 +1897,12 @@ Status Plan<GPUDevice, FloatType>::execute(DType* d_c, DType* d_fk) {
     // Step 1: spread (type 1) or deconvolve (type 2).
     switch (this->type_) {
       case TransformType::TYPE_1:
+          if (weighted_c.NumElements() > 0) {
+            this->c_ = reinterpret_cast<DType*>(
+                weighted_c.flat<std::complex<FloatType>>().data());
+            TF_RETURN_IF_ERROR(this->weight_batch(d_cstart, this->c_,
+                                                  batch_size));
+          }
           TF_RETURN_IF_ERROR(this->spread_batch(batch_size));
           break;
         case TransformType::TYPE_2:
@@ -1891,6 +1927,10 @@ Status Plan<GPUDevice, FloatType>::execute(DType* d_c, DType* d_fk) {
           break;
         case TransformType::TYPE_2:
           TF_RETURN_IF_ERROR(this->interp_batch(batch_size));
+          if (this->spread_params_.point_weights != nullptr) {
+            TF_RETURN_IF_ERROR(this->weight_batch(this->c_, this->c_,
+                                                  batch_size));
+          }
           break;
         case TransformType::TYPE_3:
           return errors::Unimplemented("type 3 transform is not implemented");
@@ -1916,6 +1956,9 @@ Status Plan<GPUDevice, FloatType>::interp(DType* d_c, DType* d_fk) {
     this->grid_data_ = d_fkstart;
 
     TF_RETURN_IF_ERROR(this->interp_batch(batch_size));
+    if (this->spread_params_.point_weights != nullptr) {
+      TF_RETURN_IF_ERROR(this->weight_batch(this->c_, this->c_, batch_size));
+    }
   }
 
   thrust::device_ptr<FloatType> dev_ptr(reinterpret_cast<FloatType*>(d_c));
@@ -1933,6 +1976,16 @@ Status Plan<GPUDevice, FloatType>::spread(DType* d_c, DType* d_fk) {
   DType* d_fkstart;
   DType* d_cstart;
 
+  // Weighted copy of the values.
+  Tensor weighted_c;
+  if (this->spread_params_.point_weights != nullptr) {
+    TF_RETURN_IF_ERROR(this->context_->allocate_temp(
+        DataTypeToEnum<std::complex<FloatType>>::value,
+        TensorShape({int64_t{this->options_.max_batch_size} *
+                     this->num_points_}),
+        &weighted_c));
+  }
+
   for (int i = 0;
        i * this->options_.max_batch_size < this->num_transforms_;
        i++) {
@@ -1944,6 +1997,11 @@ Status Plan<GPUDevice, FloatType>::spread(DType* d_c, DType* d_fk) {
     this->c_  = d_cstart;
     this->grid_data_ = d_fkstart;
 
+    if (weighted_c.NumElements() > 0) {
+      this->c_ = reinterpret_cast<DType*>(
+          weighted_c.flat<std::complex<FloatType>>().data());
+      TF_RETURN_IF_ERROR(this->weight_batch(d_cstart, this->c_, batch_size));
+    }
     TF_RETURN_IF_ERROR(this->spread_batch(batch_size));
   }
 
@@ -1956,6 +2014,29 @@ Status Plan<GPUDevice, FloatType>::spread(DType* d_c, DType* d_fk) {
   return Status::OK();
 }
 
+template<typename FloatType>
+Status Plan<GPUDevice, FloatType>::set_weights(const FloatType* weights) {
+  this->spread_params_.point_weights = weights;
+  return Status::OK();
+}
+
+template<typename FloatType>
+Status Plan<GPUDevice, FloatType>::weight_batch(const DType* c_in,
+                                                DType* c_out,
+                                                int batch_size) {
+  // The kernel loops over the values, so the number of blocks can be capped.
+  const int threads_per_block = 1024;
+  const int64_t num_values = int64_t{this->num_points_} * batch_size;
+  const int num_blocks = static_cast<int>(std::min<int64_t>(
+      (num_values + threads_per_block - 1) / threads_per_block, 65535));
+  TF_RETURN_IF_ERROR(GpuLaunchKernel(
+      WeightPointsKernel<FloatType>,
+      num_blocks, threads_per_block, 0, this->device_.stream(),
+      int64_t{this->num_points_}, batch_size,
+      this->spread_params_.point_weights, c_in, c_out));
+  return Status::OK();
+}
+
 template<typename FloatType>
 Status Plan<GPUDevice, FloatType>::spread_batch(int batch_size) {
   // Set fine grid to zero.
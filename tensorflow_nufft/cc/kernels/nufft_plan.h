@@ -37,6 +37,8 @@ limitations under the License.
 #endif  // GOOGLE_CUDA
 
 #include <cstdint>
+#include <memory>
+#include <vector>
 
 #include "third_party/eigen3/unsupported/Eigen/CXX11/Tensor"
 #if GOOGLE_CUDA
@@ -45,6 +47,7 @@ limitations under the License.
 #endif
 #include "tensorflow/core/framework/op_kernel.h"
 #include "tensorflow/core/platform/stream_executor.h"
+#include "tensorflow_nufft/cc/kernels/fft_plan.h"
 #include "tensorflow_nufft/cc/kernels/fftw_api.h"
 #include "tensorflow_nufft/cc/kernels/nufft_options.h"
 
@@ -128,6 +131,30 @@ enum class SpreadDirection {
   INTERP   // uniform to non-uniform
 };
 
+// Width of the integer type used to index the non-uniform points and the fine
+// grid in the CPU spreader and the point sorter. 32-bit indices halve the
+// memory used by the sort permutation and the bandwidth needed to read it.
+enum class IndexWidth {
+  INT32,  // Point and grid indices fit in an `int32_t`.
+  INT64   // Point or grid indices need an `int64_t`.
+};
+
+// Statistics of the non-uniform points, gathered by the CPU plan in the same
+// pass that checks and bins the points. Available to heuristics which depend
+// on the distribution of the points.
+template<typename FloatType>
+struct PointStatistics {
+  // The bounding box of the points, in fine grid coordinates after folding
+  // into [0, n]. Zero in unused dimensions.
+  FloatType lower_bound[3] = {0, 0, 0};
+  FloatType upper_bound[3] = {0, 0, 0};
+  // The average number of points per fine grid point.
+  double density = 0.0;
+  // The average number of points per fine grid point within the bounding box.
+  // Much larger than `density` if the points are clustered.
+  double bounding_box_density = 0.0;
+};
+
 template<typename FloatType>
 struct SpreadParameters {
   // The spread direction (U->NU or NU->U). See enum above.
@@ -164,6 +191,12 @@ struct SpreadParameters {
   FloatType kernel_half_width;
   FloatType kernel_c;
   FloatType kernel_scale;
+  // Real weights of the non-uniform points, indexed like the points, or null.
+  // The values are multiplied by them before spreading and after
+  // interpolation.
+  const FloatType* point_weights = nullptr;
+  // If true, spreading adds to the uniform data instead of overwriting it.
+  bool accumulate = false;
 
   #if GOOGLE_CUDA
   // Used for 3D subproblem method. 0 means automatic selection.
@@ -173,6 +206,25 @@ struct SpreadParameters {
   #endif  // GOOGLE_CUDA
 };
 
+// Where each transform of a batch is stored in the arrays passed to
+// `Plan::execute`, `Plan::interp` or `Plan::spread`. By default, the
+// transforms are stored contiguously, one after another. Otherwise, the
+// non-uniform data of the `i`-th transform starts `c_offsets[i]` elements
+// after the start of `c`, and its uniform data starts `f_offsets[i]` elements
+// after the start of `f`. This allows `c` and `f` to be tensors whose batch
+// dimensions are in any order, or broadcast inputs (with repeated offsets).
+// Either array may be null, in which case the corresponding data is
+// contiguous. The data of each transform is always contiguous.
+struct BatchLayout {
+  const int64_t* c_offsets = nullptr;
+  const int64_t* f_offsets = nullptr;
+
+  // Returns true if this is the default, contiguous layout.
+  bool is_contiguous() const {
+    return c_offsets == nullptr && f_offsets == nullptr;
+  }
+};
+
 template<typename Device, typename FloatType>
 class PlanBase {
  public:
@@ -208,19 +260,166 @@ class PlanBase {
                             FloatType* points_y,
                             FloatType* points_z) = 0;
 
+  // Like above, but consecutive coordinates along each axis are
+  // `points_stride` elements apart. This allows the points to be passed as an
+  // array of structures without copying, e.g. for a row-major array of shape
+  // [num_points, rank] pass `points_stride = rank` and pointers to the first
+  // point's coordinates, in any axis order. The default implementation only
+  // supports a stride of 1.
+  virtual Status set_points(int num_points,
+                            FloatType* points_x,
+                            FloatType* points_y,
+                            FloatType* points_z,
+                            int64_t points_stride) {
+    if (points_stride != 1)
+      return errors::Unimplemented("Strided points not supported.");
+    return this->set_points(num_points, points_x, points_y, points_z);
+  }
+
+  // Updates the non-uniform points after a previous call to `set_points` or
+  // `update_points`. The new points are the previous points, except those in
+  // the range [remove_begin, remove_end), in the same order and possibly with
+  // different coordinates, followed by any appended points. `num_points` is
+  // the new total number of points. Implementations may reuse work done for
+  // the previous points, so this is cheaper than `set_points` when the points
+  // change only slightly. The default implementation calls `set_points`.
+  virtual Status update_points(int num_points,
+                               FloatType* points_x,
+                               FloatType* points_y,
+                               FloatType* points_z,
+                               int remove_begin,
+                               int remove_end) {
+    return this->set_points(num_points, points_x, points_y, points_z);
+  }
+
   // Executes the plan. Must be called after initialize() and set_points(). `c`
   // and `f` are the non-uniform and uniform grid arrays, respectively. Each
   // may be an input or an output depending on the type of the transform.
   virtual Status execute(DType* c, DType* f) = 0;
 
+  // Like above, but with the batch layout given by `layout`. The default
+  // implementation only supports the contiguous layout.
+  virtual Status execute(DType* c, DType* f, const BatchLayout& layout) {
+    if (!layout.is_contiguous())
+      return errors::Unimplemented("Batch layout not supported.");
+    return this->execute(c, f);
+  }
+
   // Performs the interpolation step only. Must be called after initialize() and
   // set_points().
   virtual Status interp(DType* c, DType* f) = 0;
 
+  // Like above, but with the batch layout given by `layout`.
+  virtual Status interp(DType* c, DType* f, const BatchLayout& layout) {
+    if (!layout.is_contiguous())
+      return errors::Unimplemented("Batch layout not supported.");
+    return this->interp(c, f);
+  }
+
   // Performs the spreading step only. Must be called after initialize() and
   // set_points().
   virtual Status spread(DType* c, DType* f) = 0;
 
+  // Like above, but with the batch layout given by `layout`.
+  virtual Status spread(DType* c, DType* f, const BatchLayout& layout) {
+    if (!layout.is_contiguous())
+      return errors::Unimplemented("Batch layout not supported.");
+    return this->spread(c, f);
+  }
+
+  // Sets real weights for the points set by set_points(), which has
+  // `num_points` elements. The values at the points are multiplied by them:
+  // the inputs of a type-1 transform (or of spreading) and the outputs of a
+  // type-2 transform (or of interpolation), for all the transforms. The
+  // weights apply to execute(), spread() and interp() until the next call. A
+  // null pointer removes them. The default implementation only accepts null.
+  virtual Status set_weights(const FloatType* weights) {
+    if (weights != nullptr) {
+      return errors::Unimplemented("Point weights not supported.");
+    }
+    return Status::OK();
+  }
+
+  // Sets complex sensitivities (e.g., the coil sensitivities of a SENSE
+  // model), which modulate the uniform data of each transform. They have the
+  // layout of the uniform data, and those of transform `i` start `offsets[i]`
+  // elements after `sensitivities`, or `i * mode_count_` elements if
+  // `offsets` is null. When set, the input of type-2 transform `i` is
+  // `s_i * f_i`, and type-1 transform `i` adds `conj(s_i)` times its output to
+  // `f_i`, which must be initialized. With a batch layout in which several
+  // transforms share the same `f_i`, these are the SENSE forward and adjoint
+  // operators. The sensitivities apply to execute() until the next call. A
+  // null pointer removes them. The default implementation only accepts null.
+  virtual Status set_sensitivities(const DType* sensitivities,
+                                   const int64_t* offsets) {
+    if (sensitivities != nullptr) {
+      return errors::Unimplemented("Sensitivities not supported.");
+    }
+    return Status::OK();
+  }
+
+  // Spreads the non-uniform data of `count` transforms onto a single fine
+  // grid, summing them, so that transform_sum() computes the sum of their
+  // type-1 transforms with a single FFT. The data of the `i`-th of them starts
+  // `c_offsets[i]` elements after `c`. If `accumulate` is true, they are added
+  // to the sum of the previous calls, which may have had other points or
+  // weights. Must be called after initialize() and set_points(), on a type-1
+  // plan. The default implementation returns an error.
+  virtual Status spread_sum(DType* c, int count, const int64_t* c_offsets,
+                            bool accumulate) {
+    return errors::Unimplemented("Summed spreading not supported.");
+  }
+
+  // Computes the type-1 transform of the data summed by spread_sum() and
+  // writes it to `f`, which holds a single transform. The plan must have a
+  // batch size of 1 (e.g., it is a plan for a single transform). The default
+  // implementation returns an error.
+  virtual Status transform_sum(DType* f) {
+    return errors::Unimplemented("Summed spreading not supported.");
+  }
+
+  // Computes the gradient with respect to the points of
+  // `sum_i sum_j Re(c_i[j] * t_i[j])`, where `t_i` is the type-2 transform of
+  // the uniform grid `f_i` (or its interpolation, in spread/interp only mode)
+  // and `i` runs over the transforms. Must be called after initialize() and
+  // set_points(), on a type-2 plan. The gradients along
+  // the x, y and z axes are written to `grad_x`, `grad_y` and `grad_z`, which
+  // have the same layout as the points passed to set_points(). The default
+  // implementation returns an error.
+  virtual Status points_grad(DType* c, DType* f, FloatType* grad_x,
+                             FloatType* grad_y, FloatType* grad_z,
+                             const BatchLayout& layout) {
+    return errors::Unimplemented("Points gradient not supported.");
+  }
+
+  // Computes the tangent (directional derivative) of the output of the
+  // transform, given the tangent of its input and the tangents of the points.
+  // For a type-1 transform, `c` and `c_tangent` are the inputs and the
+  // tangent is written to `f_tangent`. For a type-2 transform, `f` and
+  // `f_tangent` are the inputs and the tangent is written to `c_tangent`.
+  // The tangents of the points `tangent_x`, `tangent_y` and `tangent_z` have
+  // the same layout as the points passed to set_points(). `layout` applies
+  // to the values and to their tangents. Must be called after initialize()
+  // and set_points(). The default implementation returns an error.
+  virtual Status tangent(DType* c, DType* f, DType* c_tangent,
+                         DType* f_tangent, FloatType* tangent_x,
+                         FloatType* tangent_y, FloatType* tangent_z,
+                         const BatchLayout& layout) {
+    return errors::Unimplemented("Tangent not supported.");
+  }
+
+  // Computes sampling density compensation weights for the points with the
+  // fixed-point iteration of Pipe and Menon, `w <- w / |interp(spread(w))|`,
+  // starting from `w = 1`. Iterates `max_iterations` times, or until the
+  // relative change of `w` (in the 2-norm) is at most `rtol`. The weights are
+  // written to `weights`, which has `num_points` elements. Must be called after
+  // initialize() and set_points(), on a spread/interp only type-1 plan with a
+  // single transform. The default implementation returns an error.
+  virtual Status density_compensation(FloatType* weights, int max_iterations,
+                                      FloatType rtol) {
+    return errors::Unimplemented("Density compensation not supported.");
+  }
+
  public:  // TODO(jmontalt): make protected after refactoring FINUFFT.
   // The type of the transform. See enum above.
   TransformType type_;
@@ -244,6 +443,9 @@ class PlanBase {
   // device pointers. These pointers are not owned by the plan. Unused pointers
   // are set to nullptr.
   FloatType* points_[3];
+  // The distance between consecutive coordinates in each of the arrays in
+  // `points_`. See `set_points`.
+  int64_t points_stride_;
   // The total number of points.
   int num_points_;
   // Pointer to the op kernel context.
@@ -266,8 +468,6 @@ class Plan<CPUDevice, FloatType> : public PlanBase<CPUDevice, FloatType> {
   explicit Plan(OpKernelContext* context)
       : PlanBase<CPUDevice, FloatType>(context) { }
 
-  ~Plan();
-
   Status initialize(TransformType type,
                     int rank,
                     int* num_modes,
@@ -281,13 +481,109 @@ class Plan<CPUDevice, FloatType> : public PlanBase<CPUDevice, FloatType> {
                     FloatType* points_y,
                     FloatType* points_z) override;
 
+  Status set_points(int num_points,
+                    FloatType* points_x,
+                    FloatType* points_y,
+                    FloatType* points_z,
+                    int64_t points_stride) override;
+
+  // Reuses the previous bin assignment: only the points which were appended
+  // or changed bin are sorted, and merged into the previous order.
+  Status update_points(int num_points,
+                       FloatType* points_x,
+                       FloatType* points_y,
+                       FloatType* points_z,
+                       int remove_begin,
+                       int remove_end) override;
+
+  // Sets the same non-uniform points as `other`, whose points must have been
+  // set. If both plans have the same rank, fine grid and spreading
+  // parameters, the preprocessing of the points (including their sort
+  // order) is shared with `other` instead of being repeated. This is the case
+  // for a type-2 plan and its adjoint type-1 plan. Otherwise, this is the
+  // same as calling `set_points` with the points of `other`.
+  Status set_points_from(const Plan& other);
+
   Status execute(DType* c, DType* f) override;
 
+  Status execute(DType* c, DType* f, const BatchLayout& layout) override;
+
   Status interp(DType* c, DType* f) override;
 
+  Status interp(DType* c, DType* f, const BatchLayout& layout) override;
+
   Status spread(DType* c, DType* f) override;
 
+  Status spread(DType* c, DType* f, const BatchLayout& layout) override;
+
+  // The weights are applied as the values are read into the spreading
+  // subproblems, and as the interpolated values are written out.
+  Status set_weights(const FloatType* weights) override;
+
+  // The sensitivities are applied by the deconvolution, so the modulated
+  // uniform data is never stored.
+  Status set_sensitivities(const DType* sensitivities,
+                           const int64_t* offsets) override;
+
+  // The transforms are spread one after another, each of them
+  // multi-threaded, onto the first fine grid of the plan.
+  Status spread_sum(DType* c, int count, const int64_t* c_offsets,
+                    bool accumulate) override;
+
+  Status transform_sum(DType* f) override;
+
+  Status points_grad(DType* c, DType* f, FloatType* grad_x,
+                     FloatType* grad_y, FloatType* grad_z,
+                     const BatchLayout& layout) override;
+
+  // The tangents of the input and of the points are applied in a single
+  // pass. For type 1, both are spread to the same fine grid, so the tangent
+  // costs one transform. For type 2, the input and its tangent are
+  // transformed separately, and the value and the partial derivatives are
+  // then interpolated together.
+  Status tangent(DType* c, DType* f, DType* c_tangent, DType* f_tangent,
+                 FloatType* tangent_x, FloatType* tangent_y,
+                 FloatType* tangent_z, const BatchLayout& layout) override;
+
+  // Spreading and interpolation share the sorted points and the working
+  // grid, and the weights are updated in place between iterations. The
+  // per-point updates run in parallel on the device.
+  Status density_compensation(FloatType* weights, int max_iterations,
+                              FloatType rtol) override;
+
  protected:
+  // Implements `set_points` and `update_points`. If `update` is false, the
+  // removed range is ignored.
+  Status set_or_update_points(int num_points,
+                              FloatType* points_x,
+                              FloatType* points_y,
+                              FloatType* points_z,
+                              int64_t points_stride,
+                              bool update,
+                              int remove_begin,
+                              int remove_end);
+
+  // Creates the FFT plans for the first `batch_size` fine grids and appends
+  // them to `plans`.
+  Status plan_fft(int batch_size,
+                  std::vector<std::unique_ptr<FftPlan<FloatType>>>* plans);
+
+  // Creates the FFT plans for the pruned FFT of the first `batch_size` fine
+  // grids and appends them to `plans`. The FFT is computed one dimension at a
+  // time. Along each dimension, the rows which are zero (type 2, before their
+  // FFT) or discarded (type 1, after their FFT) are skipped. These are the rows
+  // whose index along a dimension which has not been transformed yet (type 2)
+  // or which will be transformed later (type 1) falls outside the modes.
+  Status plan_pruned_fft(
+      int batch_size, std::vector<std::unique_ptr<FftPlan<FloatType>>>* plans);
+
+  // Checks, sorts and gathers statistics of the current points, using indices
+  // of type `IndexType`. If `update` is true, reuses the previous sort order.
+  template<typename IndexType>
+  Status preprocess_points_typed(bool update,
+                                 int previous_num_points,
+                                 int remove_begin,
+                                 int remove_end);
 
   // If opts.spread_direction=1, evaluate, in the 1D case,
 
@@ -358,7 +654,7 @@ class Plan<CPUDevice, FloatType> : public PlanBase<CPUDevice, FloatType> {
   // Melody Shih split into 3 routines: check, sort, spread. Jun 2018, making
   // this routine just a caller to them. Name change, Barnett 7/27/18
   // Tidy, Barnett 5/20/20. Tidy doc, Barnett 10/22/20.
-  Status spread_or_interp(DType* c, DType* f);
+  Status spread_or_interp(DType* c, DType* f, const BatchLayout& layout);
 
   // Spreads (or interpolates) a batch of batch_size strength vectors in cBatch
   // to (or from) the batch of fine working grids this->grid_data_, using the same set of
@@ -373,18 +669,36 @@ class Plan<CPUDevice, FloatType> : public PlanBase<CPUDevice, FloatType> {
   // 3) the 3rd parameter is used when doing interp/spread only. When received,
   //    input/output data is read/written from/to this pointer instead of from/to
   //    the internal array this->fWBatch. Montalt 5/8/2021
+  // 4) if not null, c_offsets and f_offsets give the offset of each
+  //    transform in cBatch and fBatch, as in BatchLayout. Otherwise the
+  //    transforms are contiguous.
   Status spread_or_interp_sorted_batch(
-      int batch_size, DType* cBatch, DType* fBatch=nullptr);
+      int batch_size, DType* cBatch, DType* fBatch=nullptr,
+      const int64_t* c_offsets=nullptr, const int64_t* f_offsets=nullptr);
 
   // Type 1: deconvolves (amplifies) from each interior fw array in this->grid_data_
   // into each output array fk in fkBatch.
   // Type 2: deconvolves from user-supplied input fk to 0-padded interior fw,
   // again looping over fk in fkBatch and fw in this->grid_data_.
   // The direction (spread vs interpolate) is set by this->spread_params_.spread_direction.
-  // This is mostly a loop calling deconvolveshuffle?d for the needed rank batch_size
-  // times.
+  // Each fine grid is split into rows along its first dimension, and the rows
+  // of all the fine grids in the batch are processed in parallel. The indices
+  // of a row along the other dimensions give the offset of the matching row
+  // of modes, if any, and the factor of the kernel Fourier series along those
+  // dimensions. The row is then deconvolved in 1D. Rows which match no modes
+  // are zeroed for type 2 and skipped for type 1. The fk array of transform i
+  // is at fkBatch + fk_offsets[i], or at fkBatch + i * mode_count_ if
+  // fk_offsets is null.
+  // If sensBatch is not null, the modes of transform i are modulated by the
+  // sensitivities at sensBatch + sens_offsets[i] (or sensBatch +
+  // i * mode_count_), as in set_sensitivities. Type-1 transforms then add
+  // to fk, which may be shared by several transforms, so the rows are
+  // processed in parallel and the transforms of each row in order.
   // Barnett 5/21/20, simplified from Malleo 2019 (eg t3 logic won't be in here)
-  Status deconvolve_batch(int batch_size, DType* fkBatch);
+  Status deconvolve_batch(int batch_size, DType* fkBatch,
+                          const int64_t* fk_offsets = nullptr,
+                          const DType* sensBatch = nullptr,
+                          const int64_t* sens_offsets = nullptr);
 
  public:  // TODO(jmontalt): make private after refactoring FINUFFT.
 
@@ -400,20 +714,41 @@ class Plan<CPUDevice, FloatType> : public PlanBase<CPUDevice, FloatType> {
   FftwType* grid_data_;
   // Relative user tol.
   FloatType tol_;
-  // The FFTW plan for FFTs.
-  typename fftw::PlanType<FloatType>::Type fft_plan_;
+  // The FFT plans, in execution order. A single plan computes the full FFT
+  // of the fine grids, unless the pruned FFT is used, in which case each plan
+  // computes the 1D FFTs along one dimension for a block of rows. See
+  // `plan_pruned_fft`.
+  std::vector<std::unique_ptr<FftPlan<FloatType>>> fft_plans_;
+  // The FFT plans for the last batch, if it has fewer than `batch_size_`
+  // transforms. Empty otherwise.
+  std::vector<std::unique_ptr<FftPlan<FloatType>>> remainder_fft_plans_;
   // The parameters for the spreading algorithm/s.
   SpreadParameters<FloatType> spread_params_;
-  // Tensors in host memory. Used for deconvolution. Empty in spread/interp
-  // mode. Only the first `rank` tensors are allocated.
+  // Tensors in host memory. Used for deconvolution. Hold the reciprocals of
+  // the kernel Fourier series coefficients. Empty in spread/interp mode. Only
+  // the first `rank` tensors are allocated.
   Tensor fseries_tensor_[3];
   // Convenience raw pointers to above tensors. Only the first `rank` pointers
   // are valid.
   FloatType* fseries_data_[3];
   // Precomputed non-uniform point permutation, used to speed up spread/interp.
-  int64_t* sort_indices_;
+  // Holds 32-bit indices if the point and grid sizes allow it (see
+  // `index_width_`), and 64-bit indices otherwise.
+  Tensor sort_indices_tensor_;
+  // The width of the indices used for the non-uniform points and the fine
+  // grid. Selected by `set_points`.
+  IndexWidth index_width_;
+  // Bin key of each non-uniform point, by point index. Same type as
+  // `sort_indices_tensor_`. Used by `update_points`.
+  Tensor bin_keys_tensor_;
   // Whether bin-sorting was used.
   bool did_sort_;
+  // Statistics of the current non-uniform points. Set by `set_points`.
+  PointStatistics<FloatType> points_stats_;
+  // The sensitivities and their offsets, or null. Set by
+  // `set_sensitivities`. Not owned by the plan.
+  const DType* sensitivities_ = nullptr;
+  const int64_t* sensitivity_offsets_ = nullptr;
 };
 
 #if GOOGLE_CUDA
@@ -436,17 +771,27 @@ class Plan<GPUDevice, FloatType> : public PlanBase<GPUDevice, FloatType> {
                     FloatType tol,
                     const InternalOptions& options) override;
 
+  using PlanBase<GPUDevice, FloatType>::set_points;
+
   Status set_points(int num_points,
                     FloatType* points_x,
                     FloatType* points_y,
                     FloatType* points_z) override;
 
+  using PlanBase<GPUDevice, FloatType>::execute;
+  using PlanBase<GPUDevice, FloatType>::interp;
+  using PlanBase<GPUDevice, FloatType>::spread;
+
   Status execute(DType* d_c, DType* d_fk) override;
 
   Status interp(DType* d_c, DType* d_fk) override;
 
   Status spread(DType* d_c, DType* d_fk) override;
 
+  // The weights are applied in a separate pass: to a copy of the values
+  // before spreading, and in place after interpolation.
+  Status set_weights(const FloatType* weights) override;
+
  protected:
   static int64_t CufftScratchSize;
 
@@ -462,6 +807,8 @@ class Plan<GPUDevice, FloatType> : public PlanBase<GPUDevice, FloatType> {
   Status interp_batch_subproblem(int batch_size);
   // Deconvolve and/or amplify a batch of data.
   Status deconvolve_batch(int batch_size);
+  // Multiplies a batch of values at the points by the point weights.
+  Status weight_batch(const DType* c_in, DType* c_out, int batch_size);
   // Batch of fine grids for cuFFT to plan and execute. This is usually the
   // largest array allocated by NUFFT.
   Tensor grid_tensor_;
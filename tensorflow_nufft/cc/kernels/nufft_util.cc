@@ -34,7 +34,7 @@ limitations under the License.
 
 #include "tensorflow_nufft/cc/kernels/legendre_rule_fast.h"
 #include "tensorflow_nufft/cc/kernels/nufft_plan.h"
-#include "tensorflow_nufft/cc/kernels/omp_api.h"
+#include "tensorflow_nufft/cc/kernels/parallel_api.h"
 
 
 namespace tensorflow {
@@ -69,7 +69,8 @@ FloatType evaluate_kernel(FloatType x, const SpreadParameters<FloatType> &opts)
 }
 
 template<typename FloatType>
-void kernel_fseries_1d(int grid_size,
+void kernel_fseries_1d(const Eigen::ThreadPoolDevice& device,
+                       int grid_size,
                        const SpreadParameters<FloatType>& spread_params,
                        FloatType* fseries_coeffs) {
 
@@ -92,20 +93,16 @@ void kernel_fseries_1d(int grid_size,
     a[n] = exp(2 * kPi<FloatType> * kImaginaryUnit<FloatType> * (FloatType)(grid_size / 2 - z[n]) / (FloatType)grid_size);  // phase winding rates
   }
   int nout = grid_size / 2 + 1;                   // how many values we're writing to
-  int nt = std::min(nout, (int)spread_params.num_threads);         // how many chunks
-  std::vector<int> brk(nt + 1);        // start indices for each thread
-  for (int t = 0; t <= nt; ++t)             // split nout mode indices btw threads
-    brk[t] = (int)(0.5 + nout * t / (double)nt);
 
-  #pragma omp parallel num_threads(nt)
-  {                                     // each thread gets own chunk to do
-    int t = OMP_GET_THREAD_NUM();
-    std::complex<FloatType> aj[kMaxQuadNodes];    // phase rotator for this thread
+  // Each shard of the output gets its own phase rotators.
+  const Eigen::TensorOpCost cost(0, sizeof(FloatType), 8 * q);
+  parallel_for(&device, nout, cost, [&](int64_t first, int64_t last) {
+    std::complex<FloatType> aj[kMaxQuadNodes];    // phase rotator for this shard
 
     for (int n = 0; n < q; ++n)
-      aj[n] = pow(a[n], (FloatType)brk[t]);    // init phase factors for chunk
+      aj[n] = pow(a[n], (FloatType)first);    // init phase factors for shard
 
-    for (int j = brk[t]; j < brk[t + 1]; ++j) {          // loop along output array
+    for (int64_t j = first; j < last; ++j) {          // loop along output array
       FloatType x = 0.0;                      // accumulator for answer at this j
       for (int n = 0; n < q; ++n) {
         x += f[n] * 2 * real(aj[n]);      // include the negative freq
@@ -113,7 +110,7 @@ void kernel_fseries_1d(int grid_size,
       }
       fseries_coeffs[j] = x;
     }
-  }
+  });
 }
 
 template<typename IntType>
@@ -147,9 +144,11 @@ template double calculate_scale_factor<double>(
     int, const SpreadParameters<double>&);
 
 template void kernel_fseries_1d<float>(
-    int, const SpreadParameters<float>&, float*);
+    const Eigen::ThreadPoolDevice&, int, const SpreadParameters<float>&,
+    float*);
 template void kernel_fseries_1d<double>(
-    int, const SpreadParameters<double>&, double*);
+    const Eigen::ThreadPoolDevice&, int, const SpreadParameters<double>&,
+    double*);
 
 template int next_smooth_int<int>(int, int);
 template int64_t next_smooth_int<int64_t>(int64_t, int64_t);
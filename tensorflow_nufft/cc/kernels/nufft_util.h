@@ -56,8 +56,10 @@ FloatType evaluate_kernel(FloatType x, const SpreadParameters<FloatType> &opts);
 // kernel. The FT definition is f(k) = int e^{-ikx} f(x) dx. The output has an
 // overall prefactor of 1/h, which is needed anyway for the correction, and
 // arises because the quadrature weights are scaled for grid units not x units.
+// The output is computed on the thread pool of `device`.
 template<typename FloatType>
-void kernel_fseries_1d(int grid_size,
+void kernel_fseries_1d(const Eigen::ThreadPoolDevice& device,
+                       int grid_size,
                        const SpreadParameters<FloatType>& spread_params,
                        FloatType* fseries_coeffs);
 
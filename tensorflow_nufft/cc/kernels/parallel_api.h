@@ -0,0 +1,84 @@
+/* Copyright 2021 The TensorFlow NUFFT Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef TENSORFLOW_NUFFT_CC_KERNELS_PARALLEL_API_H_
+#define TENSORFLOW_NUFFT_CC_KERNELS_PARALLEL_API_H_
+
+#define EIGEN_USE_THREADS
+
+#include <cstdint>
+#include <functional>
+
+#include "third_party/eigen3/unsupported/Eigen/CXX11/Tensor"
+
+namespace tensorflow {
+namespace nufft {
+
+// Estimated cost of a task which is large enough to be worth running on its
+// own thread, in cycles. See `parallel_tasks`.
+constexpr double kLargeTaskCycles = 1e6;
+
+// Runs `fn(first, last)` over shards of [0, total) on the thread pool of
+// `device`. The shard sizes are chosen based on `cost_per_unit`. If `device` is
+// null, runs `fn(0, total)` on the calling thread. This is used inside loops
+// which are already parallel, as blocking on a nested parallel loop may
+// starve the thread pool.
+inline void parallel_for(const Eigen::ThreadPoolDevice* device, int64_t total,
+                         const Eigen::TensorOpCost& cost_per_unit,
+                         const std::function<void(int64_t, int64_t)>& fn) {
+  if (device == nullptr) {
+    if (total > 0) fn(0, total);
+    return;
+  }
+  device->parallelFor(total, cost_per_unit,
+                      [&fn](Eigen::Index first, Eigen::Index last) {
+                        fn(first, last);
+                      });
+}
+
+// Runs `fn(task)` for each task in [0, num_tasks) on the thread pool of
+// `device`, or on the calling thread if `device` is null. Each task should be
+// large, e.g. one of a few precomputed ranges of work, one per thread.
+inline void parallel_tasks(const Eigen::ThreadPoolDevice* device,
+                           int num_tasks, const std::function<void(int)>& fn) {
+  parallel_for(device, num_tasks, Eigen::TensorOpCost(0, 0, kLargeTaskCycles),
+               [&fn](int64_t first, int64_t last) {
+                 for (int64_t task = first; task < last; task++)
+                   fn(static_cast<int>(task));
+               });
+}
+
+// Returns the number of threads in the thread pool of `device`, or 1 if
+// `device` is null.
+inline int get_num_threads(const Eigen::ThreadPoolDevice* device) {
+  return device == nullptr ? 1 : device->numThreads();
+}
+
+// Adds `value` to `*address` atomically.
+template<typename FloatType>
+inline void atomic_add(FloatType* address, FloatType value) {
+  FloatType expected, desired;
+  __atomic_load(address, &expected, __ATOMIC_RELAXED);
+  do {
+    desired = expected + value;
+  } while (!__atomic_compare_exchange(address, &expected, &desired,
+                                      /* weak */ true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+}
+
+}  // namespace nufft
+}  // namespace tensorflow
+
+#endif  // TENSORFLOW_NUFFT_CC_KERNELS_PARALLEL_API_H_
@@ -24,7 +24,8 @@ using shape_inference::DimensionHandle;
 using shape_inference::InferenceContext;
 using shape_inference::ShapeHandle;
 
-Status NUFFTBaseShapeFn(InferenceContext* c, int transform_type) {
+Status NUFFTBaseShapeFn(InferenceContext* c, int transform_type,
+                        const std::vector<int32>& reduce_batch_axes = {}) {
   // Input shapes.
   ShapeHandle source_shape = c->input(0);
   ShapeHandle points_shape = c->input(1);
@@ -86,6 +87,38 @@ Status NUFFTBaseShapeFn(InferenceContext* c, int transform_type) {
   TF_RETURN_IF_ERROR(BroadcastBinaryOpOutputShapeFnHelper(
       c, source_batch_shape, points_batch_shape, true, &output_batch_shape));
 
+  // Remove the batch axes which are reduced.
+  if (!reduce_batch_axes.empty()) {
+    if (transform_type != 1) {
+      return errors::InvalidArgument(
+          "reduce_batch_axes is only supported for type-1 transforms.");
+    }
+    if (!c->RankKnown(output_batch_shape)) {
+      c->set_output(0, c->UnknownShape());
+      return Status::OK();
+    }
+    int32 num_batch_dims = c->Rank(output_batch_shape);
+    std::vector<bool> is_reduced(num_batch_dims, false);
+    for (int32 axis : reduce_batch_axes) {
+      if (axis < -num_batch_dims || axis >= num_batch_dims) {
+        return errors::InvalidArgument(
+            "reduce_batch_axes must be in the range [", -num_batch_dims, ", ",
+            num_batch_dims, "), but got: ", axis);
+      }
+      if (axis < 0) axis += num_batch_dims;
+      if (is_reduced[axis]) {
+        return errors::InvalidArgument(
+            "reduce_batch_axes contains a duplicate axis: ", axis);
+      }
+      is_reduced[axis] = true;
+    }
+    std::vector<DimensionHandle> dims;
+    for (int32 i = 0; i < num_batch_dims; i++) {
+      if (!is_reduced[i]) dims.push_back(c->Dim(output_batch_shape, i));
+    }
+    output_batch_shape = c->MakeShape(dims);
+  }
+
   ShapeHandle output_shape;
   switch (transform_type) {
     case 1:  // nonuniform to uniform
@@ -119,7 +152,14 @@ Status NUFFTShapeFn(InferenceContext* c) {
         transform_type_str);
   }
 
-  return NUFFTBaseShapeFn(c, transform_type);
+  // Only the `NUFFT` and `WeightedNUFFT` ops have the `reduce_batch_axes`
+  // attribute.
+  std::vector<int32> reduce_batch_axes;
+  if (c->attrs().Find("reduce_batch_axes") != nullptr) {
+    TF_RETURN_IF_ERROR(c->GetAttr("reduce_batch_axes", &reduce_batch_axes));
+  }
+
+  return NUFFTBaseShapeFn(c, transform_type, reduce_batch_axes);
 }
 
 
@@ -133,6 +173,126 @@ Status SpreadShapeFn(InferenceContext* c) {
 }
 
 
+Status NUFFTPointsGradShapeFn(InferenceContext* c) {
+  // The gradient has the shape of the points.
+  ShapeHandle points_shape;
+  TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(1), 2, &points_shape));
+  ShapeHandle weights_shape;
+  TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(2), 1, &weights_shape));
+  DimensionHandle unused;
+  TF_RETURN_IF_ERROR(c->Merge(c->Dim(points_shape, -2),
+                              c->Dim(weights_shape, -1), &unused));
+  c->set_output(0, points_shape);
+  return Status::OK();
+}
+
+
+Status NUFFTTangentShapeFn(InferenceContext* c) {
+  // The tangents have the shapes of the corresponding inputs, and the output
+  // has the shape of the output of the transform.
+  ShapeHandle unused;
+  TF_RETURN_IF_ERROR(c->Merge(c->input(0), c->input(3), &unused));
+  TF_RETURN_IF_ERROR(c->Merge(c->input(1), c->input(4), &unused));
+  return NUFFTShapeFn(c);
+}
+
+
+Status NUFFTConjugateGradientShapeFn(InferenceContext* c) {
+  // The weights have the shape of the points, without the last dimension.
+  ShapeHandle points_shape;
+  TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(1), 2, &points_shape));
+  ShapeHandle weights_shape;
+  TF_RETURN_IF_ERROR(c->Subshape(points_shape, 0, -1, &weights_shape));
+  TF_RETURN_IF_ERROR(c->Merge(c->input(3), weights_shape, &weights_shape));
+  // The solution has the shape of the output of a type-1 transform of the
+  // data.
+  return NUFFTBaseShapeFn(c, 1);
+}
+
+Status NUFFTSenseShapeFn(InferenceContext* c) {
+  string transform_type;
+  TF_RETURN_IF_ERROR(c->GetAttr("transform_type", &transform_type));
+
+  ShapeHandle points_shape;
+  TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(1), 2, &points_shape));
+  DimensionHandle rank_handle = c->Dim(points_shape, -1);
+  if (!c->ValueKnown(rank_handle)) {
+    c->set_output(0, c->UnknownShape());
+    return Status::OK();
+  }
+  int64_t rank = c->Value(rank_handle);
+  if (rank < 1 || rank > 3) {
+    return errors::InvalidArgument(
+        "Dimension must be 1, 2 or 3, but is ", rank);
+  }
+  DimensionHandle num_points = c->Dim(points_shape, -2);
+
+  // The sensitivities have shape `[..., C] + grid_shape`.
+  ShapeHandle sensitivities_shape;
+  TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(2), rank + 1,
+                                        &sensitivities_shape));
+  ShapeHandle grid_shape;
+  TF_RETURN_IF_ERROR(c->Subshape(sensitivities_shape, -rank, &grid_shape));
+  DimensionHandle num_coils = c->Dim(sensitivities_shape, -rank - 1);
+
+  // The source is an image with shape `[...] + grid_shape` (type 2) or
+  // k-space data with shape `[..., C, M]` (type 1).
+  ShapeHandle source_shape = c->input(0);
+  ShapeHandle source_batch_shape;
+  if (transform_type == "type_2") {
+    TF_RETURN_IF_ERROR(c->WithRankAtLeast(source_shape, rank, &source_shape));
+    ShapeHandle source_grid_shape;
+    TF_RETURN_IF_ERROR(c->Subshape(source_shape, -rank, &source_grid_shape));
+    TF_RETURN_IF_ERROR(c->Merge(source_grid_shape, grid_shape, &grid_shape));
+    TF_RETURN_IF_ERROR(c->Subshape(source_shape, 0, -rank,
+                                   &source_batch_shape));
+  } else {
+    TF_RETURN_IF_ERROR(c->WithRankAtLeast(source_shape, 2, &source_shape));
+    TF_RETURN_IF_ERROR(c->Merge(c->Dim(source_shape, -1), num_points,
+                                &num_points));
+    TF_RETURN_IF_ERROR(c->Merge(c->Dim(source_shape, -2), num_coils,
+                                &num_coils));
+    TF_RETURN_IF_ERROR(c->Subshape(source_shape, 0, -2, &source_batch_shape));
+  }
+
+  // The batch shapes of the three inputs are broadcast.
+  ShapeHandle sensitivities_batch_shape;
+  TF_RETURN_IF_ERROR(c->Subshape(sensitivities_shape, 0, -rank - 1,
+                                 &sensitivities_batch_shape));
+  ShapeHandle points_batch_shape;
+  TF_RETURN_IF_ERROR(c->Subshape(points_shape, 0, -2, &points_batch_shape));
+  ShapeHandle output_batch_shape;
+  TF_RETURN_IF_ERROR(BroadcastBinaryOpOutputShapeFnHelper(
+      c, source_batch_shape, points_batch_shape, true, &output_batch_shape));
+  TF_RETURN_IF_ERROR(BroadcastBinaryOpOutputShapeFnHelper(
+      c, output_batch_shape, sensitivities_batch_shape, true,
+      &output_batch_shape));
+
+  ShapeHandle output_shape;
+  if (transform_type == "type_2") {
+    TF_RETURN_IF_ERROR(c->Concatenate(
+        output_batch_shape, c->Vector(num_coils), &output_shape));
+    TF_RETURN_IF_ERROR(c->Concatenate(
+        output_shape, c->Vector(num_points), &output_shape));
+  } else {
+    TF_RETURN_IF_ERROR(c->Concatenate(
+        output_batch_shape, grid_shape, &output_shape));
+  }
+  c->set_output(0, output_shape);
+  return Status::OK();
+}
+
+Status DensityCompensationShapeFn(InferenceContext* c) {
+  // The weights have the shape of the points, without the last dimension.
+  ShapeHandle points_shape;
+  TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(0), 2, &points_shape));
+  ShapeHandle weights_shape;
+  TF_RETURN_IF_ERROR(c->Subshape(points_shape, 0, -1, &weights_shape));
+  c->set_output(0, weights_shape);
+  return Status::OK();
+}
+
+
 REGISTER_OP("Interp")
   .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
   .Attr("Treal: {float32, float64} = DT_FLOAT")
@@ -200,6 +360,70 @@ target: The target grid. Has shape `[...] + grid_shape`, where the batch shape
   `...` is the result of broadcasting the batch shapes of `source` and `points`.
 )doc");
 
+REGISTER_OP("WeightedInterp")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Input("source: Tcomplex")
+  .Input("points: Treal")
+  .Input("weights: Treal")
+  .Output("target: Tcomplex")
+  .Attr("tol: float = 1e-6")
+  .SetShapeFn(InterpShapeFn)
+  .Doc(R"doc(
+Interpolate a regular grid at an arbitrary set of weighted points.
+
+Same as `Interp`, but the interpolated values are multiplied by `weights`.
+
+weights: Real weights of the target points. Must have the shape of `points`
+  without the last dimension.
+)doc");
+
+
+REGISTER_OP("WeightedSpread")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Attr("Tshape: {int32, int64} = DT_INT32")
+  .Input("source: Tcomplex")
+  .Input("points: Treal")
+  .Input("grid_shape: Tshape")
+  .Input("weights: Treal")
+  .Output("target: Tcomplex")
+  .Attr("tol: float = 1e-6")
+  .SetShapeFn(SpreadShapeFn)
+  .Doc(R"doc(
+Spread an arbitrary set of weighted points into a regular grid.
+
+Same as `Spread`, but the values are multiplied by `weights` before spreading.
+
+weights: Real weights of the source points. Must have the shape of `points`
+  without the last dimension.
+)doc");
+
+
+REGISTER_OP("InterpPointsGrad")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Input("source: Tcomplex")
+  .Input("points: Treal")
+  .Input("weights: Tcomplex")
+  .Output("grad_points: Treal")
+  .Attr("tol: float = 1e-6")
+  .SetShapeFn(NUFFTPointsGradShapeFn)
+  .Doc(R"doc(
+Computes the gradient of `interp` with respect to the points.
+
+Returns the gradient of `sum(real(weights * interp(source, points)))` with
+respect to `points`. All the partial derivatives are interpolated from
+`source` in a single pass, using the derivative of the spreading kernel.
+
+source: The source grid. Must have shape `[...] + grid_shape`.
+points: The non-uniform point coordinates. Must have shape `[..., M, N]`.
+weights: The weights of each target point. Must have shape `[..., M]`. The
+  batch dimensions of `source`, `points` and `weights` must be broadcastable.
+tol: The desired relative precision, as passed to `interp`.
+grad_points: The gradient. Has the same shape as `points`. It is summed over the
+  batch dimensions in which `points` is broadcast.
+)doc");
 
 REGISTER_OP("NUFFT")
   .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
@@ -213,10 +437,167 @@ REGISTER_OP("NUFFT")
   .Attr("fft_direction: {'forward', 'backward'} = 'forward'")
   .Attr("tol: float = 1e-6")
   .Attr("options: string = ''")
+  .Attr("reduce_batch_axes: list(int) = []")
   .SetShapeFn(NUFFTShapeFn)
   .Doc(R"doc(
 See Python docstring for `tfft.nufft`.
 )doc");
 
+
+REGISTER_OP("WeightedNUFFT")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Attr("Tshape: {int32, int64} = DT_INT32")
+  .Input("source: Tcomplex")
+  .Input("points: Treal")
+  .Input("grid_shape: Tshape")
+  .Input("weights: Treal")
+  .Output("target: Tcomplex")
+  .Attr("transform_type: {'type_1', 'type_2'} = 'type_2'")
+  .Attr("fft_direction: {'forward', 'backward'} = 'forward'")
+  .Attr("tol: float = 1e-6")
+  .Attr("options: string = ''")
+  .Attr("reduce_batch_axes: list(int) = []")
+  .SetShapeFn(NUFFTShapeFn)
+  .Doc(R"doc(
+See Python docstring for `tfft.nufft` (with `weights`).
+)doc");
+
+
+REGISTER_OP("NUFFTPointsGrad")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Input("source: Tcomplex")
+  .Input("points: Treal")
+  .Input("weights: Tcomplex")
+  .Output("grad_points: Treal")
+  .Attr("fft_direction: {'forward', 'backward'} = 'forward'")
+  .Attr("tol: float = 1e-6")
+  .Attr("options: string = ''")
+  .SetShapeFn(NUFFTPointsGradShapeFn)
+  .Doc(R"doc(
+Computes the gradient of a type-2 NUFFT with respect to the points.
+
+Returns the gradient of `sum(real(weights * nufft(source, points)))` with
+respect to `points`, where `nufft` is the type-2 transform. All the partial
+derivatives are interpolated from a single fine grid, using the derivative of
+the spreading kernel.
+
+source: The source grid. Must have shape `[...] + grid_shape`.
+points: The non-uniform point coordinates. Must have shape `[..., M, N]`.
+weights: The weights of each target point. Must have shape `[..., M]`. The
+  batch dimensions of `source`, `points` and `weights` must be broadcastable.
+grad_points: The gradient. Has the same shape as `points`. It is summed over the
+  batch dimensions in which `points` is broadcast.
+)doc");
+
+
+REGISTER_OP("NUFFTTangent")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Attr("Tshape: {int32, int64} = DT_INT32")
+  .Input("source: Tcomplex")
+  .Input("points: Treal")
+  .Input("grid_shape: Tshape")
+  .Input("source_tangent: Tcomplex")
+  .Input("points_tangent: Treal")
+  .Output("target_tangent: Tcomplex")
+  .Attr("transform_type: {'type_1', 'type_2'} = 'type_2'")
+  .Attr("fft_direction: {'forward', 'backward'} = 'forward'")
+  .Attr("tol: float = 1e-6")
+  .Attr("options: string = ''")
+  .SetShapeFn(NUFFTTangentShapeFn)
+  .Doc(R"doc(
+Computes the tangent of a NUFFT (forward-mode derivative).
+
+Returns the derivative of `nufft(source, points)` in the direction of
+`(source_tangent, points_tangent)`. The part due to the points uses the
+derivative of the spreading kernel, weighted by the tangent of each point's
+coordinates, and is computed in the same pass as the part due to the source,
+over the same sorted points.
+
+source: The source, as passed to `nufft`.
+points: The non-uniform point coordinates, as passed to `nufft`.
+grid_shape: The shape of the grid, as passed to `nufft`.
+source_tangent: The tangent of `source`. Must have the same shape as `source`.
+points_tangent: The tangent of `points`. Must have the same shape as `points`.
+target_tangent: The tangent of the output of `nufft`. Has the same shape.
+)doc");
+
+
+REGISTER_OP("NUFFTConjugateGradient")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Attr("Tshape: {int32, int64} = DT_INT32")
+  .Input("data: Tcomplex")
+  .Input("points: Treal")
+  .Input("grid_shape: Tshape")
+  .Input("weights: Treal")
+  .Output("target: Tcomplex")
+  .Attr("fft_direction: {'forward', 'backward'} = 'forward'")
+  .Attr("l2_regularization: float = 0.0")
+  .Attr("num_iterations: int = 10")
+  .Attr("rtol: float = 0.0")
+  .Attr("tol: float = 1e-6")
+  .Attr("options: string = ''")
+  .SetShapeFn(NUFFTConjugateGradientShapeFn)
+  .Doc(R"doc(
+See Python docstring for `tfft.nufft_conjugate_gradient`.
+)doc");
+
+REGISTER_OP("NUFFTSense")
+  .Attr("Tcomplex: {complex64, complex128} = DT_COMPLEX64")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Input("source: Tcomplex")
+  .Input("points: Treal")
+  .Input("sensitivities: Tcomplex")
+  .Output("target: Tcomplex")
+  .Attr("transform_type: {'type_1', 'type_2'} = 'type_2'")
+  .Attr("fft_direction: {'forward', 'backward'} = 'forward'")
+  .Attr("tol: float = 1e-6")
+  .Attr("options: string = ''")
+  .SetShapeFn(NUFFTSenseShapeFn)
+  .Doc(R"doc(
+See Python docstring for `tfft.nufft_sense`.
+)doc");
+
+REGISTER_OP("DensityCompensation")
+  .Attr("Treal: {float32, float64} = DT_FLOAT")
+  .Attr("Tshape: {int32, int64} = DT_INT32")
+  .Input("points: Treal")
+  .Input("grid_shape: Tshape")
+  .Output("weights: Treal")
+  .Attr("num_iterations: int = 10")
+  .Attr("rtol: float = 0.0")
+  .Attr("tol: float = 1e-6")
+  .Attr("options: string = ''")
+  .SetShapeFn(DensityCompensationShapeFn)
+  .Doc(R"doc(
+Computes sampling density compensation weights for a set of points.
+
+Runs the fixed-point iteration of Pipe and Menon (Magn. Reson. Med., 41:
+179-186, 1999), `w <- w / |C(w)|`, where
+`C(w) = interp(spread(w, points, grid_shape), points)`, starting from `w = 1`.
+The points are sorted once, and spreading and interpolation share the same
+grid, for all the iterations.
+
+See also `tfft.spread`, `tfft.interp`.
+
+points: The non-uniform point coordinates. Must have shape `[..., M, N]`, where
+  `M` is the number of non-uniform points, `N` is the rank of the grid and
+  `...` is any number of batch dimensions. `N` must be 1, 2 or 3. The
+  non-uniform coordinates must be in units of radians/pixel, i.e., in the range
+  `[-pi, pi]`.
+grid_shape: The shape of the grid used for spreading and interpolation, as
+  passed to `tfft.spread`.
+num_iterations: The maximum number of iterations.
+rtol: The relative tolerance for convergence. The iteration stops when the
+  relative change of the weights (in the 2-norm) is at most `rtol`. If 0, all
+  `num_iterations` iterations are run.
+tol: The desired relative precision of spreading and interpolation.
+weights: The density compensation weights. Has shape `[..., M]`.
+)doc");
+
+
 }  // namespace nufft
 }  // namespace tensorflow
@@ -27,17 +27,15 @@ _nufft_ops = tf.load_op_library(
     tf.compat.v1.resource_loader.get_path_to_datafile('_nufft_ops.so'))
 
 
-interp = _nufft_ops.interp
-spread = _nufft_ops.spread
-
-
 def nufft(source,  # pylint: disable=missing-function-docstring
           points,
           grid_shape=None,
           transform_type='type_2',
           fft_direction='forward',
           tol=1e-6,
-          options=None):
+          options=None,
+          weights=None,
+          reduce_batch_axes=None):
   """Computes the non-uniform discrete Fourier transform via NUFFT.
 
   Evaluates the type-1 or type-2 non-uniform discrete Fourier transform (NUDFT)
@@ -87,6 +85,24 @@ def nufft(source,  # pylint: disable=missing-function-docstring
       change the result (beyond the precision specified by `tol`). You might
       be able to optimize performance or memory usage by tweaking these
       options. See `tfft.Options` for details.
+    weights: An optional `tf.Tensor` of the same type as `points`, with shape
+      `[..., M]`, equal to the shape of `points` without the last dimension.
+      Real weights of the non-uniform points (e.g., density compensation
+      weights). For type-1 transforms, the source point set is multiplied by
+      the weights before the transform. For type-2 transforms, the target point
+      set is multiplied by the weights after the transform. On the CPU, the
+      weights are applied while spreading or interpolating, with no additional
+      pass over the data. On the GPU, they are applied in a separate pass,
+      which for type-1 transforms also needs a temporary copy of the source
+      point set.
+    reduce_batch_axes: An optional list of `int`. Batch axes over which the
+      output of a type-1 transform is summed (e.g., the frames which are binned
+      into one image). Indexes the batch shape `...` of the output; negative
+      axes count from its end. Equivalent to `tf.math.reduce_sum` over these
+      axes of the output, but the transforms which are summed are spread onto
+      a single oversampled grid, so that the output needs a single FFT and
+      the unreduced output is never stored. Only supported for type-1
+      transforms on the CPU.
 
   Returns:
     A `tf.Tensor` of the same type as `source`. The target point set, for
@@ -95,7 +111,11 @@ def nufft(source,  # pylint: disable=missing-function-docstring
     the batch shape `...` is the result of broadcasting the batch shapes of
     `source` and `points`. If `transform_type` is `"type_1"`, the output has
     shape `[...] + grid_shape`, where the batch shape `...` is the result of
-    broadcasting the batch shapes of `source` and `points`.
+    broadcasting the batch shapes of `source` and `points`, without the axes
+    in `reduce_batch_axes`.
+
+  Raises:
+    ValueError: If `reduce_batch_axes` is given for a type-2 transform.
 
   References:
     1. Barnett, A.H., Magland, J. and Klinteberg, L. af (2019), A parallel
@@ -115,16 +135,488 @@ def nufft(source,  # pylint: disable=missing-function-docstring
     # the C++ op. For type-1 transform the C++ op already implements the
     # relevant checks.
     grid_shape = tf.constant([], dtype=tf.int32)
+  reduce_batch_axes = list(reduce_batch_axes or [])
+  if reduce_batch_axes and transform_type != 'type_1':
+    raise ValueError(
+        "`reduce_batch_axes` is only supported for type-1 transforms, but "
+        "got transform type: {}".format(transform_type))
+
+  options = options or nufft_options.Options()
+  attrs = dict(transform_type=transform_type,
+               fft_direction=fft_direction,
+               tol=tol,
+               options=options.to_proto().SerializeToString(),
+               reduce_batch_axes=reduce_batch_axes)
+  if weights is None:
+    return _nufft_ops.nufft(source, points, grid_shape, **attrs)
+  points = tf.convert_to_tensor(points)
+  weights = tf.convert_to_tensor(weights, dtype=points.dtype)
+  return _nufft_ops.weighted_nufft(source, points, grid_shape, weights,
+                                   **attrs)
+
+
+def interp(source, points, tol=1e-6, weights=None, name=None):
+  """Interpolates a regular grid at an arbitrary set of points.
+
+  This function can be used to perform the interpolation step of the NUFFT,
+  without the FFT or the deconvolution.
+
+  See also `tfft.nufft`, `tfft.spread`.
+
+  Args:
+    source: A `tf.Tensor` of type `complex64` or `complex128`. The source grid.
+      Must have shape `[...] + grid_shape`, where `grid_shape` is the shape of
+      the grid and `...` is any number of batch dimensions. `grid_shape` must
+      have rank 1, 2 or 3.
+    points: A `tf.Tensor` of type `float32` or `float64`. The target
+      non-uniform point coordinates. Must have shape `[..., M, N]`, where `M`
+      is the number of non-uniform points, `N` is the rank of the grid and
+      `...` is any number of batch dimensions, which must be broadcastable with
+      the batch dimensions of `source`. `N` must be 1, 2 or 3 and must be equal
+      to the rank of `grid_shape`. The non-uniform coordinates must be in units
+      of radians/pixel, i.e., in the range `[-pi, pi]`.
+    tol: An optional `float`. The desired relative precision. Should be in the
+      range `[1e-06, 1e-01]` for `complex64` types and `[1e-14, 1e-01]` for
+      `complex128` types. The computation may take longer for smaller values of
+      `tol`. Defaults to `1e-06`.
+    weights: An optional `tf.Tensor` of the same type as `points`, with shape
+      `[..., M]`, equal to the shape of `points` without the last dimension.
+      Real weights of the target points, which multiply the interpolated
+      values. On the GPU, the weights are applied in a separate pass.
+    name: A name for the operation (optional).
+
+  Returns:
+    A `tf.Tensor` of the same type as `source`. The target point set. Has shape
+    `[..., M]`, where the batch shape `...` is the result of broadcasting the
+    batch shapes of `source` and `points`.
+  """
+  if weights is None:
+    return _nufft_ops.interp(source, points, tol=tol, name=name)
+  points = tf.convert_to_tensor(points)
+  weights = tf.convert_to_tensor(weights, dtype=points.dtype)
+  return _nufft_ops.weighted_interp(source, points, weights, tol=tol,
+                                    name=name)
+
+
+def spread(source, points, grid_shape, tol=1e-6, weights=None, name=None):
+  """Spreads an arbitrary set of points into a regular grid.
+
+  This function can be used to perform the spreading step of the NUFFT,
+  without the FFT or the deconvolution.
+
+  See also `tfft.nufft`, `tfft.interp`.
+
+  Args:
+    source: A `tf.Tensor` of type `complex64` or `complex128`. The source point
+      set. Must have shape `[..., M]`, where `M` is the number of non-uniform
+      points and `...` is any number of batch dimensions.
+    points: A `tf.Tensor` of type `float32` or `float64`. The source
+      non-uniform point coordinates. Must have shape `[..., M, N]`, where `M`
+      is the number of non-uniform points, `N` is the rank of the grid and
+      `...` is any number of batch dimensions, which must be broadcastable with
+      the batch dimensions of `source`. `N` must be 1, 2 or 3 and must be equal
+      to the rank of `grid_shape`. The non-uniform coordinates must be in units
+      of radians/pixel, i.e., in the range `[-pi, pi]`.
+    grid_shape: A 1D `tf.Tensor` of type `int32` or `int64`. The shape of the
+      output grid.
+    tol: An optional `float`. The desired relative precision. Should be in the
+      range `[1e-06, 1e-01]` for `complex64` types and `[1e-14, 1e-01]` for
+      `complex128` types. The computation may take longer for smaller values of
+      `tol`. Defaults to `1e-06`.
+    weights: An optional `tf.Tensor` of the same type as `points`, with shape
+      `[..., M]`, equal to the shape of `points` without the last dimension.
+      Real weights of the source points, which multiply the values before
+      spreading. On the GPU, the weights are applied in a separate pass over a
+      temporary copy of the source point set.
+    name: A name for the operation (optional).
+
+  Returns:
+    A `tf.Tensor` of the same type as `source`. The target grid. Has shape
+    `[...] + grid_shape`, where the batch shape `...` is the result of
+    broadcasting the batch shapes of `source` and `points`.
+  """
+  if weights is None:
+    return _nufft_ops.spread(source, points, grid_shape, tol=tol, name=name)
+  points = tf.convert_to_tensor(points)
+  weights = tf.convert_to_tensor(weights, dtype=points.dtype)
+  return _nufft_ops.weighted_spread(source, points, grid_shape, weights,
+                                    tol=tol, name=name)
+
+
+def density_compensation(points,
+                         grid_shape,
+                         num_iterations=10,
+                         rtol=0.0,
+                         tol=1e-6,
+                         options=None,
+                         name=None):
+  """Computes sampling density compensation weights for a set of points.
+
+  Runs the fixed-point iteration of Pipe and Menon, `w <- w / |C(w)|`, where
+  `C(w) = interp(spread(w, points, grid_shape), points)`, starting from
+  `w = 1`. The points are sorted once, and spreading and interpolation share
+  the same grid, for all the iterations.
+
+  See also `tfft.spread`, `tfft.interp`.
+
+  ```{note}
+  This op is currently only implemented on the CPU and is not differentiable.
+  ```
+
+  Args:
+    points: A `tf.Tensor` of type `float32` or `float64`. The non-uniform point
+      coordinates. Must have shape `[..., M, N]`, where `M` is the number of
+      non-uniform points, `N` is the rank of the grid and `...` is any number
+      of batch dimensions. `N` must be 1, 2 or 3. The non-uniform coordinates
+      must be in units of radians/pixel, i.e., in the range `[-pi, pi]`.
+    grid_shape: A 1D `tf.Tensor` of type `int32` or `int64`. The shape of the
+      grid used for spreading and interpolation. Must have `N` elements.
+    num_iterations: An optional `int`. The maximum number of iterations. Must
+      be non-negative. Defaults to 10.
+    rtol: An optional `float`. The relative tolerance for convergence. The
+      iteration stops when the relative change of the weights (in the 2-norm)
+      is at most `rtol`. If 0, all `num_iterations` iterations are run.
+      Defaults to 0.
+    tol: An optional `float`. The desired relative precision of spreading and
+      interpolation. See `tfft.spread`. Defaults to `1e-06`.
+    options: A `tfft.Options` structure. See `tfft.nufft`.
+    name: A name for the operation (optional).
+
+  Returns:
+    A `tf.Tensor` of the same type as `points`, with shape `[..., M]`. The
+    density compensation weights.
+
+  Raises:
+    ValueError: If `num_iterations` or `rtol` are negative, or if the rank of
+      `points` or the size of its last dimension are invalid.
+
+  References:
+    1. Pipe, J. G., & Menon, P. (1999). Sampling density compensation in MRI:
+       Rationale and an iterative numerical solution. Magnetic Resonance in
+       Medicine, 41(1), 179-186.
+  """
+  if num_iterations < 0:
+    raise ValueError(
+        "`num_iterations` must be non-negative, but got: {}".format(
+            num_iterations))
+  if rtol < 0:
+    raise ValueError(
+        "`rtol` must be non-negative, but got: {}".format(rtol))
+  points = tf.convert_to_tensor(points)
+  if points.shape.rank is not None and points.shape.rank < 2:
+    raise ValueError(
+        "`points` must have rank of at least 2, but got shape: {}".format(
+            points.shape))
+  if points.shape[-1] is not None and points.shape[-1] not in (1, 2, 3):
+    raise ValueError(
+        "The last dimension of `points` must be 1, 2 or 3, but got: {}".format(
+            points.shape[-1]))
 
   options = options or nufft_options.Options()
-  return _nufft_ops.nufft(source, points, grid_shape,
-                          transform_type=transform_type,
-                          fft_direction=fft_direction,
-                          tol=tol,
-                          options=options.to_proto().SerializeToString())
+  return _nufft_ops.density_compensation(
+      points, grid_shape,
+      num_iterations=num_iterations,
+      rtol=rtol,
+      tol=tol,
+      options=options.to_proto().SerializeToString(),
+      name=name)
+
+
+def nufft_gram_kernel(points,
+                      grid_shape,
+                      weights=None,
+                      fft_direction='forward',
+                      tol=1e-6,
+                      options=None):
+  """Computes the Toeplitz kernel of the Gram operator of the NUFFT.
+
+  Let `A` be the type-2 transform from a grid of shape `grid_shape` to the
+  non-uniform `points`, with the given `fft_direction`, and let `W` be a
+  diagonal matrix of (density compensation) `weights`. Then `A^H W A` is a
+  convolution on the grid, whose kernel is the point spread function of the
+  trajectory. This function evaluates that kernel with a single type-1
+  transform onto a grid with twice the size in each dimension and returns its
+  Fourier transform, ready to be applied with `tfft.nufft_gram`.
+
+  The kernel only depends on `points` and `weights`, so it can be computed once
+  and then reused to apply `A^H W A` to many inputs (e.g., on every iteration
+  of an iterative reconstruction), each at the cost of two FFTs on the
+  oversampled grid, instead of two NUFFTs.
+
+  Args:
+    points: A `tf.Tensor` of type `float32` or `float64`. The non-uniform
+      points. Must have shape `[..., M, N]`, where `M` is the number of
+      non-uniform points, `N` is the rank of the grid and `...` is any number of
+      batch dimensions.
+    grid_shape: A 1D `tf.Tensor` of type `int32` or `int64`. The shape of the
+      grid on which `A` operates. Must have `N` elements.
+    weights: An optional `tf.Tensor` with shape `[..., M]`, whose batch
+      dimensions must be broadcastable with those of `points`. The weights `W`
+      of the non-uniform points. Defaults to ones.
+    fft_direction: An optional `str` from `"forward"`, `"backward"`. The
+      direction of the type-2 transform `A`. Defaults to `"forward"`.
+    tol: An optional `float`. The desired relative precision of the kernel.
+      See `tfft.nufft`.
+    options: A `tfft.Options` structure. See `tfft.nufft`.
+
+  Returns:
+    A `tf.Tensor` of the complex type corresponding to `points`, with shape
+    `[...] + 2 * grid_shape`, where `...` is the result of broadcasting the
+    batch shapes of `points` and `weights`.
+  """
+  fft_direction = _validate_enum(
+      fft_direction, {'backward', 'forward'}, 'fft_direction')
+  points = tf.convert_to_tensor(points)
+  rank = points.shape[-1]
+  grid_shape = tf.convert_to_tensor(grid_shape)
+  dtype = _complex_dtype(points.dtype)
+  if weights is None:
+    weights = tf.ones(tf.shape(points)[:-1], dtype=dtype)
+  weights = tf.cast(weights, dtype)
+
+  # The entries of `A^H W A` are `sum_j w_j exp(+/-i (k - l) x_j)` with the
+  # sign of the adjoint transform, for differences `k - l` in `(-n, n)` along
+  # each dimension. This is a type-1 transform onto a grid of size `2n`.
+  adjoint_fft_direction = (
+      'backward' if fft_direction == 'forward' else 'forward')
+  psf = nufft(weights, points,
+              grid_shape=2 * grid_shape,
+              transform_type='type_1',
+              fft_direction=adjoint_fft_direction,
+              tol=tol,
+              options=options)
+
+  # The zero difference is at index `n` of the centered grid. Move it to index
+  # 0 to obtain the first column of the circulant embedding.
+  psf = tf.roll(psf, shift=tf.unstack(grid_shape, num=rank),
+                axis=list(range(-rank, 0)))
+  return _fftn(psf, rank)
+
+
+def nufft_gram(source, kernel, rank):
+  """Applies the Gram operator of the NUFFT using its Toeplitz kernel.
+
+  Computes `A^H W A` applied to `source`, where `A`, `W` are defined by the
+  `kernel` computed by `tfft.nufft_gram_kernel`. This is a zero-padded
+  convolution on the oversampled grid, evaluated with FFTs.
+
+  Args:
+    source: A `tf.Tensor` of type `complex64` or `complex128`, with shape
+      `[...] + grid_shape`.
+    kernel: A `tf.Tensor` of the same type as `source`, with shape
+      `[...] + 2 * grid_shape`, as returned by `tfft.nufft_gram_kernel`. Its
+      batch dimensions must be broadcastable with those of `source`.
+    rank: A Python `int`. The rank of the grid, i.e., the number of elements of
+      `grid_shape`. Must be 1, 2 or 3.
+
+  Returns:
+    A `tf.Tensor` of the same type as `source`, with shape `[...] + grid_shape`,
+    where `...` is the result of broadcasting the batch shapes of `source` and
+    `kernel`.
+  """
+  source = tf.convert_to_tensor(source)
+  grid_shape = tf.shape(source)[-rank:]
+
+  # Zero-pad the source to the size of the kernel, leaving the source in the
+  # leading corner so that the circular convolution does not wrap around.
+  paddings = tf.concat([
+      tf.zeros([tf.rank(source) - rank, 2], dtype=tf.int32),
+      tf.stack([tf.zeros([rank], dtype=tf.int32), grid_shape], axis=1)], 0)
+  target = tf.pad(source, paddings)
+  target = _ifftn(_fftn(target, rank) * kernel, rank)
+  return target[(Ellipsis,) + tuple(
+      slice(0, grid_shape[d]) for d in range(rank))]
+
+
+def _fftn(x, rank):
+  """Computes the FFT over the innermost `rank` dimensions of `x`."""
+  fft_fns = {1: tf.signal.fft, 2: tf.signal.fft2d, 3: tf.signal.fft3d}
+  if rank not in fft_fns:
+    raise ValueError("rank must be 1, 2 or 3, but got: {}".format(rank))
+  return fft_fns[rank](x)
+
+
+def _ifftn(x, rank):
+  """Computes the inverse FFT over the innermost `rank` dimensions of `x`."""
+  ifft_fns = {1: tf.signal.ifft, 2: tf.signal.ifft2d, 3: tf.signal.ifft3d}
+  if rank not in ifft_fns:
+    raise ValueError("rank must be 1, 2 or 3, but got: {}".format(rank))
+  return ifft_fns[rank](x)
+
+
+def nufft_conjugate_gradient(data,
+                             points,
+                             grid_shape,
+                             weights=None,
+                             l2_regularization=0.0,
+                             num_iterations=10,
+                             rtol=0.0,
+                             fft_direction='forward',
+                             tol=1e-6,
+                             options=None):
+  """Solves a regularized NUFFT least squares problem by conjugate gradient.
+
+  Let `A` be the type-2 transform from a grid of shape `grid_shape` to the
+  non-uniform `points`, with the given `fft_direction`. This function finds the
+  grid `x` that minimizes `||W^(1/2) (A x - y)||^2 + lambda ||x||^2`, by
+  running the conjugate gradient method on the normal equations
+  `(A^H W A + lambda I) x = A^H W y`, starting from `x = 0`.
+
+  All the iterations run within a single op, with the same forward and adjoint
+  plans and the same work vectors. The points are sorted once per element of
+  the points batch, and the sort order is shared by both plans. The problems in the batch dimensions of `data` in which the points
+  are broadcast (e.g., coils) are solved together.
+
+  ```{note}
+  This op is currently only implemented on the CPU and is not differentiable.
+  ```
+
+  Args:
+    data: A `tf.Tensor` of type `complex64` or `complex128`. The data `y` at the
+      non-uniform points. Must have shape `[..., M]`, where `M` is the number of
+      non-uniform points and `...` is any number of batch dimensions.
+    points: A `tf.Tensor` of type `float32` or `float64`. The non-uniform
+      points. Must have shape `[..., M, N]`, where `N` is the rank of the grid
+      and `...` is any number of batch dimensions, which must be broadcastable
+      with the batch dimensions of `data`.
+    grid_shape: A 1D `tf.Tensor` of type `int32` or `int64`. The shape of the
+      grid. Must have `N` elements.
+    weights: An optional `tf.Tensor` of the real type corresponding to `data`,
+      with shape `[..., M]`, broadcastable to the shape of `points` without the
+      last dimension. The (density compensation) weights `W` of the
+      non-uniform points. Defaults to ones.
+    l2_regularization: An optional `float`. The Tikhonov regularization
+      parameter `lambda`. Defaults to 0.
+    num_iterations: An optional `int`. The maximum number of iterations.
+      Defaults to 10.
+    rtol: An optional `float`. The relative tolerance for convergence. The
+      iteration stops when the norm of the residual of the normal equations is
+      at most `rtol` times the norm of `A^H W y`, for all the problems in a
+      batch. If 0, all `num_iterations` iterations are run. Defaults to 0.
+    fft_direction: An optional `str` from `"forward"`, `"backward"`. The
+      direction of the type-2 transform `A`. Defaults to `"forward"`.
+    tol: An optional `float`. The desired relative precision of the
+      transforms. See `tfft.nufft`.
+    options: A `tfft.Options` structure. See `tfft.nufft`.
+
+  Returns:
+    A `tf.Tensor` of the same type as `data`, with shape `[...] + grid_shape`,
+    where `...` is the result of broadcasting the batch shapes of `data` and
+    `points`.
+  """
+  fft_direction = _validate_enum(
+      fft_direction, {'backward', 'forward'}, 'fft_direction')
+  data = tf.convert_to_tensor(data)
+  points = tf.convert_to_tensor(points)
+  if weights is None:
+    weights = tf.ones(tf.shape(points)[:-1], dtype=points.dtype)
+  else:
+    weights = tf.broadcast_to(tf.cast(weights, points.dtype),
+                              tf.shape(points)[:-1])
+
+  options = options or nufft_options.Options()
+  return _nufft_ops.nufft_conjugate_gradient(
+      data, points, grid_shape, weights,
+      fft_direction=fft_direction,
+      l2_regularization=l2_regularization,
+      num_iterations=num_iterations,
+      rtol=rtol,
+      tol=tol,
+      options=options.to_proto().SerializeToString())
+
+
+def nufft_sense(source,
+                points,
+                sensitivities,
+                transform_type='type_2',
+                fft_direction='forward',
+                tol=1e-6,
+                options=None):
+  """Applies the SENSE forward or adjoint operator via NUFFT.
+
+  The SENSE forward operator (`transform_type="type_2"`) modulates an image by
+  the sensitivity of each coil and computes the type-2 NUFFT of each modulated
+  image. The adjoint operator (`transform_type="type_1"`) computes the type-1
+  NUFFT of the data of each coil, demodulates it by the conjugate of the
+  sensitivity of the coil, and sums over the coils. That is, for coil
+  sensitivities `s_c`:
+
+  * `"type_2"`: `target[..., c, :] = nufft(s_c * source, points)`.
+  * `"type_1"`:
+    `target = sum_c conj(s_c) * nufft(source[..., c, :], points, type_1)`.
+
+  This is equivalent to, but faster and more memory-efficient than, the
+  explicit expression with `tfft.nufft`. The sensitivities are applied by the
+  deconvolution step of the NUFFT, so the per-coil images are not stored.
+
+  ```{warning}
+  Currently only supported on the CPU.
+  ```
+
+  Args:
+    source: A `tf.Tensor` of type `complex64` or `complex128`. For type-2
+      transforms, the image, with shape `[...] + grid_shape`. For type-1
+      transforms, the data of each coil, with shape `[..., C, M]`, where `C` is
+      the number of coils and `M` is the number of non-uniform points.
+    points: A `tf.Tensor` of type `float32` or `float64`. The non-uniform point
+      coordinates, with shape `[..., M, N]`, where `N` is the rank of the grid.
+      Must be in the range `[-pi, pi]`. See `tfft.nufft` for details.
+    sensitivities: A `tf.Tensor` of the same type as `source`. The coil
+      sensitivities, with shape `[..., C] + grid_shape`. The batch dimensions
+      of `source`, `points` and `sensitivities` must be broadcastable.
+    transform_type: An optional `str` from `"type_1"`, `"type_2"`. Whether to
+      apply the adjoint (`"type_1"`) or the forward (`"type_2"`) operator.
+    fft_direction: An optional `str` from `"forward"`, `"backward"`. The sign of
+      the exponent in the Fourier transform. See `tfft.nufft` for details.
+    tol: An optional `float`. The desired relative precision. See `tfft.nufft`
+      for details.
+    options: A `tfft.Options` structure specifying advanced options. See
+      `tfft.nufft` for details.
+
+  Returns:
+    A `tf.Tensor` of the same type as `source`. For type-2 transforms, the data
+    of each coil, with shape `[..., C, M]`. For type-1 transforms, the image,
+    with shape `[...] + grid_shape`. `...` is the result of broadcasting the
+    batch shapes of `source`, `points` and `sensitivities`.
+  """
+  transform_type = _validate_enum(
+      transform_type, {'type_1', 'type_2'}, 'transform_type')
+  fft_direction = _validate_enum(
+      fft_direction, {'backward', 'forward'}, 'fft_direction')
+
+  options = options or nufft_options.Options()
+  return _nufft_ops.nufft_sense(source, points, sensitivities,
+                                transform_type=transform_type,
+                                fft_direction=fft_direction,
+                                tol=tol,
+                                options=options.to_proto().SerializeToString())
+
+
+def _nufft_sense_unfused(source, points, sensitivities, transform_type,
+                         fft_direction, tol, options):
+  """Same as `nufft_sense`, computed with `nufft` and the per-coil images."""
+  points = tf.convert_to_tensor(points)
+  sensitivities = tf.convert_to_tensor(sensitivities)
+  rank = points.shape[-1]
+  if transform_type == 'type_2':
+    return nufft(tf.expand_dims(source, -(rank + 1)) * sensitivities,
+                 tf.expand_dims(points, -3),
+                 transform_type='type_2',
+                 fft_direction=fft_direction,
+                 tol=tol,
+                 options=options)
+  images = nufft(source, tf.expand_dims(points, -3),
+                 grid_shape=tf.shape(sensitivities)[-rank:],
+                 transform_type='type_1',
+                 fft_direction=fft_direction,
+                 tol=tol,
+                 options=options)
+  return tf.math.reduce_sum(tf.math.conj(sensitivities) * images,
+                            axis=-(rank + 1))
 
 
 @tf.RegisterGradient("NUFFT")
+@tf.RegisterGradient("WeightedNUFFT")
 def _nufft_grad(op, grad):
   """Gradients for `nufft`.
 
@@ -138,7 +630,7 @@ def _nufft_grad(op, grad):
   # Get inputs.
   source = op.inputs[0]
   points = op.inputs[1]
-  grid_shape = op.inputs[2]
+  weights = _optional_input(op, 3)
   transform_type = op.get_attr('transform_type').decode()
   fft_direction = op.get_attr('fft_direction').decode()
   tol = op.get_attr('tol')
@@ -146,12 +638,79 @@ def _nufft_grad(op, grad):
   options_proto.ParseFromString(op.get_attr('options'))
   options = nufft_options.Options.from_proto(options_proto)
   rank = points.shape[-1]
-  dtype = source.dtype
   if transform_type == 'type_1':
     grid_shape = op.inputs[2]
   elif transform_type == 'type_2':
     grid_shape = tf.shape(source)[-rank:]
 
+  # The gradient of a sum over batch axes is broadcast over them. Then the
+  # gradients are those of the unreduced transform.
+  reduce_batch_axes = op.get_attr('reduce_batch_axes')
+  if reduce_batch_axes:
+    grad = _broadcast_over_reduced_axes(grad, source, points, grid_shape,
+                                        reduce_batch_axes)
+
+  if _is_gpu_device(points.device):
+    grad_source, grad_points = _nufft_vjp(
+        grad, source, points, grid_shape, weights, transform_type,
+        fft_direction, tol, options, native_points_grad=False)
+  else:
+    grad_source, grad_points = _nufft_vjp_with_tangent(
+        grad, source, points, grid_shape, weights, transform_type,
+        fft_direction, tol, options)
+
+  # The gradient with respect to the weights needs the unweighted transform
+  # of the type opposite to that of the gradient with respect to the source,
+  # so it is only computed if requested.
+  grad_weights = None
+  if weights is not None and _input_grad_needed(op, 3):
+    if transform_type == 'type_1':
+      grad_weights = _point_weights_grad(
+          nufft(grad, points,
+                transform_type='type_2',
+                fft_direction=_opposite_fft_direction(fft_direction),
+                tol=tol,
+                options=options),
+          source, weights)
+    elif transform_type == 'type_2':
+      grad_weights = _point_weights_grad(
+          grad,
+          nufft(source, points,
+                transform_type='type_2',
+                fft_direction=fft_direction,
+                tol=tol,
+                options=options),
+          weights)
+
+  # Gradient with respect to the grid shape is not meaningful.
+  return _with_weights_grad([grad_source, grad_points, None], weights,
+                            grad_weights)
+
+
+def _nufft_vjp(grad, source, points, grid_shape, weights, transform_type,
+               fft_direction, tol, options, native_points_grad):
+  """Computes the vector-Jacobian product of `nufft`.
+
+  Args:
+    grad: Gradient with respect to the output of `nufft`.
+    source: The `source` input of `nufft`.
+    points: The `points` input of `nufft`.
+    grid_shape: The shape of the grid.
+    weights: The `weights` input of `nufft`, or `None`.
+    transform_type: The type of the transform.
+    fft_direction: The direction of the FFT.
+    tol: The desired relative precision.
+    options: A `tfft.Options` object.
+    native_points_grad: If `True`, the points gradient is computed by the
+      `NUFFTPointsGrad` op (CPU only). Otherwise it is computed using type-2
+      transforms.
+
+  Returns:
+    A tuple `(grad_source, grad_points)`, with the shapes of `source` and
+    `points`.
+  """
+  rank = points.shape[-1]
+
   # Gradient of type-1 transform is computed using type-2 transform and
   # viceversa.
   if transform_type == 'type_1':    # nonuniform to uniform
@@ -161,21 +720,215 @@ def _nufft_grad(op, grad):
 
   # Gradient of forward transform is computed using backward transform and
   # viceversa.
-  if fft_direction == 'backward':
-    grad_fft_direction = 'forward'
-  elif fft_direction == 'forward':
-    grad_fft_direction = 'backward'
+  grad_fft_direction = _opposite_fft_direction(fft_direction)
 
-  # Compute the gradients with respect to the `source` input.
+  # Compute the gradients with respect to the `source` input. The weights are
+  # applied by the adjoint transform in the same way.
   grad_source = nufft(grad,
                       points,
                       grid_shape=grid_shape,
                       transform_type=grad_transform_type,
                       fft_direction=grad_fft_direction,
                       tol=tol,
-                      options=options)
+                      options=options,
+                      weights=weights)
+
+  # Compute the gradients with respect to the `points` input. This is the
+  # real part of the derivative of a type-2 transform, weighted by the other
+  # operand. On the CPU, the derivatives along all axes are interpolated from
+  # a single fine grid. Otherwise, each of them is computed by a separate
+  # type-2 transform.
+  grad = tf.math.conj(grad)
+  if transform_type == 'type_2':
+    grid_values, point_values = source, grad
+  elif transform_type == 'type_1':
+    grid_values, point_values = grad, source
+  if weights is not None:
+    point_values *= tf.cast(weights, point_values.dtype)
+  if native_points_grad:
+    grad_points = _nufft_ops.nufft_points_grad(
+        grid_values, points, point_values,
+        fft_direction=fft_direction,
+        tol=tol,
+        options=options.to_proto().SerializeToString())
+  else:
+    grad_points = _nufft_points_grad_with_transforms(
+        grid_values, points, point_values, fft_direction, tol, options)
+
+  # Handle broadcasting. The points gradient is already reduced over the
+  # batch dimensions in which the points are broadcast.
+  source_elem_rank = 1 if transform_type == 'type_1' else rank
+  source_batch_shape = tf.shape(source)[:-source_elem_rank]
+  points_batch_shape = tf.shape(points)[:-2]
+  source_reduction_indices, _ = (
+      tf.raw_ops.BroadcastGradientArgs(s0=source_batch_shape,
+                                       s1=points_batch_shape))
+  grad_source = tf.reshape(
+      tf.math.reduce_sum(grad_source, source_reduction_indices),
+      tf.shape(source))
+  grad_points = tf.reshape(grad_points, tf.shape(points))
+  return grad_source, grad_points
+
 
-  # Compute the gradients with respect to the `points` input.
+def _nufft_vjp_with_tangent(grad, source, points, grid_shape, weights,
+                            transform_type, fft_direction, tol, options):
+  """Same as `_nufft_vjp`, differentiable with the `NUFFTTangent` op.
+
+  The vector-Jacobian product is linear in `grad`, so its gradient with
+  respect to `grad` is the Jacobian-vector product of `nufft`. This is how
+  forward-mode autodiff (e.g., `tf.autodiff.ForwardAccumulator`) evaluates
+  the tangent of `nufft`, which is computed here by the `NUFFTTangent` op in a
+  single pass, instead of by transposing each of the ops above. The
+  gradients with respect to `source` and `points` (second-order terms) are
+  those of the transform-based product. The weights, if any, are treated as
+  constants.
+
+  For the arguments, see `_nufft_vjp`.
+  """
+  @tf.custom_gradient
+  def vjp(grad, source, points):
+    outputs = _nufft_vjp(grad, source, points, grid_shape, weights,
+                         transform_type, fft_direction, tol, options,
+                         native_points_grad=True)
+
+    def vjp_grad(source_tangent, points_tangent):
+      if source_tangent is None:
+        source_tangent = tf.zeros_like(source)
+      if points_tangent is None:
+        points_tangent = tf.zeros_like(points)
+      # The weights multiply the source of a type-1 transform and the target
+      # of a type-2 transform, and so does their tangent.
+      weighted_source, weighted_source_tangent = source, source_tangent
+      if weights is not None and transform_type == 'type_1':
+        weighted_source *= tf.cast(weights, source.dtype)
+        weighted_source_tangent *= tf.cast(weights, source.dtype)
+      grad_grad = _nufft_ops.nufft_tangent(
+          weighted_source, points, grid_shape, weighted_source_tangent,
+          points_tangent,
+          transform_type=transform_type,
+          fft_direction=fft_direction,
+          tol=tol,
+          options=options.to_proto().SerializeToString())
+      if weights is not None and transform_type == 'type_2':
+        grad_grad *= tf.cast(weights, grad_grad.dtype)
+      with tf.GradientTape() as tape:
+        tape.watch([source, points])
+        outputs = _nufft_vjp(grad, source, points, grid_shape, weights,
+                             transform_type, fft_direction, tol, options,
+                             native_points_grad=False)
+      grad_source, grad_points = tape.gradient(
+          outputs, [source, points],
+          output_gradients=[source_tangent, points_tangent])
+      return grad_grad, grad_source, grad_points
+
+    return outputs, vjp_grad
+
+  return vjp(grad, source, points)
+
+
+def _is_gpu_device(device):
+  """Returns `True` if `device` is the name of a GPU device."""
+  return bool(device) and tf.DeviceSpec.from_string(device).device_type == 'GPU'
+
+
+def _opposite_fft_direction(fft_direction):
+  """Returns the FFT direction opposite to `fft_direction`."""
+  if fft_direction == 'backward':
+    return 'forward'
+  return 'backward'
+
+
+def _optional_input(op, index):
+  """Returns input `index` of `op`, or `None` if `op` has no such input.
+
+  The weighted ops (e.g., `WeightedNUFFT`) have the weights after the inputs
+  of the corresponding unweighted ops.
+  """
+  if index < len(op.inputs):
+    return op.inputs[index]
+  return None
+
+
+def _with_weights_grad(grads, weights, grad_weights):
+  """Appends `grad_weights` to `grads` if the op has a `weights` input."""
+  if weights is None:
+    return grads
+  return grads + [grad_weights]
+
+
+def _input_grad_needed(op, index):
+  """Returns `False` if the gradient for input `index` of `op` is unused."""
+  skip_input_indices = getattr(op, 'skip_input_indices', None)
+  return skip_input_indices is None or index not in skip_input_indices
+
+
+def _broadcast_over_reduced_axes(grad, source, points, grid_shape,
+                                 reduce_batch_axes):
+  """Broadcasts the gradient of a type-1 `nufft` over its reduced axes.
+
+  Args:
+    grad: The gradient with respect to the output of `nufft`, without the
+      axes in `reduce_batch_axes`.
+    source: The `source` input of `nufft`, with shape `[..., M]`.
+    points: The `points` input of `nufft`, with shape `[..., M, N]`.
+    grid_shape: The shape of the grid.
+    reduce_batch_axes: The batch axes over which the output was summed.
+
+  Returns:
+    The gradient with respect to the unreduced output, with shape
+    `[...] + grid_shape`, where `...` is the result of broadcasting the batch
+    shapes of `source` and `points`.
+  """
+  batch_shape = tf.broadcast_dynamic_shape(tf.shape(source)[:-1],
+                                           tf.shape(points)[:-2])
+  num_batch_dims = max(source.shape.rank - 1, points.shape.rank - 2)
+  for axis in sorted(axis % num_batch_dims for axis in reduce_batch_axes):
+    grad = tf.expand_dims(grad, axis)
+  return tf.broadcast_to(
+      grad, tf.concat([batch_shape, tf.cast(grid_shape, tf.int32)], 0))
+
+
+def _point_weights_grad(grad, values, weights):
+  """Computes the gradient with respect to the weights of the points.
+
+  Args:
+    grad: The gradient with respect to the weighted values at the points.
+    values: The unweighted values at the points.
+    weights: The weights of the points, with shape `[..., M]`.
+
+  Returns:
+    The gradient with respect to `weights`, summed over the batch dimensions
+    in which the weights are broadcast.
+  """
+  grad_weights = tf.math.real(grad * tf.math.conj(values))
+  weights_reduction_indices, _ = tf.raw_ops.BroadcastGradientArgs(
+      s0=tf.shape(weights)[:-1], s1=tf.shape(grad_weights)[:-1])
+  return tf.reshape(
+      tf.math.reduce_sum(grad_weights, weights_reduction_indices),
+      tf.shape(weights))
+
+
+def _nufft_points_grad_with_transforms(source, points, weights,
+                                       fft_direction, tol, options):
+  """Computes the points gradient of a type-2 NUFFT using type-2 NUFFTs.
+
+  Same as `_nufft_ops.nufft_points_grad`, for devices on which that op is not
+  available. Uses one type-2 transform per axis.
+
+  Args:
+    source: The uniform grid, with shape `[...] + grid_shape`.
+    points: The nonuniform points, with shape `[..., M, N]`.
+    weights: The weights of each nonuniform point, with shape `[..., M]`.
+    fft_direction: The direction of the FFT.
+    tol: The desired relative precision.
+    options: A `tfft.Options` object.
+
+  Returns:
+    The gradient with respect to `points`, with the shape of `points`.
+  """
+  rank = points.shape[-1]
+  dtype = source.dtype
+  grid_shape = tf.shape(source)[-rank:]
   grid_vec = [
       tf.linspace(-grid_shape[ax] / 2, grid_shape[ax] / 2 - 1, grid_shape[ax])
       for ax in range(rank)]
@@ -192,45 +945,180 @@ def _nufft_grad(op, grad):
         tf.constant(0.0, dtype=dtype.real_dtype),
         tf.constant(1.0, dtype=dtype.real_dtype))
 
-  grad = tf.math.conj(grad)
-  if transform_type == 'type_2':
-    grad_points = nufft(
-        tf.expand_dims(source, -(rank + 1)) * grid_points,
-        tf.expand_dims(points, -3),
-        transform_type='type_2',
-        fft_direction=fft_direction,
-        tol=tol,
-        options=options) * tf.expand_dims(grad, -2) * imag_unit
-
-  if transform_type == 'type_1':
-    grad_points = nufft(
-        tf.expand_dims(grad, -(rank + 1)) * grid_points,
-        tf.expand_dims(points, -3),
-        transform_type='type_2',
-        fft_direction=fft_direction,
-        tol=tol,
-        options=options) * tf.expand_dims(source, -2) * imag_unit
+  grad_points = nufft(
+      tf.expand_dims(source, -(rank + 1)) * grid_points,
+      tf.expand_dims(points, -3),
+      transform_type='type_2',
+      fft_direction=fft_direction,
+      tol=tol,
+      options=options) * tf.expand_dims(weights, -2) * imag_unit
 
   # Keep only real part of gradient w.r.t points and transpose the last two
   # axes.
   grad_points = tf.einsum('...ij->...ji', tf.math.real(grad_points))
 
-  # Handle broadcasting.
-  source_elem_rank = 1 if transform_type == 'type_1' else rank
-  source_batch_shape = tf.shape(source)[:-source_elem_rank]
+  # Sum over the batch dimensions in which the points are broadcast.
+  grad_batch_shape = tf.shape(grad_points)[:-2]
   points_batch_shape = tf.shape(points)[:-2]
-  source_reduction_indices, points_reduction_indices = (
-      tf.raw_ops.BroadcastGradientArgs(s0=source_batch_shape,
-                                       s1=points_batch_shape))
+  _, points_reduction_indices = tf.raw_ops.BroadcastGradientArgs(
+      s0=grad_batch_shape, s1=points_batch_shape)
+  return tf.reshape(
+      tf.math.reduce_sum(grad_points, points_reduction_indices),
+      tf.shape(points))
+
+
+@tf.RegisterGradient("Interp")
+@tf.RegisterGradient("WeightedInterp")
+def _interp_grad(op, grad):
+  """Gradients for `interp`.
+
+  Args:
+    op: The `interp` `tf.Operation`.
+    grad: Gradient with respect to the output of the `interp` op.
+
+  Returns:
+    Gradients with respect to the inputs of `interp`.
+  """
+  source = op.inputs[0]
+  points = op.inputs[1]
+  weights = _optional_input(op, 2)
+  tol = op.get_attr('tol')
+  rank = points.shape[-1]
+
+  # The adjoint of the interpolation is the spreading, with the same weights.
+  grad_source = spread(grad, points, tf.shape(source)[-rank:], tol=tol,
+                       weights=weights)
+  point_values = tf.math.conj(grad)
+  if weights is not None:
+    point_values *= tf.cast(weights, point_values.dtype)
+  grad_points = _interp_points_grad(source, points, point_values, tol)
+
+  # Handle broadcasting.
+  source_reduction_indices, _ = tf.raw_ops.BroadcastGradientArgs(
+      s0=tf.shape(source)[:-rank], s1=tf.shape(points)[:-2])
   grad_source = tf.reshape(
       tf.math.reduce_sum(grad_source, source_reduction_indices),
       tf.shape(source))
-  grad_points = tf.reshape(
-      tf.math.reduce_sum(grad_points, points_reduction_indices),
-      tf.shape(points))
+
+  grad_weights = None
+  if weights is not None and _input_grad_needed(op, 2):
+    grad_weights = _point_weights_grad(
+        grad, interp(source, points, tol=tol), weights)
+  return _with_weights_grad([grad_source, grad_points], weights, grad_weights)
+
+
+@tf.RegisterGradient("Spread")
+@tf.RegisterGradient("WeightedSpread")
+def _spread_grad(op, grad):
+  """Gradients for `spread`.
+
+  Args:
+    op: The `spread` `tf.Operation`.
+    grad: Gradient with respect to the output of the `spread` op.
+
+  Returns:
+    Gradients with respect to the inputs of `spread`.
+  """
+  source = op.inputs[0]
+  points = op.inputs[1]
+  weights = _optional_input(op, 3)
+  tol = op.get_attr('tol')
+
+  # The adjoint of the spreading is the interpolation, with the same weights.
+  grad_source = interp(grad, points, tol=tol, weights=weights)
+  point_values = source
+  if weights is not None:
+    point_values *= tf.cast(weights, point_values.dtype)
+  grad_points = _interp_points_grad(tf.math.conj(grad), points, point_values,
+                                    tol)
+
+  # Handle broadcasting.
+  source_reduction_indices, _ = tf.raw_ops.BroadcastGradientArgs(
+      s0=tf.shape(source)[:-1], s1=tf.shape(points)[:-2])
+  grad_source = tf.reshape(
+      tf.math.reduce_sum(grad_source, source_reduction_indices),
+      tf.shape(source))
+
+  grad_weights = None
+  if weights is not None and _input_grad_needed(op, 3):
+    grad_weights = _point_weights_grad(
+        interp(grad, points, tol=tol), source, weights)
 
   # Gradient with respect to the grid shape is not meaningful.
-  return [grad_source, grad_points, None]
+  return _with_weights_grad([grad_source, grad_points, None], weights,
+                            grad_weights)
+
+
+@tf.RegisterGradient("NUFFTSense")
+def _nufft_sense_grad(op, grad):
+  """Gradients for `nufft_sense`.
+
+  Args:
+    op: The `nufft_sense` `tf.Operation`.
+    grad: Gradient with respect to the output of the `nufft_sense` op.
+
+  Returns:
+    Gradients with respect to the inputs of `nufft_sense`.
+  """
+  source = op.inputs[0]
+  points = op.inputs[1]
+  sensitivities = op.inputs[2]
+  transform_type = op.get_attr('transform_type').decode()
+  fft_direction = op.get_attr('fft_direction').decode()
+  tol = op.get_attr('tol')
+  options_proto = nufft_options_pb2.Options()
+  options_proto.ParseFromString(op.get_attr('options'))
+  options = nufft_options.Options.from_proto(options_proto)
+  rank = points.shape[-1]
+
+  # The forward and adjoint operators are adjoint to each other.
+  grad_source = nufft_sense(
+      grad, points, sensitivities,
+      transform_type='type_1' if transform_type == 'type_2' else 'type_2',
+      fft_direction=_opposite_fft_direction(fft_direction),
+      tol=tol,
+      options=options)
+  source_elem_rank = rank if transform_type == 'type_2' else 2
+  source_reduction_indices, _ = tf.raw_ops.BroadcastGradientArgs(
+      s0=tf.shape(source)[:-source_elem_rank],
+      s1=tf.shape(grad_source)[:-source_elem_rank])
+  grad_source = tf.reshape(
+      tf.math.reduce_sum(grad_source, source_reduction_indices),
+      tf.shape(source))
+
+  # The gradients with respect to the points and the sensitivities need the
+  # per-coil images, so they are computed by the unfused operator, and only if
+  # requested.
+  grad_points, grad_sensitivities = None, None
+  if _input_grad_needed(op, 1) or _input_grad_needed(op, 2):
+    with tf.GradientTape() as tape:
+      tape.watch([points, sensitivities])
+      target = _nufft_sense_unfused(source, points, sensitivities,
+                                    transform_type, fft_direction, tol,
+                                    options)
+    grad_points, grad_sensitivities = tape.gradient(
+        target, [points, sensitivities], output_gradients=grad)
+  return [grad_source, grad_points, grad_sensitivities]
+
+
+def _interp_points_grad(source, points, weights, tol):
+  """Computes the points gradient of `interp`, weighted by `weights`.
+
+  The op is only available on the CPU, so it is always placed there.
+
+  Args:
+    source: The uniform grid, with shape `[...] + grid_shape`.
+    points: The nonuniform points, with shape `[..., M, N]`.
+    weights: The weights of each nonuniform point, with shape `[..., M]`.
+    tol: The desired relative precision.
+
+  Returns:
+    The gradient with respect to `points`, with the shape of `points`.
+  """
+  with tf.device('/cpu:0'):
+    grad_points = _nufft_ops.interp_points_grad(source, points, weights,
+                                                tol=tol)
+  return tf.reshape(grad_points, tf.shape(points))
 
 
 def nudft(source,
@@ -57,6 +57,40 @@ def parameterized(**params):
   return decorator
 
 
+def _random_complex(shape):
+  """Returns a random complex128 tensor with parts uniform in [-0.5, 0.5)."""
+  return tf.dtypes.complex(
+      tf.random.uniform(shape, minval=-0.5, maxval=0.5, dtype=tf.float64),
+      tf.random.uniform(shape, minval=-0.5, maxval=0.5, dtype=tf.float64))
+
+
+def _assert_fused_matches_reference(test_case, fused_fn, ref_fn, inputs):
+  """Asserts that a fused operator matches a reference implementation.
+
+  Compares the outputs of `fused_fn(*inputs)` and `ref_fn(*inputs)`, and the
+  gradients of the squared norms of the outputs with respect to `inputs`.
+
+  Args:
+    test_case: The `tf.test.TestCase` used to make the assertions.
+    fused_fn: The operator under test.
+    ref_fn: The reference implementation of the same operator.
+    inputs: A list of `tf.Tensor`. The inputs of both functions.
+  """
+  results, grads = [], []
+  for fn in (fused_fn, ref_fn):
+    with tf.GradientTape() as tape:
+      tape.watch(inputs)
+      target = fn(*inputs)
+      loss = tf.math.reduce_sum(tf.math.abs(target) ** 2)
+    results.append(target)
+    grads.append(tape.gradient(loss, inputs))
+
+  test_case.assertAllEqual(results[0].shape, results[1].shape)
+  test_case.assertAllClose(results[0], results[1], rtol=1e-8, atol=1e-8)
+  for grad, expected in zip(*grads):
+    test_case.assertAllClose(grad, expected, rtol=1e-6, atol=1e-6)
+
+
 class NUFFTOpsTest(tf.test.TestCase):
   """Test case for NUFFT functions."""
   def test_nufft_with_options(self):
@@ -80,6 +114,89 @@ class NUFFTOpsTest(tf.test.TestCase):
     target2 = nufft_ops.nufft(source, points, options=options)
     self.assertAllClose(target1, target2, rtol=rtol, atol=atol)
 
+    for points_sorting in nufft_options.PointsSorting:
+      options = nufft_options.Options()
+      options.points_sorting = points_sorting
+      target2 = nufft_ops.nufft(source, points, options=options)
+      self.assertAllClose(target1, target2, rtol=rtol, atol=atol)
+
+    for fft_backend in nufft_options.FftBackend:
+      options = nufft_options.Options()
+      options.fft_backend = fft_backend
+      target2 = nufft_ops.nufft(source, points, options=options)
+      self.assertAllClose(target1, target2, rtol=rtol, atol=atol)
+
+  def test_nufft_cache_points(self):
+    """Test NUFFT with the points cache enabled."""
+    source = tf.dtypes.complex(
+        tf.random.stateless_normal([4, 20, 20], seed=[0, 0]),
+        tf.random.stateless_normal([4, 20, 20], seed=[0, 1]))
+    points = tf.Variable(tf.random.stateless_uniform(
+        [4, 400, 2], minval=-np.pi, maxval=np.pi, seed=[0, 2]))
+
+    options = nufft_options.Options()
+    options.cache_points = True
+
+    rtol, atol = 1e-4, 1e-4
+
+    # First call populates the cache, second call hits it.
+    expected = nufft_ops.nufft(source, tf.identity(points))
+    for _ in range(2):
+      result = nufft_ops.nufft(source, points, options=options)
+      self.assertAllClose(expected, result, rtol=rtol, atol=atol)
+
+    # Type-1 transform with the same points reuses the same entry.
+    samples = result
+    expected = nufft_ops.nufft(samples, tf.identity(points),
+                               grid_shape=[20, 20], transform_type='type_1')
+    result = nufft_ops.nufft(samples, points, grid_shape=[20, 20],
+                             transform_type='type_1', options=options)
+    self.assertAllClose(expected, result, rtol=rtol, atol=atol)
+
+    # Updating the points in place must invalidate the cached entry.
+    points.assign(tf.random.stateless_uniform(
+        [4, 400, 2], minval=-np.pi, maxval=np.pi, seed=[0, 3]))
+    expected = nufft_ops.nufft(source, tf.identity(points))
+    result = nufft_ops.nufft(source, points, options=options)
+    self.assertAllClose(expected, result, rtol=rtol, atol=atol)
+
+    # So must a change to a single coordinate.
+    points.scatter_nd_update([[1, 7, 0]], [0.5])
+    expected = nufft_ops.nufft(source, tf.identity(points))
+    result = nufft_ops.nufft(source, points, options=options)
+    self.assertAllClose(expected, result, rtol=rtol, atol=atol)
+
+  def test_nufft_cache_points_update(self):
+    """Test NUFFT with cached points which move, grow and shrink."""
+    source = tf.dtypes.complex(
+        tf.random.stateless_normal([32, 32], seed=[1, 0]),
+        tf.random.stateless_normal([32, 32], seed=[1, 1]))
+    points = tf.random.stateless_uniform(
+        [4000, 2], minval=-np.pi, maxval=np.pi, seed=[1, 2])
+
+    options = nufft_options.Options()
+    options.cache_points = True
+    options.points_sorting = nufft_options.PointsSorting.CARTESIAN
+
+    rtol, atol = 1e-4, 1e-4
+
+    # Each call updates the sort order of the previous points: a few moved
+    # points, a few moved and appended points, the trailing points removed,
+    # and finally all points moved, which requires a full sort.
+    offsets = tf.random.stateless_uniform(
+        [4100, 2], minval=-0.01, maxval=0.01, seed=[1, 3])
+    appended = tf.random.stateless_uniform(
+        [100, 2], minval=-np.pi, maxval=np.pi, seed=[1, 4])
+    moved = tf.tensor_scatter_nd_add(points, [[5], [500]], offsets[:2])
+    grown = tf.concat([moved, appended], 0) + offsets
+    shrunk = grown[:3000]
+    scrambled = tf.reverse(shrunk, [0])
+    for pts in [points, moved, grown, shrunk, scrambled]:
+      pts = tf.clip_by_value(pts, -np.pi, np.pi)
+      expected = nufft_ops.nufft(source, pts)
+      result = nufft_ops.nufft(source, pts, options=options)
+      self.assertAllClose(expected, result, rtol=rtol, atol=atol)
+
 
   @parameterized(grid_shape=[[10, 16], [10, 10, 8]],
                  source_batch_shape=[[], [2, 4], [4]],
@@ -318,6 +435,146 @@ class NUFFTOpsTest(tf.test.TestCase):
                           rtol=1e-4, atol=1e-4)
 
 
+  @parameterized(grid_shape=[[16], [16, 20], [16, 16, 16]],
+                 source_batch_shape=[[], [2]],
+                 points_batch_shape=[[], [2]])
+  def test_interp_gradient(self, grid_shape, source_batch_shape,
+                           points_batch_shape):
+    """Test gradients of `interp` against numerical gradients."""
+    # pylint: disable=unexpected-keyword-arg
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 20
+    source_shape = source_batch_shape + grid_shape
+    source = _random_complex(source_shape)
+    points = tf.random.uniform(points_batch_shape + [num_points, rank],
+                               minval=-np.pi, maxval=np.pi, dtype=tf.float64)
+
+    theoretical, numerical = tf.test.compute_gradient(
+        lambda source, points: nufft_ops.interp(source, points, tol=1e-6),
+        [source, points])
+    self.assertAllClose(theoretical, numerical, rtol=1e-3, atol=1e-3)
+
+
+  @parameterized(grid_shape=[[16], [16, 20], [16, 16, 16]],
+                 source_batch_shape=[[], [2]],
+                 points_batch_shape=[[], [2]])
+  def test_spread_gradient(self, grid_shape, source_batch_shape,
+                           points_batch_shape):
+    """Test gradients of `spread` against numerical gradients."""
+    # pylint: disable=unexpected-keyword-arg
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 20
+    source_shape = source_batch_shape + [num_points]
+    source = _random_complex(source_shape)
+    points = tf.random.uniform(points_batch_shape + [num_points, rank],
+                               minval=-np.pi, maxval=np.pi, dtype=tf.float64)
+
+    theoretical, numerical = tf.test.compute_gradient(
+        lambda source, points: nufft_ops.spread(source, points, grid_shape,
+                                                tol=1e-6),
+        [source, points])
+    self.assertAllClose(theoretical, numerical, rtol=1e-3, atol=1e-3)
+
+
+  @parameterized(transform_type=['type_1', 'type_2'],
+                 grid_shape=[[16], [16, 20], [10, 12, 8]],
+                 source_batch_shape=[[], [3]],
+                 points_batch_shape=[[], [3]])
+  def test_nufft_weights(self, transform_type, grid_shape, source_batch_shape,
+                         points_batch_shape):
+    """Test weighted `nufft` against explicit multiplication by the weights."""
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 30
+    if transform_type == 'type_1':
+      source_shape = source_batch_shape + [num_points]
+    elif transform_type == 'type_2':
+      source_shape = source_batch_shape + grid_shape
+    source = _random_complex(source_shape)
+    points = tf.random.uniform(points_batch_shape + [num_points, rank],
+                               minval=-np.pi, maxval=np.pi, dtype=tf.float64)
+    weights = tf.random.uniform(points_batch_shape + [num_points],
+                                minval=0.0, maxval=2.0, dtype=tf.float64)
+
+    def weighted_nufft(source, points, weights):
+      return nufft_ops.nufft(source, points,
+                             grid_shape=grid_shape,
+                             transform_type=transform_type,
+                             tol=1e-12,
+                             weights=weights)
+
+    def explicit_nufft(source, points, weights):
+      weights = tf.cast(weights, source.dtype)
+      if transform_type == 'type_1':
+        return nufft_ops.nufft(source * weights, points,
+                               grid_shape=grid_shape,
+                               transform_type=transform_type,
+                               tol=1e-12)
+      return nufft_ops.nufft(source, points,
+                             transform_type=transform_type,
+                             tol=1e-12) * weights
+
+    _assert_fused_matches_reference(self, weighted_nufft, explicit_nufft,
+                                    [source, points, weights])
+
+
+  def test_unweighted_ops_have_no_weights_input(self):
+    """Test that the raw ops keep their inputs when weights are added."""
+    # Graphs saved before the `Weighted*` ops were added must still load.
+    num_inputs = {op.name: len(op.input_arg)
+                  for op in nufft_ops._nufft_ops.OP_LIST.op}  # pylint: disable=protected-access
+    self.assertEqual(num_inputs['NUFFT'], 3)
+    self.assertEqual(num_inputs['Interp'], 2)
+    self.assertEqual(num_inputs['Spread'], 3)
+    self.assertEqual(num_inputs['WeightedNUFFT'], 4)
+    self.assertEqual(num_inputs['WeightedInterp'], 3)
+    self.assertEqual(num_inputs['WeightedSpread'], 4)
+
+
+  @parameterized(grid_shape=[[16], [16, 20], [16, 16, 16]],
+                 op=['interp', 'spread'])
+  def test_interp_spread_weights(self, grid_shape, op):
+    """Test weighted `interp` and `spread` and their gradients."""
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 20
+    if op == 'interp':
+      source_shape = [2] + grid_shape
+    elif op == 'spread':
+      source_shape = [2, num_points]
+    source = _random_complex(source_shape)
+    points = tf.random.uniform([num_points, rank], minval=-np.pi,
+                               maxval=np.pi, dtype=tf.float64)
+    weights = tf.random.uniform([num_points], minval=0.0, maxval=2.0,
+                                dtype=tf.float64)
+
+    def fn(source, points, weights):
+      if op == 'interp':
+        return nufft_ops.interp(source, points, tol=1e-6, weights=weights)
+      return nufft_ops.spread(source, points, grid_shape, tol=1e-6,
+                              weights=weights)
+
+    if op == 'interp':
+      expected = nufft_ops.interp(source, points, tol=1e-6) * tf.cast(
+          weights, source.dtype)
+    elif op == 'spread':
+      expected = nufft_ops.spread(
+          source * tf.cast(weights, source.dtype), points, grid_shape,
+          tol=1e-6)
+    self.assertAllClose(fn(source, points, weights), expected,
+                        rtol=1e-10, atol=1e-10)
+
+    theoretical, numerical = tf.test.compute_gradient(
+        fn, [source, points, weights])
+    self.assertAllClose(theoretical, numerical, rtol=1e-3, atol=1e-3)
+
+
   @parameterized(transform_type=['type_1', 'type_2'],
                  which=['source', 'points'],
                  device=['/cpu:0', '/gpu:0'])
@@ -375,6 +632,8 @@ class NUFFTOpsTest(tf.test.TestCase):
       # Compute gradients.
       grad_nufft = tape.gradient(result_nufft, source)
       grad_nudft = tape.gradient(result_nudft, source)
+      grad_points_nufft = tape.gradient(result_nufft, points)
+      grad_points_nudft = tape.gradient(result_nudft, points)
 
       if device == '/gpu:0':
         tol = 1
@@ -385,6 +644,267 @@ class NUFFTOpsTest(tf.test.TestCase):
                           rtol=tol, atol=tol)
       self.assertAllClose(grad_nufft, grad_nudft,
                           rtol=tol, atol=tol)
+      self.assertAllClose(grad_points_nufft, grad_points_nudft,
+                          rtol=tol, atol=tol)
+      self.assertAllEqual(grad_points_nufft.shape, points_shape)
+
+
+  @parameterized(transform_type=['type_1', 'type_2'],
+                 grid_shape=[[16], [16, 20], [16, 16, 16]],
+                 source_batch_shape=[[], [2]])
+  def test_nufft_forward_mode(self, transform_type, grid_shape,
+                              source_batch_shape):
+    """Test forward-mode derivatives of `nufft` against those of the NUDFT."""
+    # pylint: disable=unexpected-keyword-arg
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 20
+    fft_direction = 'forward'
+    if transform_type == 'type_1':
+      source_shape = source_batch_shape + [num_points]
+    elif transform_type == 'type_2':
+      source_shape = source_batch_shape + grid_shape
+
+    source = _random_complex(source_shape)
+    source_tangent = _random_complex(source_shape)
+    points = tf.random.uniform([num_points, rank], minval=-np.pi,
+                               maxval=np.pi, dtype=tf.float64)
+    points_tangent = tf.random.uniform([num_points, rank], minval=-1.0,
+                                       maxval=1.0, dtype=tf.float64)
+
+    def nufft(source, points):
+      return nufft_ops.nufft(source, points,
+                             grid_shape=grid_shape,
+                             transform_type=transform_type,
+                             fft_direction=fft_direction,
+                             tol=1e-8)
+
+    def nudft(source, points):
+      matrix = nufft_ops._nudft_matrix(points, grid_shape, fft_direction)  # pylint: disable=protected-access
+      if transform_type == 'type_1':
+        target = tf.linalg.matvec(matrix, source, transpose_a=True)
+        return tf.reshape(target, source_batch_shape + grid_shape)
+      return tf.linalg.matvec(
+          matrix, tf.reshape(source, source_batch_shape + [-1]))
+
+    jvps = []
+    for fn in (nufft, nudft):
+      with tf.autodiff.ForwardAccumulator(
+          primals=[source, points],
+          tangents=[source_tangent, points_tangent]) as acc:
+        target = fn(source, points)
+      jvps.append(acc.jvp(target))
+
+    jvp_nufft, jvp_nudft = jvps
+    self.assertAllClose(jvp_nufft, jvp_nudft, rtol=1e-5,
+                        atol=1e-5 * np.max(np.abs(jvp_nudft)))
+
+
+  @parameterized(grid_shape=[[16], [8, 10], [6, 6, 4]],
+                 l2_regularization=[0.0, 0.5])
+  def test_nufft_conjugate_gradient(self, grid_shape, l2_regularization):
+    """Test the conjugate gradient solver against a direct solve."""
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 400
+    num_coils = 2
+    points = tf.random.uniform([num_points, rank], minval=-np.pi,
+                               maxval=np.pi, dtype=tf.float64)
+    weights = tf.random.uniform([num_points], minval=0.5, maxval=1.5,
+                                dtype=tf.float64)
+    data = tf.dtypes.complex(
+        tf.random.uniform([num_coils, num_points], dtype=tf.float64),
+        tf.random.uniform([num_coils, num_points], dtype=tf.float64))
+
+    target = nufft_ops.nufft_conjugate_gradient(
+        data, points, grid_shape, weights=weights,
+        l2_regularization=l2_regularization,
+        num_iterations=1000, rtol=1e-10, tol=1e-10)
+    self.assertAllEqual(target.shape, [num_coils] + grid_shape)
+
+    matrix = nufft_ops._nudft_matrix(points, grid_shape, 'forward')  # pylint: disable=protected-access
+    weighted = tf.math.conj(tf.transpose(matrix)) * tf.cast(
+        weights, matrix.dtype)
+    normal = tf.linalg.matmul(weighted, matrix) + tf.cast(
+        l2_regularization, matrix.dtype) * tf.eye(matrix.shape[1],
+                                                  dtype=matrix.dtype)
+    rhs = tf.linalg.matmul(weighted, data, transpose_b=True)
+    expected = tf.reshape(tf.transpose(tf.linalg.solve(normal, rhs)),
+                          [num_coils] + grid_shape)
+
+    self.assertAllClose(target, expected, rtol=1e-6,
+                        atol=1e-6 * np.max(np.abs(expected)))
+
+
+  @parameterized(grid_shape=[[64], [64, 48], [32, 24, 20]],
+                 points_batch_shape=[[], [2]])
+  def test_density_compensation(self, grid_shape, points_batch_shape):
+    """Test density compensation against iterated `spread` and `interp`."""
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_iterations = 5
+    tol = 1e-8
+    points = tf.random.uniform(points_batch_shape + [500, rank],
+                               minval=-np.pi, maxval=np.pi, dtype=tf.float64)
+
+    weights = nufft_ops.density_compensation(points, grid_shape,
+                                             num_iterations=num_iterations,
+                                             tol=tol)
+    self.assertAllEqual(weights.shape, points.shape[:-1])
+
+    expected = tf.ones(points.shape[:-1], dtype=tf.float64)
+    for _ in range(num_iterations):
+      values = nufft_ops.spread(tf.cast(expected, tf.complex128), points,
+                                grid_shape, tol=tol)
+      values = nufft_ops.interp(values, points, tol=tol)
+      expected /= tf.math.abs(values)
+    self.assertAllClose(weights, expected)
+
+    # With a loose convergence tolerance, the iteration stops after the first
+    # update.
+    weights = nufft_ops.density_compensation(points, grid_shape,
+                                             num_iterations=1000,
+                                             rtol=1e9, tol=tol)
+    expected = nufft_ops.density_compensation(points, grid_shape,
+                                              num_iterations=1, tol=tol)
+    self.assertAllClose(weights, expected)
+
+    # Options are forwarded to the spreading and interpolation plan.
+    options = nufft_options.Options()
+    options.points_sorting = nufft_options.PointsSorting.MORTON
+    weights = nufft_ops.density_compensation(points, grid_shape,
+                                             num_iterations=num_iterations,
+                                             tol=tol, options=options)
+    expected = nufft_ops.density_compensation(points, grid_shape,
+                                              num_iterations=num_iterations,
+                                              tol=tol)
+    self.assertAllClose(weights, expected)
+
+    with self.assertRaisesRegex(ValueError, "must be non-negative"):
+      nufft_ops.density_compensation(points, grid_shape, num_iterations=-1)
+    with self.assertRaisesRegex(ValueError, "must be non-negative"):
+      nufft_ops.density_compensation(points, grid_shape, rtol=-1.0)
+
+
+  @parameterized(grid_shape=[[16], [16, 20], [10, 12, 8]],
+                 weighted=[False, True])
+  def test_nufft_gram(self, grid_shape, weighted):
+    """Test the Toeplitz Gram operator against a type-2/type-1 pair."""
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 100
+    tol = 1e-8
+    points = tf.random.uniform([num_points, rank], minval=-np.pi,
+                               maxval=np.pi, dtype=tf.float64)
+    source = tf.dtypes.complex(
+        tf.random.uniform([2] + grid_shape, dtype=tf.float64),
+        tf.random.uniform([2] + grid_shape, dtype=tf.float64))
+    weights = None
+    if weighted:
+      weights = tf.random.uniform([num_points], minval=0.5, maxval=1.5,
+                                  dtype=tf.float64)
+
+    kernel = nufft_ops.nufft_gram_kernel(points, grid_shape, weights=weights,
+                                         tol=tol)
+    self.assertAllEqual(kernel.shape, [2 * n for n in grid_shape])
+    target = nufft_ops.nufft_gram(source, kernel, rank)
+
+    expected = nufft_ops.nufft(source, points, tol=tol)
+    if weighted:
+      expected *= tf.cast(weights, expected.dtype)
+    expected = nufft_ops.nufft(expected, points,
+                               grid_shape=grid_shape,
+                               transform_type='type_1',
+                               fft_direction='backward',
+                               tol=tol)
+
+    self.assertAllEqual(target.shape, expected.shape)
+    self.assertAllClose(target, expected, rtol=1e-6,
+                        atol=1e-6 * np.max(np.abs(expected)))
+
+
+  @parameterized(grid_shape=[[16], [16, 20], [10, 12, 8]],
+                 points_batch_shape=[[], [4, 1], [4, 3]],
+                 reduce_batch_axes=[[0], [-1], [0, 1]])
+  def test_nufft_reduce_batch_axes(self, grid_shape, points_batch_shape,
+                                   reduce_batch_axes):
+    """Test type-1 `nufft` summed over batch axes against `reduce_sum`."""
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 30
+    source_shape = [4, 3, num_points]
+    source = _random_complex(source_shape)
+    points = tf.random.uniform(points_batch_shape + [num_points, rank],
+                               minval=-np.pi, maxval=np.pi, dtype=tf.float64)
+    weights = tf.random.uniform(points_batch_shape + [num_points],
+                                minval=0.0, maxval=2.0, dtype=tf.float64)
+
+    def reduced_nufft(source, points, weights):
+      return nufft_ops.nufft(source, points,
+                             grid_shape=grid_shape,
+                             transform_type='type_1',
+                             tol=1e-12,
+                             weights=weights,
+                             reduce_batch_axes=reduce_batch_axes)
+
+    def explicit_nufft(source, points, weights):
+      target = nufft_ops.nufft(source, points,
+                               grid_shape=grid_shape,
+                               transform_type='type_1',
+                               tol=1e-12,
+                               weights=weights)
+      return tf.math.reduce_sum(target, axis=reduce_batch_axes)
+
+    _assert_fused_matches_reference(self, reduced_nufft, explicit_nufft,
+                                    [source, points, weights])
+
+    with self.assertRaisesRegex(ValueError, "only supported for type-1"):
+      nufft_ops.nufft(source, points, transform_type='type_2',
+                      reduce_batch_axes=reduce_batch_axes)
+
+
+  @parameterized(transform_type=['type_1', 'type_2'],
+                 grid_shape=[[16], [16, 20], [10, 12, 8]],
+                 source_batch_shape=[[], [2]])
+  def test_nufft_sense(self, transform_type, grid_shape, source_batch_shape):
+    """Test the fused SENSE operator against per-coil transforms."""
+    tf.random.set_seed(0)
+
+    rank = len(grid_shape)
+    num_points = 40
+    num_coils = 3
+    if transform_type == 'type_1':
+      source_shape = source_batch_shape + [num_coils, num_points]
+    elif transform_type == 'type_2':
+      source_shape = source_batch_shape + grid_shape
+    source = _random_complex(source_shape)
+    sensitivities = _random_complex([num_coils] + grid_shape)
+    points = tf.random.uniform([num_points, rank], minval=-np.pi,
+                               maxval=np.pi, dtype=tf.float64)
+
+    def explicit_sense(source, points, sensitivities):
+      if transform_type == 'type_1':
+        images = nufft_ops.nufft(source, points,
+                                 grid_shape=grid_shape,
+                                 transform_type='type_1',
+                                 tol=1e-12)
+        return tf.math.reduce_sum(tf.math.conj(sensitivities) * images,
+                                  axis=-(rank + 1))
+      return nufft_ops.nufft(tf.expand_dims(source, -(rank + 1)) *
+                             sensitivities, points, tol=1e-12)
+
+    def fused_sense(source, points, sensitivities):
+      return nufft_ops.nufft_sense(source, points, sensitivities,
+                                   transform_type=transform_type,
+                                   tol=1e-12)
+
+    _assert_fused_matches_reference(self, fused_sense, explicit_sense,
+                                    [source, points, sensitivities])
 
 
   @parameterized(device=['/cpu:0', '/gpu:0'])
@@ -404,6 +924,29 @@ class NUFFTOpsTest(tf.test.TestCase):
         self.assertAllClose(tf.math.real(result), tf.ones([num_points]),
                             rtol=DEFAULT_TOLERANCE, atol=DEFAULT_TOLERANCE)
 
+  def test_points_out_of_range(self):
+    """Test that invalid points are reported on the CPU."""
+    # The kernels name the coordinates in reverse order, i.e. the last column
+    # of the points is `kx`.
+    cases = [([32, 32], 0, 'ky'),
+             ([32, 32], 1, 'kx'),
+             ([16, 16, 16], 0, 'kz'),
+             ([16, 16, 16], 1, 'ky'),
+             ([16, 16, 16], 2, 'kx')]
+    with tf.device('/cpu:0'):
+      for grid_shape, column, name in cases:
+        rank = len(grid_shape)
+        source = tf.complex(tf.ones(grid_shape), tf.zeros(grid_shape))
+        points = tf.random.stateless_uniform(
+            [1000, rank], minval=-np.pi, maxval=np.pi, seed=[0, 0])
+        for value in [4.0 * np.pi, np.nan]:
+          invalid = tf.tensor_scatter_nd_update(
+              points, [[500, column]], [value])
+          with self.assertRaisesRegex(
+              tf.errors.InvalidArgumentError,
+              r"points outside valid range: {}\[500\]".format(name)):
+            self.evaluate(nufft_ops.nufft(source, invalid))
+
 
   def test_parallel_iteration(self):
     """Test NUFFT with parallel iterations."""
@@ -593,6 +1136,380 @@ class NUFFTOpsBenchmark(tf.test.Benchmark):
       except ModuleNotFoundError:
         pass
 
+  def benchmark_points_sorting(self):
+    """Benchmark 3D NUFFT with different point sorting strategies."""
+    grid_shape = [128, 128, 128]
+    num_points = 800000
+    dtype = tf.dtypes.complex64
+
+    rng = np.random.default_rng(0)
+
+    def radial_points():
+      # 3D radial "kooshball": spokes through the center along random
+      # directions, sampled in order along each spoke.
+      num_samples = 256
+      num_spokes = num_points // num_samples
+      directions = rng.normal(size=[num_spokes, 1, 3])
+      directions /= np.linalg.norm(directions, axis=-1, keepdims=True)
+      radii = np.linspace(-np.pi, np.pi, num_samples, endpoint=False)
+      return np.reshape(directions * radii[None, :, None], [-1, 3])
+
+    def spiral_points():
+      # Stack of spirals, each sampled in order along the spiral.
+      num_partitions = grid_shape[0]
+      num_samples = num_points // num_partitions
+      t = np.linspace(0.0, 1.0, num_samples, endpoint=False)
+      radius = np.pi * t
+      angle = 32.0 * np.pi * t
+      kz = np.linspace(-np.pi, np.pi, num_partitions, endpoint=False)
+      shape = [num_partitions, num_samples]
+      kx = np.broadcast_to(radius * np.cos(angle), shape)
+      ky = np.broadcast_to(radius * np.sin(angle), shape)
+      kz = np.broadcast_to(kz[:, None], shape)
+      return np.reshape(np.stack([kx, ky, kz], axis=-1), [-1, 3])
+
+    def random_points():
+      return (rng.random([num_points, 3]) - 0.5) * 2.0 * np.pi
+
+    trajectories = {
+        'radial': radial_points(),
+        'spiral': spiral_points(),
+        'random': random_points()
+    }
+    strategies = [nufft_options.PointsSorting.CARTESIAN,
+                  nufft_options.PointsSorting.MORTON]
+
+    results = []
+    headers = []
+    for trajectory, points_array in trajectories.items():
+      for transform_type in ['type_1', 'type_2']:
+        for points_sorting in strategies:
+          with tf.Graph().as_default(), \
+              tf.compat.v1.Session(config=tf.test.benchmark_config()) as sess, \
+              tf.device('/cpu:0'):
+            if transform_type == 'type_1':
+              source_shape = [points_array.shape[0]]
+            else:
+              source_shape = grid_shape
+            source = tf.Variable(
+                tf.dtypes.complex(
+                    rng.random(source_shape, dtype=np.float32) - 0.5,
+                    rng.random(source_shape, dtype=np.float32) - 0.5))
+            points = tf.Variable(points_array.astype(np.float32))
+
+            self.evaluate(tf.compat.v1.global_variables_initializer())
+
+            options = nufft_options.Options()
+            options.points_sorting = points_sorting
+            target = nufft_ops.nufft(
+                tf.cast(source, dtype),
+                points,
+                grid_shape=grid_shape if transform_type == 'type_1' else None,
+                transform_type=transform_type,
+                options=options)
+
+            result = self.run_op_benchmark(
+                sess,
+                target,
+                burn_iters=2,
+                min_iters=20,
+                extras={
+                  'trajectory': trajectory,
+                  'transform_type': transform_type,
+                  'points_sorting': points_sorting.name
+                })
+
+          result.update(result['extras'])
+          result.pop('extras')
+          headers = list(result.keys())
+          results.append(list(result.values()))
+
+    try:
+      from tabulate import tabulate # pylint: disable=import-outside-toplevel
+      print(tabulate(results, headers=headers))
+    except ModuleNotFoundError:
+      pass
+
+  def benchmark_fft_backend(self):
+    """Benchmark NUFFT with different FFT backends.
+
+    The grid shapes are chosen so that the fine grids cover a range of the
+    sizes selected by `next_smooth_int` (with prime factors 2, 3 and 5 only).
+    """
+    # The fine grid has twice the size of the grid, rounded up to the next
+    # smooth integer.
+    grid_shapes = [[120, 120], [135, 135], [192, 192], [216, 216],
+                   [250, 250], [256, 256], [300, 300], [384, 384],
+                   [64, 64, 64], [75, 75, 75], [96, 96, 96], [128, 128, 128]]
+    num_points = 20000
+    dtype = tf.dtypes.complex64
+
+    rng = np.random.default_rng(0)
+
+    backends = [nufft_options.FftBackend.FFTW,
+                nufft_options.FftBackend.NATIVE]
+
+    results = []
+    headers = []
+    for grid_shape in grid_shapes:
+      rank = len(grid_shape)
+      points_array = (rng.random([num_points, rank]) - 0.5) * 2.0 * np.pi
+      for transform_type in ['type_1', 'type_2']:
+        for fft_backend in backends:
+          with tf.Graph().as_default(), \
+              tf.compat.v1.Session(config=tf.test.benchmark_config()) as sess, \
+              tf.device('/cpu:0'):
+            if transform_type == 'type_1':
+              source_shape = [num_points]
+            else:
+              source_shape = grid_shape
+            source = tf.Variable(
+                tf.dtypes.complex(
+                    rng.random(source_shape, dtype=np.float32) - 0.5,
+                    rng.random(source_shape, dtype=np.float32) - 0.5))
+            points = tf.Variable(points_array.astype(np.float32))
+
+            self.evaluate(tf.compat.v1.global_variables_initializer())
+
+            options = nufft_options.Options()
+            options.fft_backend = fft_backend
+            target = nufft_ops.nufft(
+                tf.cast(source, dtype),
+                points,
+                grid_shape=grid_shape if transform_type == 'type_1' else None,
+                transform_type=transform_type,
+                options=options)
+
+            result = self.run_op_benchmark(
+                sess,
+                target,
+                burn_iters=2,
+                min_iters=20,
+                extras={
+                  'grid_shape': grid_shape,
+                  'transform_type': transform_type,
+                  'fft_backend': fft_backend.name
+                })
+
+          result.update(result['extras'])
+          result.pop('extras')
+          headers = list(result.keys())
+          results.append(list(result.values()))
+
+    try:
+      from tabulate import tabulate # pylint: disable=import-outside-toplevel
+      print(tabulate(results, headers=headers))
+    except ModuleNotFoundError:
+      pass
+
+  def benchmark_broadcast_layouts(self):
+    """Benchmark NUFFT with the broadcasting layouts of `test_nufft`.
+
+    Includes layouts in which the batch dimensions of the source and the
+    points are interleaved, e.g. a source of shape `[coils, frames, ...]` with
+    points of shape `[frames, ...]`.
+    """
+    grid_shape = [128, 128]
+    num_points = 20000
+    dtype = tf.dtypes.complex64
+
+    rng = np.random.default_rng(0)
+
+    # source_batch_shape, points_batch_shape
+    layouts = [
+        ([], []),
+        ([8, 4], []),
+        ([8, 4], [8, 1]),
+        ([8, 4], [1, 4]),
+        ([4], [8, 1]),
+        ([4], [4])
+    ]
+
+    results = []
+    headers = []
+    for source_batch_shape, points_batch_shape in layouts:
+      points_shape = points_batch_shape + [num_points, len(grid_shape)]
+      for transform_type in ['type_1', 'type_2']:
+        with tf.Graph().as_default(), \
+            tf.compat.v1.Session(config=tf.test.benchmark_config()) as sess, \
+            tf.device('/cpu:0'):
+          if transform_type == 'type_1':
+            source_shape = source_batch_shape + [num_points]
+          else:
+            source_shape = source_batch_shape + grid_shape
+          source = tf.Variable(
+              tf.dtypes.complex(
+                  rng.random(source_shape, dtype=np.float32) - 0.5,
+                  rng.random(source_shape, dtype=np.float32) - 0.5))
+          points = tf.Variable(
+              ((rng.random(points_shape) - 0.5) * 2.0 * np.pi).astype(
+                  np.float32))
+
+          self.evaluate(tf.compat.v1.global_variables_initializer())
+
+          target = nufft_ops.nufft(
+              tf.cast(source, dtype),
+              points,
+              grid_shape=grid_shape if transform_type == 'type_1' else None,
+              transform_type=transform_type)
+
+          result = self.run_op_benchmark(
+              sess,
+              target,
+              burn_iters=2,
+              min_iters=20,
+              store_memory_usage=True,
+              extras={
+                'source_batch_shape': source_batch_shape,
+                'points_batch_shape': points_batch_shape,
+                'transform_type': transform_type
+              })
+
+        result.update(result['extras'])
+        result.pop('extras')
+        headers = list(result.keys())
+        results.append(list(result.values()))
+
+    try:
+      from tabulate import tabulate # pylint: disable=import-outside-toplevel
+      print(tabulate(results, headers=headers))
+    except ModuleNotFoundError:
+      pass
+
+  def benchmark_points_grad(self):
+    """Benchmark the gradient of the NUFFT with respect to the points.
+
+    Compares the time of the forward transform with that of the gradient with
+    respect to the points, as in trajectory learning.
+    """
+    rng = np.random.default_rng(0)
+
+    # source_shape, points_shape, grid_shape
+    cases = [
+        ([256, 256], [65536, 2], [256, 256]),
+        ([8, 256, 256], [65536, 2], [256, 256]),
+        ([64, 64, 64], [262144, 3], [64, 64, 64])
+    ]
+
+    results = []
+    headers = []
+    for source_shape, points_shape, grid_shape in cases:
+      for transform_type in ['type_1', 'type_2']:
+        for mode in ['forward', 'grad_points']:
+          with tf.Graph().as_default(), \
+              tf.compat.v1.Session(config=tf.test.benchmark_config()) as sess, \
+              tf.device('/cpu:0'):
+            if transform_type == 'type_1':
+              shape = source_shape[:-len(grid_shape)] + points_shape[-2:-1]
+            else:
+              shape = source_shape
+            source = tf.Variable(
+                tf.dtypes.complex(rng.random(shape, dtype=np.float32) - 0.5,
+                                  rng.random(shape, dtype=np.float32) - 0.5))
+            points = tf.Variable(
+                ((rng.random(points_shape) - 0.5) * 2.0 * np.pi).astype(
+                    np.float32))
+
+            self.evaluate(tf.compat.v1.global_variables_initializer())
+
+            target = nufft_ops.nufft(
+                source, points,
+                grid_shape=grid_shape if transform_type == 'type_1' else None,
+                transform_type=transform_type)
+            if mode == 'grad_points':
+              target = tf.gradients(
+                  tf.math.real(target * tf.math.conj(target)), points)[0]
+
+            result = self.run_op_benchmark(
+                sess,
+                target,
+                burn_iters=2,
+                min_iters=20,
+                store_memory_usage=True,
+                extras={
+                  'source_shape': source_shape,
+                  'points_shape': points_shape,
+                  'transform_type': transform_type,
+                  'mode': mode
+                })
+
+          result.update(result['extras'])
+          result.pop('extras')
+          headers = list(result.keys())
+          results.append(list(result.values()))
+
+    try:
+      from tabulate import tabulate # pylint: disable=import-outside-toplevel
+      print(tabulate(results, headers=headers))
+    except ModuleNotFoundError:
+      pass
+
+  def benchmark_nufft_gram(self):
+    """Benchmark the Toeplitz Gram operator.
+
+    Compares a type-2 transform followed by a type-1 transform, as in each
+    iteration of an iterative reconstruction, with `nufft_gram` using a
+    precomputed kernel.
+    """
+    rng = np.random.default_rng(0)
+
+    # grid_shape, num_points
+    cases = [
+        ([256, 256], 65536),
+        ([64, 64, 64], 262144),
+        ([128, 128, 128], 800000)
+    ]
+
+    results = []
+    headers = []
+    for grid_shape, num_points in cases:
+      rank = len(grid_shape)
+      for mode in ['nufft', 'gram']:
+        with tf.Graph().as_default(), \
+            tf.compat.v1.Session(config=tf.test.benchmark_config()) as sess, \
+            tf.device('/cpu:0'):
+          source = tf.Variable(
+              tf.dtypes.complex(rng.random(grid_shape, dtype=np.float32) - 0.5,
+                                rng.random(grid_shape, dtype=np.float32) - 0.5))
+          points = ((rng.random([num_points, rank]) - 0.5) *
+                    2.0 * np.pi).astype(np.float32)
+          kernel = tf.Variable(nufft_ops.nufft_gram_kernel(points, grid_shape))
+          points = tf.Variable(points)
+
+          self.evaluate(tf.compat.v1.global_variables_initializer())
+
+          if mode == 'nufft':
+            target = nufft_ops.nufft(
+                nufft_ops.nufft(source, points), points,
+                grid_shape=grid_shape,
+                transform_type='type_1',
+                fft_direction='backward')
+          else:
+            target = nufft_ops.nufft_gram(source, kernel, rank)
+
+          result = self.run_op_benchmark(
+              sess,
+              target,
+              burn_iters=2,
+              min_iters=10,
+              store_memory_usage=True,
+              extras={
+                'grid_shape': grid_shape,
+                'num_points': num_points,
+                'mode': mode
+              })
+
+        result.update(result['extras'])
+        result.pop('extras')
+        headers = list(result.keys())
+        results.append(list(result.values()))
+
+    try:
+      from tabulate import tabulate # pylint: disable=import-outside-toplevel
+      print(tabulate(results, headers=headers))
+    except ModuleNotFoundError:
+      pass
+
 
 DEFAULT_TOLERANCE = 1.e-3
 
@@ -92,6 +92,109 @@ class FftwPlanningRigor(enum.IntEnum):
     )
 
 
+class PointsSorting(enum.IntEnum):
+  """Represents the strategy used to sort the nonuniform points.
+
+  Sorting the nonuniform points into bins improves the memory locality of the
+  spreading and interpolation steps, at the cost of a sorting pass each time
+  the points change.
+
+  - **AUTO**: Selects the sorting strategy automatically. Currently sorts in
+    `CARTESIAN` order, except for some 1D cases where sorting does not pay
+    off.
+
+  - **NONE**: Does not sort the points. The points are processed in the order
+    in which they are given.
+
+  - **CARTESIAN**: Sorts the points into fixed-size bins and visits the bins
+    in Cartesian order (x fastest, z slowest).
+
+  - **MORTON**: Sorts the points into bins sized to fit the CPU caches and
+    visits the bins along a Morton (Z-order) curve, so that consecutive bins
+    are close in all dimensions. Often faster for 3D transforms. On the GPU,
+    this is the same as `CARTESIAN`.
+  """
+  AUTO = 0
+  NONE = 1
+  CARTESIAN = 2
+  MORTON = 3
+
+  def to_proto(self):  # pylint: disable=missing-function-docstring
+    if self == PointsSorting.AUTO:
+      return nufft_options_pb2.PointsSorting.POINTS_SORTING_AUTO
+    if self == PointsSorting.NONE:
+      return nufft_options_pb2.PointsSorting.POINTS_SORTING_NONE
+    if self == PointsSorting.CARTESIAN:
+      return nufft_options_pb2.PointsSorting.POINTS_SORTING_CARTESIAN
+    if self == PointsSorting.MORTON:
+      return nufft_options_pb2.PointsSorting.POINTS_SORTING_MORTON
+    raise ValueError(
+        f"Invalid value of `PointsSorting`. Supported values include "
+        f"`AUTO`, `NONE`, `CARTESIAN` and `MORTON`. Got {self.name}."
+    )
+
+  @classmethod
+  def from_proto(cls, pb):  # pylint: disable=missing-function-docstring
+    if pb == nufft_options_pb2.PointsSorting.POINTS_SORTING_AUTO:
+      return cls.AUTO
+    if pb == nufft_options_pb2.PointsSorting.POINTS_SORTING_NONE:
+      return cls.NONE
+    if pb == nufft_options_pb2.PointsSorting.POINTS_SORTING_CARTESIAN:
+      return cls.CARTESIAN
+    if pb == nufft_options_pb2.PointsSorting.POINTS_SORTING_MORTON:
+      return cls.MORTON
+    raise ValueError(
+        f"Invalid value of `PointsSorting` in protocol buffer. Supported "
+        f"values include `AUTO`, `NONE`, `CARTESIAN` and `MORTON`. "
+        f"Got {pb}."
+    )
+
+
+class FftBackend(enum.IntEnum):
+  """Represents the library used to compute the FFTs on the CPU.
+
+  - **AUTO**: Selects the FFT backend automatically. Currently defaults to
+    `FFTW`.
+
+  - **FFTW**: Uses the FFTW library. The planning rigor can be configured via
+    `tfft.FftwOptions`.
+
+  - **NATIVE**: Uses a built-in mixed-radix FFT engine which does not depend
+    on FFTW. It has no planning cost and is optimized for the fine grid sizes
+    used by the NUFFT, whose only prime factors are 2, 3 and 5.
+
+  The GPU kernels always use cuFFT.
+  """
+  AUTO = 0
+  FFTW = 1
+  NATIVE = 2
+
+  def to_proto(self):  # pylint: disable=missing-function-docstring
+    if self == FftBackend.AUTO:
+      return nufft_options_pb2.FftBackend.FFT_BACKEND_AUTO
+    if self == FftBackend.FFTW:
+      return nufft_options_pb2.FftBackend.FFT_BACKEND_FFTW
+    if self == FftBackend.NATIVE:
+      return nufft_options_pb2.FftBackend.FFT_BACKEND_NATIVE
+    raise ValueError(
+        f"Invalid value of `FftBackend`. Supported values include "
+        f"`AUTO`, `FFTW` and `NATIVE`. Got {self.name}."
+    )
+
+  @classmethod
+  def from_proto(cls, pb):  # pylint: disable=missing-function-docstring
+    if pb == nufft_options_pb2.FftBackend.FFT_BACKEND_AUTO:
+      return cls.AUTO
+    if pb == nufft_options_pb2.FftBackend.FFT_BACKEND_FFTW:
+      return cls.FFTW
+    if pb == nufft_options_pb2.FftBackend.FFT_BACKEND_NATIVE:
+      return cls.NATIVE
+    raise ValueError(
+        f"Invalid value of `FftBackend` in protocol buffer. Supported "
+        f"values include `AUTO`, `FFTW` and `NATIVE`. Got {pb}."
+    )
+
+
 class FftwOptions(pydantic.BaseModel):
   """Represents options for the FFTW library.
 
@@ -139,6 +242,18 @@ class Options(pydantic.BaseModel):
   >>> tfft.nufft(x, k, options=options)
 
   Attributes:
+    cache_points: A `bool`. Whether to reuse the preprocessing (e.g. the
+      sorting) of the nonuniform points across calls with identical points.
+      This can speed up repeated transforms with the same points, such as
+      iterative reconstructions, but the cached data is kept in a
+      process-wide cache (at most a few recent point sets, up to 256 MiB) and
+      each cache miss incurs an extra copy of the points. On a cache miss,
+      the sort order of the most recently sorted points is updated to the
+      new points if few of them changed bin, which speeds up calls with
+      slowly moving points, such as in trajectory optimization. Defaults to
+      `False`. Only applies to the CPU kernels.
+    fft_backend: The library used to compute the FFTs on the CPU. See
+      `tfft.FftBackend` for more information.
     fftw: Options for the FFTW library. See `tfft.FftwOptions` for more
       information.
     max_batch_size: An optional `int`. The maximum batch size to use during
@@ -146,23 +261,34 @@ class Options(pydantic.BaseModel):
       vectorization batch size to this value. Smaller values may reduce memory
       usage, but may also reduce performance. If not set, the internal batch
       size is chosen automatically.
+    points_sorting: The strategy used to sort the nonuniform points. See
+      `tfft.PointsSorting` for more information.
   """
+  cache_points: bool = False
+  fft_backend: FftBackend = FftBackend.AUTO
   fftw: FftwOptions = FftwOptions()
   max_batch_size: typing.Optional[int] = None
+  points_sorting: PointsSorting = PointsSorting.AUTO
 
   def to_proto(self):
     pb = nufft_options_pb2.Options()
+    pb.cache_points = self.cache_points
+    pb.fft_backend = self.fft_backend.to_proto()
     pb.fftw.CopyFrom(self.fftw.to_proto())
     if self.max_batch_size is not None:
       pb.max_batch_size = self.max_batch_size
+    pb.points_sorting = self.points_sorting.to_proto()
     return pb
 
   @classmethod
   def from_proto(cls, pb):
     obj = cls()
+    obj.cache_points = pb.cache_points
+    obj.fft_backend = FftBackend.from_proto(pb.fft_backend)
     obj.fftw = FftwOptions.from_proto(pb.fftw)
     if pb.max_batch_size is not None:
       obj.max_batch_size = pb.max_batch_size
+    obj.points_sorting = PointsSorting.from_proto(pb.points_sorting)
     return obj
 
   class Config:
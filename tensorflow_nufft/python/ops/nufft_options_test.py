@@ -27,10 +27,16 @@ class OptionsTest(tf.test.TestCase):
     options = nufft_options.Options()
     options.max_batch_size = 4
     options.fftw.planning_rigor = nufft_options.FftwPlanningRigor.PATIENT
+    options.points_sorting = nufft_options.PointsSorting.MORTON
+    options.fft_backend = nufft_options.FftBackend.NATIVE
+    options.cache_points = True
     # Test round-trip options -> proto -> options.
     options2 = nufft_options.Options.from_proto(options.to_proto())
     self.assertEqual(options2.max_batch_size, options.max_batch_size)
     self.assertEqual(options2.fftw.planning_rigor, options.fftw.planning_rigor)
+    self.assertEqual(options2.points_sorting, options.points_sorting)
+    self.assertEqual(options2.fft_backend, options.fft_backend)
+    self.assertEqual(options2.cache_points, options.cache_points)
     self.assertEqual(options2, options)
 
   def test_invalid_value(self):